@@ -7,16 +7,15 @@
 #include "atm.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
 
 #define ERROR_USAGE 62
 #define ERROR_FILE_OPEN 64
 
-static const char prompt[] = "ATM: ";
-
 int main(int argc, char **argv)
 {
-    char user_input[10000];
-
     if (argc != 2)
     {
         printf("Usage:  init <filename>\n");
@@ -37,22 +36,40 @@ int main(int argc, char **argv)
         return ERROR_FILE_OPEN;
     }
 
+    TRACE_OPEN("atm");
     ATM *atm = atm_create(atm_file);
 
-    printf("%s", prompt);
-    fflush(stdout);
+    atm_prompt(atm, &atm->sessions[0]);
 
-    while (fgets(user_input, 10000,stdin) != NULL)
+    // One loop drives every session: commands are read as they arrive, replies
+    // are matched to their sessions and retransmissions fire from the timers
+    while (!atm_done(atm))
     {
-        atm_process_command(atm, user_input);
+        struct pollfd fds[2];
+        fds[0].fd = atm->input_eof ? -1 : STDIN_FILENO;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd = atm->sockfd;
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
 
-        // change the prompt to "ATM (<username>): " if a user is logged in
-        if (atm->is_logged_in) {
-            printf("ATM (%s): ", atm->curr_user);
-        } else {
-            printf("%s", prompt);
+        int timeout_ms = atm_poll_timeout(atm);
+        struct timespec timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+        if (transport_poll(fds, 2, timeout_ms < 0 ? NULL : &timeout) < 0 && errno != EINTR)
+        {
+            perror("poll");
+            break;
+        }
+
+        if (fds[1].revents & POLLIN)
+        {
+            atm_handle_socket(atm);
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP))
+        {
+            atm_handle_input(atm);
         }
-        fflush(stdout);
+        atm_handle_timers(atm);
     }
     atm_free(atm);
 	return EXIT_SUCCESS;
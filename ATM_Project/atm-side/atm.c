@@ -1,16 +1,33 @@
 #include "atm.h"
 #include "ports.h"
 #include "encryption/enc.h"
+#include "encryption/frame.h"
+#include "util/env.h"
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <limits.h>
 #include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <stdarg.h>
+#include <errno.h>
 
 #define MAX_ATTEMPTS 5
 #define MAX_USERNAME_LEN 250
 
+// Retransmission timers are kept on a 1ms timing wheel
+#define ATM_TIMER_TICK_US 1000
+#define ATM_TIMER_SLOTS 1024
+
+static long now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
 ATM *atm_create(char *atm_file)
 {
     ATM *atm = (ATM *)malloc(sizeof(ATM));
@@ -21,7 +38,7 @@ ATM *atm_create(char *atm_file)
     }
 
     // Set up the network state
-    atm->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    atm->sockfd = transport_socket();
 
     bzero(&atm->rtr_addr, sizeof(atm->rtr_addr));
     atm->rtr_addr.sin_family = AF_INET;
@@ -31,14 +48,67 @@ ATM *atm_create(char *atm_file)
     bzero(&atm->atm_addr, sizeof(atm->atm_addr));
     atm->atm_addr.sin_family = AF_INET;
     atm->atm_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-    atm->atm_addr.sin_port = htons(ATM_PORT);
-    bind(atm->sockfd, (struct sockaddr *)&atm->atm_addr, sizeof(atm->atm_addr));
+    atm->atm_addr.sin_port = htons(env_int("ATM_PORT", ATM_PORT, 1, 65535));
+    transport_bind(atm->sockfd, &atm->atm_addr);
+
+    // A stream has no datagram size to fit, so over tcp frames go out whole
+    int fragment_default = transport_kind() == TRANSPORT_TCP ? FRAME_MAX_SIZE : FRAGMENT_DEFAULT_SIZE;
+    atm->fragment_size = env_int("ATM_FRAGMENT_SIZE", fragment_default, FRAGMENT_MIN_SIZE, FRAME_MAX_SIZE);
+    atm->fragments = reassembler_create(env_int("ATM_REASSEMBLY_SLOTS", ATM_DEFAULT_REASSEMBLY_SLOTS, 1, 4096),
+                                        env_int("ATM_REASSEMBLY_TIMEOUT_MS", ATM_DEFAULT_REASSEMBLY_TIMEOUT_MS,
+                                                1, 600000) * 1000000ULL);
+    if (atm->fragments == NULL)
+    {
+        perror("Could not allocate ATM reassembly buffers");
+        exit(1);
+    }
 
     // Set up the protocol state
     // TODO set up more, as needed
-    atm->is_logged_in = 0;
-    atm->curr_user = NULL;
     atm->atm_file = atm_file;
+    if (extract_msg_key(atm_file, atm->msg_key) != 0)
+    {
+        exit(1);
+    }
+    atm->card_vault_path = getenv("CARD_VAULT");
+    atm->card_vault = NULL;
+    atm->attempts_list_head = NULL;
+
+    atm->num_sessions = env_int("ATM_SESSIONS", 1, 1, ATM_MAX_SESSIONS);
+    atm->sessions = (ATMSession *)calloc(atm->num_sessions, sizeof(ATMSession));
+    if (atm->sessions == NULL)
+    {
+        perror("Could not allocate ATM sessions");
+        exit(1);
+    }
+    for (int i = 0; i < atm->num_sessions; i++)
+    {
+        atm->sessions[i].id = i;
+        atm->sessions[i].state = SESSION_IDLE;
+        atm->sessions[i].pending_account_id = -1;
+        atm->sessions[i].account_id = -1;
+    }
+    atm->in_len = 0;
+    atm->input_eof = 0;
+
+    // Request IDs start at a random point so different ATMs do not collide
+    generate_rand_bytes(sizeof(atm->next_request_id), (unsigned char *)&atm->next_request_id);
+
+    // Retransmission timer: starts at ATM_TIMEOUT_MS and adapts to the measured RTT
+    atm->min_rto_us = env_int("ATM_MIN_TIMEOUT_MS", 20, 1, 60000) * 1000L;
+    atm->max_rto_us = env_int("ATM_MAX_TIMEOUT_MS", 5000, 1, 600000) * 1000L;
+    atm->rto_us = env_int("ATM_TIMEOUT_MS", 500, 1, 600000) * 1000L;
+    atm->srtt_us = 0;
+    atm->rttvar_us = 0;
+    atm->max_retries = env_int("ATM_MAX_RETRIES", 5, 0, 100);
+    atm->retransmissions = 0;
+    atm->busy_replies = 0;
+    atm->timers = timer_wheel_create(ATM_TIMER_TICK_US, ATM_TIMER_SLOTS, now_us());
+    if (atm->timers == NULL)
+    {
+        perror("Could not allocate ATM timers");
+        exit(1);
+    }
 
     return atm;
 }
@@ -60,8 +130,23 @@ void atm_free(ATM *atm)
 {
     if (atm != NULL)
     {
-        close(atm->sockfd);
+        transport_close(atm->sockfd);
         free_login_attempts(atm);
+        for (int i = 0; i < atm->num_sessions; i++)
+        {
+            ATMSession *session = &atm->sessions[i];
+            while (session->queue_head != NULL)
+            {
+                InputLine *line = session->queue_head;
+                session->queue_head = line->next;
+                free(line);
+            }
+            free(session->curr_user);
+        }
+        free(atm->sessions);
+        timer_wheel_free(atm->timers);
+        reassembler_free(atm->fragments);
+        card_vault_close(atm->card_vault);
         free(atm);
     }
 }
@@ -69,14 +154,85 @@ void atm_free(ATM *atm)
 ssize_t atm_send(ATM *atm, char *data, size_t data_len)
 {
     // Returns the number of bytes sent; negative on error
-    return sendto(atm->sockfd, data, data_len, 0,
-                  (struct sockaddr *)&atm->rtr_addr, sizeof(atm->rtr_addr));
+    int count = frame_fragment_count(data_len, atm->fragment_size);
+    if (count == 1)
+    {
+        return transport_sendto(atm->sockfd, data, data_len, 0, &atm->rtr_addr);
+    }
+    if (count < 0)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    // A frame too large for one datagram goes out as fragments, together
+    unsigned char buf[FRAME_MAX_SIZE + FRAME_MAX_FRAGMENTS * FRAGMENT_OVERHEAD];
+    struct mmsghdr msgs[FRAME_MAX_FRAGMENTS];
+    struct iovec iov[FRAME_MAX_FRAGMENTS];
+    size_t used = 0;
+    memset(msgs, 0, count * sizeof(msgs[0]));
+    for (int i = 0; i < count; i++)
+    {
+        int len = frame_fragment((unsigned char *)data, data_len, atm->fragment_size, i, buf + used, sizeof(buf) - used);
+        if (len < 0)
+        {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        iov[i].iov_base = buf + used;
+        iov[i].iov_len = len;
+        msgs[i].msg_hdr.msg_name = &atm->rtr_addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(atm->rtr_addr);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        used += len;
+    }
+
+    int sent = 0;
+    while (sent < count)
+    {
+        int n = transport_sendmmsg(atm->sockfd, msgs + sent, count - sent, 0);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            return -1;
+        }
+        sent += n;
+    }
+    return data_len;
 }
 
 ssize_t atm_recv(ATM *atm, char *data, size_t max_data_len)
 {
     // Returns the number of bytes received; negative on error
-    return recvfrom(atm->sockfd, data, max_data_len, 0, NULL, NULL);
+    return atm_recv_frame(atm, data, max_data_len, 0);
+}
+
+// Receive the next whole frame, putting fragmented ones back together along the way.
+// Returns its length; negative on error, or with MSG_DONTWAIT once nothing complete is left
+ssize_t atm_recv_frame(ATM *atm, char *data, size_t max_data_len, int flags)
+{
+    while (1)
+    {
+        ssize_t n = transport_recvfrom(atm->sockfd, data, max_data_len, flags, NULL);
+        FrameHeader header;
+        if (n < 0 || frame_peek((unsigned char *)data, n, &header) < 0 || header.type != FRAME_FRAGMENT)
+        {
+            return n;
+        }
+
+        // Replies only come from the router, so fragments are told apart by request ID alone
+        const Reassembly *done;
+        if (reassembler_add(atm->fragments, NULL, (unsigned char *)data, n, now_us() * 1000ULL, &done) == 1 &&
+            done->frame_len <= max_data_len)
+        {
+            memcpy(data, done->frame, done->frame_len);
+            return done->frame_len;
+        }
+    }
 }
 
 // Functions to extract the AES key used to encrypt pins (first 32 bytes of .bank and .atm)
@@ -129,9 +285,50 @@ int extract_msg_key(char *atm_file, unsigned char *key)
     return 0;
 }
 
-// Read in the encrypted pin and IV from <username>.card
-int card_contents(char *card, char *username, unsigned char *pin, unsigned char *iv)
+// The account ID that follows the IV on a card, or -1 if the card has none
+static long card_account_id(const unsigned char *id, size_t len)
 {
+    if (len < 4)
+    {
+        return -1;
+    }
+    return (long)id[0] << 24 | id[1] << 16 | id[2] << 8 | id[3];
+}
+
+// Read in the encrypted pin, IV and account ID from the card vault
+static int vault_card_contents(ATM *atm, char *username, unsigned char *pin, unsigned char *iv, long *account_id)
+{
+    unsigned char card[AES_BLOCK_SIZE + IV_SIZE + 4];
+    int len = -1;
+    if (atm->card_vault == NULL)
+    {
+        atm->card_vault = card_vault_open(atm->card_vault_path, 0);
+    }
+    if (atm->card_vault != NULL)
+    {
+        len = card_vault_get(atm->card_vault, username, card, sizeof(card));
+    }
+    if (len < AES_BLOCK_SIZE + IV_SIZE)
+    {
+        printf("Unable to access %s's card\n", username);
+        return 1;
+    }
+    memcpy(pin, card, AES_BLOCK_SIZE);
+    memcpy(iv, card + AES_BLOCK_SIZE, IV_SIZE);
+    *account_id = card_account_id(card + AES_BLOCK_SIZE + IV_SIZE, len - AES_BLOCK_SIZE - IV_SIZE);
+    memset(card, 0, sizeof(card));
+    return 0;
+}
+
+// Read in the encrypted pin, IV and account ID from <username>.card. Cards
+// written before accounts had IDs end after the IV; account_id is -1 for them
+int card_contents(ATM *atm, char *card, char *username, unsigned char *pin, unsigned char *iv, long *account_id)
+{
+    if (atm->card_vault_path != NULL)
+    {
+        return vault_card_contents(atm, username, pin, iv, account_id);
+    }
+
     // Ensure that exactly one argument is provided
     FILE *card_fd = fopen(card, "rb");
     if (card_fd == NULL)
@@ -151,6 +348,8 @@ int card_contents(char *card, char *username, unsigned char *pin, unsigned char
         fclose(card_fd);
         return 1;
     }
+    unsigned char id[4];
+    *account_id = card_account_id(id, fread(id, 1, sizeof(id), card_fd));
     fclose(card_fd);
     return 0;
 }
@@ -209,12 +408,13 @@ int check_input(char *username)
     return valid_username(username);
 }
 
-// Compare the encryption of the user-entered plaintext pin to the stored encrypted pin in their card file
-int check_pin(char *atm_file, char *card_file, char *username, char *plaintext_pin)
+// Compare the encryption of the user-entered plaintext pin to the stored encrypted pin in their card file,
+// and return the card's account ID in account_id
+int check_pin(ATM *atm, char *card_file, char *username, char *plaintext_pin, long *account_id)
 {
     // extract the pin key from .atm
     unsigned char pin_key[AES_KEY_SIZE];
-    if (extract_pin_key(atm_file, pin_key) != 0)
+    if (extract_pin_key(atm->atm_file, pin_key) != 0)
     {
         printf("Error extracting key\n");
         return 1;
@@ -223,7 +423,7 @@ int check_pin(char *atm_file, char *card_file, char *username, char *plaintext_p
     // extract the contents of .card
     unsigned char stored_pin[AES_BLOCK_SIZE];
     unsigned char iv[IV_SIZE];
-    if (card_contents(card_file, username, stored_pin, iv) != 0)
+    if (card_contents(atm, card_file, username, stored_pin, iv, account_id) != 0)
     {
         return 1;
     }
@@ -279,210 +479,580 @@ LoginAttempt *add_new(ATM *atm, char *username)
     return new_user;
 }
 
-// Create the entire message to send to the bank, consisting of the encrypted command, the initialization vector,
-// and the tag.
-unsigned char *encrypt_message(ATM *atm, unsigned char *plaintext, size_t *sendline_len)
+// Fold a round-trip sample into the smoothed RTT and recompute the
+// retransmission timeout (RFC 6298)
+static void update_rto(ATM *atm, long rtt_us)
 {
-    unsigned char msg_key[AES_KEY_SIZE];
-    extract_msg_key(atm->atm_file, msg_key);
+    if (atm->srtt_us == 0)
+    {
+        atm->srtt_us = rtt_us;
+        atm->rttvar_us = rtt_us / 2;
+    }
+    else
+    {
+        long err = rtt_us - atm->srtt_us;
+        atm->rttvar_us += ((err < 0 ? -err : err) - atm->rttvar_us) / 4;
+        atm->srtt_us += err / 8;
+    }
 
-    unsigned char iv[GCM_IV_SIZE];
-    generate_rand_bytes(GCM_IV_SIZE, iv);
+    atm->rto_us = atm->srtt_us + 4 * atm->rttvar_us;
+    if (atm->rto_us < atm->min_rto_us)
+    {
+        atm->rto_us = atm->min_rto_us;
+    }
+    if (atm->rto_us > atm->max_rto_us)
+    {
+        atm->rto_us = atm->max_rto_us;
+    }
+}
 
-    // Encrypt the message
-    unsigned char ciphertext[strlen((char *)plaintext) + AES_BLOCK_SIZE]; // make sure the ciphertext buffer is large enough to store the encrypted message
-    unsigned char tag[TAG_SIZE];
 
-    int c_len = gcm_encrypt(plaintext, strlen((char *)plaintext), NULL, 0, msg_key, iv, GCM_IV_SIZE, ciphertext, tag);
-    int length_ciphertext = c_len;
+// printf for a session's output; tagged with the session when there are several
+static void say(ATM *atm, ATMSession *session, const char *fmt, ...)
+{
+    va_list ap;
 
-    *sendline_len = sizeof(int) + length_ciphertext + GCM_IV_SIZE + TAG_SIZE;
+    if (atm->num_sessions > 1)
+    {
+        printf("[%d] ", session->id);
+    }
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+}
 
-    unsigned char *sendline = malloc(*sendline_len);
+// Print the prompt for an idle session (interactive, single-session use only)
+void atm_prompt(ATM *atm, ATMSession *session)
+{
+    if (atm->num_sessions > 1 || session->state != SESSION_IDLE)
+    {
+        return;
+    }
 
-    if (sendline == NULL)
+    // change the prompt to "ATM (<username>): " if a user is logged in
+    if (session->is_logged_in) {
+        printf("ATM (%s): ", session->curr_user);
+    } else {
+        printf("ATM: ");
+    }
+    fflush(stdout);
+}
+
+/*
+    How long the ATM will keep waiting for a request that is sent now, as attempt `attempt` with
+    timeout rto_us, before giving up: this timeout plus every backed-off timeout of the retries still
+    to come. A reply to any copy completes the request, so the bank can drop the request once this
+    budget has run out and not before.
+*/
+uint32_t atm_request_budget_ms(ATM *atm, long rto_us, int attempt)
+{
+    long budget_us = 0;
+    for (int a = attempt; a <= atm->max_retries; a++)
     {
-        printf("Memory allocation failed!\n");
-        exit(EXIT_FAILURE);
+        budget_us += rto_us;
+        rto_us = rto_us * 2 > atm->max_rto_us ? atm->max_rto_us : rto_us * 2;
     }
+    return (uint32_t)((budget_us + 999) / 1000);
+}
 
-    // Write the message into sendline
-    int offset = 0;
-    memcpy(sendline + offset, &length_ciphertext, sizeof(int)); // Length of ciphertext
-    offset += sizeof(int);
+// Send (or resend) the session's request with its remaining budget and start its retransmission timer
+static void send_request(ATM *atm, ATMSession *session)
+{
+    frame_set_budget(session->frame, atm_request_budget_ms(atm, session->rto_us, session->attempt));
 
-    memcpy(sendline + offset, ciphertext, length_ciphertext); // Ciphertext
-    offset += length_ciphertext;
+    uint64_t trace_start = TRACE_NOW();
+    atm_send(atm, (char *)session->frame, session->frame_len);
+    TRACE_SPAN(session->request_id, TRACE_ATM_SEND, trace_start);
 
-    memcpy(sendline + offset, iv, GCM_IV_SIZE); // IV
-    offset += GCM_IV_SIZE;
+    session->sent_at_us = now_us();
+    timer_wheel_add(atm->timers, &session->timer, session->sent_at_us + session->rto_us);
+}
 
+/*
+    Seal a command for the bank and send it, leaving the session waiting for the reply. The frame is kept
+    so a timeout can retransmit it unchanged; its request ID carries the session index so the reply can be
+    matched without a search.
 
-    /*
-        If the tag is not the same as the one created by gcm_encrypt(), then sending it over
-        would terminate the bank program as it is seen as malicious.
+    Returns 0 on success; -1 if the command could not be sealed.
+*/
+static int start_request(ATM *atm, ATMSession *session, RequestKind kind, char *command)
+{
+    uint64_t trace_start = TRACE_NOW();
 
-        Example: generating a tag using generate_rand_bytes() instead of gcm_encrypt()
+    FrameHeader header;
+    memset(&header, 0, sizeof(header));
+    header.type = FRAME_REQUEST;
+    header.request_id = (atm->next_request_id++ << ATM_SESSION_BITS) | (uint64_t)session->id;
 
-            unsigned char badtag[TAG_SIZE];
-            generate_rand_bytes(TAG_SIZE, badtag);
-            memcpy(sendline + offset, badtag, TAG_SIZE);
-        
-        Results in bank program terminating because tag is not recognized by gcm_decrypt().
-    */
-    
-    memcpy(sendline + offset, tag, TAG_SIZE); 
+    int frame_len = frame_seal(&header, atm->msg_key, (unsigned char *)command, strlen(command),
+                               session->frame, sizeof(session->frame));
+    TRACE_SPAN(header.request_id, TRACE_ATM_SEAL, trace_start);
+    if (frame_len < 0)
+    {
+        return -1;
+    }
 
-    return sendline; 
-}
+    session->request_kind = kind;
+    session->request_id = header.request_id;
+    session->frame_len = frame_len;
+    session->attempt = 0;
+    session->rto_us = atm->rto_us;
+    session->busy = 0;
+    session->state = SESSION_WAIT_BANK;
+    session->trace_start_ns = trace_start;
 
-/* 
-    Decrypt an AES-256-GCM encoded message sent to the atm. If the extracted authentication tag differs from that
-    created by gcm_encrypt(), the program will terminate.
-*/
-int decrypt_message(ATM *atm, char *command, size_t len, char *plaintext_buffer, size_t buffer_size)
-{
-    char received_data[10000];
-    memcpy(received_data, command, len);
+    send_request(atm, session);
+    return 0;
+}
 
-    int length_ciphertext;
-    int offset = 0;
-    memcpy(&length_ciphertext, received_data + offset, sizeof(int)); // Get length of ciphertext
-    offset += sizeof(int);
+static void run_line(ATM *atm, ATMSession *session, char *line);
 
-    // Extract the ciphertext, iv, and tag
-    unsigned char *ciphertext = malloc(length_ciphertext);
-    memcpy(ciphertext, received_data + offset, length_ciphertext);
-    offset += length_ciphertext;
+// Run the lines that queued up behind a request, until one starts another
+// request or the queue is empty
+static void drain_queue(ATM *atm, ATMSession *session)
+{
+    while (session->state != SESSION_WAIT_BANK && session->queue_head != NULL)
+    {
+        InputLine *line = session->queue_head;
+        session->queue_head = line->next;
+        if (session->queue_head == NULL)
+        {
+            session->queue_tail = NULL;
+        }
+        run_line(atm, session, line->text);
+        free(line);
+    }
+}
 
-    unsigned char *iv = malloc(GCM_IV_SIZE);
-    memcpy(iv, received_data + offset, GCM_IV_SIZE);
-    offset += GCM_IV_SIZE;
+// The request outstanding on session is over, one way or the other
+static void finish_request(ATM *atm, ATMSession *session, SessionState next)
+{
+    session->state = next;
+    atm_prompt(atm, session);
+    drain_queue(atm, session);
+}
 
-    unsigned char *tag = malloc(TAG_SIZE);
-    memcpy(tag, received_data + offset, TAG_SIZE);
+// Ask for the PIN of the user named by a successful begin-session
+static void ask_pin(ATM *atm, ATMSession *session)
+{
+    say(atm, session, "PIN? ");
+    fflush(stdout);
+    finish_request(atm, session, SESSION_WAIT_PIN);
+}
 
-    // Retrieve the AES message key from .bank
-    unsigned char msg_key[AES_KEY_SIZE];
-    extract_msg_key(atm->atm_file, msg_key);
+// How requests name the logged-in user's account: "@<session handle>", or
+// the username if the bank gave no handle. account holds MAX_USERNAME_LEN + 1 bytes
+static char *session_account(ATMSession *session, char *account)
+{
+    if (session->handle == 0)
+    {
+        return session->curr_user;
+    }
+    snprintf(account, MAX_USERNAME_LEN + 1, "@%llx", (unsigned long long)session->handle);
+    return account;
+}
 
-    // Decrypt the message
-    int p_len = gcm_decrypt(ciphertext, length_ciphertext, NULL, 0, tag, msg_key, iv, GCM_IV_SIZE, (unsigned char *)plaintext_buffer);
+static int open_session(ATM *atm, ATMSession *session);
 
-    // Handle decryption errors
-    if (p_len < 0)
+// Send "withdraw <account> <amount>" or "balance <account>" for the logged-in user, first
+// asking the bank for a session if it has not opened one. Returns 0 on success; -1 if the
+// request could not be sealed
+static int start_account_request(ATM *atm, ATMSession *session, RequestKind kind, int amount)
+{
+    char account[MAX_USERNAME_LEN + 1];
+    char plaintext[MAX_USERNAME_LEN + 32];
+    if (kind == REQUEST_WITHDRAW)
     {
-        printf("Untrustworthy source\n");
-        free(ciphertext); // Free allocated memory
-        free(iv);         // Free allocated memory
-        free(tag);        // Free allocated memory
-        return -1;        // Return -1 to indicate decryption failure
+        snprintf(plaintext, sizeof(plaintext), "withdraw %s %d", session_account(session, account), amount);
     }
+    else
+    {
+        snprintf(plaintext, sizeof(plaintext), "balance %s", session_account(session, account));
+    }
+    session->account_request = kind;
+    session->request_amount = amount;
+    if (session->handle == 0 && session->account_id >= 0 && !session->renewing)
+    {
+        return open_session(atm, session);
+    }
+    return start_request(atm, session, kind, plaintext);
+}
 
-    plaintext_buffer[p_len] = '\0'; // Null-terminate the plaintext
+// Ask the bank to open a session on the logged-in user's account, named by username and
+// account ID: before the user's first withdraw or balance, and again if the bank has
+// closed the session. The request waiting on it is sent once the bank answers.
+// Returns 0 on success; -1 if the request could not be sealed
+static int open_session(ATM *atm, ATMSession *session)
+{
+    char plaintext[MAX_USERNAME_LEN + 32];
+    snprintf(plaintext, sizeof(plaintext), "open-session %s#%ld", session->curr_user, session->account_id);
+    session->renewing = 1;
+    return start_request(atm, session, REQUEST_OPEN_SESSION, plaintext);
+}
 
-    free(ciphertext); // Free allocated memory
-    free(iv);         // Free allocated memory
-    free(tag);        // Free allocated memory
+// Tell the bank the session with handle is over, rather than leave it to idle out.
+// Returns 0 on success; -1 if the request could not be sealed
+static int close_session(ATM *atm, ATMSession *session, uint64_t handle)
+{
+    char plaintext[32];
+    snprintf(plaintext, sizeof(plaintext), "close-session @%llx", (unsigned long long)handle);
+    return start_request(atm, session, REQUEST_CLOSE_SESSION, plaintext);
+}
 
-    return p_len; // Return the length of the decrypted plaintext
+// Log the session's user out
+static void end_session(ATM *atm, ATMSession *session)
+{
+    // reset login attempts to 0
+    get_login(atm, session->curr_user)->attempts = 0;
+    session->is_logged_in = 0;
+    free(session->curr_user);
+    session->curr_user = NULL;
+    session->account_id = -1;
+    session->handle = 0;
 }
 
-// Send the begin-session command formatted like "begin-session <username>" to the bank so the bank can directly check its in-memory users list to see
-// if the user exists. Print the bank's response.
-int begin_session(ATM *atm, char *username, char *recvline)
+static void handle_reply(ATM *atm, ATMSession *session, char *reply)
 {
-    unsigned char plaintext[MAX_USERNAME_LEN + strlen("begin-session ") + 1];
-    snprintf((char *)plaintext, sizeof(plaintext), "begin-session %s", username);
+    unsigned id;
+    unsigned long long handle;
+
+    switch (session->request_kind)
+    {
+    case REQUEST_BEGIN_SESSION:
+        if (strcmp(reply, "No such user") == 0)
+        {
+            say(atm, session, "%s\n", reply);
+            finish_request(atm, session, SESSION_IDLE);
+            return;
+        }
+        session->pending_account_id = sscanf(reply, "success %u", &id) == 1 ? (long)id : -1;
+        ask_pin(atm, session);
+        return;
+
+    case REQUEST_WITHDRAW:
+    case REQUEST_BALANCE:
+        // The bank closed the session: open another and send the request again
+        if (strcmp(reply, "Session expired") == 0 && !session->renewing && session->account_id >= 0 &&
+            open_session(atm, session) == 0)
+        {
+            return;
+        }
+        say(atm, session, "%s\n", reply);
+        finish_request(atm, session, SESSION_IDLE);
+        return;
+
+    case REQUEST_OPEN_SESSION:
+        if (sscanf(reply, "success %llx", &handle) == 1 && handle != 0)
+        {
+            session->handle = handle;
+            if (start_account_request(atm, session, session->account_request, session->request_amount) == 0)
+            {
+                return;
+            }
+        }
 
-    size_t sendline_len = 0;
+        // The account is gone, or is not the one logged in: so is the session
+        say(atm, session, "Session expired\n");
+        end_session(atm, session);
+        finish_request(atm, session, SESSION_IDLE);
+        return;
 
-    unsigned char *sendline = encrypt_message(atm, plaintext, &sendline_len);
+    case REQUEST_CLOSE_SESSION:
+        finish_request(atm, session, SESSION_IDLE);
+        return;
+    }
+}
 
-    atm_send(atm, (char *)sendline, sendline_len);
-    free(sendline);
-    int n = atm_recv(atm, recvline, 10000);
+/*
+    Read every reply waiting on the socket and hand each to the session whose outstanding request it
+    answers. Replies to requests that are no longer outstanding (e.g. the answer to an earlier
+    retransmission) are ignored. If a reply fails authentication, the program will terminate.
+*/
+void atm_handle_socket(ATM *atm)
+{
+    char recvline[FRAME_MAX_SIZE];
 
-    char plaintext_buf[1000];
-    if (decrypt_message(atm, recvline, n, plaintext_buf, 1000) == -1)
+    while (1)
     {
-        atm_free(atm);
-        exit(-1);
+        ssize_t n = atm_recv_frame(atm, recvline, sizeof(recvline), MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            return;
+        }
+
+        FrameHeader header;
+        if (frame_peek((unsigned char *)recvline, n, &header) < 0 ||
+            (header.type != FRAME_REPLY && header.type != FRAME_BUSY))
+        {
+            continue;
+        }
+
+        uint64_t index = header.request_id & ((1ULL << ATM_SESSION_BITS) - 1);
+        if (index >= (uint64_t)atm->num_sessions)
+        {
+            continue;
+        }
+        ATMSession *session = &atm->sessions[index];
+        if (session->state != SESSION_WAIT_BANK || session->request_id != header.request_id)
+        {
+            continue;
+        }
+
+        if (header.type == FRAME_BUSY)
+        {
+            // The bank is shedding load: hold the retransmission back for a doubled timeout
+            timer_wheel_cancel(atm->timers, &session->timer);
+            session->rto_us = session->rto_us * 2 > atm->max_rto_us ? atm->max_rto_us : session->rto_us * 2;
+            session->busy = 1;
+            atm->busy_replies++;
+            timer_wheel_add(atm->timers, &session->timer, now_us() + session->rto_us);
+            continue;
+        }
+
+        uint64_t trace_start = TRACE_NOW();
+        char reply[FRAME_MAX_SIZE];
+        if (frame_open(atm->msg_key, (unsigned char *)recvline, n, &header, reply, sizeof(reply)) < 0)
+        {
+            printf("Untrustworthy source\n");
+            atm_free(atm);
+            exit(-1);
+        }
+        TRACE_SPAN(header.request_id, TRACE_ATM_OPEN, trace_start);
+
+        timer_wheel_cancel(atm->timers, &session->timer);
+
+        // Karn's algorithm: only time replies to requests that were sent once
+        if (session->attempt == 0)
+        {
+            update_rto(atm, now_us() - session->sent_at_us);
+        }
+        TRACE_SPAN(header.request_id, TRACE_ATM_REQUEST, session->trace_start_ns);
+        handle_reply(atm, session, reply);
     }
+}
 
-    if (strcmp(plaintext_buf, "No such user") == 0)
+// Retransmit every request whose timer fired, backing off exponentially, and
+// give up on those that have run out of retries
+void atm_handle_timers(ATM *atm)
+{
+    TimerEntry *entry = timer_wheel_expire(atm->timers, now_us());
+
+    while (entry != NULL)
     {
-        printf("%s\n", plaintext_buf);
-        return 1;
-    }
+        ATMSession *session = (ATMSession *)entry;
+        entry = entry->next;
 
-    return 0; 
+        session->rto_us = session->rto_us * 2 > atm->max_rto_us ? atm->max_rto_us : session->rto_us * 2;
+
+        if (session->attempt >= atm->max_retries)
+        {
+            atm->rto_us = session->rto_us;
+            TRACE_SPAN(session->request_id, TRACE_ATM_REQUEST, session->trace_start_ns);
+            // Closing a session is best effort: the bank closes it anyway once it idles out
+            if (session->request_kind != REQUEST_CLOSE_SESSION)
+            {
+                say(atm, session, session->busy ? "Bank busy, try again later\n" : "Bank unavailable\n");
+            }
+            finish_request(atm, session, SESSION_IDLE);
+            continue;
+        }
+
+        session->attempt++;
+        atm->retransmissions++;
+        send_request(atm, session);
+    }
 }
 
-// Send the withdraw command to the bank formatted like "withdraw <username> <amount>".
-// Print the bank's response.
-int withdraw(ATM *atm, char *username, char *amount, char *recvline)
+// Milliseconds until the next retransmission is due; -1 if none are pending
+int atm_poll_timeout(ATM *atm)
 {
-    unsigned char plaintext[MAX_USERNAME_LEN + strlen("withdraw") + strlen(amount) + 3];
-    snprintf((char *)plaintext, sizeof(plaintext), "withdraw %s %s", username, amount);
+    return timer_wheel_timeout_ms(atm->timers, now_us());
+}
 
-    // Sendline length (will be set by encrypt_message)
-    size_t sendline_len = 0;
+// Whether input has ended and every session has finished its work
+int atm_done(ATM *atm)
+{
+    if (!atm->input_eof)
+    {
+        return 0;
+    }
+    for (int i = 0; i < atm->num_sessions; i++)
+    {
+        if (atm->sessions[i].state == SESSION_WAIT_BANK || atm->sessions[i].queue_head != NULL)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
 
-    unsigned char *sendline = encrypt_message(atm, plaintext, &sendline_len);
+// Check the PIN typed after a successful begin-session and log the user in
+static void check_session_pin(ATM *atm, ATMSession *session, char *pin)
+{
+    char *username = session->pending_user;
+    session->state = SESSION_IDLE;
 
-    atm_send(atm, (char *)sendline, sendline_len);
-    free(sendline);
-    int n = atm_recv(atm, recvline, 10000);
+    size_t len = strlen(pin);
+    if (len > 0 && pin[len - 1] == '\n')
+    {
+        pin[len - 1] = '\0';
+    }
 
-    char plaintext_buf[1000];
-    if (decrypt_message(atm, recvline, n, plaintext_buf, 1000) == -1)
+    if (!get_login(atm, username))
     {
-        atm_free(atm);
-        exit(-1);
+        add_new(atm, username);
     }
 
-    printf("%s\n", plaintext_buf);
+    // if a user has attempted to log in more than MAX_ATTEMPTS times, then lock
+    // them out of their account for the rest of the session.
+    LoginAttempt *curr = get_login(atm, username);
 
-    if (strcmp(plaintext_buf, "Insufficient funds") == 0)
+    if (curr->attempts > MAX_ATTEMPTS)
     {
-        return 1;
+        say(atm, session, "Too many attempts. %s's card file has been locked.\n", username);
+        return;
+    }
+
+    // check the pin against the stored pin in their card
+    char card_file[MAX_USERNAME_LEN + 6];
+    strncpy(card_file, username, MAX_USERNAME_LEN);
+    card_file[MAX_USERNAME_LEN] = '\0';
+    strcat(card_file, ".card");
+
+    // The card must also be for the account the bank named; a card carrying
+    // another account's ID is refused like a wrong PIN
+    long card_account = -1;
+    if (check_pin(atm, card_file, username, pin, &card_account) != 0 ||
+        (card_account >= 0 && session->pending_account_id >= 0 && card_account != session->pending_account_id))
+    {
+        say(atm, session, "Not authorized\n");
+        curr->attempts++;
+
+        if (curr->attempts > MAX_ATTEMPTS)
+        {
+            say(atm, session, "Too many attempts. %s's card file has been locked.\n", username);
+        }
+        return;
     }
+    memset(card_file, 0, MAX_USERNAME_LEN + 6);
+
+    say(atm, session, "Authorized\n");
 
-    return 0; // Success
+    // set state of the session
+    session->is_logged_in = 1;
+    session->curr_user = strdup(username);
+    session->account_id = session->pending_account_id;
+    session->handle = 0;
 }
 
-// Send the withdraw command to the bank formatted like "balance <username>".
-// Print the bank's response.
-int balance(ATM *atm, char *username, char *recvline)
+// Handle one line of input for an idle session or one waiting for a PIN
+static void run_line(ATM *atm, ATMSession *session, char *line)
 {
-    unsigned char plaintext[MAX_USERNAME_LEN + strlen("balance ") + 1];
-    snprintf((char *)plaintext, sizeof(plaintext), "balance %s", username);
+    if (session->state == SESSION_WAIT_PIN)
+    {
+        check_session_pin(atm, session, line);
+    }
+    else
+    {
+        atm_process_command(atm, session, line);
+    }
+    atm_prompt(atm, session);
+}
 
-    size_t sendline_len = 0;
+// Route a line to its session: "@<n> <command>" when there are several
+// sessions, otherwise session 0. Lines for a busy session wait their turn
+static void dispatch_line(ATM *atm, char *line)
+{
+    ATMSession *session = &atm->sessions[0];
 
-    unsigned char *sendline = encrypt_message(atm, plaintext, &sendline_len);
+    if (atm->num_sessions > 1 && line[0] == '@')
+    {
+        char *end;
+        long index = strtol(line + 1, &end, 10);
+        if (end == line + 1 || *end != ' ' || index < 0 || index >= atm->num_sessions)
+        {
+            printf("Usage: @<session> <command>\n");
+            return;
+        }
+        session = &atm->sessions[index];
+        line = end + 1;
+    }
 
-    atm_send(atm, (char *)sendline, sendline_len);
-    free(sendline);
-    int n = atm_recv(atm, recvline, 10000);
+    if (session->state == SESSION_WAIT_BANK || session->queue_head != NULL)
+    {
+        size_t len = strlen(line) + 1;
+        InputLine *queued = malloc(sizeof(InputLine) + len);
+        if (!queued)
+        {
+            perror("malloc failed");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(queued->text, line, len);
+        queued->next = NULL;
+        if (session->queue_tail != NULL)
+            session->queue_tail->next = queued;
+        else
+            session->queue_head = queued;
+        session->queue_tail = queued;
+        return;
+    }
+
+    run_line(atm, session, line);
+}
 
-    char plaintext_buf[1000];
-    if (decrypt_message(atm, recvline, n, plaintext_buf, 1000) == -1)
+// Read whatever is available on stdin and dispatch each complete line.
+// At end of input a final unterminated line is dispatched as well
+void atm_handle_input(ATM *atm)
+{
+    ssize_t n = read(STDIN_FILENO, atm->in_buf + atm->in_len, sizeof(atm->in_buf) - 1 - atm->in_len);
+    if (n < 0 && errno == EINTR)
     {
-        atm_free(atm);
-        exit(-1);
+        return;
+    }
+    if (n <= 0)
+    {
+        atm->input_eof = 1;
+        if (atm->in_len > 0)
+        {
+            atm->in_buf[atm->in_len] = '\0';
+            atm->in_len = 0;
+            dispatch_line(atm, atm->in_buf);
+        }
+        return;
     }
+    atm->in_len += n;
 
-    printf("%s\n", plaintext_buf);
+    size_t start = 0;
+    for (size_t i = 0; i < atm->in_len; i++)
+    {
+        if (atm->in_buf[i] == '\n')
+        {
+            char line[ATM_MAX_INPUT + 1];
+            memcpy(line, atm->in_buf + start, i + 1 - start);
+            line[i + 1 - start] = '\0';
+            start = i + 1;
+            dispatch_line(atm, line);
+        }
+    }
 
-    return 0; 
+    // Keep the partial line; one that fills the whole buffer is taken as is
+    memmove(atm->in_buf, atm->in_buf + start, atm->in_len - start);
+    atm->in_len -= start;
+    if (atm->in_len == sizeof(atm->in_buf) - 1)
+    {
+        atm->in_buf[atm->in_len] = '\0';
+        atm->in_len = 0;
+        dispatch_line(atm, atm->in_buf);
+    }
 }
 
-void atm_process_command(ATM *atm, char *command)
+void atm_process_command(ATM *atm, ATMSession *session, char *command)
 {
     char command_copy[1000];
-    char recvline[1000];
 
     // Ensure null-termination
     if (strlen(command) >= sizeof(command_copy))
@@ -499,9 +1069,9 @@ void atm_process_command(ATM *atm, char *command)
 
     if (strstr(command, "begin-session"))
     {
-        if (atm->is_logged_in)
+        if (session->is_logged_in)
         {
-            printf("A user is already logged in\n");
+            say(atm, session, "A user is already logged in\n");
             return;
         }
 
@@ -518,7 +1088,7 @@ void atm_process_command(ATM *atm, char *command)
             }
             else
             { // too many args
-                printf("Usage:  begin-session <user-name>\n");
+                say(atm, session, "Usage:  begin-session <user-name>\n");
                 return;
             }
             token = strtok(NULL, " ");
@@ -527,7 +1097,7 @@ void atm_process_command(ATM *atm, char *command)
         // too few args
         if (arg_count < 2)
         {
-            printf("Usage:  begin-session <user-name>\n");
+            say(atm, session, "Usage:  begin-session <user-name>\n");
             return;
         }
 
@@ -536,76 +1106,27 @@ void atm_process_command(ATM *atm, char *command)
 
         if (strcmp(command, "begin-session") || !check_input(username))
         {
-            printf("Usage: begin-session <user-name>\n");
+            say(atm, session, "Usage: begin-session <user-name>\n");
             return;
         }
 
-        // check if the user is in the bank system
-        if (begin_session(atm, username, recvline) != 0)
-        {
-            return;
-        }
-
-        // ask for their pin
-        char user_input[1000];
-        printf("PIN? ");
-        char *pin = fgets(user_input, 1000, stdin);
-
-        if (pin != NULL)
-        {
-            size_t len = strlen(pin);
-            if (len > 0 && pin[len - 1] == '\n')
-            {
-                pin[len - 1] = '\0'; 
-            }
-        }
+        // Ask the bank whether the user exists; the PIN is asked for once it answers.
+        // The bank checks its in-memory users list for "begin-session <username>"
+        strncpy(session->pending_user, username, sizeof(session->pending_user) - 1);
+        session->pending_user[sizeof(session->pending_user) - 1] = '\0';
 
-        if (!get_login(atm, username))
+        char plaintext[MAX_USERNAME_LEN + strlen("begin-session ") + 1];
+        snprintf(plaintext, sizeof(plaintext), "begin-session %s", username);
+        if (start_request(atm, session, REQUEST_BEGIN_SESSION, plaintext) != 0)
         {
-            add_new(atm, username);
+            say(atm, session, "Bank unavailable\n");
         }
-
-        // if a user has attempted to log in more than MAX_ATTEMPTS times, then lock
-        // them out of their account for the rest of the session. 
-        LoginAttempt *curr = get_login(atm, username);
-
-        if (curr->attempts > MAX_ATTEMPTS)
-        {
-            printf("Too many attempts. %s's card file has been locked.\n", username);
-            return;
-        }
-
-        // check the pin against the stored pin in their card
-        char card_file[MAX_USERNAME_LEN + 6];
-        strncpy(card_file, username, MAX_USERNAME_LEN);
-        strcat(card_file, ".card");
-
-        if (check_pin(atm->atm_file, card_file, username, pin) != 0)
-        {
-            printf("Not authorized\n");
-            LoginAttempt *curr = get_login(atm, username);
-            curr->attempts++;
-
-            if (curr->attempts > MAX_ATTEMPTS)
-            {
-                printf("Too many attempts. %s's card file has been locked.\n", username);
-                return;
-            }
-            return;
-        }
-        memset(card_file, 0, MAX_USERNAME_LEN + 6);
-
-        printf("Authorized\n");
-
-        // set state of ATM
-        atm->is_logged_in = 1;
-        atm->curr_user = strdup(username);
     }
     else if (strstr(command, "withdraw"))
     {
-        if (!atm->is_logged_in)
+        if (!session->is_logged_in)
         {
-            printf("No user logged in\n");
+            say(atm, session, "No user logged in\n");
             return;
         }
         char *args[2]; // Expected arguments: command, amount
@@ -620,7 +1141,7 @@ void atm_process_command(ATM *atm, char *command)
             }
             else
             { // too many args
-                printf("Usage: withdraw <amt>\n");
+                say(atm, session, "Usage: withdraw <amt>\n");
                 return;
             }
             token = strtok(NULL, " ");
@@ -629,7 +1150,7 @@ void atm_process_command(ATM *atm, char *command)
         // too few args
         if (arg_count < 2)
         {
-            printf("Usage: withdraw <amt>\n");
+            say(atm, session, "Usage: withdraw <amt>\n");
             return;
         }
 
@@ -638,21 +1159,22 @@ void atm_process_command(ATM *atm, char *command)
 
         if (strcmp(command, "withdraw") != 0 || !valid_balance(amount))
         {
-            printf("Usage: withdraw <amt>\n");
+            say(atm, session, "Usage: withdraw <amt>\n");
             return;
         }
 
-        // encrypt message "withdraw <username> <amount>"
-        if (withdraw(atm, atm->curr_user, amount, recvline) != 0)
+        // send "withdraw <account> <amount>"; the bank's response is printed when it arrives
+        session->renewing = 0;
+        if (start_account_request(atm, session, REQUEST_WITHDRAW, (int)strtol(amount, NULL, 10)) != 0)
         {
-            return;
+            say(atm, session, "Bank unavailable\n");
         }
     }
     else if (strstr(command, "balance"))
     {
-        if (!atm->is_logged_in)
+        if (!session->is_logged_in)
         {
-            printf("No user logged in\n");
+            say(atm, session, "No user logged in\n");
             return;
         }
         
@@ -660,31 +1182,38 @@ void atm_process_command(ATM *atm, char *command)
 
         if (strcmp(token, "balance") != 0 || strtok(NULL, " ") != NULL)
         {
-            printf("Usage: balance\n");
+            say(atm, session, "Usage: balance\n");
             return;
         }
 
-        balance(atm, atm->curr_user, recvline);
+        // send "balance <account>"; the bank's response is printed when it arrives
+        session->renewing = 0;
+        if (start_account_request(atm, session, REQUEST_BALANCE, 0) != 0)
+        {
+            say(atm, session, "Bank unavailable\n");
+        }
         return;
     }
     else if (strstr(command, "end-session\n"))
     {
-        if (!atm->is_logged_in)
+        if (!session->is_logged_in)
         {
-            printf("No user logged in\n");
+            say(atm, session, "No user logged in\n");
             return;
         }
 
-        // reset login attempts to 0
-        get_login(atm, atm->curr_user)->attempts = 0;
-        atm->is_logged_in = 0;
-        atm->curr_user = NULL;
-        printf("User logged out\n");
+        uint64_t handle = session->handle;
+        end_session(atm, session);
+        say(atm, session, "User logged out\n");
+        if (handle != 0)
+        {
+            close_session(atm, session, handle);
+        }
         return;
     }
     else
     {
-        printf("Invalid command\n");
+        say(atm, session, "Invalid command\n");
         return;
     }
 }
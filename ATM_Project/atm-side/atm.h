@@ -16,6 +16,13 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <stdio.h>
+#include <stdint.h>
+#include "encryption/enc.h"
+#include "encryption/reassembly.h"
+#include "util/card_vault.h"
+#include "util/timer_wheel.h"
+#include "util/transport.h"
+#include "util/trace.h"
 
 // Structure to store login attempts for each user
 typedef struct LoginAttempt {
@@ -24,26 +31,143 @@ typedef struct LoginAttempt {
     struct LoginAttempt *next;   // Pointer to the next user
 } LoginAttempt;
 
+// Upper bound on the number of logical sessions one ATM process drives.
+// Session i's requests carry i in the low bits of their request ID.
+#define ATM_MAX_SESSIONS 4096
+#define ATM_SESSION_BITS 16
+
+#define ATM_MAX_REQUEST 512
+#define ATM_MAX_INPUT 10000
+
+// Frames larger than ATM_FRAGMENT_SIZE are sent as fragments, and up to
+// ATM_REASSEMBLY_SLOTS fragmented replies are put back together at once,
+// each given ATM_REASSEMBLY_TIMEOUT_MS for its fragments to arrive
+#define ATM_DEFAULT_REASSEMBLY_SLOTS 16
+#define ATM_DEFAULT_REASSEMBLY_TIMEOUT_MS 1000
+
+// What a session is waiting for
+typedef enum
+{
+    SESSION_IDLE,           // the next command
+    SESSION_WAIT_BANK,      // the reply to an outstanding request
+    SESSION_WAIT_PIN,       // the PIN of the user named by begin-session
+} SessionState;
+
+// The request a session has outstanding, which decides how its reply is handled
+typedef enum
+{
+    REQUEST_BEGIN_SESSION,
+    REQUEST_WITHDRAW,
+    REQUEST_BALANCE,
+    REQUEST_OPEN_SESSION,   // opens the logged-in user's session at the bank, for the withdraw or balance waiting on it
+    REQUEST_CLOSE_SESSION,  // closes it again at end-session
+} RequestKind;
+
+// A line of input that arrived while its session was busy
+typedef struct InputLine {
+    struct InputLine *next;
+    char text[];
+} InputLine;
+
+typedef struct _ATMSession
+{
+    // Retransmission timer; must stay first, expired timers are cast back to the session
+    TimerEntry timer;
+
+    int id;
+    SessionState state;
+    char * curr_user;
+    int is_logged_in;
+    char pending_user[251];     // named by begin-session, until the PIN is checked
+
+    // The bank's account ID for the user, from its answer to begin-session,
+    // and the handle of the session the bank opened once the PIN was checked.
+    // Requests name the account by the handle rather than the username. -1
+    // and 0 if unknown
+    long pending_account_id;
+    long account_id;
+    uint64_t handle;
+
+    // The withdraw or balance last asked for, to send once the bank has
+    // opened a session for it; renewing is set once one has been opened
+    RequestKind account_request;
+    int request_amount;
+    int renewing;
+
+    // The outstanding request: sealed once, resent unchanged on every retry
+    RequestKind request_kind;
+    uint64_t request_id;
+    unsigned char frame[ATM_MAX_REQUEST];
+    int frame_len;
+    int attempt;
+    long sent_at_us;
+    long rto_us;
+    int busy;                   // the bank's last answer was a busy frame
+    uint64_t trace_start_ns;
+
+    // Lines queued until the outstanding request completes
+    InputLine *queue_head;
+    InputLine *queue_tail;
+} ATMSession;
+
 typedef struct _ATM
 {
     // Networking state
     int sockfd;
     struct sockaddr_in rtr_addr;
     struct sockaddr_in atm_addr;
+    int fragment_size;
+    Reassembler *fragments;
 
     // Protocol state
     char * atm_file;
-    char * curr_user;
-    int is_logged_in;
+    unsigned char msg_key[AES_KEY_SIZE];    // read from atm_file once, at startup
+
+    // Cards come from the card vault named by CARD_VAULT, if set, which is
+    // opened at the first PIN check; otherwise from <username>.card
+    char *card_vault_path;
+    CardVault *card_vault;
 
     // Track login attempts
     LoginAttempt *attempts_list_head; 
+
+    // Logical sessions driven by this process. With more than one, input lines
+    // are addressed as "@<session> <command>" and output is tagged "[<session>] "
+    int num_sessions;
+    ATMSession *sessions;
+
+    // Buffered stdin, split into lines by atm_handle_input()
+    char in_buf[ATM_MAX_INPUT];
+    size_t in_len;
+    int input_eof;
+
+    // Request/reply reliability: every request gets a fresh ID, and is
+    // retransmitted after rto_us, which follows the measured RTT
+    uint64_t next_request_id;
+    long srtt_us;
+    long rttvar_us;
+    long rto_us;
+    long min_rto_us;
+    long max_rto_us;
+    int max_retries;
+    unsigned long retransmissions;
+    unsigned long busy_replies;     // requests the bank turned away (see FRAME_BUSY)
+    TimerWheel *timers;
 } ATM;
 
 ATM* atm_create();
 void atm_free(ATM *atm);
 ssize_t atm_send(ATM *atm, char *data, size_t data_len);
 ssize_t atm_recv(ATM *atm, char *data, size_t max_data_len);
-void atm_process_command(ATM *atm, char *command);
+ssize_t atm_recv_frame(ATM *atm, char *data, size_t max_data_len, int flags);
+void atm_process_command(ATM *atm, ATMSession *session, char *command);
+void atm_prompt(ATM *atm, ATMSession *session);
+void atm_handle_input(ATM *atm);
+void atm_handle_socket(ATM *atm);
+void atm_handle_timers(ATM *atm);
+int atm_poll_timeout(ATM *atm);
+int atm_done(ATM *atm);
+uint32_t atm_request_budget_ms(ATM *atm, long rto_us, int attempt);
+int extract_msg_key(char *atm_file, unsigned char *key);
 
 #endif
@@ -0,0 +1,581 @@
+/*
+ * An open-loop load generator for the ATM/bank protocol.
+ *
+ * Usage:  atm-loadgen [-r <rate>] [-d <seconds>] [-n <users>] [-m <mix>]
+ *                     [-c <outstanding>] [-t <timeout ms>] [-C] <atm file>
+ *
+ *   -r  requests per second, arriving as a Poisson process (default 1000)
+ *   -d  how long to generate arrivals for (default 10)
+ *   -n  number of simulated customers (default 1000)
+ *   -m  begin-session:balance:withdraw weights (default 1:2:1)
+ *   -c  most requests outstanding at once (default 4096); arrivals that
+ *       find no free slot are counted as dropped
+ *   -t  initial retransmission timeout (default ATM_TIMEOUT_MS); the
+ *       retry count and backoff cap follow the ATM's settings
+ *   -C  print the bank commands that create the customers, then exit
+ *
+ * Requests are sealed and sent exactly as the ATM sends them, from the
+ * ATM's port, so they go through the router like real traffic.  Like the
+ * ATM, a customer's first balance or withdraw after a begin-session is sent
+ * as an open-session naming them by username and account ID (counted as
+ * open-session), and later ones name them by the handle the bank gave it;
+ * once the bank has closed that session, the next one opens another.
+ * Customers with no begin-session answered yet are named by username.  Because
+ * arrivals are scheduled independently of replies, a slow bank shows up
+ * as latency rather than as a lower offered load; latency is measured
+ * from each request's scheduled arrival, so time spent retransmitting
+ * is included.
+ *
+ * Results are printed to stdout as JSON.
+ */
+
+#include "atm.h"
+#include "encryption/frame.h"
+#include "util/histogram.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <time.h>
+
+#define ERROR_USAGE 62
+#define ERROR_FILE_OPEN 64
+
+#define LOADGEN_MAX_USERS 400000
+#define LOADGEN_MAX_OUTSTANDING (1 << ATM_SESSION_BITS)
+#define LOADGEN_PIN "1234"
+#define LOADGEN_BALANCE 1000000000
+
+// The first NUM_MIX_CMDS are picked by the mix; open-session is sent in place of a pick
+enum { CMD_BEGIN_SESSION, CMD_BALANCE, CMD_WITHDRAW, NUM_MIX_CMDS, CMD_OPEN_SESSION = NUM_MIX_CMDS, NUM_CMDS };
+
+static const char *cmd_names[NUM_CMDS] = { "begin-session", "balance", "withdraw", "open-session" };
+
+// One request in flight; its slot index is the low bits of its request ID
+typedef struct _LoadRequest
+{
+    // Retransmission timer; must stay first, expired timers are cast back to the request
+    TimerEntry timer;
+
+    int in_use;
+    int cmd;
+    int user;
+    uint64_t request_id;
+    long scheduled_us;
+    int attempt;
+    long rto_us;
+    uint64_t trace_start_ns;
+    int frame_len;
+    unsigned char frame[ATM_MAX_REQUEST];
+} LoadRequest;
+
+typedef struct _CommandStats
+{
+    unsigned long sent;
+    unsigned long completed;
+    unsigned long errors;       // answered, but not with success
+    unsigned long timeouts;     // given up on after every retry
+    unsigned long busy;         // busy frames received: the bank shed the request
+    Histogram latency;
+} CommandStats;
+
+typedef struct _LoadGen
+{
+    ATM *atm;
+
+    int num_users;
+    long *ids;                  // per customer, from begin-session; -1 until known
+    uint64_t *handles;          // per customer, from open-session; 0 until known
+    int weights[NUM_MIX_CMDS];
+    int total_weight;
+    uint64_t rng;
+
+    uint32_t num_slots;
+    LoadRequest *slots;
+    uint32_t *free_slots;
+    uint32_t num_free;
+    uint64_t next_request_id;
+
+    unsigned long arrivals;
+    unsigned long dropped;
+    unsigned long retransmissions;
+    unsigned long bad_replies;
+    long last_completion_us;
+    CommandStats cmds[NUM_CMDS];
+    Histogram latency;
+} LoadGen;
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage:  atm-loadgen [-r <rate>] [-d <seconds>] [-n <users>] [-m <mix>]\n"
+                    "                    [-c <outstanding>] [-t <timeout ms>] [-C] <atm file>\n");
+    exit(ERROR_USAGE);
+}
+
+static long now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+// xorshift64*: uniform in [0, 1)
+static double random_uniform(uint64_t *rng)
+{
+    uint64_t x = *rng;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *rng = x;
+    return (double)((x * 0x2545F4914F6CDD1DULL) >> 11) / (double)(1ULL << 53);
+}
+
+// Customer names must be alphabetic, so number them in base 26
+static void user_name(int index, char *name)
+{
+    strcpy(name, "loadgen");
+    char *p = name + strlen(name);
+    for (int i = 0; i < 4; i++)
+    {
+        p[3 - i] = 'a' + index % 26;
+        index /= 26;
+    }
+    p[4] = '\0';
+}
+
+static int parse_mix(LoadGen *lg, const char *mix)
+{
+    if (sscanf(mix, "%d:%d:%d", &lg->weights[CMD_BEGIN_SESSION], &lg->weights[CMD_BALANCE],
+               &lg->weights[CMD_WITHDRAW]) != 3)
+    {
+        return -1;
+    }
+
+    lg->total_weight = 0;
+    for (int i = 0; i < NUM_MIX_CMDS; i++)
+    {
+        if (lg->weights[i] < 0)
+        {
+            return -1;
+        }
+        lg->total_weight += lg->weights[i];
+    }
+    return lg->total_weight > 0 ? 0 : -1;
+}
+
+static int pick_command(LoadGen *lg)
+{
+    int r = (int)(random_uniform(&lg->rng) * lg->total_weight);
+    for (int i = 0; i < NUM_MIX_CMDS; i++)
+    {
+        if (r < lg->weights[i])
+        {
+            return i;
+        }
+        r -= lg->weights[i];
+    }
+    return NUM_MIX_CMDS - 1;
+}
+
+static void send_request(LoadGen *lg, LoadRequest *req)
+{
+    frame_set_budget(req->frame, atm_request_budget_ms(lg->atm, req->rto_us, req->attempt));
+
+    uint64_t trace_start = TRACE_NOW();
+    atm_send(lg->atm, (char *)req->frame, req->frame_len);
+    TRACE_SPAN(req->request_id, TRACE_ATM_SEND, trace_start);
+    timer_wheel_add(lg->atm->timers, &req->timer, now_us() + req->rto_us);
+}
+
+static void release(LoadGen *lg, LoadRequest *req)
+{
+    req->in_use = 0;
+    lg->free_slots[lg->num_free++] = req - lg->slots;
+}
+
+// Start one request scheduled to arrive at scheduled_us
+static void issue(LoadGen *lg, long scheduled_us)
+{
+    lg->arrivals++;
+    if (lg->num_free == 0)
+    {
+        lg->dropped++;
+        return;
+    }
+
+    uint32_t slot = lg->free_slots[--lg->num_free];
+    LoadRequest *req = &lg->slots[slot];
+
+    char name[32];
+    req->user = (int)(random_uniform(&lg->rng) * lg->num_users);
+    if (lg->handles[req->user] != 0)
+    {
+        snprintf(name, sizeof(name), "@%llx", (unsigned long long)lg->handles[req->user]);
+    }
+    else
+    {
+        user_name(req->user, name);
+    }
+
+    char command[ATM_MAX_REQUEST];
+    req->cmd = pick_command(lg);
+    if (req->cmd != CMD_BEGIN_SESSION && lg->handles[req->user] == 0 && lg->ids[req->user] >= 0)
+    {
+        req->cmd = CMD_OPEN_SESSION;
+    }
+    switch (req->cmd)
+    {
+    case CMD_BEGIN_SESSION:
+        user_name(req->user, name);
+        snprintf(command, sizeof(command), "begin-session %s", name);
+        break;
+    case CMD_OPEN_SESSION:
+        snprintf(command, sizeof(command), "open-session %s#%ld", name, lg->ids[req->user]);
+        break;
+    case CMD_BALANCE:
+        snprintf(command, sizeof(command), "balance %s", name);
+        break;
+    default:
+        snprintf(command, sizeof(command), "withdraw %s 1", name);
+        break;
+    }
+
+    uint64_t trace_start = TRACE_NOW();
+    FrameHeader header;
+    memset(&header, 0, sizeof(header));
+    header.type = FRAME_REQUEST;
+    header.request_id = (lg->next_request_id++ << ATM_SESSION_BITS) | slot;
+
+    req->frame_len = frame_seal(&header, lg->atm->msg_key, (unsigned char *)command, strlen(command),
+                                req->frame, sizeof(req->frame));
+    TRACE_SPAN(header.request_id, TRACE_ATM_SEAL, trace_start);
+    if (req->frame_len < 0)
+    {
+        release(lg, req);
+        lg->dropped++;
+        return;
+    }
+
+    req->in_use = 1;
+    req->request_id = header.request_id;
+    req->scheduled_us = scheduled_us;
+    req->attempt = 0;
+    req->rto_us = lg->atm->rto_us;
+    req->trace_start_ns = trace_start;
+    lg->cmds[req->cmd].sent++;
+    send_request(lg, req);
+}
+
+// Match every waiting reply to its request and record the latency
+static void handle_replies(LoadGen *lg)
+{
+    char recvline[FRAME_MAX_SIZE];
+
+    while (1)
+    {
+        ssize_t n = atm_recv_frame(lg->atm, recvline, sizeof(recvline), MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            return;
+        }
+
+        FrameHeader header;
+        if (frame_peek((unsigned char *)recvline, n, &header) < 0 ||
+            (header.type != FRAME_REPLY && header.type != FRAME_BUSY))
+        {
+            lg->bad_replies++;
+            continue;
+        }
+
+        LoadRequest *req = &lg->slots[header.request_id & (lg->num_slots - 1)];
+        if (!req->in_use || req->request_id != header.request_id)
+        {
+            continue; // the answer to a retransmission that was already answered
+        }
+
+        if (header.type == FRAME_BUSY)
+        {
+            // Back off like the ATM does: retry after a doubled timeout
+            timer_wheel_cancel(lg->atm->timers, &req->timer);
+            req->rto_us = req->rto_us * 2 > lg->atm->max_rto_us ? lg->atm->max_rto_us : req->rto_us * 2;
+            lg->cmds[req->cmd].busy++;
+            timer_wheel_add(lg->atm->timers, &req->timer, now_us() + req->rto_us);
+            continue;
+        }
+
+        uint64_t trace_start = TRACE_NOW();
+        char reply[FRAME_MAX_SIZE];
+        if (frame_open(lg->atm->msg_key, (unsigned char *)recvline, n, &header, reply, sizeof(reply)) < 0)
+        {
+            lg->bad_replies++;
+            continue;
+        }
+        TRACE_SPAN(header.request_id, TRACE_ATM_OPEN, trace_start);
+        TRACE_SPAN(header.request_id, TRACE_ATM_REQUEST, req->trace_start_ns);
+
+        long now = now_us();
+        CommandStats *cs = &lg->cmds[req->cmd];
+        timer_wheel_cancel(lg->atm->timers, &req->timer);
+        histogram_record(&cs->latency, now - req->scheduled_us);
+        histogram_record(&lg->latency, now - req->scheduled_us);
+        cs->completed++;
+        unsigned id;
+        unsigned long long handle;
+        if (req->cmd == CMD_BEGIN_SESSION && sscanf(reply, "success %u", &id) == 1)
+        {
+            lg->ids[req->user] = id;
+        }
+        else if (req->cmd == CMD_OPEN_SESSION && sscanf(reply, "success %llx", &handle) == 1)
+        {
+            lg->handles[req->user] = handle;
+        }
+        else if (reply[0] != '$')
+        {
+            // The customer's session may have been closed; the next request opens another
+            lg->handles[req->user] = 0;
+            if (req->cmd == CMD_OPEN_SESSION)
+            {
+                lg->ids[req->user] = -1;
+            }
+            cs->errors++;
+        }
+        lg->last_completion_us = now;
+        release(lg, req);
+    }
+}
+
+// Retransmit requests whose timer fired, with the ATM's backoff and retry limit
+static void handle_timers(LoadGen *lg)
+{
+    ATM *atm = lg->atm;
+    TimerEntry *entry = timer_wheel_expire(atm->timers, now_us());
+
+    while (entry != NULL)
+    {
+        LoadRequest *req = (LoadRequest *)entry;
+        entry = entry->next;
+
+        if (req->attempt >= atm->max_retries)
+        {
+            TRACE_SPAN(req->request_id, TRACE_ATM_REQUEST, req->trace_start_ns);
+            lg->cmds[req->cmd].timeouts++;
+            release(lg, req);
+            continue;
+        }
+
+        req->attempt++;
+        req->rto_us = req->rto_us * 2 > atm->max_rto_us ? atm->max_rto_us : req->rto_us * 2;
+        lg->retransmissions++;
+        send_request(lg, req);
+    }
+}
+
+static void print_latency(const Histogram *h)
+{
+    printf("{\"mean\": %.1f, \"p50\": %lu, \"p99\": %lu, \"p99_9\": %lu, \"max\": %lu}",
+           histogram_mean(h),
+           (unsigned long)histogram_percentile(h, 50.0),
+           (unsigned long)histogram_percentile(h, 99.0),
+           (unsigned long)histogram_percentile(h, 99.9),
+           (unsigned long)(h->count > 0 ? h->max : 0));
+}
+
+static void print_report(LoadGen *lg, double rate, long start_us, long end_us)
+{
+    unsigned long completed = 0, timeouts = 0, busy = 0;
+    for (int i = 0; i < NUM_CMDS; i++)
+    {
+        completed += lg->cmds[i].completed;
+        timeouts += lg->cmds[i].timeouts;
+        busy += lg->cmds[i].busy;
+    }
+
+    // Throughput over the time it took to serve what arrived
+    long last = lg->last_completion_us > end_us ? lg->last_completion_us : end_us;
+    double elapsed = (last - start_us) / 1e6;
+
+    printf("{\n");
+    printf("  \"duration_s\": %.3f,\n", (end_us - start_us) / 1e6);
+    printf("  \"offered_rate\": %.1f,\n", rate);
+    printf("  \"users\": %d,\n", lg->num_users);
+    printf("  \"arrivals\": %lu,\n", lg->arrivals);
+    printf("  \"dropped_arrivals\": %lu,\n", lg->dropped);
+    printf("  \"completed\": %lu,\n", completed);
+    printf("  \"timeouts\": %lu,\n", timeouts);
+    printf("  \"retransmissions\": %lu,\n", lg->retransmissions);
+    printf("  \"busy\": %lu,\n", busy);
+    printf("  \"bad_replies\": %lu,\n", lg->bad_replies);
+    printf("  \"throughput\": %.1f,\n", elapsed > 0 ? completed / elapsed : 0.0);
+    printf("  \"latency_us\": ");
+    print_latency(&lg->latency);
+    printf(",\n  \"commands\": {\n");
+    for (int i = 0; i < NUM_CMDS; i++)
+    {
+        CommandStats *cs = &lg->cmds[i];
+        printf("    \"%s\": {\"sent\": %lu, \"completed\": %lu, \"errors\": %lu, \"timeouts\": %lu, \"busy\": %lu, "
+               "\"latency_us\": ", cmd_names[i], cs->sent, cs->completed, cs->errors, cs->timeouts, cs->busy);
+        print_latency(&cs->latency);
+        printf("}%s\n", i + 1 < NUM_CMDS ? "," : "");
+    }
+    printf("  }\n}\n");
+}
+
+int main(int argc, char **argv)
+{
+    double rate = 1000;
+    double duration = 10;
+    int num_users = 1000;
+    int outstanding = 4096;
+    int timeout_ms = 0;
+    int print_users = 0;
+    char *mix = "1:2:1";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:d:n:m:c:t:C")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r': rate = atof(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'n': num_users = atoi(optarg); break;
+        case 'm': mix = optarg; break;
+        case 'c': outstanding = atoi(optarg); break;
+        case 't': timeout_ms = atoi(optarg); break;
+        case 'C': print_users = 1; break;
+        default: usage();
+        }
+    }
+    if (optind != argc - 1 || rate <= 0 || duration <= 0 || num_users < 1 ||
+        num_users > LOADGEN_MAX_USERS || outstanding < 1 || outstanding > LOADGEN_MAX_OUTSTANDING ||
+        timeout_ms < 0)
+    {
+        usage();
+    }
+
+    LoadGen lg;
+    memset(&lg, 0, sizeof(lg));
+    lg.num_users = num_users;
+    if (parse_mix(&lg, mix) != 0)
+    {
+        usage();
+    }
+
+    char name[32];
+    if (print_users)
+    {
+        for (int i = 0; i < num_users; i++)
+        {
+            user_name(i, name);
+            printf("create-user %s %s %d\n", name, LOADGEN_PIN, LOADGEN_BALANCE);
+        }
+        return EXIT_SUCCESS;
+    }
+
+    char *atm_file = argv[optind];
+
+    // init writes its files relative to the current directory, like the ATM expects
+    if (atm_file[0] == '/') {
+        atm_file++;
+    }
+    FILE *atm_fd = fopen(atm_file, "r");
+    if (atm_fd == NULL)
+    {
+        perror("Error opening ATM initialization file");
+        return ERROR_FILE_OPEN;
+    }
+    fclose(atm_fd);
+
+    TRACE_OPEN("loadgen");
+    lg.atm = atm_create(atm_file);
+    if (timeout_ms > 0)
+    {
+        lg.atm->rto_us = timeout_ms * 1000L;
+    }
+
+    // Slots are indexed by the low bits of the request ID, so round up to a power of two
+    lg.num_slots = 1;
+    while (lg.num_slots < (uint32_t)outstanding)
+    {
+        lg.num_slots <<= 1;
+    }
+    lg.slots = (LoadRequest *)calloc(lg.num_slots, sizeof(LoadRequest));
+    lg.free_slots = (uint32_t *)malloc(lg.num_slots * sizeof(uint32_t));
+    lg.ids = (long *)malloc(lg.num_users * sizeof(long));
+    lg.handles = (uint64_t *)calloc(lg.num_users, sizeof(uint64_t));
+    if (lg.slots == NULL || lg.free_slots == NULL || lg.ids == NULL || lg.handles == NULL)
+    {
+        perror("Could not allocate request slots");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < lg.num_users; i++)
+    {
+        lg.ids[i] = -1;
+    }
+    for (uint32_t i = 0; i < lg.num_slots; i++)
+    {
+        lg.free_slots[lg.num_free++] = lg.num_slots - 1 - i;
+    }
+
+    generate_rand_bytes(sizeof(lg.next_request_id), (unsigned char *)&lg.next_request_id);
+    generate_rand_bytes(sizeof(lg.rng), (unsigned char *)&lg.rng);
+    lg.rng |= 1;
+    histogram_reset(&lg.latency);
+    for (int i = 0; i < NUM_CMDS; i++)
+    {
+        histogram_reset(&lg.cmds[i].latency);
+    }
+
+    long start_us = now_us();
+    long end_us = start_us + (long)(duration * 1e6);
+    double next_arrival = start_us;
+
+    // Arrivals stop at end_us; then wait for what is still outstanding
+    while (1)
+    {
+        long now = now_us();
+        while (next_arrival <= now && next_arrival < end_us)
+        {
+            issue(&lg, (long)next_arrival);
+            next_arrival += -log(1.0 - random_uniform(&lg.rng)) / rate * 1e6;
+        }
+        if (next_arrival >= end_us && lg.num_free == lg.num_slots)
+        {
+            break;
+        }
+
+        long wait_us = -1;
+        if (next_arrival < end_us)
+        {
+            wait_us = (long)next_arrival - now;
+        }
+        int timer_ms = timer_wheel_timeout_ms(lg.atm->timers, now);
+        if (timer_ms >= 0 && (wait_us < 0 || timer_ms * 1000L < wait_us))
+        {
+            wait_us = timer_ms * 1000L;
+        }
+
+        struct pollfd pfd = { lg.atm->sockfd, POLLIN, 0 };
+        struct timespec ts = { wait_us / 1000000, (wait_us % 1000000) * 1000 };
+        if (transport_poll(&pfd, 1, wait_us < 0 ? NULL : &ts) > 0)
+        {
+            handle_replies(&lg);
+        }
+        handle_timers(&lg);
+    }
+
+    print_report(&lg, rate, start_us, end_us);
+
+    free(lg.slots);
+    free(lg.free_slots);
+    free(lg.ids);
+    free(lg.handles);
+    atm_free(lg.atm);
+    return EXIT_SUCCESS;
+}
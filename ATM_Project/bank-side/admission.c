@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <string.h>
+#include "admission.h"
+
+Admission *admission_create(double rate, double burst, uint64_t target_ns, uint64_t interval_ns)
+{
+    Admission *admission = (Admission *)malloc(sizeof(Admission));
+    if (admission == NULL)
+    {
+        return NULL;
+    }
+
+    memset(admission, 0, sizeof(Admission));
+    admission->rate = rate;
+    admission->burst = burst < 1 ? 1 : burst;
+    admission->target_ns = target_ns;
+    admission->interval_ns = interval_ns;
+    return admission;
+}
+
+void admission_free(Admission *admission)
+{
+    free(admission);
+}
+
+// Find (or claim) the bucket for a client; clients past the table's capacity share the overflow bucket
+static TokenBucket *bucket_of(Admission *admission, const struct sockaddr_in *from, uint64_t now_ns)
+{
+    uint64_t client = ((uint64_t)from->sin_addr.s_addr << 16 | from->sin_port) + 1;
+    uint32_t slot = (uint32_t)((client * 0x9E3779B97F4A7C15ULL) >> 32) & (ADMISSION_MAX_CLIENTS - 1);
+
+    for (uint32_t probe = 0; probe < ADMISSION_MAX_CLIENTS; probe++)
+    {
+        TokenBucket *bucket = &admission->buckets[(slot + probe) & (ADMISSION_MAX_CLIENTS - 1)];
+        if (bucket->client == client)
+        {
+            return bucket;
+        }
+        if (bucket->client == 0)
+        {
+            bucket->client = client;
+            bucket->tokens = admission->burst;
+            bucket->refilled_ns = now_ns;
+            admission->num_clients++;
+            return bucket;
+        }
+    }
+
+    if (admission->overflow.client == 0)
+    {
+        admission->overflow.client = 1;
+        admission->overflow.tokens = admission->burst;
+        admission->overflow.refilled_ns = now_ns;
+    }
+    return &admission->overflow;
+}
+
+// Whether the queue has stayed above target for a whole interval
+static int standing_queue(Admission *admission, uint64_t queue_delay_ns, uint64_t now_ns)
+{
+    if (admission->target_ns == 0 || queue_delay_ns < admission->target_ns)
+    {
+        admission->above_since_ns = 0;
+        return 0;
+    }
+    if (admission->above_since_ns == 0)
+    {
+        admission->above_since_ns = now_ns;
+        return 0;
+    }
+    return now_ns - admission->above_since_ns >= admission->interval_ns;
+}
+
+// Decide whether to serve a request that waited queue_delay_ns in the socket buffer
+AdmitDecision admission_check(Admission *admission, const struct sockaddr_in *from,
+                              uint64_t queue_delay_ns, uint64_t now_ns)
+{
+    AdmissionStats *stats = &admission->stats;
+    stats->last_delay_ns = queue_delay_ns;
+    if (queue_delay_ns > stats->max_delay_ns)
+    {
+        stats->max_delay_ns = queue_delay_ns;
+    }
+
+    if (standing_queue(admission, queue_delay_ns, now_ns))
+    {
+        stats->shed_delay++;
+        return ADMIT_SHED_DELAY;
+    }
+
+    if (admission->rate > 0)
+    {
+        TokenBucket *bucket = bucket_of(admission, from, now_ns);
+        bucket->tokens += (now_ns - bucket->refilled_ns) * admission->rate / 1e9;
+        if (bucket->tokens > admission->burst)
+        {
+            bucket->tokens = admission->burst;
+        }
+        bucket->refilled_ns = now_ns;
+
+        if (bucket->tokens < 1)
+        {
+            stats->shed_rate++;
+            return ADMIT_SHED_RATE;
+        }
+        bucket->tokens -= 1;
+    }
+
+    stats->admitted++;
+    return ADMIT_OK;
+}
@@ -0,0 +1,74 @@
+/*
+ * Admission control for remote requests.
+ *
+ * Under overload it is better to turn a request away at once, with a
+ * cheap busy reply, than to let the socket buffer fill and serve every
+ * ATM late.  Two checks run before a request is decrypted:
+ *
+ *   - Each ATM (identified by the router upstream socket it arrives
+ *     from) has a token bucket, so one ATM cannot take more than its
+ *     share of the bank.
+ *
+ *   - A queue-delay shedder in the style of CoDel compares the time
+ *     each request waited in the socket buffer (from the kernel's
+ *     receive timestamp) against a target.  Requests are shed only once
+ *     the delay has stayed above target for a whole interval, so a
+ *     burst that drains quickly is absorbed and only a standing queue
+ *     is cut back.
+ *
+ * Buckets live in a fixed open-addressing table; clients beyond its
+ * capacity share one overflow bucket.
+ */
+
+#ifndef __ADMISSION_H__
+#define __ADMISSION_H__
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define ADMISSION_MAX_CLIENTS 1024
+
+typedef enum
+{
+    ADMIT_OK,
+    ADMIT_SHED_RATE,            // the ATM's token bucket was empty
+    ADMIT_SHED_DELAY            // the request queued for too long
+} AdmitDecision;
+
+typedef struct _TokenBucket
+{
+    uint64_t client;            // address and port; 0 marks an unused slot
+    double tokens;
+    uint64_t refilled_ns;
+} TokenBucket;
+
+typedef struct _AdmissionStats
+{
+    unsigned long admitted;
+    unsigned long shed_rate;
+    unsigned long shed_delay;
+    uint64_t last_delay_ns;     // queue delay of the last request checked
+    uint64_t max_delay_ns;
+} AdmissionStats;
+
+typedef struct _Admission
+{
+    double rate;                // tokens per second per ATM; 0 disables the buckets
+    double burst;               // bucket capacity
+    uint64_t target_ns;         // acceptable queue delay; 0 disables the shedder
+    uint64_t interval_ns;       // how long the delay must stay above target
+
+    uint64_t above_since_ns;    // when the delay went above target; 0 if it is below
+    uint32_t num_clients;
+    TokenBucket buckets[ADMISSION_MAX_CLIENTS];
+    TokenBucket overflow;
+
+    AdmissionStats stats;
+} Admission;
+
+Admission* admission_create(double rate, double burst, uint64_t target_ns, uint64_t interval_ns);
+void admission_free(Admission *admission);
+AdmitDecision admission_check(Admission *admission, const struct sockaddr_in *from,
+                              uint64_t queue_delay_ns, uint64_t now_ns);
+
+#endif
@@ -0,0 +1,251 @@
+/*
+ * Send admin commands to a running bank over its control socket.
+ *
+ * Usage:  bank-ctl [-s <socket>] [-q] [<command> ...]
+ *
+ *   -s  control socket (default BANK_CONTROL)
+ *   -q  only print the answers to commands that failed
+ *
+ * Each argument is one command; with none, commands are read from stdin
+ * one per line.  Commands are written as fast as the bank takes them,
+ * without waiting for each answer, and the answers (JSON lines, see
+ * control.h) are printed as they arrive.  A summary goes to stderr, and
+ * the exit status is 1 if any command failed.
+ *
+ *   bank-ctl create-user alice 1234 100
+ *   yes 'deposit alice 1' | head -n 100000 | bank-ctl -q
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define ERROR_USAGE 62
+#define CTL_BUFFER_SIZE 65536
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage:  bank-ctl [-s <socket>] [-q] [<command> ...]\n");
+    exit(ERROR_USAGE);
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_control(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+
+    // Neither direction may block the other: the bank stops reading from a
+    // client that is not reading its answers
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+// Fill buf with the next commands: the remaining arguments, or what stdin has.
+// Returns the number of bytes; 0 once there are no more
+static size_t next_commands(char ***args, int *nargs, char *buf, size_t size, int *partial)
+{
+    size_t len = 0;
+    if (*args != NULL)
+    {
+        while (*nargs > 0 && len + strlen(**args) + 1 <= size)
+        {
+            len += sprintf(buf + len, "%s\n", **args);
+            (*args)++;
+            (*nargs)--;
+        }
+        return len;
+    }
+
+    ssize_t n;
+    do
+    {
+        n = read(STDIN_FILENO, buf, size - 1);
+    }
+    while (n < 0 && errno == EINTR);
+    if (n <= 0)
+    {
+        // A last line without its newline still counts as a command
+        if (*partial)
+        {
+            buf[0] = '\n';
+            *partial = 0;
+            return 1;
+        }
+        return 0;
+    }
+    *partial = buf[n - 1] != '\n';
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    char *path = getenv("BANK_CONTROL");
+    int quiet = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:q")) != -1)
+    {
+        switch (opt)
+        {
+        case 's': path = optarg; break;
+        case 'q': quiet = 1; break;
+        default: usage();
+        }
+    }
+    if (path == NULL || path[0] == '\0')
+    {
+        usage();
+    }
+
+    int fd = connect_control(path);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Could not connect to %s: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    char **args = optind < argc ? argv + optind : NULL;
+    int nargs = argc - optind;
+    int partial = 0;
+
+    static char out[CTL_BUFFER_SIZE], in[CTL_BUFFER_SIZE];
+    size_t out_len = 0, out_sent = 0, in_len = 0;
+    int sending = 1;
+    unsigned long sent = 0, answered = 0, failed = 0;
+    double start = now_seconds();
+
+    while (1)
+    {
+        if (sending && out_sent == out_len)
+        {
+            out_len = next_commands(&args, &nargs, out, sizeof(out), &partial);
+            out_sent = 0;
+            for (size_t i = 0; i < out_len; i++)
+            {
+                sent += out[i] == '\n';
+            }
+            if (out_len == 0)
+            {
+                // The bank closes the connection once it has answered everything
+                shutdown(fd, SHUT_WR);
+                sending = 0;
+            }
+        }
+
+        struct pollfd pfd = { fd, POLLIN | (sending ? POLLOUT : 0), 0 };
+        if (poll(&pfd, 1, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("poll");
+            return EXIT_FAILURE;
+        }
+
+        if (pfd.revents & POLLOUT)
+        {
+            ssize_t n = send(fd, out + out_sent, out_len - out_sent, MSG_NOSIGNAL);
+            if (n < 0 && errno != EAGAIN && errno != EINTR)
+            {
+                perror("send");
+                break;
+            }
+            out_sent += n > 0 ? n : 0;
+        }
+
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            ssize_t n = recv(fd, in + in_len, sizeof(in) - in_len, 0);
+            if (n == 0)
+            {
+                break;
+            }
+            if (n < 0)
+            {
+                if (errno == EAGAIN || errno == EINTR)
+                {
+                    continue;
+                }
+                perror("recv");
+                break;
+            }
+            in_len += n;
+
+            size_t start_line = 0;
+            char *newline;
+            while ((newline = memchr(in + start_line, '\n', in_len - start_line)) != NULL)
+            {
+                size_t len = newline + 1 - (in + start_line);
+                *newline = '\0';
+                int ok = strstr(in + start_line, "\"ok\":false") == NULL;
+                answered++;
+                failed += !ok;
+                if (!quiet || !ok)
+                {
+                    *newline = '\n';
+                    fwrite(in + start_line, 1, len, stdout);
+                }
+                start_line += len;
+            }
+            memmove(in, in + start_line, in_len - start_line);
+            in_len -= start_line;
+
+            // An answer longer than the buffer is passed through in pieces
+            if (in_len == sizeof(in))
+            {
+                if (!quiet)
+                {
+                    fwrite(in, 1, in_len, stdout);
+                }
+                in_len = 0;
+            }
+        }
+    }
+    fflush(stdout);
+    close(fd);
+
+    double elapsed = now_seconds() - start;
+    fprintf(stderr, "%lu commands, %lu failed, %.3fs (%.0f/s)\n", answered, failed, elapsed,
+            elapsed > 0 ? answered / elapsed : 0.0);
+    if (answered < sent)
+    {
+        fprintf(stderr, "The bank answered %lu of %lu commands\n", answered, sent);
+        return EXIT_FAILURE;
+    }
+    return failed > 0 ? 1 : EXIT_SUCCESS;
+}
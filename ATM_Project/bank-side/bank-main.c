@@ -1,5 +1,6 @@
 #include <string.h>
-#include <sys/select.h>
+#include <poll.h>
+#include <sys/epoll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
@@ -9,69 +10,116 @@
 #include "bank.h"
 #include "ports.h"
 #include "encryption/enc.h"
+#include "encryption/frame.h"
 
 #define ERROR_USAGE 62
 #define ERROR_FILE_OPEN 64
 
-static const char prompt[] = "BANK: ";
-
 /* 
-    Decrypt an AES-256-GCM encoded message sent to the bank. If the extracted authentication tag differs from that
-    created by gcm_encrypt(), the program will terminate.
+    Decrypt an AES-256-GCM encoded frame sent to the bank, keeping its header so the reply can echo the
+    request ID. Returns -1 if the extracted authentication tag differs from that created by gcm_encrypt().
 */
 int decrypt_message(Bank *bank, char *command, size_t len, char *plaintext_buffer, size_t buffer_size) {
-    char received_data[10000];
-    memcpy(received_data, command, len);
-
-    int length_ciphertext;
-    int offset = 0;
-    memcpy(&length_ciphertext, received_data + offset, sizeof(int)); // Get length of ciphertext
-    offset += sizeof(int);
-
-    // Extract the ciphertext, iv, and tag
-    unsigned char *ciphertext = malloc(length_ciphertext);
-    memcpy(ciphertext, received_data + offset, length_ciphertext);
-    offset += length_ciphertext;
-
-    unsigned char *iv = malloc(GCM_IV_SIZE);
-    memcpy(iv, received_data + offset, GCM_IV_SIZE);
-    offset += GCM_IV_SIZE;
-
-    unsigned char *tag = malloc(TAG_SIZE);
-    memcpy(tag, received_data + offset, TAG_SIZE);
-
-    // Retrieve the AES message key from .bank
-    unsigned char msg_key[AES_KEY_SIZE];
-    extract_msg_key(bank->bank_file, msg_key);
-
-    // Decrypt the message
-    int p_len = gcm_decrypt(ciphertext, length_ciphertext, NULL, 0, tag, msg_key, iv, GCM_IV_SIZE, (unsigned char *)plaintext_buffer);
-
-    // Handle decryption errors
-    if (p_len < 0) {
-        free(ciphertext);  
-        free(iv);  
-        free(tag);  
-        return -1;
-    }
+    int plaintext_len = frame_open(bank->msg_key, (unsigned char *)command, len, &bank->request, plaintext_buffer, buffer_size);
+    bank_stage_end(bank, BANK_STAGE_DECRYPT);
+    return plaintext_len;
+}
 
-    plaintext_buffer[p_len] = '\0';  
 
-    free(ciphertext);  
-    free(iv);  
-    free(tag);  
 
-    return p_len;
+// Serve up to budget batches of remote requests, sending each batch's replies
+// together. Returns 1 if the socket may hold more; 0 once a receive finds it empty
+static int serve_requests(Bank *bank, int budget)
+{
+    for (int b = 0; b < budget; b++)
+    {
+        int count = bank_recv_batch(bank);
+        if (count <= 0)
+        {
+            return 0;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            // A fragment is held until its frame is complete, which then takes its place
+            if (!bank_reassemble(bank, i))
+            {
+                continue;
+            }
+            int n = bank->in_msgs[i].msg_len;
+            bank->reply_addr = &bank->in_addrs[i];
+
+            // A retransmission is answered with the reply it already got
+            bank_stage_begin(bank);
+            if (bank_reply_from_cache(bank, bank->in_bufs[i], n))
+            {
+                continue;
+            }
+
+            // Skip work the ATM no longer wants, and under overload turn the
+            // request away now rather than serve it late
+            if (bank_drop_expired(bank, i) || bank_shed_request(bank, i))
+            {
+                continue;
+            }
+
+            char plaintext_buf[FRAME_MAX_SIZE];
+            if (decrypt_message(bank, bank->in_bufs[i], n, plaintext_buf, sizeof(plaintext_buf)) == -1) {
+                // Forged or corrupted: drop it rather than let any sender stop the bank
+                METRIC_ADD(bank->metrics->decrypt_failures, 1);
+                continue;
+            }
+            bank_process_remote_command(bank, plaintext_buf, n);
+        }
+        bank->reply_addr = NULL;
+        bank_flush(bank);
+    }
+    return 1;
 }
 
+// Wait up to timeout_ms for the socket, stdin or the control socket, noting
+// which became ready.  The socket is edge-triggered, so once it is ready it
+// stays so until a receive finds it empty.  stdin is shared with whoever
+// started the bank and cannot be made non-blocking, so it is level-triggered,
+// as is the control socket.  shm endpoints are not descriptors (see
+// transport.h) and are waited on with transport_poll
+static int wait_for_work(Bank *bank, int epfd, int input_polled, int timeout_ms, int *net_ready, int *input_ready,
+                         int *control_ready)
+{
+    int control = bank->control != NULL ? control_fd(bank->control) : -1;
+    if (epfd < 0)
+    {
+        struct pollfd fds[3] = { { input_polled ? STDIN_FILENO : -1, POLLIN, 0 }, { bank->sockfd, POLLIN, 0 },
+                                 { control, POLLIN, 0 } };
+        struct timespec timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+        int n = transport_poll(fds, 3, &timeout);
+        *input_ready |= (fds[0].revents & (POLLIN | POLLHUP)) != 0;
+        *net_ready |= (fds[1].revents & POLLIN) != 0;
+        *control_ready |= (fds[2].revents & POLLIN) != 0;
+        return n;
+    }
 
+    struct epoll_event events[3];
+    int n = epoll_wait(epfd, events, 3, timeout_ms);
+    for (int i = 0; i < n; i++)
+    {
+        if (events[i].data.fd == STDIN_FILENO)
+        {
+            *input_ready = 1;
+        }
+        else if (events[i].data.fd == control)
+        {
+            *control_ready = 1;
+        }
+        else
+        {
+            *net_ready = 1;
+        }
+    }
+    return n;
+}
 
 int main(int argc, char **argv)
 {
-    int n;
-    char sendline[10000];
-    char recvline[10000];
-
     if (argc != 2)
     {
         printf("Usage:  init <filename>\n");
@@ -101,36 +149,72 @@ int main(int argc, char **argv)
     }
     fclose(bank_fd);
 
+    TRACE_OPEN("bank");
     Bank * bank = bank_create(bank_file);
 
-    printf("%s", prompt);
+    printf("%s", BANK_PROMPT);
     fflush(stdout);
 
+    int epfd = -1;
+    if (transport_kind() != TRANSPORT_SHM)
+    {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        struct epoll_event net = { EPOLLIN | EPOLLET, { .fd = bank_event_fd(bank) } };
+        if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, net.data.fd, &net) < 0)
+        {
+            perror("epoll");
+            return EXIT_FAILURE;
+        }
+    }
+
+    struct epoll_event admin = { EPOLLIN, { .fd = bank->control != NULL ? control_fd(bank->control) : -1 } };
+    if (epfd >= 0 && bank->control != NULL && epoll_ctl(epfd, EPOLL_CTL_ADD, admin.data.fd, &admin) < 0)
+    {
+        perror("epoll");
+        return EXIT_FAILURE;
+    }
+
+    // A regular file or /dev/null on stdin cannot go into epoll, and is always ready
+    int input_polled = 1;
+    struct epoll_event input = { EPOLLIN, { .fd = STDIN_FILENO } };
+    if (epfd >= 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, STDIN_FILENO, &input) < 0)
+    {
+        input_polled = 0;
+    }
+
+    // Each turn serves a bounded amount of remote and local work, and only
+    // waits when none has any left, so a busy admin console or control
+    // client cannot hold up the ATMs or the other way round
+    int net_ready = 1, input_ready = !input_polled, control_ready = 0;
     while (1)
     {
-        fd_set fds;
-        FD_ZERO(&fds);
-        FD_SET(0, &fds);
-        FD_SET(bank->sockfd, &fds);
-        select(bank->sockfd + 1, &fds, NULL, NULL, NULL);
+        int timeout_ms = net_ready || input_ready || control_ready ? 0 : bank_poll_timeout(bank);
+        if (wait_for_work(bank, epfd, input_polled && !bank->input_eof, timeout_ms, &net_ready, &input_ready,
+                          &control_ready) < 0 && errno != EINTR)
+        {
+            perror("poll");
+            break;
+        }
 
-        if (FD_ISSET(0, &fds))
+        if (net_ready)
         {
-            fgets(sendline, 10000, stdin);
-            bank_process_local_command(bank, sendline, strlen(sendline));
-            printf("%s", prompt);
-            fflush(stdout);
+            net_ready = serve_requests(bank, bank->net_budget);
         }
-        else if (FD_ISSET(bank->sockfd, &fds))
+        if (input_ready)
         {
-            n = bank_recv(bank, recvline, 10000);
-            char plaintext_buf[1000];
-            if (decrypt_message(bank, recvline, n, plaintext_buf, 1000) == -1) {
-                bank_free(bank);
-                exit(-1);
+            input_ready = bank_handle_input(bank, bank->local_budget) || (!input_polled && !bank->input_eof);
+            if (bank->input_eof && input_polled && epfd >= 0)
+            {
+                // Keep serving the ATMs once the console goes away
+                epoll_ctl(epfd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+                input_polled = 0;
             }
-            bank_process_remote_command(bank, plaintext_buf, n);
         }
+        if (control_ready)
+        {
+            control_ready = control_serve(bank, bank->control);
+        }
+        bank_handle_timers(bank);
     }
     bank_free(bank);
     
@@ -0,0 +1,195 @@
+/*
+ * A live view of a running bank's metrics.
+ *
+ * Usage:  bank-top [-m <segment>] [-i <seconds>] [-n <iterations>] [-b]
+ *
+ *   -m  metrics segment to watch (default BANK_METRICS, or
+ *       /atm-bank-metrics)
+ *   -i  seconds between updates (default 1)
+ *   -n  stop after <iterations> updates (default: run until interrupted)
+ *   -b  batch mode: append each update instead of redrawing the screen
+ *
+ * bank-top only reads the shared-memory segment the bank publishes (see
+ * metrics.h), so watching a bank costs it nothing.  Rates are computed
+ * between successive updates.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include "metrics.h"
+
+#define ERROR_USAGE 62
+
+static const char *command_names[BANK_NUM_CMDS] = BANK_COMMAND_NAMES;
+
+// The values of interest, copied out of the segment at one point in time
+typedef struct _Snapshot
+{
+    uint64_t at_ns;
+    uint64_t requests[BANK_NUM_CMDS];
+    uint64_t decrypt_failures;
+    uint64_t packets_in;
+    uint64_t packets_out;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t recv_calls;
+    uint64_t send_calls;
+    uint64_t ring_enters;
+    uint64_t request_allocs;
+    uint64_t shed_rate;
+    uint64_t shed_delay;
+    uint64_t expired;
+    uint64_t fragments_in;
+    uint64_t frames_reassembled;
+    uint64_t reassembly_failures;
+    uint64_t cards_written;
+} Snapshot;
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage:  bank-top [-m <segment>] [-i <seconds>] [-n <iterations>] [-b]\n");
+    exit(ERROR_USAGE);
+}
+
+static void take_snapshot(const BankMetrics *m, Snapshot *s)
+{
+    s->at_ns = metrics_now_ns();
+    for (int i = 0; i < BANK_NUM_CMDS; i++)
+    {
+        s->requests[i] = METRIC_GET(m->requests[i]);
+    }
+    s->decrypt_failures = METRIC_GET(m->decrypt_failures);
+    s->packets_in = METRIC_GET(m->packets_in);
+    s->packets_out = METRIC_GET(m->packets_out);
+    s->bytes_in = METRIC_GET(m->bytes_in);
+    s->bytes_out = METRIC_GET(m->bytes_out);
+    s->recv_calls = METRIC_GET(m->recv_calls);
+    s->send_calls = METRIC_GET(m->send_calls);
+    s->ring_enters = METRIC_GET(m->ring_enters);
+    s->request_allocs = METRIC_GET(m->request_allocs);
+    s->shed_rate = METRIC_GET(m->shed_rate);
+    s->shed_delay = METRIC_GET(m->shed_delay);
+    s->expired = METRIC_GET(m->expired_dequeue) + METRIC_GET(m->expired_execute);
+    s->fragments_in = METRIC_GET(m->fragments_in);
+    s->frames_reassembled = METRIC_GET(m->frames_reassembled);
+    s->reassembly_failures = METRIC_GET(m->reassembly_failures);
+    s->cards_written = METRIC_GET(m->cards_written);
+}
+
+static void print_update(const BankMetrics *m, const Snapshot *prev, const Snapshot *cur, int batch)
+{
+    double secs = (cur->at_ns - prev->at_ns) / 1e9;
+    if (secs <= 0)
+    {
+        secs = 1e-9;
+    }
+
+    if (!batch)
+    {
+        printf("\033[H\033[J");
+    }
+
+    int alive = kill(METRIC_GET(m->pid), 0) == 0 || errno == EPERM;
+    printf("bank pid %u%s, up %.0fs\n", METRIC_GET(m->pid), alive ? "" : " (exited)",
+           (cur->at_ns - METRIC_GET(m->start_ns)) / 1e9);
+
+    printf("%-14s %12s %12s\n", "command", "req/s", "total");
+    uint64_t total = 0;
+    for (int i = 0; i < BANK_NUM_CMDS; i++)
+    {
+        printf("%-14s %12.1f %12lu\n", command_names[i], (cur->requests[i] - prev->requests[i]) / secs,
+               (unsigned long)cur->requests[i]);
+        total += cur->requests[i] - prev->requests[i];
+    }
+    printf("%-14s %12.1f\n", "all", total / secs);
+
+    printf("decrypt failures: %.1f/s (%lu total)\n", (cur->decrypt_failures - prev->decrypt_failures) / secs,
+           (unsigned long)cur->decrypt_failures);
+    printf("in:  %.1f pkt/s, %.1f KB/s    out: %.1f pkt/s, %.1f KB/s\n",
+           (cur->packets_in - prev->packets_in) / secs, (cur->bytes_in - prev->bytes_in) / secs / 1024,
+           (cur->packets_out - prev->packets_out) / secs, (cur->bytes_out - prev->bytes_out) / secs / 1024);
+    printf("syscalls: %.1f recv/s, %.1f send/s, %.1f io_uring_enter/s\n", (cur->recv_calls - prev->recv_calls) / secs,
+           (cur->send_calls - prev->send_calls) / secs, (cur->ring_enters - prev->ring_enters) / secs);
+    printf("shed: %.1f/s over rate, %.1f/s for queue delay (%lu, %lu total)    queue delay: %.1f us\n",
+           (cur->shed_rate - prev->shed_rate) / secs, (cur->shed_delay - prev->shed_delay) / secs,
+           (unsigned long)cur->shed_rate, (unsigned long)cur->shed_delay, METRIC_GET(m->queue_delay_ns) / 1e3);
+    printf("expired: %.1f/s (%lu total)\n", (cur->expired - prev->expired) / secs, (unsigned long)cur->expired);
+    printf("fragments: %.1f/s in, %.1f frames/s reassembled (%lu abandoned)\n",
+           (cur->fragments_in - prev->fragments_in) / secs,
+           (cur->frames_reassembled - prev->frames_reassembled) / secs, (unsigned long)cur->reassembly_failures);
+    printf("heap: %.3f allocations/request, %lu live\n",
+           total > 0 ? (double)(cur->request_allocs - prev->request_allocs) / total : 0.0,
+           (unsigned long)METRIC_GET(m->heap_allocs));
+    printf("accounts: %lu    reply cache entries: %lu\n", (unsigned long)METRIC_GET(m->accounts),
+           (unsigned long)METRIC_GET(m->reply_cache_entries));
+    printf("rx batch: %lu (max %lu)    tx queue: %lu (max %lu)\n",
+           (unsigned long)METRIC_GET(m->rx_batch), (unsigned long)METRIC_GET(m->rx_batch_max),
+           (unsigned long)METRIC_GET(m->tx_queue), (unsigned long)METRIC_GET(m->tx_queue_max));
+    printf("cards: %.1f written/s, %lu queued (max %lu), %lu failed\n",
+           (cur->cards_written - prev->cards_written) / secs, (unsigned long)METRIC_GET(m->card_queue),
+           (unsigned long)METRIC_GET(m->card_queue_max), (unsigned long)METRIC_GET(m->card_write_failures));
+    if (batch)
+    {
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    char *name = getenv("BANK_METRICS");
+    double interval = 1;
+    long iterations = -1;
+    int batch = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:i:n:b")) != -1)
+    {
+        switch (opt)
+        {
+        case 'm': name = optarg; break;
+        case 'i': interval = atof(optarg); break;
+        case 'n': iterations = atol(optarg); break;
+        case 'b': batch = 1; break;
+        default: usage();
+        }
+    }
+    if (optind != argc || interval <= 0 || iterations == 0)
+    {
+        usage();
+    }
+    if (name == NULL)
+    {
+        name = BANK_METRICS_DEFAULT_NAME;
+    }
+
+    const BankMetrics *metrics = metrics_open(name);
+    if (metrics == NULL)
+    {
+        fprintf(stderr, "No bank metrics at %s\n", name);
+        return EXIT_FAILURE;
+    }
+
+    Snapshot prev, cur;
+    take_snapshot(metrics, &prev);
+
+    struct timespec pause;
+    pause.tv_sec = (time_t)interval;
+    pause.tv_nsec = (long)((interval - pause.tv_sec) * 1e9);
+
+    for (long i = 0; iterations < 0 || i < iterations; i++)
+    {
+        nanosleep(&pause, NULL);
+        take_snapshot(metrics, &cur);
+        print_update(metrics, &prev, &cur, batch);
+        prev = cur;
+    }
+
+    metrics_close(metrics);
+    return EXIT_SUCCESS;
+}
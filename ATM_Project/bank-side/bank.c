@@ -1,6 +1,7 @@
 #include "bank.h"
 #include "ports.h"
 #include "encryption/enc.h"
+#include "util/env.h"
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -8,6 +9,7 @@
 #include <limits.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
 #include <openssl/conf.h>
 #include <openssl/evp.h>
 #include <openssl/err.h>
@@ -17,6 +19,39 @@
 #define MAX_USERNAME_LEN 250
 #define MAX_INT_BYTES 11
 
+static const char *command_names[BANK_NUM_CMDS] = BANK_COMMAND_NAMES;
+static const char *stage_names[BANK_NUM_STAGES] = {
+    "cache", "admit", "decrypt", "parse", "execute", "encrypt", "send", "total"
+};
+
+// Wall-clock time, comparable with the kernel's receive timestamps
+static uint64_t realtime_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Time that never steps, for measuring how long sessions have idled
+static uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void reset_latency(BankLatency *latency)
+{
+    for (int c = 0; c < BANK_NUM_CMDS; c++)
+    {
+        for (int s = 0; s < BANK_NUM_STAGES; s++)
+        {
+            histogram_reset(&latency->stages[c][s]);
+        }
+    }
+    latency->window_start_ns = metrics_now_ns();
+}
+
 Bank *bank_create(char *bank_file)
 {
     Bank *bank = (Bank *)malloc(sizeof(Bank));
@@ -27,7 +62,7 @@ Bank *bank_create(char *bank_file)
     }
 
     // Set up the network state
-    bank->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    bank->sockfd = transport_socket();
 
     bzero(&bank->rtr_addr, sizeof(bank->rtr_addr));
     bank->rtr_addr.sin_family = AF_INET;
@@ -37,12 +72,173 @@ Bank *bank_create(char *bank_file)
     bzero(&bank->bank_addr, sizeof(bank->bank_addr));
     bank->bank_addr.sin_family = AF_INET;
     bank->bank_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-    bank->bank_addr.sin_port = htons(BANK_PORT);
-    bind(bank->sockfd, (struct sockaddr *)&bank->bank_addr, sizeof(bank->bank_addr));
+    bank->bank_addr.sin_port = htons(env_int("BANK_PORT", BANK_PORT, 1, 65535));
+    transport_bind(bank->sockfd, &bank->bank_addr);
+
+    // Have the kernel stamp each datagram on arrival, so admission control can see how long it queued
+    int on = 1;
+    transport_setsockopt(bank->sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+
+    // Point each batch slot at its buffer once so the hot path only resets lengths
+    bank->batch_size = env_int("BANK_BATCH_SIZE", BANK_DEFAULT_BATCH, 1, BANK_MAX_BATCH);
+    bzero(bank->in_msgs, sizeof(bank->in_msgs));
+    bzero(bank->out_msgs, sizeof(bank->out_msgs));
+    for (int i = 0; i < BANK_MAX_BATCH; i++)
+    {
+        bank->in_iov[i].iov_base = bank->in_bufs[i];
+        bank->in_iov[i].iov_len = BANK_MAX_FRAME;
+        bank->in_msgs[i].msg_hdr.msg_name = &bank->in_addrs[i];
+        bank->in_msgs[i].msg_hdr.msg_iov = &bank->in_iov[i];
+        bank->in_msgs[i].msg_hdr.msg_iovlen = 1;
+        bank->in_msgs[i].msg_hdr.msg_control = bank->in_ctrl[i];
+
+        bank->out_iov[i].iov_base = bank->out_bufs[i];
+        bank->out_msgs[i].msg_hdr.msg_iov = &bank->out_iov[i];
+        bank->out_msgs[i].msg_hdr.msg_iovlen = 1;
+        bank->out_msgs[i].msg_hdr.msg_name = &bank->out_addrs[i];
+        bank->out_msgs[i].msg_hdr.msg_namelen = sizeof(bank->out_addrs[i]);
+    }
+    bank->out_count = 0;
+    bank->reply_addr = NULL;
+
+    // BANK_IO=uring moves socket I/O onto io_uring
+    bank->uring = NULL;
+    char *io = getenv("BANK_IO");
+    if (io != NULL && strcmp(io, "uring") == 0)
+    {
+        if (transport_kind() != TRANSPORT_UDP)
+        {
+            fprintf(stderr, "BANK_IO=uring needs TRANSPORT=udp; using sync I/O\n");
+        }
+        else
+        {
+            bank->uring = bank_uring_create(bank->sockfd,
+                                            env_int("BANK_URING_BUFFERS", BANK_URING_DEFAULT_BUFFERS, 1,
+                                                    BANK_URING_MAX_BUFFERS),
+                                            BANK_MAX_FRAME);
+            if (bank->uring == NULL)
+            {
+                fprintf(stderr, "io_uring unavailable (%s); using sync I/O\n", strerror(errno));
+            }
+        }
+    }
+
+    // A stream has no datagram size to fit, so over tcp replies go out whole
+    int fragment_default = transport_kind() == TRANSPORT_TCP ? FRAME_MAX_SIZE : FRAGMENT_DEFAULT_SIZE;
+    bank->fragment_size = env_int("BANK_FRAGMENT_SIZE", fragment_default, FRAGMENT_MIN_SIZE, FRAME_MAX_SIZE);
+    bank->fragments = reassembler_create(env_int("BANK_REASSEMBLY_SLOTS", BANK_DEFAULT_REASSEMBLY_SLOTS, 1, 4096),
+                                         env_int("BANK_REASSEMBLY_TIMEOUT_MS", BANK_DEFAULT_REASSEMBLY_TIMEOUT_MS,
+                                                 1, 600000) * 1000000ULL);
+    if (bank->fragments == NULL)
+    {
+        perror("Could not allocate reassembly buffers");
+        exit(1);
+    }
+
+    bank->input_len = 0;
+    bank->input_eof = 0;
+    bank->net_budget = env_int("BANK_NET_BUDGET", BANK_DEFAULT_NET_BUDGET, 1, 1000000);
+    bank->local_budget = env_int("BANK_LOCAL_BUDGET", BANK_DEFAULT_LOCAL_BUDGET, 1, 1000000);
+    bank->next_tick_ns = realtime_ns() + BANK_TICK_MS * 1000000ULL;
+
+    // BANK_CONTROL=path takes admin commands on a unix socket as well as stdin
+    bank->out = stdout;
+    bank->control = NULL;
+    char *control_path = getenv("BANK_CONTROL");
+    if (control_path != NULL && control_path[0] != '\0')
+    {
+        bank->control = control_create(control_path, env_int("BANK_CONTROL_BUDGET", CONTROL_DEFAULT_BUDGET, 1,
+                                                             1000000));
+        if (bank->control == NULL)
+        {
+            fprintf(stderr, "Could not listen on %s: %s\n", control_path, strerror(errno));
+            exit(1);
+        }
+    }
+
+    char *metrics_name = getenv("BANK_METRICS");
+    bank->metrics = metrics_create(metrics_name != NULL ? metrics_name : BANK_METRICS_DEFAULT_NAME);
+    if (bank->metrics == NULL)
+    {
+        perror("Could not allocate bank metrics");
+        exit(1);
+    }
+
+    bank->replies = reply_cache_create(env_int("BANK_REPLY_CACHE", BANK_DEFAULT_REPLY_CACHE, 1, 1 << 20));
+    if (bank->replies == NULL)
+    {
+        perror("Could not allocate reply cache");
+        exit(1);
+    }
+    bzero(&bank->request_key, sizeof(bank->request_key));
+
+    bank->sessions = session_table_create(env_int("BANK_SESSIONS", BANK_DEFAULT_SESSIONS, 1, 1 << 24),
+                                          env_int("BANK_SESSION_IDLE_S", BANK_DEFAULT_SESSION_IDLE_S, 1, 86400) *
+                                              1000000000ULL);
+    if (bank->sessions == NULL)
+    {
+        perror("Could not allocate session table");
+        exit(1);
+    }
+
+    int shed_target_us = env_int("BANK_SHED_TARGET_US", BANK_DEFAULT_SHED_TARGET_US, 0, 10000000);
+    int shed_interval_us = env_int("BANK_SHED_INTERVAL_US", BANK_DEFAULT_SHED_INTERVAL_US, 0, 10000000);
+    bank->admission = admission_create(env_int("BANK_ATM_RATE", 0, 0, 10000000),
+                                       env_int("BANK_ATM_BURST", BANK_DEFAULT_ATM_BURST, 1, 10000000),
+                                       shed_target_us * 1000ULL, shed_interval_us * 1000ULL);
+    if (bank->admission == NULL)
+    {
+        perror("Could not allocate admission control");
+        exit(1);
+    }
+
+    bank->latency = (BankLatency *)malloc(sizeof(BankLatency));
+    if (bank->latency == NULL)
+    {
+        perror("Could not allocate latency histograms");
+        exit(1);
+    }
+    reset_latency(bank->latency);
+    bank_stage_begin(bank);
 
     // Set up the protocol state
     bank->bank_file = bank_file;
+    if (extract_msg_key(bank_file, bank->msg_key) != 0)
+    {
+        exit(1);
+    }
+
+    // Cards go in the working directory, or the card vault if there is one,
+    // written by a thread of their own
+    unsigned char pin_key[AES_KEY_SIZE];
+    if (extract_pin_key(bank_file, pin_key) != 0)
+    {
+        exit(1);
+    }
+    bank->cards = card_writer_create(".", getenv("CARD_VAULT"), pin_key,
+                                     env_int("BANK_CARD_QUEUE", CARD_WRITER_DEFAULT_QUEUE, 1, 1 << 20),
+                                     env_int("BANK_CARD_SYNC", 1, 0, 1), bank->metrics);
+    memset(pin_key, 0, sizeof(pin_key));
+    if (bank->cards == NULL)
+    {
+        perror("Could not start the card writer");
+        exit(1);
+    }
     bank->user_list_head = NULL;
+    bank->users = hash_table_create(BANK_USER_BINS);
+    if (bank->users == NULL)
+    {
+        perror("Could not allocate user index");
+        exit(1);
+    }
+    bank->num_accounts = 0;
+    bank->accounts_size = BANK_INITIAL_ACCOUNTS;
+    bank->accounts = (User **)malloc(bank->accounts_size * sizeof(User *));
+    if (bank->accounts == NULL)
+    {
+        perror("Could not allocate accounts table");
+        exit(1);
+    }
 
     return bank;
 }
@@ -58,14 +254,29 @@ void free_users(Bank *bank)
         free(tmp);
     }
     bank->user_list_head = NULL;
+    hash_table_free(bank->users);
+    bank->users = NULL;
+    free(bank->accounts);
+    bank->accounts = NULL;
+    bank->num_accounts = 0;
 }
 
 void bank_free(Bank *bank)
 {
     if (bank != NULL)
     {
-        close(bank->sockfd);
+        bank_flush(bank);
+        bank_uring_free(bank->uring);
+        control_free(bank->control);
+        card_writer_free(bank->cards);
+        transport_close(bank->sockfd);
         free_users(bank);
+        reply_cache_free(bank->replies);
+        session_table_free(bank->sessions);
+        reassembler_free(bank->fragments);
+        admission_free(bank->admission);
+        free(bank->latency);
+        metrics_close(bank->metrics);
         free(bank);
     }
 }
@@ -73,35 +284,456 @@ void bank_free(Bank *bank)
 ssize_t bank_send(Bank *bank, char *data, size_t data_len)
 {
     // Returns the number of bytes sent; negative on error
-    return sendto(bank->sockfd, data, data_len, 0,
-                  (struct sockaddr *)&bank->rtr_addr, sizeof(bank->rtr_addr));
+    METRIC_ADD(bank->metrics->send_calls, 1);
+    ssize_t n = transport_sendto(bank->sockfd, data, data_len, 0, &bank->rtr_addr);
+    if (n > 0)
+    {
+        METRIC_ADD(bank->metrics->packets_out, 1);
+        METRIC_ADD(bank->metrics->bytes_out, n);
+    }
+    return n;
 }
 
 ssize_t bank_recv(Bank *bank, char *data, size_t max_data_len)
 {
     // Returns the number of bytes received; negative on error
-    return recvfrom(bank->sockfd, data, max_data_len, 0, NULL, NULL);
+    METRIC_ADD(bank->metrics->recv_calls, 1);
+    ssize_t n = transport_recvfrom(bank->sockfd, data, max_data_len, 0, NULL);
+    if (n > 0)
+    {
+        METRIC_ADD(bank->metrics->packets_in, 1);
+        METRIC_ADD(bank->metrics->bytes_in, n);
+    }
+    return n;
 }
 
-// bank->users functions
-User *get_user(Bank *bank, char *username)
+// The descriptor the event loop waits on for remote requests: the socket, or
+// the io_uring its datagrams are received through
+int bank_event_fd(Bank *bank)
 {
-    User *current = bank->user_list_head;
+    return bank->uring != NULL ? bank_uring_fd(bank->uring) : bank->sockfd;
+}
 
-    while (current != NULL)
+// Drain up to batch_size datagrams with a single recvmmsg (or, with io_uring,
+// from the completions of the posted receive). Message i is left in
+// bank->in_bufs[i] with its length in bank->in_msgs[i].msg_len.
+// Returns the number of datagrams received; negative on error
+int bank_recv_batch(Bank *bank)
+{
+    for (int i = 0; i < bank->batch_size; i++)
     {
-        if (strcmp(current->username, username) == 0)
+        bank->in_msgs[i].msg_len = 0;
+        bank->in_msgs[i].msg_hdr.msg_namelen = sizeof(bank->in_addrs[i]);
+        bank->in_msgs[i].msg_hdr.msg_controllen = sizeof(bank->in_ctrl[i]);
+    }
+
+    BankMetrics *m = bank->metrics;
+    int n;
+    if (bank->uring != NULL)
+    {
+        n = bank_uring_recvmmsg(bank->uring, bank->in_msgs, bank->batch_size);
+        METRIC_SET(m->ring_enters, bank_uring_enters(bank->uring));
+    }
+    else
+    {
+        METRIC_ADD(m->recv_calls, 1);
+        n = transport_recvmmsg(bank->sockfd, bank->in_msgs, bank->batch_size, MSG_DONTWAIT);
+    }
+    if (n > 0)
+    {
+        uint64_t bytes = 0;
+        for (int i = 0; i < n; i++)
         {
-            return current;
+            bytes += bank->in_msgs[i].msg_len;
+
+            bank->in_rx_ns[i] = 0;
+            struct msghdr *hdr = &bank->in_msgs[i].msg_hdr;
+            for (struct cmsghdr *c = CMSG_FIRSTHDR(hdr); c != NULL; c = CMSG_NXTHDR(hdr, c))
+            {
+                if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS)
+                {
+                    struct timespec ts;
+                    memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+                    bank->in_rx_ns[i] = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+                }
+            }
         }
-        current = current->next;
+        METRIC_ADD(m->packets_in, n);
+        METRIC_ADD(m->bytes_in, bytes);
+        METRIC_SET(m->rx_batch, n);
+        if ((uint64_t)n > m->rx_batch_max)
+        {
+            METRIC_SET(m->rx_batch_max, n);
+        }
+    }
+    return n;
+}
+
+static void publish_reassembly(Bank *bank)
+{
+    ReassemblyStats *rs = &bank->fragments->stats;
+    METRIC_SET(bank->metrics->fragments_in, rs->fragments);
+    METRIC_SET(bank->metrics->frames_reassembled, rs->completed);
+    METRIC_SET(bank->metrics->reassembly_failures, rs->timeouts + rs->evictions + rs->malformed);
+}
+
+// If received datagram index is a fragment, add it to its frame, and once the frame is complete
+// put it in the fragment's place, received when its first fragment was.
+// Returns 1 if message index holds a whole frame; 0 if it was a fragment of one still incomplete
+int bank_reassemble(Bank *bank, int index)
+{
+    FrameHeader header;
+    unsigned char *buf = (unsigned char *)bank->in_bufs[index];
+    size_t len = bank->in_msgs[index].msg_len;
+    if (frame_peek(buf, len, &header) != 0 || header.type != FRAME_FRAGMENT)
+    {
+        return 1;
+    }
+
+    const Reassembly *done;
+    uint64_t received = bank->in_rx_ns[index] != 0 ? bank->in_rx_ns[index] : realtime_ns();
+    int complete = reassembler_add(bank->fragments, &bank->in_addrs[index], buf, len, received, &done) == 1;
+
+    publish_reassembly(bank);
+    if (!complete)
+    {
+        return 0;
     }
 
-    return NULL;
+    memcpy(buf, done->frame, done->frame_len);
+    bank->in_msgs[index].msg_len = done->frame_len;
+    bank->in_rx_ns[index] = done->started_ns;
+    return 1;
 }
 
-void create_user(Bank *bank, char *username, char *balance)
+// Queue the count fragments of a frame too large for one datagram
+static int queue_fragments(Bank *bank, char *data, size_t data_len, int count)
 {
+    // The frame may have been sealed into the send buffer the first fragment goes in
+    memcpy(bank->fragment_src, data, data_len);
+    for (int i = 0; i < count; i++)
+    {
+        char *fragment = bank_send_buffer(bank);
+        int len = frame_fragment((unsigned char *)bank->fragment_src, data_len, bank->fragment_size, i,
+                                 (unsigned char *)fragment, BANK_MAX_FRAME);
+        if (len < 0 || bank_queue_send(bank, fragment, len) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Queue a reply to bank->reply_addr (or the router) to be sent by the next
+// bank_flush(), in fragments if it is larger than fragment_size. The queue is
+// flushed automatically once it holds batch_size datagrams.
+// Returns 0 on success; negative on error
+int bank_queue_send(Bank *bank, char *data, size_t data_len)
+{
+    if (data_len > BANK_MAX_FRAME)
+    {
+        return -1;
+    }
+
+    int count = frame_fragment_count(data_len, bank->fragment_size);
+    if (count != 1)
+    {
+        return count > 1 ? queue_fragments(bank, data, data_len, count) : -1;
+    }
+
+    int i = bank->out_count++;
+    if (data != bank->out_bufs[i])
+    {
+        memcpy(bank->out_bufs[i], data, data_len);
+    }
+    bank->out_iov[i].iov_len = data_len;
+    bank->out_addrs[i] = bank->reply_addr != NULL ? *bank->reply_addr : bank->rtr_addr;
+
+    if (bank->out_count >= bank->batch_size)
+    {
+        return bank_flush(bank);
+    }
+    return 0;
+}
+
+// The buffer the next queued reply is sent from. A reply built here is queued by
+// bank_queue_send() without being copied
+char *bank_send_buffer(Bank *bank)
+{
+    return bank->out_bufs[bank->out_count];
+}
+
+// Send every queued reply, using as few sendmmsg calls as the kernel allows
+// (with io_uring, one submission).
+// Returns 0 on success; negative on error (unsent replies are dropped)
+int bank_flush(Bank *bank)
+{
+    BankMetrics *m = bank->metrics;
+    int sent = 0;
+    if (bank->uring != NULL && bank->out_count > 0)
+    {
+        sent = bank_uring_sendmmsg(bank->uring, bank->out_msgs, bank->out_count);
+        METRIC_SET(m->ring_enters, bank_uring_enters(bank->uring));
+        if (sent < 0)
+        {
+            bank->out_count = 0;
+            return -1;
+        }
+    }
+    while (sent < bank->out_count)
+    {
+        METRIC_ADD(m->send_calls, 1);
+        int n = transport_sendmmsg(bank->sockfd, bank->out_msgs + sent, bank->out_count - sent, 0);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            bank->out_count = 0;
+            return -1;
+        }
+        sent += n;
+    }
+    uint64_t bytes = 0;
+    for (int i = 0; i < sent; i++)
+    {
+        bytes += bank->out_iov[i].iov_len;
+    }
+    METRIC_ADD(m->packets_out, sent);
+    METRIC_ADD(m->bytes_out, bytes);
+    if (sent > 0)
+    {
+        METRIC_SET(m->tx_queue, sent);
+        if ((uint64_t)sent > m->tx_queue_max)
+        {
+            METRIC_SET(m->tx_queue_max, sent);
+        }
+    }
+    bank->out_count = 0;
+    return 0;
+}
+
+// Work out when the ATM stops waiting for received datagram index (its budget counts from
+// when the kernel received it) and drop the request, unanswered, if that time has passed.
+// Returns 1 if the request was dropped; 0 if it should be served
+int bank_drop_expired(Bank *bank, int index)
+{
+    FrameHeader header;
+    bank->request_deadline_ns = 0;
+    if (frame_peek((unsigned char *)bank->in_bufs[index], bank->in_msgs[index].msg_len, &header) != 0 ||
+        header.budget_ms == 0)
+    {
+        return 0;
+    }
+
+    uint64_t now = realtime_ns();
+    uint64_t received = bank->in_rx_ns[index] != 0 ? bank->in_rx_ns[index] : now;
+    bank->request_deadline_ns = received + header.budget_ms * 1000000ULL;
+    if (now < bank->request_deadline_ns)
+    {
+        return 0;
+    }
+
+    METRIC_ADD(bank->metrics->expired_dequeue, 1);
+    bank_stage_end(bank, BANK_STAGE_ADMIT);
+    bank->request_cmd = BANK_CMD_EXPIRED;
+    bank_record_request(bank);
+    return 1;
+}
+
+// Run admission control on received datagram index, whose cache key has been recorded,
+// and answer it with a busy frame if it is turned away.
+// Returns 1 if the request was shed; 0 if it should be served
+int bank_shed_request(Bank *bank, int index)
+{
+    uint64_t queue_delay_ns = 0;
+    if (bank->in_rx_ns[index] != 0)
+    {
+        uint64_t now = realtime_ns();
+        queue_delay_ns = now > bank->in_rx_ns[index] ? now - bank->in_rx_ns[index] : 0;
+    }
+    METRIC_SET(bank->metrics->queue_delay_ns, queue_delay_ns);
+
+    AdmitDecision decision = admission_check(bank->admission, &bank->in_addrs[index], queue_delay_ns,
+                                             bank->stage_mark_ns);
+    if (decision == ADMIT_OK)
+    {
+        bank_stage_end(bank, BANK_STAGE_ADMIT);
+        return 0;
+    }
+    if (decision == ADMIT_SHED_RATE)
+    {
+        METRIC_ADD(bank->metrics->shed_rate, 1);
+    }
+    else
+    {
+        METRIC_ADD(bank->metrics->shed_delay, 1);
+    }
+
+    // Frames too short to have a header are dropped; the rest learn the bank is busy
+    FrameHeader header;
+    if (frame_peek((unsigned char *)bank->in_bufs[index], bank->in_msgs[index].msg_len, &header) == 0)
+    {
+        char *busy = bank_send_buffer(bank);
+        int busy_len = frame_busy(&header, (unsigned char *)busy, BANK_MAX_FRAME);
+        bank_stage_end(bank, BANK_STAGE_ADMIT);
+        bank_queue_send(bank, busy, busy_len);
+    }
+    bank_stage_end(bank, BANK_STAGE_SEND);
+    bank->request_cmd = BANK_CMD_SHED;
+    bank_record_request(bank);
+    return 1;
+}
+
+// Answer a retransmitted request frame with the sealed reply it already got.
+// Also records the frame's cache key so the reply to a new request can be cached.
+// Returns 1 if the reply was queued from the cache; 0 if the request must be processed
+int bank_reply_from_cache(Bank *bank, char *frame, size_t len)
+{
+    size_t reply_len;
+
+    reply_key_init(&bank->request_key, (unsigned char *)frame, len);
+    const unsigned char *reply = reply_cache_lookup(bank->replies, &bank->request_key, &reply_len);
+    bank_stage_end(bank, BANK_STAGE_CACHE);
+    if (reply == NULL)
+    {
+        return 0;
+    }
+
+    bank_queue_send(bank, (char *)reply, reply_len);
+    bank_stage_end(bank, BANK_STAGE_SEND);
+    bank->request_cmd = BANK_CMD_CACHED;
+    bank_record_request(bank);
+    return 1;
+}
+
+// Start timing a remote request
+void bank_stage_begin(Bank *bank)
+{
+    bank->request_cmd = BANK_CMD_INVALID;
+    bank->request_start_ns = bank->stage_mark_ns = metrics_now_ns();
+    memset(bank->stage_ns, 0, sizeof(bank->stage_ns));
+
+    AllocStats allocs;
+    alloc_stats_get(&allocs);
+    bank->request_allocs = allocs.allocs;
+}
+
+// Charge the time since the last mark to stage
+void bank_stage_end(Bank *bank, BankStage stage)
+{
+    uint64_t now = metrics_now_ns();
+    TRACE_SPAN_AT(bank->request_key.request_id, (TracePoint)(TRACE_BANK_CACHE + stage), bank->stage_mark_ns, now);
+    bank->stage_ns[stage] += now - bank->stage_mark_ns;
+    bank->stage_mark_ns = now;
+}
+
+// Record the stages of the finished request under its command
+void bank_record_request(Bank *bank)
+{
+    Histogram *h = bank->latency->stages[bank->request_cmd];
+
+    METRIC_ADD(bank->metrics->requests[bank->request_cmd], 1);
+    METRIC_SET(bank->metrics->reply_cache_entries, bank->replies->size);
+
+    AllocStats allocs;
+    alloc_stats_get(&allocs);
+    METRIC_ADD(bank->metrics->request_allocs, allocs.allocs - bank->request_allocs);
+    METRIC_SET(bank->metrics->heap_allocs, allocs.allocs - allocs.frees);
+
+    bank->stage_ns[BANK_STAGE_TOTAL] = bank->stage_mark_ns - bank->request_start_ns;
+    TRACE_SPAN_AT(bank->request_key.request_id, TRACE_BANK_REQUEST, bank->request_start_ns, bank->stage_mark_ns);
+    for (int s = 0; s < BANK_NUM_STAGES; s++)
+    {
+        // Stages a request never went through are not counted
+        if (bank->stage_ns[s] > 0 || s == BANK_STAGE_TOTAL)
+        {
+            histogram_record(&h[s], bank->stage_ns[s]);
+        }
+    }
+}
+
+// Print percentiles, in microseconds, for every command and stage seen this window
+static void print_latency(Bank *bank)
+{
+    BankLatency *latency = bank->latency;
+
+    fprintf(bank->out, "latency window: %.3fs\n", (metrics_now_ns() - latency->window_start_ns) / 1e9);
+    fprintf(bank->out, "%-14s %-8s %9s %9s %9s %9s %9s %9s\n", "command", "stage", "count", "mean us", "p50 us",
+           "p99 us", "p99.9 us", "max us");
+    for (int c = 0; c < BANK_NUM_CMDS; c++)
+    {
+        for (int s = 0; s < BANK_NUM_STAGES; s++)
+        {
+            Histogram *h = &latency->stages[c][s];
+            if (h->count == 0)
+            {
+                continue;
+            }
+            fprintf(bank->out, "%-14s %-8s %9lu %9.1f %9.1f %9.1f %9.1f %9.1f\n", command_names[c], stage_names[s],
+                   (unsigned long)h->count, histogram_mean(h) / 1e3,
+                   histogram_percentile(h, 50.0) / 1e3, histogram_percentile(h, 99.0) / 1e3,
+                   histogram_percentile(h, 99.9) / 1e3, h->max / 1e3);
+        }
+    }
+}
+
+// bank->users functions
+User *get_user(Bank *bank, char *username)
+{
+    return (User *)hash_table_find(bank->users, username);
+}
+
+// Parse digits, which must be a whole number in base, into n. Returns 0; -1 if it is not one
+static int parse_number(const char *digits, int base, unsigned long long *n)
+{
+    char *end;
+    errno = 0;
+    *n = strtoull(digits, &end, base);
+    return isxdigit((unsigned char)digits[0]) && *end == '\0' && errno == 0 ? 0 : -1;
+}
+
+// The user an ATM request names: "@<handle>", a session the bank opened at
+// open-session; "<username>#<id>", an account ID and the name it must belong
+// to; or a username. NULL if there is no such user, the ID is not the named
+// user's, or the session is no longer open
+User *get_account(Bank *bank, char *name)
+{
+    unsigned long long n;
+    char *hash = strchr(name, '#');
+    if (name[0] == '@')
+    {
+        return parse_number(name + 1, 16, &n) == 0 ? session_table_resolve(bank->sessions, n, monotonic_ns()) : NULL;
+    }
+    if (hash == NULL)
+    {
+        return get_user(bank, name);
+    }
+
+    // IDs are dense and easily guessed, so the ID alone does not name an account
+    if (parse_number(hash + 1, 10, &n) != 0 || n >= bank->num_accounts ||
+        strncmp(bank->accounts[n]->username, name, hash - name) != 0 || bank->accounts[n]->username[hash - name] != '\0')
+    {
+        return NULL;
+    }
+    return bank->accounts[n];
+}
+
+User *create_user(Bank *bank, char *username, char *balance)
+{
+    if (bank->num_accounts == bank->accounts_size)
+    {
+        User **accounts = (User **)realloc(bank->accounts, bank->accounts_size * 2 * sizeof(User *));
+        if (accounts == NULL)
+        {
+            perror("realloc failed");
+            exit(EXIT_FAILURE);
+        }
+        bank->accounts = accounts;
+        bank->accounts_size *= 2;
+    }
+
     // Add new user to head of list
     User *new_user = malloc(sizeof(User));
     if (!new_user)
@@ -112,9 +744,15 @@ void create_user(Bank *bank, char *username, char *balance)
     strncpy(new_user->username, username, sizeof(new_user->username) - 1);
     new_user->username[sizeof(new_user->username) - 1] = '\0';
     new_user->balance = atoi(balance);
+    new_user->id = bank->num_accounts;
+    new_user->last_withdraw_id = 0;
+    new_user->last_withdraw_reply[0] = '\0';
     new_user->next = bank->user_list_head;
     bank->user_list_head = new_user;
-    return;
+    hash_table_add(bank->users, new_user->username, new_user);
+    bank->accounts[bank->num_accounts++] = new_user;
+    METRIC_ADD(bank->metrics->accounts, 1);
+    return new_user;
 }
 
 // Functions to extract the AES key used to encrypt pins (first 32 bytes of .bank and .atm)
@@ -218,91 +856,190 @@ int check_create_user(char *command, char *username, char *pin, char *init_balan
     return strcmp(command, "create-user") == 0 && valid_username(username) && valid_pin(pin) && valid_balance(init_balance);
 }
 
-// Create a <username>.card file for the user containing their encrypted pin and initialization vector
-void create_card(Bank *bank, char *username, unsigned char *plaintext_pin)
+// Queue the <username>.card file for a new user, containing their encrypted pin, initialization vector and
+// account ID. The card is written in the background
+int create_card(Bank *bank, char *username, uint32_t account_id, unsigned char *plaintext_pin)
 {
-    size_t card_file_size = strlen(username) + strlen(".card") + 1;
-    char *card_file = (char *)malloc(card_file_size);
-
-    if (card_file == NULL)
+    if (card_writer_add(bank->cards, username, (char *)plaintext_pin, account_id) < 0)
     {
-        fprintf(stderr, "Error: Memory allocation failed.\n");
-        return; 
+        fprintf(bank->out, "Error creating card file for %s\n", username);
+        return -1;
     }
+    return 0;
+}
 
-    strncpy(card_file, username, card_file_size - 1);
-    card_file[card_file_size - 1] = '\0'; 
+int check_deposit(char *command, char *username, char *amount)
+{
+    return strcmp(command, "deposit") == 0 && valid_username(username) && valid_balance(amount);
+}
 
-    strncat(card_file, ".card", card_file_size - strlen(card_file) - 1);
+// Dispatch up to max_lines complete lines of stdin, reading more only once
+// the buffered ones are used up. At end of input a final unterminated line
+// is dispatched as well. Returns 1 if lines are left for the next call
+int bank_handle_input(Bank *bank, int max_lines)
+{
+    size_t capacity = sizeof(bank->input_buf) - 1;
 
-    FILE *file = fopen(card_file, "wb");
-    if (file == NULL)
+    if (!bank->input_eof && bank->input_len < capacity && memchr(bank->input_buf, '\n', bank->input_len) == NULL)
     {
-        printf("Error creating card file for %s\n", username);
-        free(card_file);
-        return;
+        ssize_t n = read(STDIN_FILENO, bank->input_buf + bank->input_len, capacity - bank->input_len);
+        if (n > 0)
+        {
+            bank->input_len += n;
+        }
+        else if (n == 0 || (errno != EINTR && errno != EAGAIN))
+        {
+            bank->input_eof = 1;
+        }
     }
-    else
-    {
-        unsigned char pin_key[AES_KEY_SIZE];
-        extract_pin_key(bank->bank_file, pin_key);
-        unsigned char iv[IV_SIZE];
-        generate_rand_bytes(IV_SIZE, iv);
-
-        // since each pin is 4 bytes, it will only need one block = 16 bytes (12 bytes padded).
-        unsigned char encrypted_pin[AES_BLOCK_SIZE];
 
-        // encrypt the pin in AES-256-CBC mode
-        encrypt(plaintext_pin, strlen((char *)plaintext_pin), pin_key, iv, encrypted_pin);
+    size_t start = 0;
+    for (int lines = 0; lines < max_lines; lines++)
+    {
+        char *buf = bank->input_buf + start;
+        size_t left = bank->input_len - start;
+        char *newline = memchr(buf, '\n', left);
 
-        // write the encrypted pin and IV into .card file
-        size_t written = fwrite(encrypted_pin, 1, AES_BLOCK_SIZE, file);
-        if (written != AES_BLOCK_SIZE)
+        // A partial line is only taken at end of input, or once it fills the whole buffer
+        size_t len = newline != NULL ? (size_t)(newline + 1 - buf) : left;
+        if (newline == NULL && (left == 0 || (!bank->input_eof && bank->input_len < capacity)))
         {
-            printf("Error\n");
-            fclose(file);
-            free(card_file);
-            return;
+            break;
         }
-        written = fwrite(iv, 1, IV_SIZE, file);
-        if (written != IV_SIZE)
+
+        char line[BANK_MAX_INPUT + 1];
+        memcpy(line, buf, len);
+        start += len;
+        if (newline == NULL)
         {
-            printf("Error\n");
-            fclose(file);
-            free(card_file);
-            return;
+            // Commands end in the newline bank_process_local_command strips
+            line[len++] = '\n';
         }
+        line[len] = '\0';
 
-        fclose(file);
-        free(card_file);
-        printf("Created user %s\n", username);
-        return;
+        bank_process_local_command(bank, line, len);
+        printf("%s", BANK_PROMPT);
     }
+    fflush(stdout);
+
+    memmove(bank->input_buf, bank->input_buf + start, bank->input_len - start);
+    bank->input_len -= start;
+    return memchr(bank->input_buf, '\n', bank->input_len) != NULL || bank->input_len == capacity ||
+           (bank->input_eof && bank->input_len > 0);
 }
 
-int check_deposit(char *command, char *username, char *amount)
+// Milliseconds until housekeeping is next due
+int bank_poll_timeout(Bank *bank)
 {
-    return strcmp(command, "deposit") == 0 && valid_username(username) && valid_balance(amount);
+    uint64_t now = realtime_ns();
+    if (now >= bank->next_tick_ns)
+    {
+        return 0;
+    }
+    return (bank->next_tick_ns - now + 999999) / 1000000;
 }
 
-void bank_process_local_command(Bank *bank, char *command, size_t len)
+// Housekeeping that no request triggers: frames whose fragments stopped
+// arriving are abandoned even when no other fragments come in
+void bank_handle_timers(Bank *bank)
+{
+    uint64_t now = realtime_ns();
+    if (now < bank->next_tick_ns)
+    {
+        return;
+    }
+    bank->next_tick_ns = now + BANK_TICK_MS * 1000000ULL;
+
+    if (reassembler_expire(bank->fragments, now) > 0)
+    {
+        publish_reassembly(bank);
+    }
+    session_table_expire(bank->sessions, monotonic_ns());
+}
+
+int bank_process_local_command(Bank *bank, char *command, size_t len)
 {
     char command_copy[1000];
 
     // Ensure null-termination
     if (len >= sizeof(command_copy))
     {
-        fprintf(stderr, "Error: command too long\n");
-        return;
+        fprintf(bank->out, "Error: command too long\n");
+        return -1;
     }
 
     strncpy(command_copy, command, sizeof(command_copy) - 1);
     command_copy[sizeof(command_copy) - 1] = '\0';
+    METRIC_ADD(bank->metrics->local_commands, 1);
 
     // remove newline at end of command
     command_copy[strlen(command_copy) - 1] = '\0';
 
-    if (strstr(command, "create-user"))
+    if (strcmp(command_copy, "stats") == 0 || strcmp(command_copy, "stats reset") == 0)
+    {
+        BankMetrics *m = bank->metrics;
+        unsigned long syscalls = m->recv_calls + m->send_calls + m->ring_enters;
+
+        fprintf(bank->out, "batch size: %d\n", bank->batch_size);
+        fprintf(bank->out, "recv syscalls: %lu, send syscalls: %lu\n", (unsigned long)m->recv_calls, (unsigned long)m->send_calls);
+        if (bank->uring != NULL)
+        {
+            fprintf(bank->out, "io_uring enters: %lu, failed sends: %lu\n", (unsigned long)m->ring_enters,
+                   bank->uring->send_failures);
+        }
+        fprintf(bank->out, "messages in: %lu, messages out: %lu\n", (unsigned long)m->packets_in, (unsigned long)m->packets_out);
+        if (m->packets_in > 0)
+        {
+            fprintf(bank->out, "syscalls per transaction: %.3f\n", (double)syscalls / m->packets_in);
+        }
+        fprintf(bank->out, "decrypt failures: %lu\n", (unsigned long)m->decrypt_failures);
+        fprintf(bank->out, "cards written: %lu, failed: %lu, queued: %lu (max %lu)\n",
+               (unsigned long)METRIC_GET(m->cards_written), (unsigned long)METRIC_GET(m->card_write_failures),
+               (unsigned long)METRIC_GET(m->card_queue), (unsigned long)METRIC_GET(m->card_queue_max));
+        unsigned long requests = 0;
+        for (int c = 0; c < BANK_NUM_CMDS; c++)
+        {
+            requests += m->requests[c];
+        }
+        fprintf(bank->out, "heap allocations in remote requests: %lu (%.3f per request), live: %lu\n",
+               (unsigned long)m->request_allocs, requests > 0 ? (double)m->request_allocs / requests : 0.0,
+               (unsigned long)m->heap_allocs);
+
+        ReplyCache *rc = bank->replies;
+        unsigned long lookups = rc->stats.hits + rc->stats.misses;
+        fprintf(bank->out, "reply cache: %u/%u entries, %zu reply bytes, %zu bytes allocated\n",
+               rc->size, rc->capacity, rc->reply_bytes, reply_cache_memory(rc));
+        fprintf(bank->out, "reply cache hits: %lu, misses: %lu, hit rate: %.1f%%\n", rc->stats.hits, rc->stats.misses,
+               lookups > 0 ? 100.0 * rc->stats.hits / lookups : 0.0);
+        fprintf(bank->out, "reply cache inserts: %lu, evictions: %lu, uncacheable: %lu\n",
+               rc->stats.inserts, rc->stats.evictions, rc->stats.uncacheable);
+
+        SessionTable *st = bank->sessions;
+        fprintf(bank->out, "sessions: %u/%u open, %lu opened, %lu resolved, %lu closed, %lu expired, %lu evicted, "
+               "%lu stale\n", st->size, st->capacity, st->stats.opened, st->stats.resolved, st->stats.closed,
+               st->stats.expired, st->stats.evicted, st->stats.stale);
+
+        ReassemblyStats *rs = &bank->fragments->stats;
+        fprintf(bank->out, "fragments: %lu in, %lu frames reassembled, %lu timed out, %lu evicted, %lu malformed\n",
+               rs->fragments, rs->completed, rs->timeouts, rs->evictions, rs->malformed);
+
+        Admission *ad = bank->admission;
+        fprintf(bank->out, "admission: %lu admitted, %lu shed over rate, %lu shed for queue delay\n",
+               ad->stats.admitted, ad->stats.shed_rate, ad->stats.shed_delay);
+        fprintf(bank->out, "expired: %lu at dequeue, %lu before executing\n", (unsigned long)m->expired_dequeue,
+               (unsigned long)m->expired_execute);
+        fprintf(bank->out, "queue delay: last %.1f us, max %.1f us, %u ATMs tracked\n", ad->stats.last_delay_ns / 1e3,
+               ad->stats.max_delay_ns / 1e3, ad->num_clients);
+
+        // "stats reset" starts a new latency window once this one is printed
+        print_latency(bank);
+        if (strcmp(command_copy, "stats reset") == 0)
+        {
+            reset_latency(bank->latency);
+        }
+        return 0;
+    }
+    else if (strstr(command, "create-user"))
     {
         char *args[4]; // Expected arguments: command, username, pin, amount
         char *token = strtok(command_copy, " ");
@@ -316,8 +1053,8 @@ void bank_process_local_command(Bank *bank, char *command, size_t len)
             }
             else
             { // too many args
-                printf("Usage: create-user <user-name> <pin> <balance>\n");
-                return;
+                fprintf(bank->out, "Usage: create-user <user-name> <pin> <balance>\n");
+                return -1;
             }
             token = strtok(NULL, " ");
         }
@@ -325,8 +1062,8 @@ void bank_process_local_command(Bank *bank, char *command, size_t len)
         // too few args
         if (arg_count < 4)
         {
-            printf("Usage: create-user <user-name> <pin> <balance>\n");
-            return;
+            fprintf(bank->out, "Usage: create-user <user-name> <pin> <balance>\n");
+            return -1;
         }
 
         char *command = args[0];
@@ -336,20 +1073,32 @@ void bank_process_local_command(Bank *bank, char *command, size_t len)
 
         if (!check_create_user(command, username, pin, init_balance))
         {
-            printf("Usage: create-user <user-name> <pin> <balance>\n");
-            return;
+            fprintf(bank->out, "Usage: create-user <user-name> <pin> <balance>\n");
+            return -1;
         }
 
         if (get_user(bank, username) != NULL)
         {
-            printf("Error: user %s already exists\n", username);
-            return;
+            fprintf(bank->out, "Error: user %s already exists\n", username);
+            return -1;
         }
 
-        // add the user to the users list and create <username>.card
-        create_user(bank, username, init_balance);
-        create_card(bank, username, (unsigned char *)pin);
+        // Turned away while the disk catches up, rather than holding up the ATMs
+        if (card_writer_full(bank->cards))
+        {
+            fprintf(bank->out, "Error: too many cards waiting to be written, try again\n");
+            return -1;
+        }
 
+        // Queue <username>.card first, so a card that cannot be queued leaves
+        // no user behind; the user takes the next account ID
+        if (create_card(bank, username, bank->num_accounts, (unsigned char *)pin) < 0)
+        {
+            return -1;
+        }
+        create_user(bank, username, init_balance);
+        fprintf(bank->out, "Created user %s\n", username);
+        return 0;
     }
     else if (strstr(command, "deposit"))
     {
@@ -365,8 +1114,8 @@ void bank_process_local_command(Bank *bank, char *command, size_t len)
             }
             else
             { // too many args
-                printf("Usage:  deposit <user-name> <amt>\n");
-                return;
+                fprintf(bank->out, "Usage:  deposit <user-name> <amt>\n");
+                return -1;
             }
             token = strtok(NULL, " ");
         }
@@ -374,8 +1123,8 @@ void bank_process_local_command(Bank *bank, char *command, size_t len)
         // too few args
         if (arg_count < 3)
         {
-            printf("Usage:  deposit <user-name> <amt>\n");
-            return;
+            fprintf(bank->out, "Usage:  deposit <user-name> <amt>\n");
+            return -1;
         }
 
         char *command = args[0];
@@ -384,15 +1133,15 @@ void bank_process_local_command(Bank *bank, char *command, size_t len)
 
         if (!check_deposit(command, username, amount))
         {
-            printf("Usage:  deposit <user-name> <amt>\n");
-            return;
+            fprintf(bank->out, "Usage:  deposit <user-name> <amt>\n");
+            return -1;
         }
 
         User *user = get_user(bank, username);
         if (user == NULL)
         {
-            printf("No such user\n");
-            return;
+            fprintf(bank->out, "No such user\n");
+            return -1;
         }
 
         // since we previously checked that amount is a valid integer, convert it to one
@@ -402,15 +1151,15 @@ void bank_process_local_command(Bank *bank, char *command, size_t len)
         // check that deposit doesn't cause integer overflow
         if (balance > INT_MAX - deposit_amt || deposit_amt > INT_MAX - balance)
         {
-            printf("Too rich for this program\n");
-            return;
+            fprintf(bank->out, "Too rich for this program\n");
+            return -1;
         }
 
         // deposit the money
         user->balance += deposit_amt;
 
-        printf("$%d added to %s's account\n", deposit_amt, username);
-        return;
+        fprintf(bank->out, "$%d added to %s's account\n", deposit_amt, username);
+        return 0;
     }
     else if (strstr(command, "balance"))
     {
@@ -426,8 +1175,8 @@ void bank_process_local_command(Bank *bank, char *command, size_t len)
             }
             else
             { // too many args
-                printf("Usage:  balance <user-name>\n");
-                return;
+                fprintf(bank->out, "Usage:  balance <user-name>\n");
+                return -1;
             }
             token = strtok(NULL, " ");
         }
@@ -435,8 +1184,8 @@ void bank_process_local_command(Bank *bank, char *command, size_t len)
         // too few args
         if (arg_count < 2)
         {
-            printf("Usage:  balance <user-name>\n");
-            return;
+            fprintf(bank->out, "Usage:  balance <user-name>\n");
+            return -1;
         }
 
         char *command = args[0];
@@ -444,91 +1193,72 @@ void bank_process_local_command(Bank *bank, char *command, size_t len)
 
         if (strcmp(command, "balance") != 0 || !valid_username(username))
         {
-            printf("Usage:  balance <user-name>\n");
-            return;
+            fprintf(bank->out, "Usage:  balance <user-name>\n");
+            return -1;
         }
 
         User *user = get_user(bank, username);
         if (user == NULL)
         {
-            printf("No such user\n");
-            return;
+            fprintf(bank->out, "No such user\n");
+            return -1;
         }
 
-        printf("$%d\n", user->balance);
-        return;
+        fprintf(bank->out, "$%d\n", user->balance);
+        return 0;
     }
 
     else
     {
-        printf("Invalid command\n");
+        fprintf(bank->out, "Invalid command\n");
     }
 
-    return;
+    return -1;
 }
 
-// Create the entire message to send to the ATM, consisting of the encrypted command, the initialization vector,
-// and the tag.
-unsigned char *encrypt_message(Bank *bank, unsigned char *plaintext, size_t *sendline_len)
+// Seal a reply to the request being processed: the encrypted response, the initialization vector, and the
+// tag, behind a header carrying the request's ID.
+int encrypt_message(Bank *bank, unsigned char *plaintext, unsigned char *sendline, size_t sendline_size)
 {
-    unsigned char msg_key[AES_KEY_SIZE];
-    extract_msg_key(bank->bank_file, msg_key);
-
-    unsigned char iv[GCM_IV_SIZE];
-    generate_rand_bytes(GCM_IV_SIZE, iv);
-
-    // Encrypt the message
-    unsigned char ciphertext[strlen((char *)plaintext) + AES_BLOCK_SIZE]; // make sure the ciphertext buffer is large enough to store the encrypted message
-    unsigned char tag[TAG_SIZE];
-
-    int c_len = gcm_encrypt(plaintext, strlen((char *)plaintext), NULL, 0, msg_key, iv, GCM_IV_SIZE, ciphertext, tag);
-    int length_ciphertext = c_len;
-
-    *sendline_len = sizeof(int) + length_ciphertext + GCM_IV_SIZE + TAG_SIZE;
-
-    // Allocate buffer for sending the message to the bank
-    unsigned char *sendline = malloc(*sendline_len);
-
-    if (sendline == NULL)
-    {
-        printf("Memory allocation failed!\n");
-        exit(EXIT_FAILURE);
-    }
-
-    // Write the message into sendline
-    int offset = 0;
-    memcpy(sendline + offset, &length_ciphertext, sizeof(int)); // length of ciphertext
-    offset += sizeof(int);
+    FrameHeader header;
+    memset(&header, 0, sizeof(header));
+    header.type = FRAME_REPLY;
+    header.request_id = bank->request.request_id;
 
-    memcpy(sendline + offset, ciphertext, length_ciphertext); // ciphertext
-    offset += length_ciphertext;
-
-    memcpy(sendline + offset, iv, GCM_IV_SIZE); // IV
-    offset += GCM_IV_SIZE;
-
-    memcpy(sendline + offset, tag, TAG_SIZE); // tag
-
-    return sendline;
+    return frame_seal(&header, bank->msg_key, plaintext, strlen((char *)plaintext), sendline, sendline_size);
 }
 
 // Process an authenticated command sent by the ATM
 void bank_process_remote_command(Bank *bank, char *command, size_t len)
 {
-    size_t sendline_len = 0;
     unsigned char response[1000];
     memset(response, 0, sizeof(response));
 
+    // Check the deadline again: the ATM may have given up while the request was decrypted
+    if (bank->request_deadline_ns != 0 && realtime_ns() >= bank->request_deadline_ns)
+    {
+        METRIC_ADD(bank->metrics->expired_execute, 1);
+        bank->request_cmd = BANK_CMD_EXPIRED;
+        bank_record_request(bank);
+        return;
+    }
+
     if (strstr(command, "begin-session"))
     {
         char username[MAX_USERNAME_LEN] = {0};
 
         // Extract username from the command
-        if (sscanf(command, "begin-session %s", username) == 1)
+        int matches = sscanf(command, "begin-session %s", username);
+        bank->request_cmd = BANK_CMD_BEGIN_SESSION;
+        bank_stage_end(bank, BANK_STAGE_PARSE);
+        if (matches == 1)
         {
-            // Check if the user exists
-            if (get_user(bank, username) != NULL)
+            // Check if the user exists, and give the ATM its account ID. The session is opened
+            // by open-session, once the ATM has checked the PIN
+            User *user = get_user(bank, username);
+            if (user != NULL)
             {
-                snprintf((char *)response, sizeof(response), "success");
+                snprintf((char *)response, sizeof(response), "success %u", user->id);
             }
             else
             {
@@ -536,18 +1266,59 @@ void bank_process_remote_command(Bank *bank, char *command, size_t len)
             }
         }
     }
+    else if (strstr(command, "open-session"))
+    {
+        char account[MAX_USERNAME_LEN + MAX_INT_BYTES + 1] = {0};
+
+        // Sent once the user's PIN is checked, naming the account by both username and ID
+        int matches = sscanf(command, "open-session %s", account);
+        bank->request_cmd = BANK_CMD_OPEN_SESSION;
+        bank_stage_end(bank, BANK_STAGE_PARSE);
+        User *user = matches == 1 && strchr(account, '#') != NULL ? get_account(bank, account) : NULL;
+        if (user != NULL)
+        {
+            uint64_t handle = session_table_open(bank->sessions, user, monotonic_ns());
+            snprintf((char *)response, sizeof(response), "success %llx", (unsigned long long)handle);
+        }
+        else
+        {
+            snprintf((char *)response, sizeof(response), "No such user");
+        }
+    }
+    else if (strstr(command, "close-session"))
+    {
+        char account[MAX_USERNAME_LEN + MAX_INT_BYTES + 1] = {0};
+        unsigned long long handle;
+
+        // Sent at end-session. A session already closed needs nothing more
+        int matches = sscanf(command, "close-session %s", account);
+        bank->request_cmd = BANK_CMD_CLOSE_SESSION;
+        bank_stage_end(bank, BANK_STAGE_PARSE);
+        if (matches == 1 && account[0] == '@' && parse_number(account + 1, 16, &handle) == 0)
+        {
+            session_table_close(bank->sessions, handle);
+        }
+        snprintf((char *)response, sizeof(response), "success");
+    }
     else if (strstr(command, "withdraw"))
     {
-        char username[MAX_USERNAME_LEN] = {0};
+        char username[MAX_USERNAME_LEN + MAX_INT_BYTES + 1] = {0};
         char amount[MAX_INT_BYTES] = {0};
 
         // Extract username and amount
         int matches = sscanf(command, "withdraw %s %s", username, amount);
+        bank->request_cmd = BANK_CMD_WITHDRAW;
+        bank_stage_end(bank, BANK_STAGE_PARSE);
 
         if (matches == 2)
         {
-            User *curr_user = get_user(bank, username);
-            if (curr_user)
+            User *curr_user = get_account(bank, username);
+            if (curr_user && curr_user->last_withdraw_id == bank->request.request_id)
+            {
+                // A retransmission of the withdraw we already executed
+                snprintf((char *)response, sizeof(response), "%s", curr_user->last_withdraw_reply);
+            }
+            else if (curr_user)
             {
                 int curr_balance = curr_user->balance;
                 int withdraw_amt = atoi(amount);
@@ -560,10 +1331,14 @@ void bank_process_remote_command(Bank *bank, char *command, size_t len)
                     curr_user->balance -= withdraw_amt;
                     snprintf((char *)response, sizeof(response), "$%d dispensed", withdraw_amt);
                 }
+                curr_user->last_withdraw_id = bank->request.request_id;
+                strncpy(curr_user->last_withdraw_reply, (char *)response, sizeof(curr_user->last_withdraw_reply) - 1);
+                curr_user->last_withdraw_reply[sizeof(curr_user->last_withdraw_reply) - 1] = '\0';
             }
             else
             {
-                snprintf((char *)response, sizeof(response), "User not found");
+                snprintf((char *)response, sizeof(response), "%s",
+                         username[0] == '@' ? BANK_SESSION_EXPIRED : "User not found");
             }
         }
         else
@@ -574,20 +1349,40 @@ void bank_process_remote_command(Bank *bank, char *command, size_t len)
 
     else if (strstr(command, "balance"))
     {
-        char username[MAX_USERNAME_LEN] = {0};
+        char username[MAX_USERNAME_LEN + MAX_INT_BYTES + 1] = {0};
 
         // Extract username from the command
-        if (sscanf(command, "balance %s", username) == 1)
+        int matches = sscanf(command, "balance %s", username);
+        bank->request_cmd = BANK_CMD_BALANCE;
+        bank_stage_end(bank, BANK_STAGE_PARSE);
+        if (matches == 1)
         {
-            User *curr_user = get_user(bank, username);
-            int curr_balance = curr_user->balance;
-            snprintf((char *)response, sizeof(response), "$%d", curr_balance);
+            User *curr_user = get_account(bank, username);
+            if (curr_user)
+            {
+                snprintf((char *)response, sizeof(response), "$%d", curr_user->balance);
+            }
+            else
+            {
+                snprintf((char *)response, sizeof(response), "%s",
+                         username[0] == '@' ? BANK_SESSION_EXPIRED : "User not found");
+            }
         }
     }
 
-    unsigned char *sendline = encrypt_message(bank, response, &sendline_len);
-    bank_send(bank, (char *)sendline, sendline_len);
-    free(sendline);
+    bank_stage_end(bank, BANK_STAGE_EXECUTE);
+
+    // Seal straight into the send queue's next buffer rather than copying the frame in
+    unsigned char *sendline = (unsigned char *)bank_send_buffer(bank);
+    int sendline_len = encrypt_message(bank, response, sendline, BANK_MAX_FRAME);
+    bank_stage_end(bank, BANK_STAGE_ENCRYPT);
+    if (sendline_len > 0)
+    {
+        reply_cache_insert(bank->replies, &bank->request_key, sendline, sendline_len);
+        bank_queue_send(bank, (char *)sendline, sendline_len);
+    }
+    bank_stage_end(bank, BANK_STAGE_SEND);
+    bank_record_request(bank);
 
     return;
 }
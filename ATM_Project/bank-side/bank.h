@@ -21,28 +21,192 @@
 #include <stdio.h>
 #include "util/hash_table.h"
 #include "util/list.h"
+#include "encryption/frame.h"
+#include "encryption/reassembly.h"
+#include "reply_cache.h"
+#include "session_table.h"
+#include "admission.h"
+#include "util/histogram.h"
+#include "util/alloc_stats.h"
+#include "metrics.h"
+#include "util/trace.h"
+#include "util/transport.h"
+#include "bank_uring.h"
+#include "control.h"
+#include "card_writer.h"
+
+// Upper bound on the number of datagrams moved per recvmmsg/sendmmsg call.
+// The effective batch size is read from BANK_BATCH_SIZE at startup.
+#define BANK_MAX_BATCH 64
+#define BANK_DEFAULT_BATCH 32
+#define BANK_MAX_FRAME 10000
+
+// Number of recent replies kept for retransmitted requests (BANK_REPLY_CACHE)
+#define BANK_DEFAULT_REPLY_CACHE 1024
+
+// Up to BANK_SESSIONS ATM sessions are open at once (see session_table.h),
+// each closed once idle for BANK_SESSION_IDLE_S
+#define BANK_DEFAULT_SESSIONS 65536
+#define BANK_DEFAULT_SESSION_IDLE_S 300
+
+// The reply to a request whose session handle no longer resolves
+#define BANK_SESSION_EXPIRED "Session expired"
+
+// Replies larger than BANK_FRAGMENT_SIZE are sent as fragments, and up to
+// BANK_REASSEMBLY_SLOTS fragmented requests are put back together at once,
+// each given BANK_REASSEMBLY_TIMEOUT_MS for its fragments to arrive
+#define BANK_DEFAULT_REASSEMBLY_SLOTS 64
+#define BANK_DEFAULT_REASSEMBLY_TIMEOUT_MS 1000
+
+// Admission control (see admission.h). The per-ATM rate limit is off unless
+// BANK_ATM_RATE is set; the queue-delay shedder is on unless
+// BANK_SHED_TARGET_US is 0.
+#define BANK_DEFAULT_ATM_BURST 64
+#define BANK_DEFAULT_SHED_TARGET_US 20000
+#define BANK_DEFAULT_SHED_INTERVAL_US 100000
+
+// Each turn of the event loop serves up to BANK_NET_BUDGET batches of
+// remote requests and BANK_LOCAL_BUDGET local command lines, so neither
+// source can hold up the other, and housekeeping runs every BANK_TICK_MS
+#define BANK_DEFAULT_NET_BUDGET 4
+#define BANK_DEFAULT_LOCAL_BUDGET 8
+#define BANK_TICK_MS 100
+#define BANK_MAX_INPUT 10000
+
+// Bins the user index starts with; it grows as users are created
+#define BANK_USER_BINS 1024
+
+// Accounts the account ID table starts with; it doubles as users are created
+#define BANK_INITIAL_ACCOUNTS 1024
+
+#define BANK_PROMPT "BANK: "
 
 // Store the username and current balance of each user
 typedef struct User {
     char username[251];
     int balance;
+    uint32_t id;                // index in the bank's accounts table, written on the card
+
+    // The last withdraw executed for this user and the reply it got, so a
+    // retransmission of it is answered again instead of debiting twice
+    uint64_t last_withdraw_id;
+    char last_withdraw_reply[64];
+
     struct User *next;
 } User;
 
+// Remote requests are timed stage by stage and recorded per kind of command (see metrics.h)
+typedef enum
+{
+    BANK_STAGE_CACHE,           // reply cache lookup
+    BANK_STAGE_ADMIT,           // admission control, and the busy reply if shed
+    BANK_STAGE_DECRYPT,
+    BANK_STAGE_PARSE,
+    BANK_STAGE_EXECUTE,
+    BANK_STAGE_ENCRYPT,
+    BANK_STAGE_SEND,            // queueing the reply (and any flush it triggers)
+    BANK_STAGE_TOTAL,
+    BANK_NUM_STAGES
+} BankStage;
+
+// Nanosecond histograms for every command and stage since window_start_ns
+typedef struct _BankLatency
+{
+    uint64_t window_start_ns;
+    Histogram stages[BANK_NUM_CMDS][BANK_NUM_STAGES];
+} BankLatency;
 
 typedef struct _Bank
 {
     // Networking state
     int sockfd;
+    BankUring *uring;       // NULL unless BANK_IO=uring (see bank_uring.h)
     struct sockaddr_in rtr_addr;
     struct sockaddr_in bank_addr;
-    
+
+    // Batched datagram I/O: incoming datagrams are drained into in_bufs by
+    // bank_recv_batch() and replies are queued in out_bufs until bank_flush()
+    int batch_size;
+    struct mmsghdr in_msgs[BANK_MAX_BATCH];
+    struct iovec in_iov[BANK_MAX_BATCH];
+    struct sockaddr_in in_addrs[BANK_MAX_BATCH];
+    char in_ctrl[BANK_MAX_BATCH][CMSG_SPACE(sizeof(struct timespec))];
+    uint64_t in_rx_ns[BANK_MAX_BATCH];      // kernel receive time (CLOCK_REALTIME); 0 if unknown
+    char in_bufs[BANK_MAX_BATCH][BANK_MAX_FRAME];
+    struct mmsghdr out_msgs[BANK_MAX_BATCH];
+    struct iovec out_iov[BANK_MAX_BATCH];
+    struct sockaddr_in out_addrs[BANK_MAX_BATCH];
+    char out_bufs[BANK_MAX_BATCH][BANK_MAX_FRAME];
+    int out_count;
+
+    // Frames that do not fit in one datagram travel as fragments (see frame.h)
+    int fragment_size;
+    Reassembler *fragments;
+    char fragment_src[BANK_MAX_FRAME];     // a reply being cut into fragments
+
+    // Buffered stdin, split into lines by bank_handle_input()
+    char input_buf[BANK_MAX_INPUT];
+    size_t input_len;
+    int input_eof;
+
+    // Where local commands print their results: stdout, or the answer being
+    // built for a control socket client (see control.h)
+    FILE *out;
+    Control *control;       // NULL unless BANK_CONTROL is set
+
+    // Event loop budgets, and when housekeeping next runs (CLOCK_REALTIME)
+    int net_budget;
+    int local_budget;
+    uint64_t next_tick_ns;
+
+    // Counters and gauges published for bank-top
+    BankMetrics *metrics;
+
+    // Where the remote command being processed came from. Queued replies go
+    // back to that address (the router's upstream socket for that ATM);
+    // NULL sends them to rtr_addr.
+    struct sockaddr_in *reply_addr;
+
+    // Header of the remote command being processed; replies echo its request ID
+    FrameHeader request;
+
+    // Recent sealed replies, and the cache key of the request being processed
+    ReplyCache *replies;
+    ReplyKey request_key;
+
+    // Decides which remote requests are served and which get a busy reply
+    Admission *admission;
+
+    // When the ATM stops waiting for the request being processed (CLOCK_REALTIME, from
+    // the budget in its header); 0 if it waits indefinitely
+    uint64_t request_deadline_ns;
+
+    // Timing of the request being processed: each stage runs from the previous
+    // mark to the next, and the request is recorded once its reply is queued
+    BankLatency *latency;
+    BankCommand request_cmd;
+    uint64_t request_start_ns;
+    uint64_t stage_mark_ns;
+    uint64_t stage_ns[BANK_NUM_STAGES];
+    uint64_t request_allocs;        // allocation count when the request began
 
     // Protocol state
     char * bank_file;
+    unsigned char msg_key[AES_KEY_SIZE];    // read from bank_file once, at startup
+
+    // Writes the .card files of new users (see card_writer.h)
+    CardWriter *cards;
 
-    // Maintain a list of users
+    // Maintain a list of users, indexed by username, and by account ID:
+    // accounts[id], with IDs handed out densely at create-user
     User * user_list_head;
+    HashTable *users;
+    User **accounts;
+    uint32_t num_accounts;
+    uint32_t accounts_size;
+
+    // ATM sessions opened once the ATM has checked the PIN, which later requests name by handle
+    SessionTable *sessions;
 
 } Bank;
 
@@ -50,8 +214,24 @@ Bank* bank_create(char * filename);
 void bank_free(Bank *bank);
 ssize_t bank_send(Bank *bank, char *data, size_t data_len);
 ssize_t bank_recv(Bank *bank, char *data, size_t max_data_len);
-void bank_process_local_command(Bank *bank, char *command, size_t len);
+int bank_event_fd(Bank *bank);
+int bank_recv_batch(Bank *bank);
+int bank_reassemble(Bank *bank, int index);
+char *bank_send_buffer(Bank *bank);
+int bank_queue_send(Bank *bank, char *data, size_t data_len);
+int bank_flush(Bank *bank);
+int bank_drop_expired(Bank *bank, int index);
+int bank_shed_request(Bank *bank, int index);
+int bank_reply_from_cache(Bank *bank, char *frame, size_t len);
+void bank_stage_begin(Bank *bank);
+void bank_stage_end(Bank *bank, BankStage stage);
+void bank_record_request(Bank *bank);
+int bank_handle_input(Bank *bank, int max_lines);
+int bank_poll_timeout(Bank *bank);
+void bank_handle_timers(Bank *bank);
+int bank_process_local_command(Bank *bank, char *command, size_t len);
 void bank_process_remote_command(Bank *bank, char *command, size_t len);
+int extract_pin_key(char *bank_file, unsigned char *key);
 int extract_msg_key(char *bank_file, unsigned char *key);
 
 #endif
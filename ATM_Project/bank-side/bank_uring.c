@@ -0,0 +1,239 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bank_uring.h"
+
+// What a completion is for, in the top half of its user_data
+#define URING_RECV  1ULL
+#define URING_SEND  2ULL
+
+#define URING_TAG(kind) ((kind) << 32)
+
+#define BANK_URING_BUFFER_GROUP 0
+#define BANK_URING_CONTROL_SIZE CMSG_SPACE(sizeof(struct timespec))
+
+static struct io_uring_sqe *get_sqe(BankUring *u)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(u->ring);
+    if (sqe == NULL && uring_submit(u->ring, 0) >= 0)
+    {
+        sqe = uring_get_sqe(u->ring);
+    }
+    return sqe;
+}
+
+static void arm_receive(BankUring *u)
+{
+    struct io_uring_sqe *sqe = get_sqe(u);
+    if (sqe == NULL)
+    {
+        return;
+    }
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = u->sockfd;
+    sqe->addr = (uint64_t)(uintptr_t)&u->rx_msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BANK_URING_BUFFER_GROUP;
+    sqe->user_data = URING_TAG(URING_RECV);
+    u->rx_armed = 1;
+}
+
+BankUring* bank_uring_create(int sockfd, unsigned num_buffers, size_t max_message)
+{
+    if (num_buffers == 0 || (num_buffers & (num_buffers - 1)) != 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    BankUring *u = (BankUring *)calloc(1, sizeof(BankUring));
+    if (u == NULL)
+    {
+        return NULL;
+    }
+    u->sockfd = sockfd;
+    u->max_message = max_message;
+
+    // Every receive buffer can complete before the bank looks
+    u->ring = uring_create(128, num_buffers * 2 + 64);
+    if (u->ring == NULL)
+    {
+        free(u);
+        return NULL;
+    }
+
+    // Successful sends post no completion, so an old kernel that would post
+    // one for every send is not worth the trouble
+    if (!(u->ring->features & IORING_FEAT_CQE_SKIP))
+    {
+        bank_uring_free(u);
+        errno = ENOSYS;
+        return NULL;
+    }
+
+    u->rx_msg.msg_namelen = sizeof(struct sockaddr_in);
+    u->rx_msg.msg_controllen = BANK_URING_CONTROL_SIZE;
+    u->rx_buf_size = sizeof(struct io_uring_recvmsg_out) + u->rx_msg.msg_namelen + u->rx_msg.msg_controllen +
+                     max_message;
+    u->rx_bufs = (unsigned char *)malloc(num_buffers * u->rx_buf_size);
+    if (u->rx_bufs == NULL || uring_buf_ring_init(u->ring, &u->rx, BANK_URING_BUFFER_GROUP, num_buffers) < 0)
+    {
+        int saved = errno;
+        bank_uring_free(u);
+        errno = saved;
+        return NULL;
+    }
+    for (unsigned i = 0; i < num_buffers; i++)
+    {
+        uring_buf_ring_add(&u->rx, u->rx_bufs + i * u->rx_buf_size, u->rx_buf_size, i);
+    }
+
+    // Kernels without multishot receive reject it here rather than on first use
+    arm_receive(u);
+    if (uring_submit(u->ring, 0) < 0)
+    {
+        int saved = errno;
+        bank_uring_free(u);
+        errno = saved;
+        return NULL;
+    }
+    struct io_uring_cqe *cqe = uring_peek_cqe(u->ring);
+    if (cqe != NULL && cqe->res < 0 && !(cqe->flags & IORING_CQE_F_MORE))
+    {
+        int saved = -cqe->res;
+        bank_uring_free(u);
+        errno = saved;
+        return NULL;
+    }
+    return u;
+}
+
+int bank_uring_fd(const BankUring *u)
+{
+    return u->ring->fd;
+}
+
+unsigned long bank_uring_enters(const BankUring *u)
+{
+    return u->ring->enters;
+}
+
+// Copy a datagram out of its receive buffer the way recvmsg would have
+// returned it, truncating the sender and control data to what msg has room for
+static void copy_message(BankUring *u, const unsigned char *buf, struct mmsghdr *msg)
+{
+    const struct io_uring_recvmsg_out *out = (const struct io_uring_recvmsg_out *)buf;
+    const unsigned char *name = buf + sizeof(*out);
+    const unsigned char *control = name + u->rx_msg.msg_namelen;
+    const unsigned char *payload = control + u->rx_msg.msg_controllen;
+    struct msghdr *hdr = &msg->msg_hdr;
+
+    size_t namelen = out->namelen < hdr->msg_namelen ? out->namelen : hdr->msg_namelen;
+    memcpy(hdr->msg_name, name, namelen);
+    hdr->msg_namelen = namelen;
+
+    size_t controllen = out->controllen < hdr->msg_controllen ? out->controllen : hdr->msg_controllen;
+    memcpy(hdr->msg_control, control, controllen);
+    hdr->msg_controllen = controllen;
+
+    size_t len = out->payloadlen < hdr->msg_iov[0].iov_len ? out->payloadlen : hdr->msg_iov[0].iov_len;
+    memcpy(hdr->msg_iov[0].iov_base, payload, len);
+    hdr->msg_flags = out->flags;
+    msg->msg_len = len;
+}
+
+// Handle completions until count datagrams have been copied into msgs, or
+// there are none left. Returns the number copied
+static unsigned int reap(BankUring *u, struct mmsghdr *msgs, unsigned int count)
+{
+    unsigned int n = 0;
+    struct io_uring_cqe *cqe;
+
+    while (n < count && (cqe = uring_peek_cqe(u->ring)) != NULL)
+    {
+        uint64_t kind = cqe->user_data >> 32;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        uring_cqe_seen(u->ring);
+
+        if (kind == URING_SEND)
+        {
+            u->send_failures++;
+        }
+        else if (kind == URING_RECV)
+        {
+            // The receive stops once it runs out of buffers (ENOBUFS); the
+            // datagrams wait in the socket until it is posted again
+            if (!(flags & IORING_CQE_F_MORE))
+            {
+                u->rx_armed = 0;
+            }
+            if (!(flags & IORING_CQE_F_BUFFER))
+            {
+                continue;
+            }
+            uint16_t id = flags >> IORING_CQE_BUFFER_SHIFT;
+            unsigned char *buf = u->rx_bufs + id * u->rx_buf_size;
+            if (res > 0)
+            {
+                copy_message(u, buf, &msgs[n++]);
+            }
+            uring_buf_ring_add(&u->rx, buf, u->rx_buf_size, id);
+        }
+    }
+    return n;
+}
+
+int bank_uring_recvmmsg(BankUring *u, struct mmsghdr *msgs, unsigned int count)
+{
+    unsigned int n = reap(u, msgs, count);
+    if (!u->rx_armed)
+    {
+        arm_receive(u);
+        uring_submit(u->ring, 0);
+    }
+    if (n == 0)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    return n;
+}
+
+void bank_uring_free(BankUring *u)
+{
+    if (u == NULL)
+    {
+        return;
+    }
+
+    uring_buf_ring_free(u->ring, &u->rx);
+    uring_free(u->ring);
+    free(u->rx_bufs);
+    free(u);
+}
+
+int bank_uring_sendmmsg(BankUring *u, struct mmsghdr *msgs, unsigned int count)
+{
+    for (unsigned int i = 0; i < count; i++)
+    {
+        // The send is issued while the ring is entered, and with MSG_DONTWAIT
+        // a full socket fails it then instead of leaving it to finish later,
+        // so the caller may reuse its buffers as soon as this returns
+        struct io_uring_sqe *sqe = get_sqe(u);
+        if (sqe == NULL)
+        {
+            return -1;
+        }
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = u->sockfd;
+        sqe->addr = (uint64_t)(uintptr_t)&msgs[i].msg_hdr;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_DONTWAIT;
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        sqe->user_data = URING_TAG(URING_SEND);
+    }
+    return uring_submit(u->ring, 0) < 0 ? -1 : (int)count;
+}
@@ -0,0 +1,67 @@
+/*
+ * The bank's io_uring I/O backend, used when BANK_IO=uring (the default,
+ * BANK_IO=sync, makes a system call for each receive, send and write).
+ *
+ * One multishot receive stays posted on the socket and the kernel
+ * receives each datagram into a provided buffer as it arrives, so
+ * draining the socket reads the completion ring rather than calling
+ * recvmmsg.  Replies go out as sendmsg entries, and everything queued
+ * between submissions goes to the kernel in one io_uring_enter.
+ *
+ * The ring's descriptor stands in for the socket in the bank's event
+ * loop.  Only the udp transport can use it, since the others translate
+ * addresses or are not sockets at all (see transport.h).  Where io_uring
+ * is unavailable (an old kernel, or a seccomp filter that blocks it) the
+ * bank falls back to sync I/O.
+ */
+
+#ifndef __BANK_URING_H__
+#define __BANK_URING_H__
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <time.h>
+#include "util/uring.h"
+
+// Receive buffers given to the kernel (BANK_URING_BUFFERS, a power of two)
+#define BANK_URING_DEFAULT_BUFFERS 256
+#define BANK_URING_MAX_BUFFERS 32768
+
+typedef struct _BankUring
+{
+    Uring *ring;
+    int sockfd;
+
+    // Each receive buffer holds the recvmsg header, the sender, the control
+    // data and the datagram; rx_msg gives the multishot receive the sizes
+    UringBufRing rx;
+    unsigned char *rx_bufs;
+    size_t rx_buf_size;
+    size_t max_message;
+    struct msghdr rx_msg;
+    int rx_armed;
+
+    unsigned long send_failures;
+} BankUring;
+
+// A backend for the datagram socket sockfd receiving messages of up to
+// max_message bytes. Returns NULL with errno set if io_uring cannot be used
+BankUring* bank_uring_create(int sockfd, unsigned num_buffers, size_t max_message);
+void bank_uring_free(BankUring *u);
+
+// The descriptor to wait on: readable while completions are waiting
+int bank_uring_fd(const BankUring *u);
+
+// Like recvmmsg with MSG_DONTWAIT: fills up to count messages from the
+// datagrams received so far, or returns -1 with errno EAGAIN if there are none
+int bank_uring_recvmmsg(BankUring *u, struct mmsghdr *msgs, unsigned int count);
+
+// Send count messages, together with anything else queued, in one submission.
+// A datagram the socket has no room for is dropped, as with sendmmsg.
+// Returns count; -1 on error
+int bank_uring_sendmmsg(BankUring *u, struct mmsghdr *msgs, unsigned int count);
+
+// io_uring_enter calls made so far
+unsigned long bank_uring_enters(const BankUring *u);
+
+#endif
@@ -0,0 +1,233 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "card_writer.h"
+
+// Encrypt the job's PIN and write its card: the encrypted PIN, the IV, then the account ID
+static int write_card(CardWriter *w, CardJob *job)
+{
+    char name[CARD_NAME_SIZE + 8];
+    unsigned char card[CARD_SIZE];
+    unsigned char *iv = card + AES_BLOCK_SIZE;
+    if (!generate_rand_bytes(IV_SIZE, iv))
+    {
+        errno = EIO;
+        return -1;
+    }
+    encrypt(job->pin, strlen((char *)job->pin), w->pin_key, iv, card);
+    uint32_t id = htonl(job->account_id);
+    memcpy(card + AES_BLOCK_SIZE + IV_SIZE, &id, sizeof(id));
+    if (w->vault != NULL)
+    {
+        return card_vault_put(w->vault, job->name, card, sizeof(card));
+    }
+
+    snprintf(name, sizeof(name), "%s.card", job->name);
+    int fd = openat(w->dirfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    ssize_t n = write(fd, card, sizeof(card));
+    int saved = errno;
+    close(fd);
+    if (n != (ssize_t)sizeof(card))
+    {
+        errno = n < 0 ? saved : EIO;
+        return -1;
+    }
+    return 0;
+}
+
+// Cards not yet written: those queued and those in the batch being written. Called with the lock held
+static void publish_depth(CardWriter *w)
+{
+    unsigned depth = w->count + w->writing;
+    METRIC_SET(w->metrics->card_queue, depth);
+    if (depth > METRIC_GET(w->metrics->card_queue_max))
+    {
+        METRIC_SET(w->metrics->card_queue_max, depth);
+    }
+}
+
+static void *writer_loop(void *arg)
+{
+    CardWriter *w = (CardWriter *)arg;
+    pthread_mutex_lock(&w->lock);
+    while (1)
+    {
+        while (w->count == 0 && !w->stop)
+        {
+            pthread_cond_wait(&w->not_empty, &w->lock);
+        }
+        if (w->count == 0)
+        {
+            break;
+        }
+
+        // Take everything queued, and let create-user carry on while it is written
+        CardJob *batch = w->jobs;
+        unsigned size = w->jobs_size;
+        w->jobs = w->batch;
+        w->jobs_size = w->batch_size;
+        w->batch = batch;
+        w->batch_size = size;
+        w->writing = w->count;
+        w->count = 0;
+        unsigned count = w->writing;
+        pthread_mutex_unlock(&w->lock);
+
+        unsigned failed = 0;
+        for (unsigned i = 0; i < count; i++)
+        {
+            if (write_card(w, &batch[i]) < 0)
+            {
+                failed++;
+                fprintf(stderr, "Error creating card for %s: %s\n", batch[i].name, strerror(errno));
+            }
+        }
+        memset(batch, 0, count * sizeof(CardJob));
+
+        // One sync covers every card in the batch, and their directory entries
+        if (w->sync && (w->vault != NULL ? card_vault_sync(w->vault) : syncfs(w->dirfd)) < 0)
+        {
+            failed = count;
+            perror("Error syncing cards");
+        }
+
+        pthread_mutex_lock(&w->lock);
+        METRIC_ADD(w->metrics->cards_written, count - failed);
+        METRIC_ADD(w->metrics->card_write_failures, failed);
+        w->writing = 0;
+        publish_depth(w);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+static void free_writer(CardWriter *w)
+{
+    if (w->dirfd >= 0)
+    {
+        close(w->dirfd);
+    }
+    card_vault_close(w->vault);
+    memset(w->pin_key, 0, sizeof(w->pin_key));
+    free(w->jobs);
+    free(w->batch);
+    free(w);
+}
+
+CardWriter* card_writer_create(const char *dir, const char *vault, const unsigned char *pin_key, unsigned limit,
+                               int sync, BankMetrics *metrics)
+{
+    CardWriter *w = (CardWriter *)calloc(1, sizeof(CardWriter));
+    if (w == NULL)
+    {
+        return NULL;
+    }
+    w->dirfd = -1;
+    if (vault != NULL)
+    {
+        w->vault = card_vault_open(vault, 1);
+    }
+    else
+    {
+        w->dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (vault != NULL ? w->vault == NULL : w->dirfd < 0)
+    {
+        int saved = errno;
+        free_writer(w);
+        errno = saved;
+        return NULL;
+    }
+    w->limit = limit;
+    w->sync = sync;
+    w->metrics = metrics;
+    memcpy(w->pin_key, pin_key, AES_KEY_SIZE);
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->not_empty, NULL);
+
+    int err = pthread_create(&w->thread, NULL, writer_loop, w);
+    if (err != 0)
+    {
+        free_writer(w);
+        errno = err;
+        return NULL;
+    }
+    return w;
+}
+
+void card_writer_free(CardWriter *w)
+{
+    if (w == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&w->lock);
+    w->stop = 1;
+    pthread_cond_signal(&w->not_empty);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->not_empty);
+    free_writer(w);
+}
+
+int card_writer_full(CardWriter *w)
+{
+    pthread_mutex_lock(&w->lock);
+    int full = w->count + w->writing >= w->limit;
+    pthread_mutex_unlock(&w->lock);
+    return full;
+}
+
+int card_writer_add(CardWriter *w, const char *username, const char *pin, uint32_t account_id)
+{
+    CardJob job;
+    if (strlen(username) >= sizeof(job.name) || strlen(pin) >= sizeof(job.pin))
+    {
+        return -1;
+    }
+    strcpy(job.name, username);
+    strcpy((char *)job.pin, pin);
+    job.account_id = account_id;
+
+    pthread_mutex_lock(&w->lock);
+    int queued = w->count + w->writing < w->limit;
+    if (queued && w->count == w->jobs_size)
+    {
+        unsigned size = w->jobs_size > 0 ? w->jobs_size * 2 : 64;
+        CardJob *jobs = (CardJob *)realloc(w->jobs, size * sizeof(CardJob));
+        if (jobs == NULL)
+        {
+            queued = 0;
+        }
+        else
+        {
+            w->jobs = jobs;
+            w->jobs_size = size;
+        }
+    }
+    if (queued)
+    {
+        w->jobs[w->count] = job;
+
+        // The writer only waits once it has emptied the queue
+        if (w->count++ == 0)
+        {
+            pthread_cond_signal(&w->not_empty);
+        }
+        publish_depth(w);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    memset(&job, 0, sizeof(job));
+    return queued ? 0 : -1;
+}
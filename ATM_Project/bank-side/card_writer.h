@@ -0,0 +1,82 @@
+/*
+ * Background creation of .card files.
+ *
+ * create-user puts the new account in memory and queues its card here,
+ * so the bank goes straight back to its ATMs.  A writer thread takes
+ * everything queued at once, encrypts each PIN under a fresh IV, writes
+ * the cards, and then makes the whole batch durable with one syncfs on
+ * the directory they were written to (BANK_CARD_SYNC=0 skips it).  With
+ * a card vault (see card_vault.h) the cards are appended to it instead,
+ * and one msync makes the batch durable.
+ *
+ * At most BANK_CARD_QUEUE cards wait at once.  Past that create-user
+ * fails, and can be retried, rather than hold up the ATMs while the disk
+ * catches up.  The queue depth, and the cards written and failed, are
+ * published in the bank's metrics.  A card that cannot be written is
+ * reported on stderr; the account itself is unaffected.
+ */
+
+#ifndef __CARD_WRITER_H__
+#define __CARD_WRITER_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include "encryption/enc.h"
+#include "card_vault.h"
+#include "metrics.h"
+
+#define CARD_WRITER_DEFAULT_QUEUE 65536
+#define CARD_NAME_SIZE 256
+#define CARD_PIN_SIZE 5
+
+// A card: the encrypted PIN, its IV and the account ID, in network byte order
+#define CARD_SIZE (AES_BLOCK_SIZE + IV_SIZE + 4)
+
+typedef struct _CardJob
+{
+    char name[CARD_NAME_SIZE];        // the user's name; the card file adds .card
+    unsigned char pin[CARD_PIN_SIZE];
+    uint32_t account_id;
+} CardJob;
+
+typedef struct _CardWriter
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+
+    // Jobs waiting, and the batch being written. The writer takes a batch
+    // by swapping the two arrays, which grow as needed up to limit
+    CardJob *jobs;
+    unsigned count;
+    unsigned jobs_size;
+    CardJob *batch;
+    unsigned writing;
+    unsigned batch_size;
+    unsigned limit;
+    int stop;
+
+    int dirfd;
+    CardVault *vault;                 // if set, cards go here rather than to dirfd
+    int sync;
+    unsigned char pin_key[AES_KEY_SIZE];
+    BankMetrics *metrics;
+} CardWriter;
+
+// Start a writer for cards encrypted under pin_key, in the vault at path vault
+// or, if that is NULL, in card files in the directory dir.
+// Returns NULL with errno set on failure
+CardWriter* card_writer_create(const char *dir, const char *vault, const unsigned char *pin_key, unsigned limit,
+                               int sync, BankMetrics *metrics);
+
+// Write out everything queued, then stop the writer
+void card_writer_free(CardWriter *w);
+
+// 1 if limit cards are already waiting
+int card_writer_full(CardWriter *w);
+
+// Queue the card for username's account account_id. Returns -1 if it cannot be
+// queued: the queue is full, memory ran out or the name is too long
+int card_writer_add(CardWriter *w, const char *username, const char *pin, uint32_t account_id);
+
+#endif
@@ -0,0 +1,350 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "control.h"
+#include "bank.h"
+
+Control* control_create(const char *path, int budget)
+{
+    if (strlen(path) >= sizeof(((struct sockaddr_un *)0)->sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+
+    Control *ctl = (Control *)calloc(1, sizeof(Control));
+    if (ctl == NULL)
+    {
+        return NULL;
+    }
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++)
+    {
+        ctl->clients[i].fd = -1;
+    }
+    ctl->budget = budget;
+    ctl->addr.sun_family = AF_UNIX;
+    strcpy(ctl->addr.sun_path, path);
+
+    ctl->capture = open_memstream(&ctl->capture_buf, &ctl->capture_len);
+    ctl->epfd = epoll_create1(EPOLL_CLOEXEC);
+    ctl->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (ctl->capture == NULL || ctl->epfd < 0 || ctl->listen_fd < 0)
+    {
+        int saved = errno;
+        control_free(ctl);
+        errno = saved;
+        return NULL;
+    }
+
+    // A socket left behind by a bank that did not exit cleanly is replaced
+    unlink(path);
+    struct epoll_event ev = { EPOLLIN, { .fd = ctl->listen_fd } };
+    if (bind(ctl->listen_fd, (struct sockaddr *)&ctl->addr, sizeof(ctl->addr)) < 0 || chmod(path, 0600) < 0 ||
+        listen(ctl->listen_fd, CONTROL_MAX_CLIENTS) < 0 || epoll_ctl(ctl->epfd, EPOLL_CTL_ADD, ctl->listen_fd, &ev) < 0)
+    {
+        int saved = errno;
+        control_free(ctl);
+        errno = saved;
+        return NULL;
+    }
+    return ctl;
+}
+
+static void close_client(Control *ctl, ControlClient *c)
+{
+    epoll_ctl(ctl->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->out);
+    c->fd = -1;
+    c->out = NULL;
+    c->out_len = c->out_sent = c->out_cap = 0;
+}
+
+void control_free(Control *ctl)
+{
+    if (ctl == NULL)
+    {
+        return;
+    }
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++)
+    {
+        if (ctl->clients[i].fd >= 0)
+        {
+            close_client(ctl, &ctl->clients[i]);
+        }
+    }
+    if (ctl->listen_fd >= 0)
+    {
+        close(ctl->listen_fd);
+        unlink(ctl->addr.sun_path);
+    }
+    if (ctl->epfd >= 0)
+    {
+        close(ctl->epfd);
+    }
+    if (ctl->capture != NULL)
+    {
+        fclose(ctl->capture);
+    }
+    free(ctl->capture_buf);
+    free(ctl);
+}
+
+int control_fd(const Control *ctl)
+{
+    return ctl->epfd;
+}
+
+static void accept_clients(Control *ctl)
+{
+    int fd;
+    while ((fd = accept4(ctl->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+    {
+        ControlClient *c = NULL;
+        for (int i = 0; i < CONTROL_MAX_CLIENTS && c == NULL; i++)
+        {
+            if (ctl->clients[i].fd < 0)
+            {
+                c = &ctl->clients[i];
+            }
+        }
+
+        // With every slot taken the client is turned away: it sees the connection close
+        struct epoll_event ev = { EPOLLIN, { .fd = fd } };
+        if (c == NULL || epoll_ctl(ctl->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->events = EPOLLIN;
+        c->seq = 0;
+        c->in_len = 0;
+        c->input_eof = 0;
+    }
+}
+
+static int reserve_output(ControlClient *c, size_t len)
+{
+    if (c->out_len + len <= c->out_cap)
+    {
+        return 0;
+    }
+
+    // Sent answers are dropped from the front before the buffer grows
+    memmove(c->out, c->out + c->out_sent, c->out_len - c->out_sent);
+    c->out_len -= c->out_sent;
+    c->out_sent = 0;
+    if (c->out_len + len <= c->out_cap)
+    {
+        return 0;
+    }
+
+    size_t cap = c->out_cap > 0 ? c->out_cap : 4096;
+    while (cap < c->out_len + len)
+    {
+        cap *= 2;
+    }
+    char *out = (char *)realloc(c->out, cap);
+    if (out == NULL)
+    {
+        return -1;
+    }
+    c->out = out;
+    c->out_cap = cap;
+    return 0;
+}
+
+// Queue the answer to a command: its sequence number, whether it succeeded
+// and what it printed (less the final newline), as a JSON line
+static int answer(ControlClient *c, int ok, const char *output, size_t len)
+{
+    if (len > 0 && output[len - 1] == '\n')
+    {
+        len--;
+    }
+    if (reserve_output(c, len * 6 + 64) < 0)
+    {
+        return -1;
+    }
+
+    char *p = c->out + c->out_len;
+    p += sprintf(p, "{\"seq\":%lu,\"ok\":%s,\"output\":\"", c->seq, ok ? "true" : "false");
+    for (size_t i = 0; i < len; i++)
+    {
+        unsigned char ch = output[i];
+        if (ch == '"' || ch == '\\')
+        {
+            *p++ = '\\';
+            *p++ = ch;
+        }
+        else if (ch == '\n')
+        {
+            *p++ = '\\';
+            *p++ = 'n';
+        }
+        else if (ch < 0x20)
+        {
+            p += sprintf(p, "\\u%04x", ch);
+        }
+        else
+        {
+            *p++ = ch;
+        }
+    }
+    p += sprintf(p, "\"}\n");
+    c->out_len = p - c->out;
+    return 0;
+}
+
+// Run one command line (ending in a newline) with its output captured into its answer
+static int run_command(Bank *bank, Control *ctl, ControlClient *c, char *line, size_t len)
+{
+    FILE *console = bank->out;
+    bank->out = ctl->capture;
+    fseeko(ctl->capture, 0, SEEK_SET);
+    int ok = bank_process_local_command(bank, line, len) == 0;
+    fflush(ctl->capture);
+    bank->out = console;
+
+    c->seq++;
+    ctl->commands++;
+    ctl->failures += !ok;
+    return answer(c, ok, ctl->capture_buf, ctl->capture_len);
+}
+
+static int backlog(const ControlClient *c)
+{
+    return c->out_len - c->out_sent;
+}
+
+// Run up to budget complete lines from c's input. Returns the number run
+static int run_commands(Bank *bank, Control *ctl, ControlClient *c, int budget)
+{
+    size_t start = 0;
+    int run = 0;
+    while (run < budget && backlog(c) < CONTROL_MAX_BACKLOG)
+    {
+        char *buf = c->in + start;
+        size_t left = c->in_len - start;
+        char *newline = memchr(buf, '\n', left);
+
+        // A partial line is only run once the client is done, or once it fills the buffer
+        size_t len = newline != NULL ? (size_t)(newline + 1 - buf) : left;
+        if (newline == NULL && (left == 0 || (!c->input_eof && c->in_len < sizeof(c->in) - 1)))
+        {
+            break;
+        }
+
+        char line[CONTROL_INPUT_SIZE + 1];
+        memcpy(line, buf, len);
+        start += len;
+        if (newline == NULL)
+        {
+            line[len++] = '\n';
+        }
+        line[len] = '\0';
+
+        run++;
+        if (run_command(bank, ctl, c, line, len) < 0)
+        {
+            break;
+        }
+    }
+
+    memmove(c->in, c->in + start, c->in_len - start);
+    c->in_len -= start;
+    return run;
+}
+
+// Write what the client's socket will take. Returns -1 if the client has gone away
+static int write_output(ControlClient *c)
+{
+    while (c->out_sent < c->out_len)
+    {
+        ssize_t n = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            return errno == EAGAIN || errno == EINTR ? 0 : -1;
+        }
+        c->out_sent += n;
+    }
+    c->out_len = c->out_sent = 0;
+    return 0;
+}
+
+static int read_input(ControlClient *c)
+{
+    size_t room = sizeof(c->in) - 1 - c->in_len;
+    if (c->input_eof || room == 0)
+    {
+        return 0;
+    }
+    ssize_t n = recv(c->fd, c->in + c->in_len, room, 0);
+    if (n > 0)
+    {
+        c->in_len += n;
+    }
+    else if (n == 0)
+    {
+        c->input_eof = 1;
+    }
+    else if (errno != EAGAIN && errno != EINTR)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// Watch for input while the client is keeping up, and for room to write while answers wait
+static void update_events(Control *ctl, ControlClient *c)
+{
+    unsigned events = (!c->input_eof && backlog(c) < CONTROL_MAX_BACKLOG ? EPOLLIN : 0) |
+                      (backlog(c) > 0 ? EPOLLOUT : 0);
+    if (events != c->events)
+    {
+        struct epoll_event ev = { events, { .fd = c->fd } };
+        epoll_ctl(ctl->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->events = events;
+    }
+}
+
+static int has_command(const ControlClient *c)
+{
+    return memchr(c->in, '\n', c->in_len) != NULL || c->in_len == sizeof(c->in) - 1 ||
+           (c->input_eof && c->in_len > 0);
+}
+
+int control_serve(Bank *bank, Control *ctl)
+{
+    accept_clients(ctl);
+
+    int budget = ctl->budget, pending = 0;
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++)
+    {
+        ControlClient *c = &ctl->clients[i];
+        if (c->fd < 0)
+        {
+            continue;
+        }
+
+        if (write_output(c) < 0 || (backlog(c) < CONTROL_MAX_BACKLOG && !has_command(c) && read_input(c) < 0))
+        {
+            close_client(ctl, c);
+            continue;
+        }
+        budget -= run_commands(bank, ctl, c, budget);
+        if (write_output(c) < 0 || (c->input_eof && c->in_len == 0 && backlog(c) == 0))
+        {
+            close_client(ctl, c);
+            continue;
+        }
+        update_events(ctl, c);
+        pending |= has_command(c) && backlog(c) < CONTROL_MAX_BACKLOG;
+    }
+    return pending;
+}
@@ -0,0 +1,86 @@
+/*
+ * The bank's admin control socket.
+ *
+ * With BANK_CONTROL set to a path, the bank listens on a unix stream
+ * socket there and takes the same commands as its console (create-user,
+ * deposit, balance, stats).  A client writes commands one per line and
+ * need not wait for answers between them; each is answered, in order,
+ * with one JSON line
+ *
+ *   {"seq":<n>,"ok":true|false,"output":"<what the console would print>"}
+ *
+ * where seq counts the client's commands from 1.  No prompt is printed and
+ * answers are buffered, going out whenever the client's socket takes
+ * them, so a script applies a batch at the rate the bank runs commands
+ * rather than one round trip each.  A client more than
+ * CONTROL_MAX_BACKLOG bytes of answers behind is not read from until it
+ * catches up.  bank-ctl is such a client.
+ *
+ * The listener and its clients share one epoll descriptor, control_fd(),
+ * which the bank's event loop waits on alongside its socket.  The socket
+ * is created mode 0600, so only the bank's user can administer it.
+ */
+
+#ifndef __CONTROL_H__
+#define __CONTROL_H__
+
+#include <stdio.h>
+#include <stddef.h>
+#include <sys/un.h>
+
+#define CONTROL_MAX_CLIENTS 16
+#define CONTROL_INPUT_SIZE 65536
+#define CONTROL_MAX_BACKLOG (1 << 20)
+
+// Commands run per turn of the event loop, across every client (BANK_CONTROL_BUDGET)
+#define CONTROL_DEFAULT_BUDGET 256
+
+struct _Bank;
+
+typedef struct _ControlClient
+{
+    int fd;                         // -1 while the slot is free
+    unsigned events;                // what epoll watches it for
+    unsigned long seq;
+
+    // Commands received but not yet run; input_eof once the client shuts down its side
+    char in[CONTROL_INPUT_SIZE];
+    size_t in_len;
+    int input_eof;
+
+    // Answers not yet written
+    char *out;
+    size_t out_len;
+    size_t out_sent;
+    size_t out_cap;
+} ControlClient;
+
+typedef struct _Control
+{
+    int listen_fd;
+    int epfd;
+    struct sockaddr_un addr;
+    int budget;
+
+    // Each command's output is collected here to go in its answer
+    FILE *capture;
+    char *capture_buf;
+    size_t capture_len;
+
+    unsigned long commands;
+    unsigned long failures;
+    ControlClient clients[CONTROL_MAX_CLIENTS];
+} Control;
+
+// Listen on path. Returns NULL with errno set on failure
+Control* control_create(const char *path, int budget);
+void control_free(Control *ctl);
+
+// The descriptor to wait on: readable when a client connects or has commands
+int control_fd(const Control *ctl);
+
+// Accept new clients, run up to the budget of commands and write out what
+// answers the clients will take. Returns 1 if commands are left for the next call
+int control_serve(struct _Bank *bank, Control *ctl);
+
+#endif
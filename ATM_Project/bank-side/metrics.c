@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "metrics.h"
+
+uint64_t metrics_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Create (or take over) the named segment and zero it. If shared memory is
+// unavailable the metrics are kept in private memory, so the bank still runs.
+// Returns NULL only if no memory could be mapped at all
+BankMetrics *metrics_create(const char *name)
+{
+    BankMetrics *metrics = MAP_FAILED;
+
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+    if (fd >= 0)
+    {
+        if (ftruncate(fd, sizeof(BankMetrics)) == 0)
+        {
+            metrics = mmap(NULL, sizeof(BankMetrics), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+    }
+    if (metrics == MAP_FAILED)
+    {
+        perror("Could not publish bank metrics");
+        metrics = mmap(NULL, sizeof(BankMetrics), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (metrics == MAP_FAILED)
+        {
+            return NULL;
+        }
+    }
+
+    memset(metrics, 0, sizeof(BankMetrics));
+    metrics->pid = getpid();
+    metrics->start_ns = metrics_now_ns();
+    METRIC_SET(metrics->magic, BANK_METRICS_MAGIC);
+    return metrics;
+}
+
+// Map a segment published by a bank, read-only. Returns NULL if it does not
+// exist or was not written by a bank
+const BankMetrics *metrics_open(const char *name)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    // A segment shorter than the struct would fault when read
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(BankMetrics))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    const BankMetrics *metrics = mmap(NULL, sizeof(BankMetrics), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (metrics == MAP_FAILED)
+    {
+        return NULL;
+    }
+    if (METRIC_GET(metrics->magic) != BANK_METRICS_MAGIC)
+    {
+        metrics_close(metrics);
+        return NULL;
+    }
+    return metrics;
+}
+
+void metrics_close(const BankMetrics *metrics)
+{
+    if (metrics != NULL)
+    {
+        munmap((void *)metrics, sizeof(BankMetrics));
+    }
+}
@@ -0,0 +1,94 @@
+/*
+ * The bank's counters and gauges, published in a shared-memory segment
+ * so that bank-top (or anything else) can watch them without asking the
+ * bank.
+ *
+ * The bank is the only writer, and each field is written by one of its
+ * threads (the card fields by the card writer, see card_writer.h).  Each
+ * update is a relaxed atomic store, so publishing is a plain memory write
+ * with no syscall and no lock, and readers in other processes always see
+ * whole values.
+ * Fields are independent; a reader may see one update before another.
+ *
+ * The segment is named by BANK_METRICS (default /atm-bank-metrics) and
+ * lives under /dev/shm.
+ */
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdint.h>
+
+#define BANK_METRICS_DEFAULT_NAME "/atm-bank-metrics"
+#define BANK_METRICS_MAGIC 0x3254454d4b4e4142ULL      // "BANKMET2"
+
+// Single writer, so a relaxed store is enough for readers to see a whole value
+#define METRIC_ADD(field, n) __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+#define METRIC_SET(field, v) __atomic_store_n(&(field), (v), __ATOMIC_RELAXED)
+#define METRIC_GET(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+// Kinds of remote request, counted (and timed) separately
+typedef enum
+{
+    BANK_CMD_BEGIN_SESSION,
+    BANK_CMD_WITHDRAW,
+    BANK_CMD_BALANCE,
+    BANK_CMD_OPEN_SESSION,
+    BANK_CMD_CLOSE_SESSION,
+    BANK_CMD_INVALID,
+    BANK_CMD_CACHED,            // retransmissions answered from the reply cache
+    BANK_CMD_SHED,              // turned away by admission control (see admission.h)
+    BANK_CMD_EXPIRED,           // dropped because the ATM had stopped waiting for it
+    BANK_NUM_CMDS
+} BankCommand;
+
+#define BANK_COMMAND_NAMES { "begin-session", "withdraw", "balance", "open-session", "close-session", "invalid", "cached", "shed", "expired" }
+
+typedef struct _BankMetrics
+{
+    uint64_t magic;
+    uint32_t pid;
+    uint32_t reserved;
+    uint64_t start_ns;              // CLOCK_MONOTONIC when the bank started
+
+    // Counters
+    uint64_t requests[BANK_NUM_CMDS];
+    uint64_t decrypt_failures;      // frames dropped for failing authentication
+    uint64_t recv_calls;
+    uint64_t send_calls;
+    uint64_t packets_in;
+    uint64_t packets_out;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t local_commands;
+    uint64_t request_allocs;        // heap allocations made while handling remote requests
+    uint64_t shed_rate;             // requests over their ATM's rate
+    uint64_t shed_delay;            // requests shed for a standing queue
+    uint64_t expired_dequeue;       // requests past their deadline when dequeued
+    uint64_t expired_execute;       // requests that reached their deadline while being decrypted
+    uint64_t fragments_in;          // datagrams that were fragments of a larger frame
+    uint64_t frames_reassembled;
+    uint64_t reassembly_failures;   // frames abandoned: timed out, evicted or malformed
+    uint64_t ring_enters;           // io_uring_enter calls, with BANK_IO=uring
+    uint64_t cards_written;
+    uint64_t card_write_failures;
+
+    // Gauges
+    uint64_t accounts;
+    uint64_t rx_batch;              // datagrams drained by the last receive
+    uint64_t rx_batch_max;
+    uint64_t tx_queue;              // replies sent by the last flush
+    uint64_t tx_queue_max;
+    uint64_t reply_cache_entries;
+    uint64_t heap_allocs;           // live heap allocations in the whole process
+    uint64_t queue_delay_ns;        // time the last request waited in the socket buffer
+    uint64_t card_queue;            // cards queued or being written (see card_writer.h)
+    uint64_t card_queue_max;
+} BankMetrics;
+
+BankMetrics* metrics_create(const char *name);
+const BankMetrics* metrics_open(const char *name);
+void metrics_close(const BankMetrics *metrics);
+uint64_t metrics_now_ns();
+
+#endif
@@ -0,0 +1,194 @@
+#include <stdlib.h>
+#include <string.h>
+#include "reply_cache.h"
+#include "encryption/frame.h"
+
+// Fibonacci hashing: request IDs are sequential per ATM, so spread them out
+static uint32_t bucket_of(const ReplyCache *cache, uint64_t request_id)
+{
+    return (uint32_t)((request_id * 0x9E3779B97F4A7C15ULL) >> 32) & (cache->num_buckets - 1);
+}
+
+ReplyCache *reply_cache_create(uint32_t capacity)
+{
+    ReplyCache *cache = (ReplyCache *)malloc(sizeof(ReplyCache));
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+
+    cache->capacity = capacity;
+    cache->size = 0;
+    cache->num_buckets = 1;
+    while (cache->num_buckets < capacity)
+    {
+        cache->num_buckets <<= 1;
+    }
+    cache->entries = (ReplyEntry *)malloc(capacity * sizeof(ReplyEntry));
+    cache->buckets = (int32_t *)malloc(cache->num_buckets * sizeof(int32_t));
+    if (cache->entries == NULL || cache->buckets == NULL)
+    {
+        reply_cache_free(cache);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < cache->num_buckets; i++)
+    {
+        cache->buckets[i] = -1;
+    }
+    for (uint32_t i = 0; i < capacity; i++)
+    {
+        cache->entries[i].hash_next = (i + 1 < capacity) ? (int32_t)(i + 1) : -1;
+    }
+    cache->free_head = capacity > 0 ? 0 : -1;
+    lru_init(&cache->lru, &cache->entries[0].lru, sizeof(ReplyEntry));
+    cache->reply_bytes = 0;
+    memset(&cache->stats, 0, sizeof(cache->stats));
+
+    return cache;
+}
+
+void reply_cache_free(ReplyCache *cache)
+{
+    if (cache != NULL)
+    {
+        free(cache->entries);
+        free(cache->buckets);
+        free(cache);
+    }
+}
+
+// Build the key for a request frame: its header's request ID, its length and
+// the GCM tag in its last bytes. Returns 0 on success; -1 if the frame is too
+// short to be sealed (the key is then marked invalid)
+int reply_key_init(ReplyKey *key, const unsigned char *frame, size_t frame_len)
+{
+    FrameHeader header;
+
+    memset(key, 0, sizeof(*key));
+    if (frame_len < FRAME_OVERHEAD || frame_peek(frame, frame_len, &header) != 0)
+    {
+        return -1;
+    }
+
+    key->request_id = header.request_id;
+    key->frame_len = (uint32_t)frame_len;
+    memcpy(key->tag, frame + frame_len - TAG_SIZE, TAG_SIZE);
+    return 0;
+}
+
+static int key_equal(const ReplyKey *a, const ReplyKey *b)
+{
+    return a->request_id == b->request_id && a->frame_len == b->frame_len &&
+           memcmp(a->tag, b->tag, TAG_SIZE) == 0;
+}
+
+// Find the entry for key, or -1. If prev is non-NULL it receives the entry
+// before it in the bucket chain (-1 when it is the bucket head)
+static int32_t find(const ReplyCache *cache, const ReplyKey *key, int32_t *prev)
+{
+    int32_t before = -1;
+    int32_t i = cache->buckets[bucket_of(cache, key->request_id)];
+
+    while (i != -1 && !key_equal(&cache->entries[i].key, key))
+    {
+        before = i;
+        i = cache->entries[i].hash_next;
+    }
+    if (prev != NULL)
+    {
+        *prev = before;
+    }
+    return i;
+}
+
+static void remove_entry(ReplyCache *cache, int32_t i)
+{
+    ReplyEntry *e = &cache->entries[i];
+    int32_t prev;
+
+    find(cache, &e->key, &prev);
+    if (prev == -1)
+        cache->buckets[bucket_of(cache, e->key.request_id)] = e->hash_next;
+    else
+        cache->entries[prev].hash_next = e->hash_next;
+
+    lru_unlink(&cache->lru, i);
+    cache->reply_bytes -= e->reply_len;
+    cache->size--;
+
+    e->hash_next = cache->free_head;
+    cache->free_head = i;
+}
+
+// Returns the cached sealed reply for key and stores its length in reply_len,
+// marking it most recently used; NULL on a miss
+const unsigned char *reply_cache_lookup(ReplyCache *cache, const ReplyKey *key, size_t *reply_len)
+{
+    if (key->frame_len == 0)
+    {
+        return NULL;
+    }
+
+    int32_t i = find(cache, key, NULL);
+    if (i == -1)
+    {
+        cache->stats.misses++;
+        return NULL;
+    }
+
+    cache->stats.hits++;
+    lru_touch(&cache->lru, i);
+    *reply_len = cache->entries[i].reply_len;
+    return cache->entries[i].reply;
+}
+
+// Remember the sealed reply sent for key, evicting the least recently used
+// entry if the cache is full. A reply already cached for key is replaced
+void reply_cache_insert(ReplyCache *cache, const ReplyKey *key, const unsigned char *reply, size_t reply_len)
+{
+    if (key->frame_len == 0 || cache->capacity == 0)
+    {
+        return;
+    }
+    if (reply_len > REPLY_CACHE_MAX_REPLY)
+    {
+        cache->stats.uncacheable++;
+        return;
+    }
+
+    int32_t i = find(cache, key, NULL);
+    if (i != -1)
+    {
+        remove_entry(cache, i);
+    }
+    if (cache->free_head == -1)
+    {
+        remove_entry(cache, cache->lru.tail);
+        cache->stats.evictions++;
+    }
+
+    i = cache->free_head;
+    ReplyEntry *e = &cache->entries[i];
+    cache->free_head = e->hash_next;
+
+    e->key = *key;
+    e->reply_len = (uint32_t)reply_len;
+    memcpy(e->reply, reply, reply_len);
+
+    uint32_t b = bucket_of(cache, key->request_id);
+    e->hash_next = cache->buckets[b];
+    cache->buckets[b] = i;
+    lru_push_front(&cache->lru, i);
+
+    cache->reply_bytes += reply_len;
+    cache->size++;
+    cache->stats.inserts++;
+}
+
+// Bytes allocated for the cache, whether or not its entries are in use
+size_t reply_cache_memory(const ReplyCache *cache)
+{
+    return sizeof(ReplyCache) + cache->capacity * sizeof(ReplyEntry) +
+           cache->num_buckets * sizeof(int32_t);
+}
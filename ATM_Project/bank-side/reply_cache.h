@@ -0,0 +1,77 @@
+/*
+ * A bounded cache of the bank's most recent replies, keyed by the
+ * request that produced them.
+ *
+ * When a reply is lost the ATM retransmits the identical sealed request.
+ * The bank recognises it from the cleartext header and the request's
+ * GCM tag and sends the stored sealed reply again, without decrypting
+ * the request, touching account state or re-running encryption.
+ *
+ * Lookups, insertions and evictions are O(1): entries live in a fixed
+ * array, are found through a chained hash on the request ID and are
+ * kept on a least-recently-used list for eviction.
+ */
+
+#ifndef __REPLY_CACHE_H__
+#define __REPLY_CACHE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "encryption/enc.h"
+#include "util/lru.h"
+
+// Replies larger than this are not cached
+#define REPLY_CACHE_MAX_REPLY 256
+
+// Identifies one request frame. Two frames with the same ID, length and
+// tag are the same sealed request; frame_len == 0 marks an invalid key.
+typedef struct _ReplyKey
+{
+    uint64_t request_id;
+    uint32_t frame_len;
+    unsigned char tag[TAG_SIZE];
+} ReplyKey;
+
+typedef struct _ReplyEntry
+{
+    ReplyKey key;
+    int32_t hash_next;          // next entry in the same bucket
+    LruLink lru;
+    uint32_t reply_len;
+    unsigned char reply[REPLY_CACHE_MAX_REPLY];
+} ReplyEntry;
+
+typedef struct _ReplyCacheStats
+{
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long inserts;
+    unsigned long evictions;
+    unsigned long uncacheable;  // replies too large to store
+} ReplyCacheStats;
+
+typedef struct _ReplyCache
+{
+    uint32_t capacity;
+    uint32_t size;
+    ReplyEntry *entries;
+
+    // Bucket heads index into entries[]; -1 marks an empty bucket
+    uint32_t num_buckets;
+    int32_t *buckets;
+
+    LruList lru;                // the tail is evicted first
+    int32_t free_head;          // unused entries, chained through hash_next
+
+    size_t reply_bytes;         // bytes of sealed replies currently held
+    ReplyCacheStats stats;
+} ReplyCache;
+
+ReplyCache* reply_cache_create(uint32_t capacity);
+void reply_cache_free(ReplyCache *cache);
+int reply_key_init(ReplyKey *key, const unsigned char *frame, size_t frame_len);
+const unsigned char* reply_cache_lookup(ReplyCache *cache, const ReplyKey *key, size_t *reply_len);
+void reply_cache_insert(ReplyCache *cache, const ReplyKey *key, const unsigned char *reply, size_t reply_len);
+size_t reply_cache_memory(const ReplyCache *cache);
+
+#endif
@@ -0,0 +1,81 @@
+#include "reply_cache.h"
+#include "check.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static ReplyKey key(uint64_t request_id)
+{
+    ReplyKey k;
+    memset(&k, 0, sizeof(k));
+    k.request_id = request_id;
+    k.frame_len = 100;
+    k.tag[0] = (unsigned char)request_id;
+    return k;
+}
+
+// The reply cached for request_id, or "" on a miss
+static const char *lookup(ReplyCache *cache, uint64_t request_id)
+{
+    static char reply[REPLY_CACHE_MAX_REPLY + 1];
+    ReplyKey k = key(request_id);
+    size_t len;
+    const unsigned char *r = reply_cache_lookup(cache, &k, &len);
+    if (r == NULL)
+    {
+        return "";
+    }
+    memcpy(reply, r, len);
+    reply[len] = '\0';
+    return reply;
+}
+
+static void insert(ReplyCache *cache, uint64_t request_id, const char *reply)
+{
+    ReplyKey k = key(request_id);
+    reply_cache_insert(cache, &k, (const unsigned char *)reply, strlen(reply));
+}
+
+int main()
+{
+    ReplyCache *cache = reply_cache_create(2);
+
+    insert(cache, 1, "one");
+    insert(cache, 2, "two");
+    check(strcmp(lookup(cache, 1), "one") == 0, "hit");
+    check(strcmp(lookup(cache, 3), "") == 0, "miss");
+
+    // 1 was used last, so 2 is the one evicted
+    insert(cache, 3, "three");
+    check(strcmp(lookup(cache, 2), "") == 0, "least recently used evicted");
+    check(strcmp(lookup(cache, 1), "one") == 0 && strcmp(lookup(cache, 3), "three") == 0, "others kept");
+    check(cache->size == 2 && cache->stats.evictions == 1, "one eviction");
+
+    // The same request ID with another tag is another request
+    ReplyKey other = key(1);
+    size_t len;
+    other.tag[0] ^= 0xff;
+    check(reply_cache_lookup(cache, &other, &len) == NULL, "tag compared");
+
+    insert(cache, 3, "three again");
+    check(strcmp(lookup(cache, 3), "three again") == 0 && cache->size == 2 && cache->stats.evictions == 1,
+          "replaced in place");
+    check(cache->reply_bytes == strlen("one") + strlen("three again"), "reply bytes");
+
+    char big[REPLY_CACHE_MAX_REPLY + 2];
+    memset(big, 'x', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+    insert(cache, 4, big);
+    check(strcmp(lookup(cache, 4), "") == 0 && cache->stats.uncacheable == 1, "large reply not cached");
+
+    // Every entry evicted in turn, oldest first
+    for (uint64_t id = 10; id < 20; id++)
+    {
+        insert(cache, id, "x");
+    }
+    check(strcmp(lookup(cache, 17), "") == 0 && strcmp(lookup(cache, 18), "x") == 0 &&
+          strcmp(lookup(cache, 19), "x") == 0 && cache->size == 2, "cycled");
+
+    reply_cache_free(cache);
+    return check_status();
+}
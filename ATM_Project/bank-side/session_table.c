@@ -0,0 +1,153 @@
+#include <stdlib.h>
+#include <string.h>
+#include "session_table.h"
+#include "encryption/enc.h"
+
+#define HANDLE_SLOT(handle) ((uint32_t)(handle))
+#define HANDLE_TAG(handle) ((uint32_t)((handle) >> 32))
+
+SessionTable *session_table_create(uint32_t capacity, uint64_t idle_ns)
+{
+    SessionTable *table = (SessionTable *)malloc(sizeof(SessionTable));
+    if (table == NULL)
+    {
+        return NULL;
+    }
+
+    table->capacity = capacity;
+    table->size = 0;
+    table->idle_ns = idle_ns;
+    table->entries = (SessionEntry *)malloc(capacity * sizeof(SessionEntry));
+    if (table->entries == NULL)
+    {
+        free(table);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < capacity; i++)
+    {
+        table->entries[i].user = NULL;
+        table->entries[i].tag = 0;
+        table->entries[i].lru.next = (i + 1 < capacity) ? (int32_t)(i + 1) : -1;
+    }
+    table->free_head = capacity > 0 ? 0 : -1;
+    table->tags_left = 0;
+    lru_init(&table->lru, &table->entries[0].lru, sizeof(SessionEntry));
+    memset(&table->stats, 0, sizeof(table->stats));
+
+    return table;
+}
+
+void session_table_free(SessionTable *table)
+{
+    if (table != NULL)
+    {
+        free(table->entries);
+        free(table);
+    }
+}
+
+// Close the session in slot index and put the slot on the free list
+static void close_session(SessionTable *table, int32_t index)
+{
+    SessionEntry *e = &table->entries[index];
+    lru_unlink(&table->lru, index);
+    e->user = NULL;
+    e->lru.next = table->free_head;
+    table->free_head = index;
+    table->size--;
+}
+
+// A tag for a session opened in e. Never 0, so no handle is, and never e's
+// last tag. Tags are drawn from the random source a batch at a time
+static uint32_t draw_tag(SessionTable *table, const SessionEntry *e)
+{
+    uint32_t tag;
+    do
+    {
+        if (table->tags_left == 0)
+        {
+            generate_rand_bytes(sizeof(table->tags), (unsigned char *)table->tags);
+            table->tags_left = SESSION_TAG_BATCH;
+        }
+        tag = table->tags[--table->tags_left];
+    } while (tag == 0 || tag == e->tag);
+    return tag;
+}
+
+uint64_t session_table_open(SessionTable *table, struct User *user, uint64_t now_ns)
+{
+    if (table->free_head < 0)
+    {
+        close_session(table, table->lru.tail);
+        table->stats.evicted++;
+    }
+
+    int32_t index = table->free_head;
+    SessionEntry *e = &table->entries[index];
+    table->free_head = e->lru.next;
+    e->user = user;
+    e->tag = draw_tag(table, e);
+    e->last_used_ns = now_ns;
+    lru_push_front(&table->lru, index);
+    table->size++;
+    table->stats.opened++;
+
+    return (uint64_t)e->tag << 32 | (uint32_t)index;
+}
+
+int session_table_close(SessionTable *table, uint64_t handle)
+{
+    uint32_t index = HANDLE_SLOT(handle);
+    if (index >= table->capacity || table->entries[index].user == NULL ||
+        table->entries[index].tag != HANDLE_TAG(handle))
+    {
+        table->stats.stale++;
+        return -1;
+    }
+
+    close_session(table, (int32_t)index);
+    table->stats.closed++;
+    return 0;
+}
+
+struct User *session_table_resolve(SessionTable *table, uint64_t handle, uint64_t now_ns)
+{
+    uint32_t index = HANDLE_SLOT(handle);
+    if (index >= table->capacity)
+    {
+        table->stats.stale++;
+        return NULL;
+    }
+
+    SessionEntry *e = &table->entries[index];
+    if (e->user == NULL || e->tag != HANDLE_TAG(handle))
+    {
+        table->stats.stale++;
+        return NULL;
+    }
+    if (now_ns - e->last_used_ns > table->idle_ns)
+    {
+        close_session(table, (int32_t)index);
+        table->stats.expired++;
+        table->stats.stale++;
+        return NULL;
+    }
+
+    e->last_used_ns = now_ns;
+    lru_touch(&table->lru, (int32_t)index);
+    table->stats.resolved++;
+    return e->user;
+}
+
+uint32_t session_table_expire(SessionTable *table, uint64_t now_ns)
+{
+    uint32_t expired = 0;
+    while (table->lru.tail >= 0 && now_ns - table->entries[table->lru.tail].last_used_ns > table->idle_ns)
+    {
+        close_session(table, table->lru.tail);
+        expired++;
+    }
+    table->stats.expired += expired;
+    return expired;
+}
@@ -0,0 +1,83 @@
+/*
+ * The bank's table of logged-in ATM sessions.
+ *
+ * Once the ATM has checked a user's PIN it asks the bank to open a session
+ * on the user's account, naming it by username and account ID, and is
+ * given the session's handle; withdraw and balance then name the account
+ * by the handle alone, and the bank finds it with one indexed load
+ * rather than a username lookup.  A handle is the session's slot in a
+ * fixed array and a random tag drawn when the session was opened.  The
+ * tag keeps handles from being guessed from one another, and as a slot
+ * never gets the same tag twice running, a handle whose slot has since
+ * been reused no longer resolves.
+ *
+ * The ATM closes the session at end-session.  Sessions are also kept on a
+ * least-recently-used list.  One left idle for longer than the table's
+ * idle time is closed, when it is next used or when bank_handle_timers()
+ * expires the idle ones at the tail; when every slot is taken, opening a
+ * session closes the least recently used one.  The ATM opens a new
+ * session if its handle no longer resolves.
+ *
+ * Times passed in are CLOCK_MONOTONIC, so a step in the wall clock
+ * neither expires every session nor keeps them all open.
+ */
+
+#ifndef __SESSION_TABLE_H__
+#define __SESSION_TABLE_H__
+
+#include <stdint.h>
+#include "util/lru.h"
+
+#define SESSION_TAG_BATCH 64
+
+struct User;
+
+typedef struct _SessionEntry
+{
+    struct User *user;          // NULL while the slot is free
+    uint32_t tag;               // drawn whenever a session is opened in the slot
+    LruLink lru;                // free slots chain through lru.next
+    uint64_t last_used_ns;      // CLOCK_MONOTONIC
+} SessionEntry;
+
+typedef struct _SessionTableStats
+{
+    unsigned long opened;
+    unsigned long resolved;
+    unsigned long closed;       // closed by the ATM at end-session
+    unsigned long expired;      // closed after idling too long
+    unsigned long evicted;      // closed to make room for another
+    unsigned long stale;        // handles that no longer resolve
+} SessionTableStats;
+
+typedef struct _SessionTable
+{
+    uint32_t capacity;
+    uint32_t size;
+    uint64_t idle_ns;
+    SessionEntry *entries;
+
+    LruList lru;                // the tail is expired or evicted first
+    int32_t free_head;
+    uint32_t tags[SESSION_TAG_BATCH];   // random tags not yet handed out
+    uint32_t tags_left;
+    SessionTableStats stats;
+} SessionTable;
+
+SessionTable* session_table_create(uint32_t capacity, uint64_t idle_ns);
+void session_table_free(SessionTable *table);
+
+// Open a session on user's account. Returns its handle, which is never 0
+uint64_t session_table_open(SessionTable *table, struct User *user, uint64_t now_ns);
+
+// Close the session handle names. Returns 0; -1 if it was not open
+int session_table_close(SessionTable *table, uint64_t handle);
+
+// The account handle's session is on, marking the session used. NULL if the
+// handle is unknown, or its session has been closed or has idled too long
+struct User* session_table_resolve(SessionTable *table, uint64_t handle, uint64_t now_ns);
+
+// Close the sessions idle for longer than the idle time. Returns how many
+uint32_t session_table_expire(SessionTable *table, uint64_t now_ns);
+
+#endif
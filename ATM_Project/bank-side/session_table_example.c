@@ -0,0 +1,67 @@
+#include "session_table.h"
+#include "check.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define IDLE_NS 1000
+
+struct User
+{
+    int n;
+};
+
+int main()
+{
+    struct User alice = {0}, bob = {1}, carol = {2};
+    SessionTable *table = session_table_create(2, IDLE_NS);
+
+    uint64_t a = session_table_open(table, &alice, 0);
+    uint64_t b = session_table_open(table, &bob, 0);
+    check(a != 0 && b != 0 && a != b, "handles");
+
+    // Tags are random, so neither handle follows from the other, and the same slot in another table
+    // gets another handle
+    SessionTable *other = session_table_create(2, IDLE_NS);
+    uint64_t o = session_table_open(other, &alice, 0);
+    check(a >> 32 != b >> 32 && (uint32_t)o == (uint32_t)a && o != a, "random tags");
+    session_table_free(other);
+
+    check(session_table_resolve(table, a, 10) == &alice && session_table_resolve(table, b, 10) == &bob, "resolved");
+    check(session_table_resolve(table, a ^ 1ULL << 40, 10) == NULL, "unknown tag");
+    check(session_table_resolve(table, (uint64_t)1 << 32 | 7, 10) == NULL, "unknown slot");
+
+    // The slot is reused after a close, under a new tag, so the old handle goes stale
+    check(session_table_close(table, a) == 0 && session_table_close(table, a) == -1, "closed once");
+    uint64_t c = session_table_open(table, &carol, 20);
+    check((uint32_t)c == (uint32_t)a && c != a, "slot reused");
+    check(session_table_resolve(table, a, 20) == NULL && session_table_resolve(table, c, 20) == &carol,
+          "stale tag");
+
+    // Full: opening evicts the least recently used, bob
+    session_table_resolve(table, c, 30);
+    uint64_t a2 = session_table_open(table, &alice, 30);
+    check(session_table_resolve(table, b, 30) == NULL && table->stats.evicted == 1, "evicted");
+    check(session_table_resolve(table, c, 30) == &carol && session_table_resolve(table, a2, 30) == &alice,
+          "others kept");
+
+    // Idle expiry, when next used and from the tail
+    check(session_table_resolve(table, c, 30 + IDLE_NS + 1) == NULL && table->stats.expired == 1,
+          "expired when used");
+    check(session_table_expire(table, 30 + IDLE_NS) == 0, "not yet idle");
+    check(session_table_expire(table, 31 + IDLE_NS) == 1 && table->size == 0 && table->stats.expired == 2,
+          "expired from the tail");
+
+    // Using a session keeps it open
+    uint64_t d = session_table_open(table, &bob, 0);
+    for (uint64_t now = IDLE_NS / 2; now < 10 * IDLE_NS; now += IDLE_NS / 2)
+    {
+        session_table_resolve(table, d, now);
+    }
+    check(session_table_resolve(table, d, 10 * IDLE_NS) == &bob, "kept open while used");
+
+    printf("opened %lu, resolved %lu, closed %lu, expired %lu, evicted %lu, stale %lu\n", table->stats.opened,
+           table->stats.resolved, table->stats.closed, table->stats.expired, table->stats.evicted,
+           table->stats.stale);
+    session_table_free(table);
+    return check_status();
+}
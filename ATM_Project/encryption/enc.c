@@ -72,6 +72,27 @@ int encrypt(unsigned char *plaintext, int plaintext_len, unsigned char *key,
 
 
 
+/*
+ * Each thread keeps one GCM context for encrypting and one for decrypting.
+ * The cipher is bound when a context is first used; after that each message
+ * only sets a new key and IV, so sealing and opening frames does not
+ * allocate.
+ */
+static __thread EVP_CIPHER_CTX *gcm_encrypt_ctx;
+static __thread EVP_CIPHER_CTX *gcm_decrypt_ctx;
+
+static EVP_CIPHER_CTX *gcm_context(EVP_CIPHER_CTX **cached, int enc)
+{
+    if(*cached == NULL)
+    {
+        if(!(*cached = EVP_CIPHER_CTX_new()))
+            handleErrors();
+        if(1 != EVP_CipherInit_ex(*cached, EVP_aes_256_gcm(), NULL, NULL, NULL, enc))
+            handleErrors();
+    }
+    return *cached;
+}
+
 int gcm_encrypt(unsigned char *plaintext, int plaintext_len,
                 unsigned char *aad, int aad_len,
                 unsigned char *key,
@@ -86,13 +107,8 @@ int gcm_encrypt(unsigned char *plaintext, int plaintext_len,
     int ciphertext_len;
 
 
-    /* Create and initialise the context */
-    if(!(ctx = EVP_CIPHER_CTX_new()))
-        handleErrors();
-
-    /* Initialise the encryption operation. */
-    if(1 != EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL))
-        handleErrors();
+    /* Reuse this thread's encryption context */
+    ctx = gcm_context(&gcm_encrypt_ctx, 1);
 
     /*
      * Set IV length if default 12 bytes (96 bits) is not appropriate
@@ -131,9 +147,6 @@ int gcm_encrypt(unsigned char *plaintext, int plaintext_len,
     if(1 != EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, 16, tag))
         handleErrors();
 
-    /* Clean up */
-    EVP_CIPHER_CTX_free(ctx);
-
     return ciphertext_len;
 }
 
@@ -150,13 +163,8 @@ int gcm_decrypt(unsigned char *ciphertext, int ciphertext_len,
     int plaintext_len;
     int ret;
 
-    /* Create and initialise the context */
-    if(!(ctx = EVP_CIPHER_CTX_new()))
-        handleErrors();
-
-    /* Initialise the decryption operation. */
-    if(!EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL))
-        handleErrors();
+    /* Reuse this thread's decryption context */
+    ctx = gcm_context(&gcm_decrypt_ctx, 0);
 
     /* Set IV length. Not necessary if this is 12 bytes (96 bits) */
     if(!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, iv_len, NULL))
@@ -191,9 +199,6 @@ int gcm_decrypt(unsigned char *ciphertext, int ciphertext_len,
      */
     ret = EVP_DecryptFinal_ex(ctx, plaintext + len, &len);
 
-    /* Clean up */
-    EVP_CIPHER_CTX_free(ctx);
-
     if(ret > 0) {
         /* Success */
         plaintext_len += len;
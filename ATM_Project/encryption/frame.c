@@ -0,0 +1,180 @@
+#include <string.h>
+#include <stddef.h>
+#include "enc.h"
+#include "frame.h"
+
+// The header as it is authenticated: everything but the budget
+static void header_aad(const FrameHeader *header, FrameHeader *aad)
+{
+    memcpy(aad, header, sizeof(FrameHeader));
+    aad->budget_ms = 0;
+}
+
+int frame_seal(const FrameHeader *header, unsigned char *key,
+               const unsigned char *plaintext, int plaintext_len,
+               unsigned char *frame, size_t frame_size)
+{
+    if(plaintext_len < 0 || FRAME_OVERHEAD + plaintext_len > frame_size)
+        return -1;
+
+    unsigned char iv[GCM_IV_SIZE];
+    generate_rand_bytes(GCM_IV_SIZE, iv);
+
+    size_t offset = 0;
+    memcpy(frame + offset, header, sizeof(FrameHeader));
+    offset += sizeof(FrameHeader);
+
+    // GCM is a stream mode, so the ciphertext is exactly as long as the plaintext
+    unsigned char *length_field = frame + offset;
+    offset += sizeof(int);
+
+    FrameHeader aad;
+    header_aad(header, &aad);
+
+    unsigned char *ciphertext = frame + offset;
+    int length_ciphertext = gcm_encrypt((unsigned char *)plaintext, plaintext_len,
+                                        (unsigned char *)&aad, sizeof(FrameHeader), key, iv, GCM_IV_SIZE,
+                                        ciphertext, frame + offset + plaintext_len + GCM_IV_SIZE);
+    memcpy(length_field, &length_ciphertext, sizeof(int));
+    offset += length_ciphertext;
+
+    memcpy(frame + offset, iv, GCM_IV_SIZE);
+    offset += GCM_IV_SIZE;
+    offset += TAG_SIZE;     // written by gcm_encrypt above
+
+    return (int) offset;
+}
+
+int frame_open(unsigned char *key, const unsigned char *frame, size_t frame_len,
+               FrameHeader *header, char *plaintext, size_t plaintext_size)
+{
+    int length_ciphertext;
+
+    if(frame_peek(frame, frame_len, header) < 0 || frame_len < FRAME_OVERHEAD)
+        return -1;
+
+    size_t offset = sizeof(FrameHeader);
+    memcpy(&length_ciphertext, frame + offset, sizeof(int));
+    offset += sizeof(int);
+
+    // Reject lengths that run past the end of the datagram or the caller's buffer
+    if(length_ciphertext < 0 || (size_t) length_ciphertext >= plaintext_size ||
+       offset + length_ciphertext + GCM_IV_SIZE + TAG_SIZE > frame_len)
+        return -1;
+
+    unsigned char *ciphertext = (unsigned char *)frame + offset;
+    unsigned char *iv = ciphertext + length_ciphertext;
+    unsigned char *tag = iv + GCM_IV_SIZE;
+
+    FrameHeader aad;
+    header_aad(header, &aad);
+
+    int p_len = gcm_decrypt(ciphertext, length_ciphertext, (unsigned char *)&aad, sizeof(FrameHeader),
+                            tag, key, iv, GCM_IV_SIZE, (unsigned char *)plaintext);
+    if(p_len < 0)
+        return -1;
+
+    plaintext[p_len] = '\0';
+    return p_len;
+}
+
+void frame_set_budget(unsigned char *frame, uint32_t budget_ms)
+{
+    memcpy(frame + offsetof(FrameHeader, budget_ms), &budget_ms, sizeof(budget_ms));
+}
+
+int frame_busy(const FrameHeader *request, unsigned char *frame, size_t frame_size)
+{
+    if(frame_size < sizeof(FrameHeader))
+        return -1;
+
+    FrameHeader header;
+    memset(&header, 0, sizeof(header));
+    header.type = FRAME_BUSY;
+    header.request_id = request->request_id;
+    memcpy(frame, &header, sizeof(header));
+    return (int) sizeof(header);
+}
+
+int frame_fragment_count(size_t frame_len, size_t fragment_size)
+{
+    if(frame_len <= fragment_size)
+        return 1;
+    if(fragment_size <= FRAGMENT_OVERHEAD)
+        return -1;
+
+    size_t per_fragment = fragment_size - FRAGMENT_OVERHEAD;
+    size_t count = (frame_len + per_fragment - 1) / per_fragment;
+    return count <= FRAME_MAX_FRAGMENTS ? (int) count : -1;
+}
+
+int frame_fragment(const unsigned char *frame, size_t frame_len, size_t fragment_size, int index,
+                   unsigned char *out, size_t out_size)
+{
+    int count = frame_fragment_count(frame_len, fragment_size);
+    if(count < 2 || index < 0 || index >= count || frame_len < sizeof(FrameHeader) || frame_len > FRAME_MAX_SIZE)
+        return -1;
+
+    size_t per_fragment = fragment_size - FRAGMENT_OVERHEAD;
+    size_t offset = index * per_fragment;
+    size_t length = frame_len - offset < per_fragment ? frame_len - offset : per_fragment;
+    if(FRAGMENT_OVERHEAD + length > out_size)
+        return -1;
+
+    // The frame's own header, budget and request ID included, so the
+    // fragments can be told apart and dropped like the frame would be
+    FrameHeader header;
+    memcpy(&header, frame, sizeof(header));
+    header.type = FRAME_FRAGMENT;
+
+    FragmentHeader fragment = { index, count, offset, length, frame_len, 0 };
+    memcpy(out, &header, sizeof(header));
+    memcpy(out + sizeof(header), &fragment, sizeof(fragment));
+    memcpy(out + FRAGMENT_OVERHEAD, frame + offset, length);
+    return (int) (FRAGMENT_OVERHEAD + length);
+}
+
+int frame_length(const unsigned char *buf, size_t len)
+{
+    FrameHeader header;
+    FragmentHeader fragment;
+    int length_ciphertext;
+
+    if(len < sizeof(FrameHeader))
+        return 0;
+    memcpy(&header, buf, sizeof(FrameHeader));
+    if(header.type == FRAME_BUSY)
+        return sizeof(FrameHeader);
+    if(header.type == FRAME_FRAGMENT)
+    {
+        if(len < FRAGMENT_OVERHEAD)
+            return 0;
+        memcpy(&fragment, buf + sizeof(FrameHeader), sizeof(fragment));
+        if(fragment.length > FRAME_MAX_SIZE)
+            return -1;
+        return FRAGMENT_OVERHEAD + fragment.length;
+    }
+    if(header.type != FRAME_REQUEST && header.type != FRAME_REPLY)
+        return -1;
+
+    if(len < sizeof(FrameHeader) + sizeof(int))
+        return 0;
+    memcpy(&length_ciphertext, buf + sizeof(FrameHeader), sizeof(int));
+    if(length_ciphertext < 0 || length_ciphertext > (int) (FRAME_MAX_SIZE - FRAME_OVERHEAD))
+        return -1;
+    return FRAME_OVERHEAD + length_ciphertext;
+}
+
+int frame_peek(const unsigned char *frame, size_t frame_len, FrameHeader *header)
+{
+    if(frame_len < sizeof(FrameHeader))
+        return -1;
+    memcpy(header, frame, sizeof(FrameHeader));
+
+    // Only busy frames may be a bare header, and fragments carry a slice of a frame
+    if(header->type == FRAME_FRAGMENT)
+        return frame_len < FRAGMENT_OVERHEAD ? -1 : 0;
+    if(header->type != FRAME_BUSY && frame_len < FRAME_OVERHEAD)
+        return -1;
+    return 0;
+}
@@ -0,0 +1,118 @@
+#ifndef __FRAME_H__
+#define __FRAME_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "enc.h"
+
+// Every message between the ATM and the bank is a sealed frame:
+//
+//   [FrameHeader][int length_ciphertext][ciphertext][GCM IV][tag]
+//
+// The header travels in the clear so the bank can spot retransmissions
+// and match replies to requests without decrypting anything, but it is
+// fed to AES-256-GCM as additional authenticated data, so it cannot be
+// altered without the tag check failing.
+//
+// The one exception is budget_ms, which is authenticated as zero: the
+// ATM refreshes it on every retransmission without resealing the frame.
+// Tampering with it can only make the bank drop a request early (which
+// anyone on the path can do by dropping the datagram) or keep working on
+// one the ATM has given up on.
+
+#define FRAME_REQUEST 1
+#define FRAME_REPLY 2
+
+// A busy frame is a bare header, echoing the request's ID: the bank turned
+// the request away without decrypting it and the ATM should back off before
+// retrying. It carries no tag, so a forged one can delay a retransmission
+// but never complete or fail a request.
+#define FRAME_BUSY 3
+
+// A frame too large for one datagram travels as fragments, each a copy of
+// the frame's header with its type changed, a FragmentHeader, and a slice
+// of the sealed frame:
+//
+//   [FrameHeader][FragmentHeader][bytes offset .. offset + length - 1]
+//
+// The receiver puts the frame back together (see reassembly.h) and opens
+// it as usual, so fragments need no tag of their own: a forged or mangled
+// one only spoils the reassembled frame, which then fails authentication.
+#define FRAME_FRAGMENT 4
+
+#define FRAME_MAX_SIZE 10000
+
+// A frame is split into at most this many fragments
+#define FRAME_MAX_FRAGMENTS 64
+
+typedef struct _FrameHeader
+{
+    uint16_t type;
+    uint16_t flags;
+    uint32_t budget_ms;         // how long the sender will still wait for a reply; 0 for no limit
+    uint64_t request_id;        // chosen by the ATM, echoed in the bank's reply
+} FrameHeader;
+
+typedef struct _FragmentHeader
+{
+    uint16_t index;
+    uint16_t count;             // fragments the frame was split into
+    uint16_t offset;            // where this fragment's bytes go in the frame
+    uint16_t length;            // bytes of the frame this fragment carries
+    uint16_t frame_len;         // length of the whole frame
+    uint16_t reserved;
+} FragmentHeader;
+
+// Bytes a frame adds on top of its plaintext
+#define FRAME_OVERHEAD (sizeof(FrameHeader) + sizeof(int) + GCM_IV_SIZE + TAG_SIZE)
+
+// Bytes a fragment adds on top of the slice of the frame it carries
+#define FRAGMENT_OVERHEAD (sizeof(FrameHeader) + sizeof(FragmentHeader))
+
+// Datagram sizes frames are fragmented to: by default small enough for one
+// Ethernet MTU or one shm slot (see transport.h)
+#define FRAGMENT_DEFAULT_SIZE 1400
+#define FRAGMENT_MIN_SIZE 64
+
+// Encrypts plaintext under key into frame with the given header.
+// Returns the length of the frame; -1 if it does not fit in frame_size
+int frame_seal(const FrameHeader *header, unsigned char *key,
+               const unsigned char *plaintext, int plaintext_len,
+               unsigned char *frame, size_t frame_size);
+
+// Checks the tag and decrypts frame into plaintext (NUL-terminated),
+// copying the header out. Returns the plaintext length; -1 if the frame
+// is malformed or fails authentication
+int frame_open(unsigned char *key, const unsigned char *frame, size_t frame_len,
+               FrameHeader *header, char *plaintext, size_t plaintext_size);
+
+// Rewrites the budget of a sealed frame in place
+void frame_set_budget(unsigned char *frame, uint32_t budget_ms);
+
+// Writes the busy frame answering request into frame.
+// Returns the length of the frame; -1 if it does not fit in frame_size
+int frame_busy(const FrameHeader *request, unsigned char *frame, size_t frame_size);
+
+// The number of fragments of at most fragment_size bytes frame_len bytes of
+// frame split into; 1 if the frame fits as it is. Returns -1 if it would
+// take more than FRAME_MAX_FRAGMENTS
+int frame_fragment_count(size_t frame_len, size_t fragment_size);
+
+// Writes fragment index of frame, cut into fragments of at most
+// fragment_size bytes, to out. Returns the fragment's length; -1 if index is
+// out of range or the fragment does not fit in out_size
+int frame_fragment(const unsigned char *frame, size_t frame_len, size_t fragment_size, int index,
+                   unsigned char *out, size_t out_size);
+
+// The length of the frame (or fragment) at the start of buf, going by its header and
+// ciphertext length, so frames can be cut back out of a byte stream.
+// Returns the length; 0 if buf holds too little to tell; -1 if buf does not
+// start with a frame
+int frame_length(const unsigned char *buf, size_t len);
+
+// Reads the header without authenticating it. Returns 0 on success; -1 if
+// the frame is too short. For a fragment, the header is its own copy of the
+// frame's
+int frame_peek(const unsigned char *frame, size_t frame_len, FrameHeader *header);
+
+#endif
@@ -0,0 +1,160 @@
+#include <stdlib.h>
+#include <string.h>
+#include "reassembly.h"
+
+Reassembler* reassembler_create(uint32_t num_slots, uint64_t timeout_ns)
+{
+    Reassembler *r = (Reassembler *) calloc(1, sizeof(Reassembler));
+    if(r == NULL)
+        return NULL;
+
+    r->slots = (Reassembly *) calloc(num_slots, sizeof(Reassembly));
+    if(r->slots == NULL)
+    {
+        free(r);
+        return NULL;
+    }
+    r->num_slots = num_slots;
+    r->timeout_ns = timeout_ns;
+    return r;
+}
+
+void reassembler_free(Reassembler *r)
+{
+    if(r != NULL)
+    {
+        free(r->slots);
+        free(r);
+    }
+}
+
+static int same_sender(const Reassembly *slot, const struct sockaddr_in *from)
+{
+    return slot->from.sin_addr.s_addr == from->sin_addr.s_addr && slot->from.sin_port == from->sin_port;
+}
+
+static int expire_slot(Reassembler *r, Reassembly *slot, uint64_t now_ns)
+{
+    if(!slot->used || now_ns - slot->started_ns <= r->timeout_ns)
+        return 0;
+    slot->used = 0;
+    r->stats.timeouts++;
+    return 1;
+}
+
+// The slot collecting request_id from from, or one to start collecting it
+// in. Frames past their timeout are abandoned along the way
+static Reassembly *find_slot(Reassembler *r, const struct sockaddr_in *from, uint64_t request_id, uint64_t now_ns)
+{
+    Reassembly *free_slot = NULL, *oldest = NULL;
+
+    for(uint32_t i = 0; i < r->num_slots; i++)
+    {
+        Reassembly *slot = &r->slots[i];
+        expire_slot(r, slot, now_ns);
+        if(!slot->used)
+        {
+            if(free_slot == NULL)
+                free_slot = slot;
+            continue;
+        }
+        if(slot->request_id == request_id && same_sender(slot, from))
+            return slot;
+        if(oldest == NULL || slot->started_ns < oldest->started_ns)
+            oldest = slot;
+    }
+
+    if(free_slot == NULL)
+    {
+        free_slot = oldest;
+        r->stats.evictions++;
+    }
+    memset(free_slot, 0, offsetof(Reassembly, frame));
+    free_slot->from = *from;
+    free_slot->request_id = request_id;
+    free_slot->started_ns = now_ns;
+    return free_slot;
+}
+
+int reassembler_add(Reassembler *r, const struct sockaddr_in *from, const unsigned char *fragment,
+                    size_t len, uint64_t now_ns, const Reassembly **done)
+{
+    static const struct sockaddr_in nobody;
+    FrameHeader header;
+    FragmentHeader f;
+
+    r->stats.fragments++;
+    if(r->num_slots == 0 || frame_peek(fragment, len, &header) < 0 || header.type != FRAME_FRAGMENT)
+    {
+        r->stats.malformed++;
+        return -1;
+    }
+    memcpy(&f, fragment + sizeof(FrameHeader), sizeof(f));
+    if(f.count < 2 || f.count > FRAME_MAX_FRAGMENTS || f.index >= f.count || f.frame_len > FRAME_MAX_SIZE ||
+       f.length == 0 || f.length != len - FRAGMENT_OVERHEAD || f.offset + f.length > f.frame_len)
+    {
+        r->stats.malformed++;
+        return -1;
+    }
+
+    // The fragment size this fragment implies: the fragments tile the frame
+    // once they all imply the same one
+    uint32_t per_fragment = f.length;
+    if(f.index + 1 == f.count)
+    {
+        per_fragment = f.offset / f.index;
+        if(f.offset % f.index != 0 || f.offset + f.length != f.frame_len || f.length > per_fragment)
+        {
+            r->stats.malformed++;
+            return -1;
+        }
+    }
+    else if(f.offset != (uint32_t) f.index * f.length)
+    {
+        r->stats.malformed++;
+        return -1;
+    }
+
+    Reassembly *slot = find_slot(r, from != NULL ? from : &nobody, header.request_id, now_ns);
+    if(!slot->used)
+    {
+        slot->used = 1;
+        slot->count = f.count;
+        slot->frame_len = f.frame_len;
+        slot->per_fragment = per_fragment;
+    }
+    else if(slot->count != f.count || slot->frame_len != f.frame_len || slot->per_fragment != per_fragment)
+    {
+        r->stats.malformed++;
+        return -1;
+    }
+
+    // Retransmissions repeat fragments we may already have
+    uint64_t bit = 1ULL << f.index;
+    if(slot->have & bit)
+        return 0;
+    slot->have |= bit;
+    memcpy(slot->frame + f.offset, fragment + FRAGMENT_OVERHEAD, f.length);
+
+    uint64_t all = f.count == 64 ? ~0ULL : (1ULL << f.count) - 1;
+    if(slot->have != all)
+        return 0;
+
+    slot->used = 0;
+    r->stats.completed++;
+    *done = slot;
+    return 1;
+}
+
+int reassembler_expire(Reassembler *r, uint64_t now_ns)
+{
+    int expired = 0;
+    for(uint32_t i = 0; i < r->num_slots; i++)
+        expired += expire_slot(r, &r->slots[i], now_ns);
+    return expired;
+}
+
+size_t reassembler_memory(const Reassembler *r)
+{
+    return sizeof(Reassembler) + r->num_slots * sizeof(Reassembly);
+}
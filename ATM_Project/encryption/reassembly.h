@@ -0,0 +1,71 @@
+/*
+ * Puts fragmented frames (see frame.h) back together.
+ *
+ * Each frame being reassembled takes one of a fixed number of slots,
+ * found by the sender's address and the frame's request ID, so the
+ * memory used is set when the reassembler is created whatever arrives.
+ * A frame whose fragments have not all arrived within the timeout is
+ * abandoned, and when every slot is taken the frame that started arriving
+ * longest ago is evicted to make room.  Either way the sender's
+ * retransmission recovers it, just as it would a lost datagram.
+ *
+ * Fragment i of a frame must carry the bytes from i times the fragment
+ * size, the last one up to the end of the frame, so fragments that
+ * overlap or leave gaps are dropped as malformed.
+ */
+
+#ifndef __REASSEMBLY_H__
+#define __REASSEMBLY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include "frame.h"
+
+typedef struct _Reassembly
+{
+    int used;
+    struct sockaddr_in from;
+    uint64_t request_id;
+    uint64_t started_ns;        // when the first fragment arrived
+    uint64_t have;              // bit i is set once fragment i has arrived
+    uint16_t per_fragment;      // bytes each fragment but the last carries
+    uint16_t count;
+    uint16_t frame_len;
+    unsigned char frame[FRAME_MAX_SIZE];
+} Reassembly;
+
+typedef struct _ReassemblyStats
+{
+    unsigned long fragments;
+    unsigned long completed;
+    unsigned long timeouts;     // frames abandoned for taking too long
+    unsigned long evictions;    // frames abandoned to make room for another
+    unsigned long malformed;    // fragments that contradict themselves or their frame
+} ReassemblyStats;
+
+typedef struct _Reassembler
+{
+    uint32_t num_slots;
+    uint64_t timeout_ns;
+    Reassembly *slots;
+    ReassemblyStats stats;
+} Reassembler;
+
+Reassembler* reassembler_create(uint32_t num_slots, uint64_t timeout_ns);
+void reassembler_free(Reassembler *r);
+
+// Adds a fragment from from (NULL if there is only ever one sender) that
+// arrived at now_ns. Returns 1 once it completes its frame, pointing *done
+// at the reassembly, which stays valid until the next call; 0 if the frame
+// still lacks fragments; -1 if the fragment was malformed and dropped
+int reassembler_add(Reassembler *r, const struct sockaddr_in *from, const unsigned char *fragment,
+                    size_t len, uint64_t now_ns, const Reassembly **done);
+
+// Abandons every frame whose fragments have not all arrived by now_ns.
+// Returns the number abandoned
+int reassembler_expire(Reassembler *r, uint64_t now_ns);
+
+size_t reassembler_memory(const Reassembler *r);
+
+#endif
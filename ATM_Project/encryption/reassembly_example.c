@@ -0,0 +1,95 @@
+#include "reassembly.h"
+#include "check.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FRAME_LEN 1000
+#define FRAGMENT_SIZE 300
+#define TIMEOUT_NS 1000
+
+static unsigned char frames[2][FRAME_LEN];
+static unsigned char fragments[2][8][FRAGMENT_SIZE];
+static int lengths[2][8];
+static int count;
+
+// Cut frames[f], a frame with request ID f + 1, into fragments[f]
+static void make_frame(int f)
+{
+    FrameHeader header;
+    memset(&header, 0, sizeof(header));
+    header.type = FRAME_REQUEST;
+    header.request_id = f + 1;
+    for(int i = 0; i < FRAME_LEN; i++)
+        frames[f][i] = (unsigned char) (i * 7 + f);
+    memcpy(frames[f], &header, sizeof(header));
+
+    count = frame_fragment_count(FRAME_LEN, FRAGMENT_SIZE);
+    for(int i = 0; i < count; i++)
+        lengths[f][i] = frame_fragment(frames[f], FRAME_LEN, FRAGMENT_SIZE, i, fragments[f][i], FRAGMENT_SIZE);
+}
+
+static int add(Reassembler *r, int f, int i, uint64_t now_ns, const Reassembly **done)
+{
+    return reassembler_add(r, NULL, fragments[f][i], lengths[f][i], now_ns, done);
+}
+
+// Whether every fragment of frame f, added in reverse order at now_ns, rebuilds it
+static int rebuilds(Reassembler *r, int f, uint64_t now_ns)
+{
+    const Reassembly *done = NULL;
+    int rc = 0;
+    for(int i = count - 1; i >= 0; i--)
+        rc = add(r, f, i, now_ns, &done);
+    return rc == 1 && done->frame_len == FRAME_LEN && memcmp(done->frame, frames[f], FRAME_LEN) == 0;
+}
+
+int main()
+{
+    const Reassembly *done;
+    Reassembler *r = reassembler_create(1, TIMEOUT_NS);
+    make_frame(0);
+    make_frame(1);
+    printf("%d fragments\n", count);
+
+    check(rebuilds(r, 0, 0), "reassembled");
+    int rc = add(r, 0, count - 1, 0, &done);
+    rc += add(r, 0, count - 1, 0, &done);
+    check(rc == 0 && rebuilds(r, 0, 0) && r->stats.completed == 2, "repeated fragment");
+
+    // A frame still missing fragments after the timeout starts over
+    add(r, 0, 0, 0, &done);
+    check(reassembler_expire(r, TIMEOUT_NS) == 0, "not yet timed out");
+    check(reassembler_expire(r, TIMEOUT_NS + 1) == 1 && r->stats.timeouts == 1, "timed out");
+    add(r, 0, 0, 0, &done);
+    for(int i = 1; i < count; i++)
+        add(r, 0, i, 2 * TIMEOUT_NS, &done);
+    check(r->stats.timeouts == 2 && r->stats.completed == 2, "late fragments do not complete");
+
+    // With one slot, another frame evicts the one still in it
+    check(rebuilds(r, 1, 2 * TIMEOUT_NS) && r->stats.evictions == 1, "evicted");
+
+    // A fragment moved to overlap the one before leaves a gap; so does one cut short
+    unsigned long malformed = r->stats.malformed;
+    FragmentHeader fh;
+    memcpy(&fh, fragments[0][1] + sizeof(FrameHeader), sizeof(fh));
+    fh.offset -= 10;
+    memcpy(fragments[0][1] + sizeof(FrameHeader), &fh, sizeof(fh));
+    check(add(r, 0, 1, 4 * TIMEOUT_NS, &done) == -1 && r->stats.malformed == malformed + 1, "overlap dropped");
+    make_frame(0);
+
+    check(reassembler_add(r, NULL, fragments[0][1], lengths[0][1] - 1, 4 * TIMEOUT_NS, &done) == -1,
+          "short fragment dropped");
+    unsigned char longer[FRAGMENT_SIZE + 1];
+    memcpy(longer, fragments[0][count - 1], lengths[0][count - 1]);
+    memcpy(&fh, longer + sizeof(FrameHeader), sizeof(fh));
+    fh.offset -= 1;
+    fh.length += 1;
+    memcpy(longer + sizeof(FrameHeader), &fh, sizeof(fh));
+    check(reassembler_add(r, NULL, longer, lengths[0][count - 1] + 1, 4 * TIMEOUT_NS, &done) == -1,
+          "overlapping last fragment dropped");
+    check(rebuilds(r, 0, 5 * TIMEOUT_NS), "reassembled after");
+
+    reassembler_free(r);
+    return check_status();
+}
@@ -0,0 +1,161 @@
+#include "capture.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Slots are cache-line aligned so concurrent writers never share a line
+#define SLOT_SIZE ((sizeof(CaptureRecord) + 63) & ~(size_t) 63)
+
+static Capture* capture_map(int fd, size_t map_len, int prot)
+{
+    Capture *capture = (Capture*) malloc(sizeof(Capture));
+    if(capture == NULL)
+        return NULL;
+
+    void *map = mmap(NULL, map_len, prot, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED)
+    {
+        free(capture);
+        return NULL;
+    }
+
+    capture->fd = fd;
+    capture->map_len = map_len;
+    capture->header = (CaptureHeader*) map;
+    capture->slots = (char*) map + sizeof(CaptureHeader);
+    return capture;
+}
+
+// Create (or truncate) a capture file with room for num_slots records
+Capture* capture_create(const char *path, uint32_t num_slots)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+    {
+        perror("Error creating capture file");
+        return NULL;
+    }
+
+    size_t map_len = sizeof(CaptureHeader) + (size_t) num_slots * SLOT_SIZE;
+    if(ftruncate(fd, map_len) < 0)
+    {
+        perror("Error sizing capture file");
+        close(fd);
+        return NULL;
+    }
+
+    Capture *capture = capture_map(fd, map_len, PROT_READ | PROT_WRITE);
+    if(capture == NULL)
+    {
+        perror("Error mapping capture file");
+        close(fd);
+        return NULL;
+    }
+
+    capture->header->magic = CAPTURE_MAGIC;
+    capture->header->version = CAPTURE_VERSION;
+    capture->header->slot_size = SLOT_SIZE;
+    capture->header->num_slots = num_slots;
+    capture->header->next_seq = 0;
+    return capture;
+}
+
+// Map an existing capture file read-only
+Capture* capture_open(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        perror("Error opening capture file");
+        return NULL;
+    }
+
+    struct stat st;
+    CaptureHeader header;
+    if(fstat(fd, &st) < 0 || pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+       header.magic != CAPTURE_MAGIC || header.version != CAPTURE_VERSION ||
+       header.slot_size != SLOT_SIZE ||
+       (size_t) st.st_size < sizeof(CaptureHeader) + (size_t) header.num_slots * SLOT_SIZE)
+    {
+        fprintf(stderr, "%s: not a router capture file\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    Capture *capture = capture_map(fd, st.st_size, PROT_READ);
+    if(capture == NULL)
+    {
+        perror("Error mapping capture file");
+        close(fd);
+    }
+    return capture;
+}
+
+void capture_close(Capture *capture)
+{
+    if(capture != NULL)
+    {
+        munmap(capture->header, capture->map_len);
+        close(capture->fd);
+        free(capture);
+    }
+}
+
+// Record one datagram. Safe to call from any number of threads at once.
+void capture_write(Capture *capture, uint8_t dir, const char *data, size_t len, uint64_t timestamp_ns)
+{
+    CaptureHeader *header = capture->header;
+    uint64_t seq = __atomic_fetch_add(&header->next_seq, 1, __ATOMIC_RELAXED);
+    CaptureRecord *rec = (CaptureRecord*) (capture->slots + (seq % header->num_slots) * SLOT_SIZE);
+
+    if(len > CAPTURE_MAX_DATA)
+        len = CAPTURE_MAX_DATA;
+
+    // Readers ignore the slot until seq is published again below
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    rec->timestamp_ns = timestamp_ns;
+    rec->dir = dir;
+    rec->len = (uint16_t) len;
+    memcpy(rec->data, data, len);
+    __atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+// Oldest sequence number that can still be in the ring
+uint64_t capture_first_seq(const Capture *capture)
+{
+    uint64_t end = capture_end_seq(capture);
+    return end > capture->header->num_slots ? end - capture->header->num_slots : 0;
+}
+
+// One past the newest sequence number written
+uint64_t capture_end_seq(const Capture *capture)
+{
+    return __atomic_load_n(&capture->header->next_seq, __ATOMIC_ACQUIRE);
+}
+
+// Copy out the record with sequence number seq. Returns 0 on success; -1 if
+// it was overwritten, or changed while it was being copied
+int capture_read(const Capture *capture, uint64_t seq, CaptureRecord *out)
+{
+    const CaptureRecord *rec = (const CaptureRecord*)
+        (capture->slots + (seq % capture->header->num_slots) * SLOT_SIZE);
+
+    if(__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != seq + 1)
+        return -1;
+
+    out->timestamp_ns = rec->timestamp_ns;
+    out->dir = rec->dir;
+    out->len = rec->len <= CAPTURE_MAX_DATA ? rec->len : CAPTURE_MAX_DATA;
+    memcpy(out->data, rec->data, out->len);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if(__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) != seq + 1)
+        return -1;
+    out->seq = seq + 1;
+    return 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * Packet capture for the router.
+ *
+ * A capture file is a fixed-size ring of record slots, memory-mapped
+ * by the router.  Writers claim the next slot with one atomic add, copy
+ * the datagram in and publish it by storing its sequence number last,
+ * so any number of forwarding threads can record without locks or
+ * syscalls.  Once the ring is full the oldest records are overwritten.
+ *
+ * Readers (router-replay) map the same file and walk the last
+ * num_slots sequence numbers, skipping any slot whose sequence number
+ * does not match before and after it is copied (overwritten or still
+ * being written).
+ */
+
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "encryption/frame.h"
+
+#define CAPTURE_MAGIC 0x50414352u
+#define CAPTURE_VERSION 2
+#define CAPTURE_DEFAULT_SLOTS 8192
+#define CAPTURE_MAX_DATA FRAME_MAX_SIZE      // ROUTER_MAX_PACKET, the largest datagram forwarded
+
+typedef struct _CaptureHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_size;
+    uint32_t num_slots;
+    uint64_t next_seq;
+    char pad[40];
+} CaptureHeader;
+
+typedef struct _CaptureRecord
+{
+    uint64_t seq;               // sequence number + 1; 0 while being written
+    uint64_t timestamp_ns;      // CLOCK_REALTIME when the datagram was forwarded
+    uint8_t dir;                // Direction the datagram was travelling in
+    uint8_t reserved;
+    uint16_t len;               // bytes captured, the whole datagram
+    uint32_t reserved2;
+    char data[CAPTURE_MAX_DATA];
+} CaptureRecord;
+
+typedef struct _Capture
+{
+    int fd;
+    size_t map_len;
+    CaptureHeader *header;
+    char *slots;
+} Capture;
+
+Capture* capture_create(const char *path, uint32_t num_slots);
+Capture* capture_open(const char *path);
+void capture_close(Capture *capture);
+void capture_write(Capture *capture, uint8_t dir, const char *data, size_t len, uint64_t timestamp_ns);
+uint64_t capture_first_seq(const Capture *capture);
+uint64_t capture_end_seq(const Capture *capture);
+int capture_read(const Capture *capture, uint64_t seq, CaptureRecord *out);
+
+#endif
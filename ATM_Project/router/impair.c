@@ -0,0 +1,87 @@
+#include <stdlib.h>
+#include <string.h>
+#include "impair.h"
+
+#define DEFAULT_REORDER_DELAY_US 10000
+
+// Parse one key=value option into config. Returns 0 on success; -1 on error
+int impair_parse(ImpairConfig *config, char *option)
+{
+    char *eq = strchr(option, '=');
+    if(eq == NULL)
+        return -1;
+    *eq = '\0';
+
+    char *key = option;
+    char *end;
+    double value = strtod(eq + 1, &end);
+    if(end == eq + 1 || *end != '\0' || value < 0)
+        return -1;
+
+    if(config->reorder_delay_us == 0)
+        config->reorder_delay_us = DEFAULT_REORDER_DELAY_US;
+
+    if(strcmp(key, "latency") == 0)
+        config->latency_us = (uint64_t) (value * 1000);
+    else if(strcmp(key, "jitter") == 0)
+        config->jitter_us = (uint64_t) (value * 1000);
+    else if(strcmp(key, "loss") == 0 && value <= 100)
+        config->loss = value / 100;
+    else if(strcmp(key, "duplicate") == 0 && value <= 100)
+        config->duplicate = value / 100;
+    else if(strcmp(key, "reorder") == 0 && value <= 100)
+        config->reorder = value / 100;
+    else if(strcmp(key, "reorder-delay") == 0)
+        config->reorder_delay_us = (uint64_t) (value * 1000);
+    else if(strcmp(key, "rate") == 0)
+        config->rate_bytes_per_sec = (uint64_t) (value * 1000 / 8);
+    else
+        return -1;
+
+    config->enabled = 1;
+    return 0;
+}
+
+// xorshift64*: a fast per-worker generator, good enough for coin flips
+double impair_random(uint64_t *rng)
+{
+    uint64_t x = *rng;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *rng = x;
+    return (double) ((x * 0x2545F4914F6CDD1DULL) >> 11) / (double) (1ULL << 53);
+}
+
+// Work out when a packet of len bytes handed to the link at now_us should
+// come out of the other end: queueing behind the bandwidth cap, then
+// latency plus jitter, plus the reorder hold-back if it is picked for that.
+uint64_t impair_departure(ImpairConfig *config, uint64_t now_us, size_t len, uint64_t *rng, int *reordered)
+{
+    uint64_t sent_us = now_us;
+
+    if(config->rate_bytes_per_sec > 0)
+    {
+        uint64_t busy_us = len * 1000000 / config->rate_bytes_per_sec;
+        uint64_t free_us = __atomic_load_n(&config->link_free_us, __ATOMIC_RELAXED);
+        uint64_t start_us;
+        do
+        {
+            start_us = free_us > now_us ? free_us : now_us;
+        } while(!__atomic_compare_exchange_n(&config->link_free_us, &free_us, start_us + busy_us,
+                                             1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        sent_us = start_us + busy_us;
+    }
+
+    int64_t delay_us = config->latency_us;
+    if(config->jitter_us > 0)
+        delay_us += (int64_t) ((impair_random(rng) * 2 - 1) * config->jitter_us);
+    if(delay_us < 0)
+        delay_us = 0;
+
+    *reordered = config->reorder > 0 && impair_random(rng) < config->reorder;
+    if(*reordered)
+        delay_us += config->reorder_delay_us;
+
+    return sent_us + delay_us;
+}
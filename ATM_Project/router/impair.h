@@ -0,0 +1,44 @@
+/*
+ * Network impairment emulation for the router.
+ *
+ * Each direction can be given a fixed latency, uniform jitter, random
+ * loss, duplication and reordering, and a bandwidth cap.  Packets that
+ * have to wait are copied out of the receive batch and parked on the
+ * worker's timer wheel, so a slow direction never blocks forwarding.
+ *
+ * Impairments are configured in the router's config file:
+ *
+ *     impair <atm->bank|bank->atm|both> [latency=<ms>] [jitter=<ms>]
+ *            [loss=<pct>] [duplicate=<pct>] [reorder=<pct>]
+ *            [reorder-delay=<ms>] [rate=<kbit/s>]
+ *
+ * Reordered packets are held back by an extra reorder-delay (default
+ * 10ms) so packets sent after them overtake them.
+ */
+
+#ifndef __IMPAIR_H__
+#define __IMPAIR_H__
+
+#include <stdint.h>
+
+typedef struct _ImpairConfig
+{
+    int enabled;
+    uint64_t latency_us;
+    uint64_t jitter_us;
+    double loss;
+    double duplicate;
+    double reorder;
+    uint64_t reorder_delay_us;
+    uint64_t rate_bytes_per_sec;
+
+    // Time the emulated link finishes sending what it already has queued;
+    // shared by every worker forwarding in this direction
+    uint64_t link_free_us;
+} ImpairConfig;
+
+int impair_parse(ImpairConfig *config, char *option);
+uint64_t impair_departure(ImpairConfig *config, uint64_t now_us, size_t len, uint64_t *rng, int *reordered);
+double impair_random(uint64_t *rng);
+
+#endif
@@ -0,0 +1,216 @@
+/*
+ * Replays datagrams recorded by `router -w` against a bank.
+ *
+ * Usage:  router-replay [-x <speed> | -m] [-d <direction>] [-t <ip:port>] [-l] <capture file>
+ *
+ *   -x  replay at <speed> times the recorded rate (default 1)
+ *   -m  replay as fast as possible
+ *   -d  direction to replay, atm->bank (default) or bank->atm
+ *   -t  where to send the datagrams (default 127.0.0.1:BANK_PORT)
+ *   -l  list the records instead of sending them
+ *
+ * Replies are sent back to the replay socket and counted.  The
+ * datagrams go over the transport named by TRANSPORT (see transport.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "capture.h"
+#include "route.h"
+#include "router.h"
+#include "ports.h"
+
+#define REPLAY_BATCH 64
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage:  router-replay [-x <speed> | -m] [-d <direction>] [-t <ip:port>] [-l] <capture file>\n");
+    exit(1);
+}
+
+static uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t deadline_ns)
+{
+    struct timespec ts = { deadline_ns / 1000000000, deadline_ns % 1000000000 };
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0);
+}
+
+// Count every reply waiting on the socket
+static unsigned long drain_replies(int sockfd)
+{
+    static char buf[65536];
+    unsigned long n = 0;
+    while(transport_recvfrom(sockfd, buf, sizeof(buf), MSG_DONTWAIT, NULL) >= 0)
+        n++;
+    return n;
+}
+
+static void list_records(Capture *capture)
+{
+    static const char *dir_names[NUM_DIRS] = { "atm->bank", "bank->atm" };
+    static CaptureRecord rec;
+    uint64_t first_ns = 0;
+
+    for(uint64_t seq = capture_first_seq(capture); seq < capture_end_seq(capture); seq++)
+    {
+        if(capture_read(capture, seq, &rec) < 0)
+            continue;
+        if(first_ns == 0)
+            first_ns = rec.timestamp_ns;
+        printf("%8lu  +%.9f  %-9s  %u bytes\n", (unsigned long) seq,
+               (rec.timestamp_ns - first_ns) / 1e9,
+               rec.dir < NUM_DIRS ? dir_names[rec.dir] : "?", rec.len);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    double speed = 1;
+    int max_speed = 0, list = 0;
+    int dir = DIR_ATM_TO_BANK;
+    struct sockaddr_in target;
+    int opt;
+
+    bzero(&target, sizeof(target));
+    target.sin_family = AF_INET;
+    target.sin_addr.s_addr = inet_addr("127.0.0.1");
+    target.sin_port = htons(BANK_PORT);
+
+    while((opt = getopt(argc, argv, "x:md:t:l")) != -1)
+    {
+        switch(opt)
+        {
+            case 'x': speed = atof(optarg); break;
+            case 'm': max_speed = 1; break;
+            case 'l': list = 1; break;
+            case 'd':
+                if(strcmp(optarg, "atm->bank") == 0)
+                    dir = DIR_ATM_TO_BANK;
+                else if(strcmp(optarg, "bank->atm") == 0)
+                    dir = DIR_BANK_TO_ATM;
+                else
+                    usage();
+                break;
+            case 't':
+                if(parse_endpoint(optarg, &target) < 0)
+                    usage();
+                break;
+            default: usage();
+        }
+    }
+    if(optind != argc - 1 || speed <= 0)
+        usage();
+
+    Capture *capture = capture_open(argv[optind]);
+    if(capture == NULL)
+        return EXIT_FAILURE;
+
+    if(list)
+    {
+        list_records(capture);
+        capture_close(capture);
+        return EXIT_SUCCESS;
+    }
+
+    // Bind explicitly: over unix an unbound sender cannot be answered
+    struct sockaddr_in any;
+    bzero(&any, sizeof(any));
+    any.sin_family = AF_INET;
+    any.sin_addr.s_addr = htonl(INADDR_ANY);
+    int sockfd = transport_socket();
+    if(sockfd < 0 || transport_bind(sockfd, &any) < 0)
+    {
+        perror("Could not open replay socket");
+        return EXIT_FAILURE;
+    }
+    int bufsize = 8 << 20;
+    transport_setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+
+    static CaptureRecord recs[REPLAY_BATCH];
+    struct mmsghdr msgs[REPLAY_BATCH];
+    struct iovec iov[REPLAY_BATCH];
+    bzero(msgs, sizeof(msgs));
+    for(int i = 0; i < REPLAY_BATCH; i++)
+    {
+        msgs[i].msg_hdr.msg_name = &target;
+        msgs[i].msg_hdr.msg_namelen = sizeof(target);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        iov[i].iov_base = recs[i].data;
+    }
+
+    unsigned long sent = 0, replies = 0, skipped = 0;
+    uint64_t first_ns = 0, start_ns = monotonic_ns();
+    int pending = 0;
+
+    for(uint64_t seq = capture_first_seq(capture); seq < capture_end_seq(capture); seq++)
+    {
+        CaptureRecord *rec = &recs[pending];
+        if(capture_read(capture, seq, rec) < 0)
+        {
+            skipped++;
+            continue;
+        }
+        if(rec->dir != dir)
+            continue;
+
+        if(first_ns == 0)
+            first_ns = rec->timestamp_ns;
+        iov[pending].iov_len = rec->len;
+        pending++;
+
+        // Paced replay sends each datagram at its recorded offset; at max
+        // speed they go out a batch at a time
+        if(!max_speed)
+        {
+            replies += drain_replies(sockfd);
+            sleep_until_ns(start_ns + (uint64_t) ((rec->timestamp_ns - first_ns) / speed));
+        }
+        if(!max_speed || pending == REPLAY_BATCH)
+        {
+            int n = transport_sendmmsg(sockfd, msgs, pending, 0);
+            sent += n > 0 ? n : 0;
+            pending = 0;
+            replies += drain_replies(sockfd);
+        }
+    }
+    if(pending > 0)
+    {
+        int n = transport_sendmmsg(sockfd, msgs, pending, 0);
+        sent += n > 0 ? n : 0;
+    }
+
+    double elapsed = (monotonic_ns() - start_ns) / 1e9;
+
+    // Give the bank a moment to answer the last requests
+    uint64_t give_up_ns = monotonic_ns() + 1000000000;
+    while(replies < sent)
+    {
+        uint64_t now_ns = monotonic_ns();
+        if(now_ns >= give_up_ns)
+            break;
+        struct timespec timeout = { (give_up_ns - now_ns) / 1000000000, (give_up_ns - now_ns) % 1000000000 };
+        struct pollfd pfd = { sockfd, POLLIN, 0 };
+        if(transport_poll(&pfd, 1, &timeout) <= 0)
+            break;
+        replies += drain_replies(sockfd);
+    }
+
+    printf("replayed %lu datagrams in %.3fs (%.0f/s), %lu replies, %lu records unreadable\n",
+           sent, elapsed, elapsed > 0 ? sent / elapsed : 0, replies, skipped);
+
+    transport_close(sockfd);
+    capture_close(capture);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,138 @@
+#include "route.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define INITIAL_ROUTES 16
+
+static uint64_t endpoint_key(const struct sockaddr_in *addr)
+{
+    return ((uint64_t) addr->sin_addr.s_addr << 16) | addr->sin_port;
+}
+
+// Fibonacci hashing: spreads consecutive ports across the whole table
+static uint32_t endpoint_slot(uint64_t key, uint32_t num_slots)
+{
+    return (uint32_t) ((key * 0x9E3779B97F4A7C15ULL) >> 32) & (num_slots - 1);
+}
+
+RouteTable* route_table_create()
+{
+    RouteTable *table = (RouteTable*) malloc(sizeof(RouteTable));
+    if(table == NULL)
+        return NULL;
+
+    table->num_routes = 0;
+    table->max_routes = INITIAL_ROUTES;
+    table->routes = (Route*) malloc(sizeof(Route) * table->max_routes);
+
+    // Keep the load factor at or below 1/2 so probe sequences stay short
+    table->num_slots = INITIAL_ROUTES * 2;
+    table->slots = (int32_t*) malloc(sizeof(int32_t) * table->num_slots);
+
+    if(table->routes == NULL || table->slots == NULL)
+    {
+        route_table_free(table);
+        return NULL;
+    }
+    memset(table->slots, -1, sizeof(int32_t) * table->num_slots);
+
+    return table;
+}
+
+void route_table_free(RouteTable *table)
+{
+    if(table != NULL)
+    {
+        free(table->routes);
+        free(table->slots);
+        free(table);
+    }
+}
+
+static void insert_slot(RouteTable *table, int32_t idx)
+{
+    uint32_t slot = endpoint_slot(endpoint_key(&table->routes[idx].client), table->num_slots);
+    while(table->slots[slot] != -1)
+        slot = (slot + 1) & (table->num_slots - 1);
+    table->slots[slot] = idx;
+}
+
+static int grow(RouteTable *table)
+{
+    uint32_t max_routes = table->max_routes * 2;
+    Route *routes = (Route*) realloc(table->routes, sizeof(Route) * max_routes);
+    if(routes == NULL)
+        return -1;
+    table->routes = routes;
+    table->max_routes = max_routes;
+
+    int32_t *slots = (int32_t*) malloc(sizeof(int32_t) * max_routes * 2);
+    if(slots == NULL)
+        return -1;
+    free(table->slots);
+    table->slots = slots;
+    table->num_slots = max_routes * 2;
+    memset(table->slots, -1, sizeof(int32_t) * table->num_slots);
+
+    for(uint32_t i = 0; i < table->num_routes; i++)
+        insert_slot(table, i);
+    return 0;
+}
+
+// Returns 0 on success; -1 if the client already has a route or on error
+int route_table_add(RouteTable *table, const struct sockaddr_in *client, const struct sockaddr_in *server)
+{
+    if(route_table_find(table, client) != NULL)
+        return -1;
+    if(table->num_routes == table->max_routes && grow(table) < 0)
+        return -1;
+
+    Route *route = &table->routes[table->num_routes];
+    route->client = *client;
+    route->server = *server;
+    route->upstream_fd = -1;
+    insert_slot(table, table->num_routes);
+    table->num_routes++;
+    return 0;
+}
+
+Route* route_table_find(const RouteTable *table, const struct sockaddr_in *client)
+{
+    uint64_t key = endpoint_key(client);
+    uint32_t slot = endpoint_slot(key, table->num_slots);
+
+    while(table->slots[slot] != -1)
+    {
+        Route *route = &table->routes[table->slots[slot]];
+        if(endpoint_key(&route->client) == key)
+            return route;
+        slot = (slot + 1) & (table->num_slots - 1);
+    }
+    return NULL;
+}
+
+// Parse "a.b.c.d:port" into addr. Returns 0 on success; -1 on error
+int parse_endpoint(const char *str, struct sockaddr_in *addr)
+{
+    char host[INET_ADDRSTRLEN];
+    const char *colon = strrchr(str, ':');
+    if(colon == NULL || colon == str || (size_t) (colon - str) >= sizeof(host))
+        return -1;
+
+    memcpy(host, str, colon - str);
+    host[colon - str] = '\0';
+
+    char *end;
+    long port = strtol(colon + 1, &end, 10);
+    if(*end != '\0' || port <= 0 || port > 65535)
+        return -1;
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons((unsigned short) port);
+    if(inet_pton(AF_INET, host, &addr->sin_addr) != 1)
+        return -1;
+    return 0;
+}
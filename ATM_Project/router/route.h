@@ -0,0 +1,47 @@
+/*
+ * The routing table maps client endpoints (ATMs) to the server
+ * endpoint (bank) their traffic is forwarded to.
+ *
+ * Each route owns an upstream socket on the router.  Packets from the
+ * client are sent to the server from that socket, so whatever the
+ * server sends back to it belongs to that client.  Lookups by client
+ * address go through an open-addressing hash on (ip, port), so the
+ * per-packet cost does not depend on the number of routes.
+ *
+ * Routes are loaded from the router's config file, one per line:
+ *
+ *     # <client ip:port>      <server ip:port>
+ *     route 127.0.0.1:32002  127.0.0.1:32001
+ */
+
+#ifndef __ROUTE_H__
+#define __ROUTE_H__
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+typedef struct _Route
+{
+    struct sockaddr_in client;
+    struct sockaddr_in server;
+    int upstream_fd;
+} Route;
+
+typedef struct _RouteTable
+{
+    uint32_t num_routes;
+    uint32_t max_routes;
+    Route *routes;
+
+    // Open-addressing index into routes[]; -1 marks an empty slot
+    uint32_t num_slots;
+    int32_t *slots;
+} RouteTable;
+
+RouteTable* route_table_create();
+void route_table_free(RouteTable *table);
+int route_table_add(RouteTable *table, const struct sockaddr_in *client, const struct sockaddr_in *server);
+Route* route_table_find(const RouteTable *table, const struct sockaddr_in *client);
+int parse_endpoint(const char *str, struct sockaddr_in *addr);
+
+#endif
@@ -4,45 +4,119 @@
  * For the first part of the project, you may not change this.
  *
  * For the second part of the project, feel free to change as necessary.
+ *
+ * Usage:  router [-c <config>] [-t <threads>] [-b <batch>] [-s <seconds>]
+ *                [-w <capture file> [-W <records>]]
+ *
+ *   -c  config file with routes (see route.h) and impairments (see
+ *       impair.h); by default the ATM on ATM_PORT is routed to the
+ *       bank on BANK_PORT without impairment
+ *   -t  number of forwarding threads (default 1)
+ *   -b  packets moved per recvmmsg/sendmmsg (default 32)
+ *   -s  print traffic counters every <seconds> seconds
+ *   -w  record every forwarded datagram to a capture file that holds
+ *       the last <records> datagrams (default 8192); see router-replay
+ *
+ * The counters are also printed on SIGUSR1 and on exit.
  */
 
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
 #include "router.h"
 #include "ports.h"
 
-int main(int argc, char**argv)
+static void usage(void)
 {
-   int n;
-   char mesg[1000];
-   struct sockaddr_in incoming_addr;
+    fprintf(stderr, "Usage:  router [-c <config>] [-t <threads>] [-b <batch>] [-s <seconds>]\n"
+                    "               [-w <capture file> [-W <records>]]\n");
+    exit(1);
+}
 
-   Router *router = router_create();
+int main(int argc, char**argv)
+{
+   int num_threads = 1;
+   int batch_size = ROUTER_DEFAULT_BATCH;
+   int interval = 0;
+   char *config_file = NULL;
+   char *capture_file = NULL;
+   long capture_slots = CAPTURE_DEFAULT_SLOTS;
+   int opt;
 
-   while(1)
+   while((opt = getopt(argc, argv, "c:t:b:s:w:W:")) != -1)
    {
-       n = router_recv(router, mesg, 1000, &incoming_addr);
-
-       unsigned short incoming_port = ntohs(incoming_addr.sin_port);
-
-       // Packet from the ATM: forward it to the bank
-       if(incoming_port == ATM_PORT)
+       switch(opt)
        {
-           router_sendto_bank(router, mesg, n);
+           case 'c': config_file = optarg; break;
+           case 't': num_threads = atoi(optarg); break;
+           case 'b': batch_size = atoi(optarg); break;
+           case 's': interval = atoi(optarg); break;
+           case 'w': capture_file = optarg; break;
+           case 'W': capture_slots = atol(optarg); break;
+           default: usage();
        }
+   }
+   if(num_threads < 1 || num_threads > ROUTER_MAX_THREADS ||
+      batch_size < 1 || batch_size > ROUTER_MAX_BATCH || interval < 0 ||
+      capture_slots < 1 || capture_slots > UINT32_MAX)
+       usage();
+
+   // Handle signals synchronously here; the workers inherit the blocked mask
+   sigset_t signals;
+   sigemptyset(&signals);
+   sigaddset(&signals, SIGINT);
+   sigaddset(&signals, SIGTERM);
+   sigaddset(&signals, SIGHUP);
+   sigaddset(&signals, SIGUSR1);
+   pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+   TRACE_OPEN("router");
+
+   Router *router = router_create();
+   if(config_file != NULL && router_load_config(router, config_file) < 0)
+       return EXIT_FAILURE;
+   if(capture_file != NULL && (router->capture = capture_create(capture_file, capture_slots)) == NULL)
+       return EXIT_FAILURE;
+   if(router_start(router, num_threads, batch_size) < 0)
+       return EXIT_FAILURE;
+
+   RouterCounters last[NUM_DIRS] = {{0}};
+   uint64_t unknown_drops;
 
-       // Packet from the bank: forward it to the ATM
-       else if(incoming_port == BANK_PORT)
+   while(1)
+   {
+       int sig;
+       if(interval > 0)
        {
-           router_sendto_atm(router, mesg, n);
+           struct timespec timeout = { interval, 0 };
+           sig = sigtimedwait(&signals, NULL, &timeout);
        }
-
        else
+           sig = sigwaitinfo(&signals, NULL);
+
+       if(sig == SIGUSR1)
+           router_print_stats(router, stderr);
+       else if(sig > 0)
+           break;
+       else if(interval > 0)
        {
-           fprintf(stderr, "> I don't know who this came from: dropping it\n");
+           RouterCounters now[NUM_DIRS];
+           router_get_counters(router, now, &unknown_drops);
+           fprintf(stderr, "> atm->bank %.0f pkt/s, bank->atm %.0f pkt/s, drops %lu\n",
+                   (double) (now[DIR_ATM_TO_BANK].packets - last[DIR_ATM_TO_BANK].packets) / interval,
+                   (double) (now[DIR_BANK_TO_ATM].packets - last[DIR_BANK_TO_ATM].packets) / interval,
+                   (unsigned long) (now[DIR_ATM_TO_BANK].drops + now[DIR_BANK_TO_ATM].drops + unknown_drops));
+           memcpy(last, now, sizeof(last));
        }
    }
 
+   router_print_stats(router, stderr);
+   router_free(router);
+   TRACE_CLOSE();
+
    return EXIT_SUCCESS;
 }
@@ -3,6 +3,35 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+// Counters have a single writer (their worker), so a relaxed store is enough
+// for readers on other threads to see a consistent value.
+#define COUNTER_ADD(field, n) __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+#define COUNTER_GET(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+static const char *dir_names[NUM_DIRS] = { "atm->bank", "bank->atm" };
+
+// Timer wheel resolution and size: 1ms ticks, about two seconds per revolution
+#define WHEEL_TICK_US 1000
+#define WHEEL_SLOTS 2048
+
+static uint64_t realtime_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
 Router* router_create()
 {
@@ -13,14 +42,18 @@ Router* router_create()
         exit(1);
     }
 
-    router->sockfd = socket(AF_INET,SOCK_DGRAM,0);
+    router->sockfd = transport_socket();
+
+    // Let the forwarding workers bind their own sockets to the same port
+    int one = 1;
+    transport_setsockopt(router->sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
 
     // Initialize router's address
     bzero(&router->rtr_addr,sizeof(router->rtr_addr));
     router->rtr_addr.sin_family = AF_INET;
     router->rtr_addr.sin_addr.s_addr=htonl(INADDR_ANY);
     router->rtr_addr.sin_port=htons(ROUTER_PORT);
-    bind(router->sockfd,(struct sockaddr *)&router->rtr_addr,sizeof(router->rtr_addr));
+    transport_bind(router->sockfd, &router->rtr_addr);
 
     // Initialize Bank's address
     bzero(&router->bank_addr,sizeof(router->bank_addr));
@@ -34,6 +67,28 @@ Router* router_create()
     router->atm_addr.sin_addr.s_addr=htonl(INADDR_ANY);
     router->atm_addr.sin_port=htons(ATM_PORT);
 
+    // Default route: the one ATM on ATM_PORT talks to the one bank on BANK_PORT
+    struct sockaddr_in client, server;
+    bzero(&client, sizeof(client));
+    client.sin_family = AF_INET;
+    client.sin_addr.s_addr = inet_addr("127.0.0.1");
+    client.sin_port = htons(ATM_PORT);
+    server = client;
+    server.sin_port = htons(BANK_PORT);
+    router->routes = route_table_create();
+    if(router->routes == NULL || route_table_add(router->routes, &client, &server) < 0)
+    {
+        perror("Could not create routing table");
+        exit(1);
+    }
+
+    memset(router->impair, 0, sizeof(router->impair));
+    router->capture = NULL;
+    router->batch_size = ROUTER_DEFAULT_BATCH;
+    router->num_workers = 0;
+    router->workers = NULL;
+    router->stop_fd = -1;
+
     return router;
 }
 
@@ -41,27 +96,697 @@ void router_free(Router *router)
 {
     if(router != NULL)
     {
-        close(router->sockfd);
+        router_stop(router);
+        route_table_free(router->routes);
+        capture_close(router->capture);
+        transport_close(router->sockfd);
         free(router);
     }
 }
 
 ssize_t router_recv(Router *router, char *data, size_t max_len, struct sockaddr_in *sender)
 {
-    socklen_t len = 0;
-    if(sender != NULL)
-        len = sizeof(*sender);
-    return recvfrom(router->sockfd, data, max_len, 0, (struct sockaddr*) sender, &len);
+    return transport_recvfrom(router->sockfd, data, max_len, 0, sender);
 }
 
 ssize_t router_sendto_atm(Router *router, char *data, size_t len)
 {
-    return sendto(router->sockfd, data, len, 0,
-           (struct sockaddr *)&router->atm_addr, sizeof(router->atm_addr));
+    return transport_sendto(router->sockfd, data, len, 0, &router->atm_addr);
 }
 
 ssize_t router_sendto_bank(Router *router, char *data, size_t len)
 {
-    return sendto(router->sockfd, data, len, 0,
-           (struct sockaddr *)&router->bank_addr, sizeof(router->bank_addr));
+    return transport_sendto(router->sockfd, data, len, 0, &router->bank_addr);
+}
+
+// epoll tags for the sockets a worker waits on; anything else is a route index
+#define EV_STOP UINT64_MAX
+#define EV_FRONT (UINT64_MAX - 1)
+
+// Send out_msgs[start..end) on fd and account for them. A message the kernel
+// refuses is counted as a drop and skipped so the rest of the batch still goes out.
+static void send_batch(RouterWorker *w, int fd, int start, int end)
+{
+    int sent = start;
+    while(sent < end)
+    {
+        int n = transport_sendmmsg(fd, w->out_msgs + sent, end - sent, 0);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            COUNTER_ADD(w->counters[w->out_dirs[sent]].drops, 1);
+            sent++;
+            continue;
+        }
+
+        Capture *capture = w->router->capture;
+        uint64_t timestamp_ns = capture != NULL ? realtime_ns() : 0;
+
+        for(int i = sent; i < sent + n; i++)
+        {
+            RouterCounters *c = &w->counters[w->out_dirs[i]];
+            TRACE_SPAN(trace_id_of(w->out_iov[i].iov_base, w->out_iov[i].iov_len),
+                       w->out_dirs[i] == DIR_ATM_TO_BANK ? TRACE_ROUTER_REQUEST : TRACE_ROUTER_REPLY,
+                       w->out_start_ns[i]);
+            COUNTER_ADD(c->packets, 1);
+            COUNTER_ADD(c->bytes, w->out_iov[i].iov_len);
+            if(capture != NULL)
+                capture_write(capture, w->out_dirs[i], w->out_iov[i].iov_base, w->out_iov[i].iov_len, timestamp_ns);
+        }
+        sent += n;
+    }
+}
+
+// Queue in_bufs[i] as the next outgoing message
+static void queue_out(RouterWorker *w, int *count, int i, int fd, struct sockaddr_in *dest, Direction dir)
+{
+    int k = (*count)++;
+    w->out_msgs[k].msg_hdr.msg_name = dest;
+    w->out_msgs[k].msg_hdr.msg_namelen = sizeof(*dest);
+    w->out_iov[k].iov_base = w->in_bufs[i];
+    w->out_iov[k].iov_len = w->in_msgs[i].msg_len;
+    w->out_fds[k] = fd;
+    w->out_dirs[k] = dir;
+    w->out_start_ns[k] = w->recv_ns;
+}
+
+// Copy in_bufs[i] onto the timer wheel to be sent at due_us.
+// Returns 0 on success; -1 if the worker already holds too many packets
+static int delay_packet(RouterWorker *w, int i, int fd, struct sockaddr_in *dest, Direction dir, uint64_t due_us)
+{
+    DelayedPacket *pkt = w->free_packets;
+    if(pkt != NULL)
+        w->free_packets = pkt->next_free;
+    else if(w->num_delayed < ROUTER_MAX_DELAYED)
+    {
+        pkt = (DelayedPacket*) malloc(sizeof(DelayedPacket));
+        if(pkt == NULL)
+            return -1;
+        w->num_delayed++;
+    }
+    else
+        return -1;
+
+    pkt->fd = fd;
+    pkt->dest = *dest;
+    pkt->dir = dir;
+    pkt->len = w->in_msgs[i].msg_len;
+    pkt->received_ns = w->recv_ns;
+    memcpy(pkt->data, w->in_bufs[i], pkt->len);
+    timer_wheel_add(w->wheel, &pkt->timer, due_us);
+    return 0;
+}
+
+// Pass in_bufs[i] through the impairment stage for its direction: it is
+// dropped, sent now, or parked on the timer wheel (possibly twice)
+static void route_packet(RouterWorker *w, int *count, int i, int fd, struct sockaddr_in *dest, Direction dir)
+{
+    ImpairConfig *impair = &w->router->impair[dir];
+    RouterCounters *c = &w->counters[dir];
+
+    if(!impair->enabled)
+    {
+        queue_out(w, count, i, fd, dest, dir);
+        return;
+    }
+
+    if(impair->loss > 0 && impair_random(&w->rng) < impair->loss)
+    {
+        COUNTER_ADD(c->lost, 1);
+        return;
+    }
+
+    int copies = 1;
+    if(impair->duplicate > 0 && impair_random(&w->rng) < impair->duplicate)
+    {
+        COUNTER_ADD(c->duplicated, 1);
+        copies = 2;
+    }
+
+    for(int k = 0; k < copies; k++)
+    {
+        int reordered;
+        uint64_t due_us = impair_departure(impair, w->now_us, w->in_msgs[i].msg_len, &w->rng, &reordered);
+        if(reordered)
+            COUNTER_ADD(c->reordered, 1);
+
+        if(due_us <= w->now_us)
+            queue_out(w, count, i, fd, dest, dir);
+        else if(delay_packet(w, i, fd, dest, dir, due_us) < 0)
+            COUNTER_ADD(c->drops, 1);
+    }
+}
+
+// Send out_msgs[0..count), one sendmmsg per run of messages sharing a socket
+static void send_grouped(RouterWorker *w, int count)
+{
+    int start = 0;
+    for(int i = 1; i <= count; i++)
+    {
+        if(i == count || w->out_fds[i] != w->out_fds[start])
+        {
+            send_batch(w, w->out_fds[start], start, i);
+            start = i;
+        }
+    }
+}
+
+// Send every delayed packet whose timer has fired and recycle it
+static void release_delayed(RouterWorker *w)
+{
+    TimerEntry *entry = timer_wheel_expire(w->wheel, now_us());
+
+    while(entry != NULL)
+    {
+        DelayedPacket *sent[ROUTER_MAX_BATCH];
+        int count = 0;
+
+        while(entry != NULL && count < ROUTER_MAX_BATCH)
+        {
+            DelayedPacket *pkt = (DelayedPacket*) entry;
+            entry = entry->next;
+
+            w->out_msgs[count].msg_hdr.msg_name = &pkt->dest;
+            w->out_msgs[count].msg_hdr.msg_namelen = sizeof(pkt->dest);
+            w->out_iov[count].iov_base = pkt->data;
+            w->out_iov[count].iov_len = pkt->len;
+            w->out_fds[count] = pkt->fd;
+            w->out_dirs[count] = pkt->dir;
+            w->out_start_ns[count] = pkt->received_ns;
+            sent[count++] = pkt;
+        }
+
+        send_grouped(w, count);
+
+        for(int i = 0; i < count; i++)
+        {
+            sent[i]->next_free = w->free_packets;
+            w->free_packets = sent[i];
+        }
+    }
+}
+
+// Receive up to batch_size packets from fd into in_bufs.
+// Returns the number of packets received; 0 once the socket is drained
+static int recv_batch(RouterWorker *w, int fd)
+{
+    for(int i = 0; i < w->router->batch_size; i++)
+        w->in_msgs[i].msg_hdr.msg_namelen = sizeof(w->in_addrs[i]);
+
+    int n = transport_recvmmsg(fd, w->in_msgs, w->router->batch_size, MSG_DONTWAIT);
+    w->recv_ns = TRACE_NOW();
+    return n < 0 ? 0 : n;
+}
+
+// Packets from the ATMs: look up each sender's route and forward it to the
+// bank through that route's upstream socket
+static int forward_from_clients(RouterWorker *w)
+{
+    RouteTable *routes = w->router->routes;
+    int n = recv_batch(w, w->sockfd);
+    int count = 0;
+
+    w->now_us = now_us();
+    for(int i = 0; i < n; i++)
+    {
+        Route *route = route_table_find(routes, &w->in_addrs[i]);
+        if(route == NULL)
+        {
+            fprintf(stderr, "> I don't know who this came from: dropping it\n");
+            COUNTER_ADD(w->unknown_drops, 1);
+            continue;
+        }
+        route_packet(w, &count, i, route->upstream_fd, &route->server, DIR_ATM_TO_BANK);
+    }
+
+    // Consecutive packets for the same route share one sendmmsg
+    send_grouped(w, count);
+    return n;
+}
+
+// Packets from the bank on a route's upstream socket: forward them to the
+// ATM that owns the route
+static int forward_from_server(RouterWorker *w, Route *route)
+{
+    int n = recv_batch(w, route->upstream_fd);
+    int count = 0;
+
+    w->now_us = now_us();
+    for(int i = 0; i < n; i++)
+    {
+        if(w->in_addrs[i].sin_addr.s_addr != route->server.sin_addr.s_addr ||
+           w->in_addrs[i].sin_port != route->server.sin_port)
+        {
+            fprintf(stderr, "> I don't know who this came from: dropping it\n");
+            COUNTER_ADD(w->unknown_drops, 1);
+            continue;
+        }
+        route_packet(w, &count, i, w->sockfd, &route->client, DIR_BANK_TO_ATM);
+    }
+
+    send_batch(w, w->sockfd, 0, count);
+    return n;
+}
+
+static void* worker_main(void *arg)
+{
+    RouterWorker *w = (RouterWorker*) arg;
+    Router *router = w->router;
+    struct epoll_event events[ROUTER_MAX_BATCH];
+
+    while(1)
+    {
+        int timeout = w->wheel != NULL ? timer_wheel_timeout_ms(w->wheel, now_us()) : -1;
+        int n = epoll_wait(w->epfd, events, ROUTER_MAX_BATCH, timeout);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        // Level-triggered: drain whatever is queued now, then wait again
+        for(int i = 0; i < n; i++)
+        {
+            uint64_t tag = events[i].data.u64;
+            if(tag == EV_STOP)
+                return NULL;
+            else if(tag == EV_FRONT)
+                while(forward_from_clients(w) == router->batch_size);
+            else
+                while(forward_from_server(w, &router->routes->routes[tag]) == router->batch_size);
+        }
+
+        if(w->wheel != NULL)
+            release_delayed(w);
+    }
+
+    return NULL;
+}
+
+// The same loop for shm endpoints, which epoll cannot watch: the one worker
+// waits on all of them, and the stop eventfd, in transport_poll
+static void* poll_worker_main(void *arg)
+{
+    RouterWorker *w = (RouterWorker*) arg;
+    Router *router = w->router;
+    RouteTable *routes = router->routes;
+    nfds_t nfds = 2 + routes->num_routes;
+
+    struct pollfd *fds = (struct pollfd*) calloc(nfds, sizeof(struct pollfd));
+    if(fds == NULL)
+    {
+        perror("Could not allocate router poll set");
+        return NULL;
+    }
+    fds[0].fd = router->stop_fd;
+    fds[1].fd = w->sockfd;
+    for(uint32_t i = 0; i < routes->num_routes; i++)
+        fds[2 + i].fd = routes->routes[i].upstream_fd;
+    for(nfds_t i = 0; i < nfds; i++)
+        fds[i].events = POLLIN;
+
+    while(1)
+    {
+        int timeout_ms = w->wheel != NULL ? timer_wheel_timeout_ms(w->wheel, now_us()) : -1;
+        struct timespec timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+        if(transport_poll(fds, nfds, timeout_ms < 0 ? NULL : &timeout) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            perror("transport_poll");
+            break;
+        }
+
+        if(fds[0].revents & POLLIN)
+            break;
+        if(fds[1].revents & POLLIN)
+            while(forward_from_clients(w) == router->batch_size);
+        for(uint32_t i = 0; i < routes->num_routes; i++)
+        {
+            if(fds[2 + i].revents & POLLIN)
+                while(forward_from_server(w, &routes->routes[i]) == router->batch_size);
+        }
+
+        if(w->wheel != NULL)
+            release_delayed(w);
+    }
+
+    free(fds);
+    return NULL;
+}
+
+static void watch(RouterWorker *w, int fd, uint64_t tag)
+{
+    if(transport_kind() == TRANSPORT_SHM)
+        return;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = tag;
+    epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int worker_init(Router *router, RouterWorker *w, int id)
+{
+    int one = 1;
+
+    w->router = router;
+    w->id = id;
+
+    // Worker 0 reuses the router's own socket so no packets are stranded on
+    // it, and without SO_REUSEPORT the other workers share it too
+    if(id == 0 || transport_kind() == TRANSPORT_UNIX || transport_kind() == TRANSPORT_SHM)
+        w->sockfd = router->sockfd;
+    else
+    {
+        w->sockfd = transport_socket();
+        if(w->sockfd < 0)
+            return -1;
+        transport_setsockopt(w->sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+        if(transport_bind(w->sockfd, &router->rtr_addr) < 0)
+        {
+            transport_close(w->sockfd);
+            return -1;
+        }
+    }
+
+    w->epfd = epoll_create1(0);
+    if(w->epfd < 0)
+        return -1;
+    watch(w, w->sockfd, EV_FRONT);
+    watch(w, router->stop_fd, EV_STOP);
+
+    // Only pay for the timer wheel if some direction is impaired
+    if(router->impair[DIR_ATM_TO_BANK].enabled || router->impair[DIR_BANK_TO_ATM].enabled)
+    {
+        w->wheel = timer_wheel_create(WHEEL_TICK_US, WHEEL_SLOTS, now_us());
+        if(w->wheel == NULL)
+            return -1;
+    }
+    w->rng = now_us() * 2654435761u + id + 1;
+    w->free_packets = NULL;
+    w->num_delayed = 0;
+
+    for(int i = 0; i < 2 * ROUTER_MAX_BATCH; i++)
+    {
+        w->out_msgs[i].msg_hdr.msg_iov = &w->out_iov[i];
+        w->out_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    for(int i = 0; i < ROUTER_MAX_BATCH; i++)
+    {
+        w->in_iov[i].iov_base = w->in_bufs[i];
+        w->in_iov[i].iov_len = ROUTER_MAX_PACKET;
+        w->in_msgs[i].msg_hdr.msg_name = &w->in_addrs[i];
+        w->in_msgs[i].msg_hdr.msg_namelen = sizeof(w->in_addrs[i]);
+        w->in_msgs[i].msg_hdr.msg_iov = &w->in_iov[i];
+        w->in_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    return 0;
+}
+
+// Open each route's upstream socket and hand it to a worker, round-robin
+static int open_upstreams(Router *router)
+{
+    struct sockaddr_in any;
+    bzero(&any, sizeof(any));
+    any.sin_family = AF_INET;
+    any.sin_addr.s_addr = htonl(INADDR_ANY);
+    any.sin_port = 0;
+
+    for(uint32_t i = 0; i < router->routes->num_routes; i++)
+    {
+        Route *route = &router->routes->routes[i];
+        route->upstream_fd = transport_socket();
+        if(route->upstream_fd < 0 || transport_bind(route->upstream_fd, &any) < 0)
+            return -1;
+        watch(&router->workers[i % router->num_workers], route->upstream_fd, i);
+    }
+    return 0;
+}
+
+// Parse an impair line's direction and options into the router's config
+static int parse_impair(Router *router, char *dir)
+{
+    int first, last;
+    if(strcmp(dir, "atm->bank") == 0)
+        first = last = DIR_ATM_TO_BANK;
+    else if(strcmp(dir, "bank->atm") == 0)
+        first = last = DIR_BANK_TO_ATM;
+    else if(strcmp(dir, "both") == 0)
+    {
+        first = DIR_ATM_TO_BANK;
+        last = DIR_BANK_TO_ATM;
+    }
+    else
+        return -1;
+
+    char *option;
+    while((option = strtok(NULL, " \t\r\n")) != NULL)
+    {
+        for(int d = first; d <= last; d++)
+        {
+            char copy[128];
+            snprintf(copy, sizeof(copy), "%s", option);
+            if(impair_parse(&router->impair[d], copy) < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+// Load the router's config file: its routes replace the default
+// ATM_PORT -> BANK_PORT route, and any impair lines switch on the
+// impairment stage. Must be called before router_start().
+// Prints the offending line and returns negative on error
+int router_load_config(Router *router, const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if(fp == NULL)
+    {
+        perror("Error opening router config");
+        return -1;
+    }
+
+    RouteTable *routes = route_table_create();
+    char line[1024];
+    int lineno = 0;
+    int ret = routes != NULL ? 0 : -1;
+
+    while(ret == 0 && fgets(line, sizeof(line), fp) != NULL)
+    {
+        lineno++;
+
+        char *comment = strchr(line, '#');
+        if(comment != NULL)
+            *comment = '\0';
+
+        char *keyword = strtok(line, " \t\r\n");
+        if(keyword == NULL)
+            continue;
+
+        if(strcmp(keyword, "route") == 0)
+        {
+            char *client_str = strtok(NULL, " \t\r\n");
+            char *server_str = strtok(NULL, " \t\r\n");
+            struct sockaddr_in client, server;
+
+            if(client_str == NULL || server_str == NULL || strtok(NULL, " \t\r\n") != NULL ||
+               parse_endpoint(client_str, &client) < 0 || parse_endpoint(server_str, &server) < 0)
+            {
+                fprintf(stderr, "%s:%d: expected 'route <client ip:port> <server ip:port>'\n", path, lineno);
+                ret = -1;
+            }
+            else if(route_table_add(routes, &client, &server) < 0)
+            {
+                fprintf(stderr, "%s:%d: duplicate route for %s\n", path, lineno, client_str);
+                ret = -1;
+            }
+        }
+        else if(strcmp(keyword, "impair") == 0)
+        {
+            char *dir = strtok(NULL, " \t\r\n");
+            if(dir == NULL || parse_impair(router, dir) < 0)
+            {
+                fprintf(stderr, "%s:%d: expected 'impair <atm->bank|bank->atm|both> <key>=<value> ...'\n", path, lineno);
+                ret = -1;
+            }
+        }
+        else
+        {
+            fprintf(stderr, "%s:%d: unknown directive '%s'\n", path, lineno, keyword);
+            ret = -1;
+        }
+    }
+    fclose(fp);
+
+    if(ret < 0)
+    {
+        route_table_free(routes);
+        return -1;
+    }
+
+    // A config with only impairments keeps the default route
+    if(routes->num_routes == 0)
+        route_table_free(routes);
+    else
+    {
+        route_table_free(router->routes);
+        router->routes = routes;
+    }
+    return 0;
+}
+
+// Start num_threads forwarding workers moving up to batch_size packets per syscall.
+// Returns 0 on success; negative on error
+int router_start(Router *router, int num_threads, int batch_size)
+{
+    if(num_threads < 1 || num_threads > ROUTER_MAX_THREADS ||
+       batch_size < 1 || batch_size > ROUTER_MAX_BATCH || router->workers != NULL)
+        return -1;
+
+    // An shm ring has a single consumer, and a tcp endpoint must only be used
+    // from one thread, yet every worker sends on the routes' shared upstreams
+    if((transport_kind() == TRANSPORT_SHM || transport_kind() == TRANSPORT_TCP) && num_threads > 1)
+    {
+        fprintf(stderr, "> %s transport: running 1 forwarding thread instead of %d\n",
+                transport_kind() == TRANSPORT_SHM ? "shm" : "tcp", num_threads);
+        num_threads = 1;
+    }
+
+    router->batch_size = batch_size;
+    router->stop_fd = eventfd(0, 0);
+    router->workers = (RouterWorker*) calloc(num_threads, sizeof(RouterWorker));
+    if(router->stop_fd < 0 || router->workers == NULL)
+    {
+        perror("Could not start router workers");
+        return -1;
+    }
+
+    for(int i = 0; i < num_threads; i++)
+    {
+        if(worker_init(router, &router->workers[i], i) < 0)
+        {
+            perror("Could not set up router worker");
+            return -1;
+        }
+    }
+    router->num_workers = num_threads;
+
+    if(open_upstreams(router) < 0)
+    {
+        perror("Could not open upstream sockets");
+        return -1;
+    }
+
+    for(int i = 0; i < num_threads; i++)
+    {
+        void *(*loop)(void *) = transport_kind() == TRANSPORT_SHM ? poll_worker_main : worker_main;
+        if(pthread_create(&router->workers[i].thread, NULL, loop, &router->workers[i]) != 0)
+        {
+            perror("Could not create router worker");
+            exit(1);
+        }
+    }
+
+    return 0;
+}
+
+// Stop and join the forwarding workers started by router_start()
+void router_stop(Router *router)
+{
+    if(router->workers == NULL)
+        return;
+
+    uint64_t one = 1;
+    if(write(router->stop_fd, &one, sizeof(one)) != sizeof(one))
+        perror("Could not stop router workers");
+
+    // Every worker has stopped before any endpoint is closed
+    for(int i = 0; i < router->num_workers; i++)
+        pthread_join(router->workers[i].thread, NULL);
+
+    for(int i = 0; i < router->num_workers; i++)
+    {
+        RouterWorker *w = &router->workers[i];
+        close(w->epfd);
+
+        // Packets still on the wheel are simply dropped
+        TimerEntry *entry = w->wheel != NULL ? timer_wheel_expire(w->wheel, UINT64_MAX / 2) : NULL;
+        while(entry != NULL)
+        {
+            TimerEntry *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+        while(w->free_packets != NULL)
+        {
+            DelayedPacket *next = w->free_packets->next_free;
+            free(w->free_packets);
+            w->free_packets = next;
+        }
+        timer_wheel_free(w->wheel);
+        if(w->sockfd != router->sockfd)
+            transport_close(w->sockfd);
+    }
+
+    for(uint32_t i = 0; i < router->routes->num_routes; i++)
+    {
+        if(router->routes->routes[i].upstream_fd >= 0)
+            transport_close(router->routes->routes[i].upstream_fd);
+        router->routes->routes[i].upstream_fd = -1;
+    }
+
+    close(router->stop_fd);
+    free(router->workers);
+    router->workers = NULL;
+    router->num_workers = 0;
+    router->stop_fd = -1;
+}
+
+// Sum the per-worker counters into counters[] (and the unknown-source drops)
+void router_get_counters(Router *router, RouterCounters counters[NUM_DIRS], uint64_t *unknown_drops)
+{
+    memset(counters, 0, sizeof(RouterCounters) * NUM_DIRS);
+    *unknown_drops = 0;
+
+    for(int i = 0; i < router->num_workers; i++)
+    {
+        RouterWorker *w = &router->workers[i];
+        for(int d = 0; d < NUM_DIRS; d++)
+        {
+            counters[d].packets += COUNTER_GET(w->counters[d].packets);
+            counters[d].bytes += COUNTER_GET(w->counters[d].bytes);
+            counters[d].drops += COUNTER_GET(w->counters[d].drops);
+            counters[d].lost += COUNTER_GET(w->counters[d].lost);
+            counters[d].duplicated += COUNTER_GET(w->counters[d].duplicated);
+            counters[d].reordered += COUNTER_GET(w->counters[d].reordered);
+        }
+        *unknown_drops += COUNTER_GET(w->unknown_drops);
+    }
+}
+
+void router_print_stats(Router *router, FILE *out)
+{
+    RouterCounters counters[NUM_DIRS];
+    uint64_t unknown_drops;
+
+    router_get_counters(router, counters, &unknown_drops);
+    for(int d = 0; d < NUM_DIRS; d++)
+    {
+        fprintf(out, "%s: %lu packets, %lu bytes, %lu drops", dir_names[d],
+                (unsigned long) counters[d].packets, (unsigned long) counters[d].bytes,
+                (unsigned long) counters[d].drops);
+        if(router->impair[d].enabled)
+            fprintf(out, ", %lu lost, %lu duplicated, %lu reordered",
+                    (unsigned long) counters[d].lost, (unsigned long) counters[d].duplicated,
+                    (unsigned long) counters[d].reordered);
+        fprintf(out, "\n");
+    }
+    fprintf(out, "unknown source: %lu drops\n", (unsigned long) unknown_drops);
+    fflush(out);
 }
@@ -6,6 +6,22 @@
  *
  * For the second part of the project, you may modify the router to
  * try to violate the security of other team's protocols.
+ *
+ * router_recv/router_sendto_* forward one packet at a time on the
+ * router's main socket.  router_start() instead runs the forwarding
+ * engine: one or more worker threads, each with its own SO_REUSEPORT
+ * socket on ROUTER_PORT, waiting in epoll and moving packets in
+ * batches with recvmmsg/sendmmsg.  The sockets come from the transport
+ * (see transport.h): unix sockets cannot share a port, so there the
+ * workers share the router's socket, and shm endpoints cannot go into
+ * epoll and have a single consumer, so there one worker waits in
+ * transport_poll instead.  A tcp endpoint must only be used from one
+ * thread, and the routes' upstream endpoints are shared by every worker,
+ * so over tcp one worker runs too.  Where each packet goes is decided
+ * by the routing table (see route.h), and packets can optionally be
+ * delayed, dropped or duplicated on the way (see impair.h).  Every
+ * forwarded datagram can also be recorded to a capture file (see
+ * capture.h).
  */
 
 #ifndef __ROUTER_H__
@@ -14,7 +30,91 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#include "route.h"
+#include "impair.h"
+#include "capture.h"
+#include "util/timer_wheel.h"
+#include "util/trace.h"
+#include "util/transport.h"
+#include "encryption/frame.h"
+
+#define ROUTER_MAX_PACKET FRAME_MAX_SIZE
+#define ROUTER_MAX_BATCH 64
+#define ROUTER_DEFAULT_BATCH 32
+#define ROUTER_MAX_THREADS 64
+#define ROUTER_MAX_DELAYED 65536
+
+// Direction a packet is travelling in
+typedef enum
+{
+    DIR_ATM_TO_BANK = 0,
+    DIR_BANK_TO_ATM,
+    NUM_DIRS
+} Direction;
+
+// Per-direction traffic counters. Each worker owns its own copy so the
+// forwarding path never shares a cache line; readers sum them up.
+typedef struct _RouterCounters
+{
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t drops;
+
+    // Impairment emulation
+    uint64_t lost;
+    uint64_t duplicated;
+    uint64_t reordered;
+} RouterCounters;
+
+// A packet held back by the impairment stage until its timer fires
+typedef struct _DelayedPacket
+{
+    TimerEntry timer;
+    int fd;
+    struct sockaddr_in dest;
+    Direction dir;
+    size_t len;
+    uint64_t received_ns;       // for tracing
+    struct _DelayedPacket *next_free;
+    char data[ROUTER_MAX_PACKET];
+} DelayedPacket;
+
+struct _Router;
+
+typedef struct _RouterWorker
+{
+    struct _Router *router;
+    int id;
+    int sockfd;
+    int epfd;
+    pthread_t thread;
+
+    RouterCounters counters[NUM_DIRS];
+    uint64_t unknown_drops;
+
+    struct mmsghdr in_msgs[ROUTER_MAX_BATCH];
+    struct iovec in_iov[ROUTER_MAX_BATCH];
+    struct sockaddr_in in_addrs[ROUTER_MAX_BATCH];
+    char in_bufs[ROUTER_MAX_BATCH][ROUTER_MAX_PACKET];
+
+    // Room for every packet in a batch to be duplicated
+    struct mmsghdr out_msgs[2 * ROUTER_MAX_BATCH];
+    struct iovec out_iov[2 * ROUTER_MAX_BATCH];
+    int out_fds[2 * ROUTER_MAX_BATCH];
+    Direction out_dirs[2 * ROUTER_MAX_BATCH];
+    uint64_t out_start_ns[2 * ROUTER_MAX_BATCH];   // when each was received, for tracing
+    uint64_t recv_ns;
+
+    // Impairment stage: delayed packets wait on the wheel
+    TimerWheel *wheel;
+    uint64_t now_us;
+    uint64_t rng;
+    DelayedPacket *free_packets;
+    uint32_t num_delayed;
+} RouterWorker;
 
 typedef struct _Router
 {
@@ -22,6 +122,15 @@ typedef struct _Router
     struct sockaddr_in rtr_addr;
     struct sockaddr_in atm_addr;
     struct sockaddr_in bank_addr;
+
+    // Forwarding engine state
+    RouteTable *routes;
+    ImpairConfig impair[NUM_DIRS];
+    Capture *capture;
+    int batch_size;
+    int num_workers;
+    RouterWorker *workers;
+    int stop_fd;
 } Router;
 
 Router* router_create();
@@ -30,5 +139,10 @@ ssize_t router_recv(Router *rtr, char *data, size_t max_len, struct sockaddr_in
 ssize_t router_sendto_atm(Router *rtr, char *data, size_t len);
 ssize_t router_sendto_bank(Router *rtr, char *data, size_t len);
 
+int router_load_config(Router *rtr, const char *path);
+int router_start(Router *rtr, int num_threads, int batch_size);
+void router_stop(Router *rtr);
+void router_get_counters(Router *rtr, RouterCounters counters[NUM_DIRS], uint64_t *unknown_drops);
+void router_print_stats(Router *rtr, FILE *out);
 
 #endif
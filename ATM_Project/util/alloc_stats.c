@@ -0,0 +1,75 @@
+#include <stddef.h>
+#include <errno.h>
+#include "alloc_stats.h"
+
+// glibc's own entry points, which stay reachable after we take over the public names
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+static AllocStats counters;
+
+static inline void count_alloc(size_t size)
+{
+    __atomic_fetch_add(&counters.allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counters.bytes, size, __ATOMIC_RELAXED);
+}
+
+void alloc_stats_get(AllocStats *stats)
+{
+    stats->allocs = __atomic_load_n(&counters.allocs, __ATOMIC_RELAXED);
+    stats->frees = __atomic_load_n(&counters.frees, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&counters.bytes, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size)
+{
+    count_alloc(size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    count_alloc(nmemb * size);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    count_alloc(size);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    if(ptr != NULL)
+        __atomic_fetch_add(&counters.frees, 1, __ATOMIC_RELAXED);
+    __libc_free(ptr);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    count_alloc(size);
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    count_alloc(size);
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+    if(alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+
+    count_alloc(size);
+    void *p = __libc_memalign(alignment, size);
+    if(p == NULL)
+        return ENOMEM;
+    *ptr = p;
+    return 0;
+}
@@ -0,0 +1,30 @@
+/*
+ * Process-wide heap allocation counters.
+ *
+ * Linking alloc_stats.c into a program interposes on malloc, calloc,
+ * realloc, free and the aligned allocators, so every heap allocation the
+ * process makes is counted -- including those made inside libc and
+ * OpenSSL, which a -Wl,--wrap of our own objects would miss.  Each call
+ * is forwarded to glibc's allocator after one relaxed atomic add, so the
+ * counters are cheap enough to leave on in production builds.
+ *
+ * Comparing two snapshots taken around a batch of requests tells how many
+ * allocations each request cost; the request path should cost none.
+ */
+
+#ifndef __ALLOC_STATS_H__
+#define __ALLOC_STATS_H__
+
+#include <stdint.h>
+
+typedef struct _AllocStats
+{
+    uint64_t allocs;            // malloc, calloc, realloc and aligned allocations
+    uint64_t frees;             // free of a non-NULL pointer
+    uint64_t bytes;             // bytes requested by the allocations above
+} AllocStats;
+
+// Copies the counters for the whole process into stats
+void alloc_stats_get(AllocStats *stats);
+
+#endif
@@ -0,0 +1,211 @@
+/*
+ * Builds card vaults (see card_vault.h) and times lookups in them.
+ *
+ * Usage:  card-vault import <vault> <file>.card ...
+ *         card-vault bench [-n <lookups>] [-d <dir>] <vault>
+ *
+ *   import  copies each card file into the vault, creating it if need be,
+ *           under the file's name less its directory and .card; the card
+ *           files are left as they are.  The bank must not be running
+ *           with the same vault.
+ *   bench   looks up cards for names picked at random from the vault
+ *           (-n of them, default 100000, after 1000 untimed ones) and
+ *           reports the latency; with -d it also times reading the same
+ *           cards from <dir>/<name>.card, the way the ATM does without
+ *           a vault.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <libgen.h>
+#include <time.h>
+#include "card_vault.h"
+#include "histogram.h"
+
+#define WARMUP_LOOKUPS 1000
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage:  card-vault import <vault> <file>.card ...\n"
+                    "        card-vault bench [-n <lookups>] [-d <dir>] <vault>\n");
+    exit(1);
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int import(int argc, char **argv)
+{
+    if(argc < 2)
+        usage();
+    CardVault *vault = card_vault_open(argv[0], 1);
+    if(vault == NULL)
+    {
+        fprintf(stderr, "Could not open %s: %s\n", argv[0], strerror(errno));
+        return 1;
+    }
+
+    int failed = 0, imported = 0;
+    for(int i = 1; i < argc; i++)
+    {
+        char copy[CARD_VAULT_NAME_SIZE + 4096];
+        unsigned char card[CARD_VAULT_CARD_SIZE + 1];
+        snprintf(copy, sizeof(copy), "%s", argv[i]);
+        char *name = basename(copy);
+        size_t len = strlen(name);
+        if(len <= 5 || strcmp(name + len - 5, ".card") != 0)
+        {
+            fprintf(stderr, "%s: not a .card file\n", argv[i]);
+            failed++;
+            continue;
+        }
+        name[len - 5] = '\0';
+
+        FILE *f = fopen(argv[i], "rb");
+        size_t n = f != NULL ? fread(card, 1, sizeof(card), f) : 0;
+        if(f == NULL || n == 0 || n > CARD_VAULT_CARD_SIZE || card_vault_put(vault, name, card, n) < 0)
+        {
+            fprintf(stderr, "%s: %s\n", argv[i], f == NULL ? strerror(errno) : "could not import");
+            failed++;
+        }
+        else
+            imported++;
+        if(f != NULL)
+            fclose(f);
+    }
+    if(card_vault_sync(vault) < 0)
+    {
+        perror("Could not sync the vault");
+        failed = imported;
+    }
+    card_vault_close(vault);
+    printf("%d cards imported, %d failed\n", imported, failed);
+    return failed > 0;
+}
+
+static void report(const char *what, const Histogram *h)
+{
+    printf("%-6s %12.0f %9.0f %9.0f %9.0f %9.0f %9.0f %9.0f  ns\n", what,
+           1e9 / histogram_mean(h), histogram_mean(h), (double) histogram_percentile(h, 50),
+           (double) histogram_percentile(h, 90), (double) histogram_percentile(h, 99),
+           (double) histogram_percentile(h, 99.9), (double) h->max);
+}
+
+static int read_card_file(const char *dir, const char *name, unsigned char *card)
+{
+    char path[4096 + CARD_VAULT_NAME_SIZE];
+    snprintf(path, sizeof(path), "%s/%s.card", dir, name);
+    FILE *f = fopen(path, "rb");
+    if(f == NULL)
+        return -1;
+    size_t n = fread(card, 1, CARD_VAULT_CARD_SIZE, f);
+    fclose(f);
+    return n;
+}
+
+static int bench(int argc, char **argv)
+{
+    int lookups = 100000;
+    char *dir = NULL;
+    int opt;
+    optind = 1;
+    while((opt = getopt(argc, argv, "n:d:")) != -1)
+    {
+        if(opt == 'n')
+            lookups = atoi(optarg);
+        else if(opt == 'd')
+            dir = optarg;
+        else
+            usage();
+    }
+    if(optind != argc - 1 || lookups <= 0)
+        usage();
+
+    CardVault *vault = card_vault_open(argv[optind], 0);
+    if(vault == NULL)
+    {
+        fprintf(stderr, "Could not open %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+    uint32_t records = vault->header->records;
+    if(records == 0)
+    {
+        fprintf(stderr, "%s holds no cards\n", argv[optind]);
+        card_vault_close(vault);
+        return 1;
+    }
+
+    // The same random names for both, drawn from every record written
+    uint32_t *picks = (uint32_t *) malloc((WARMUP_LOOKUPS + lookups) * sizeof(uint32_t));
+    Histogram *h = (Histogram *) malloc(sizeof(Histogram));
+    if(picks == NULL || h == NULL)
+    {
+        perror("Could not allocate");
+        return 1;
+    }
+    srand(time(NULL));
+    for(int i = 0; i < WARMUP_LOOKUPS + lookups; i++)
+        picks[i] = ((uint32_t) rand() << 16 ^ rand()) % records;
+
+    printf("%u cards, %d lookups\n", records, lookups);
+    printf("%-6s %12s %9s %9s %9s %9s %9s %9s\n", "", "lookups/s", "mean", "p50", "p90", "p99", "p99.9", "max");
+
+    unsigned char card[CARD_VAULT_CARD_SIZE];
+    int missing = 0;
+    histogram_reset(h);
+    for(int i = 0; i < WARMUP_LOOKUPS + lookups; i++)
+    {
+        const char *name = vault->records[picks[i]].name;
+        uint64_t start = now_ns();
+        int n = card_vault_get(vault, name, card, sizeof(card));
+        uint64_t elapsed = now_ns() - start;
+        if(n < 0)
+            missing++;
+        if(i >= WARMUP_LOOKUPS)
+            histogram_record(h, elapsed);
+    }
+    report("vault", h);
+
+    if(dir != NULL)
+    {
+        histogram_reset(h);
+        for(int i = 0; i < WARMUP_LOOKUPS + lookups; i++)
+        {
+            const char *name = vault->records[picks[i]].name;
+            uint64_t start = now_ns();
+            int n = read_card_file(dir, name, card);
+            uint64_t elapsed = now_ns() - start;
+            if(n < 0)
+                missing++;
+            if(i >= WARMUP_LOOKUPS)
+                histogram_record(h, elapsed);
+        }
+        report("files", h);
+    }
+    if(missing > 0)
+        printf("%d lookups found no card\n", missing);
+
+    free(picks);
+    free(h);
+    card_vault_close(vault);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc < 2)
+        usage();
+    if(strcmp(argv[1], "import") == 0)
+        return import(argc - 2, argv + 2);
+    if(strcmp(argv[1], "bench") == 0)
+        return bench(argc - 1, argv + 1);
+    usage();
+    return 1;
+}
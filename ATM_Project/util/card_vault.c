@@ -0,0 +1,273 @@
+#include "card_vault.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define RECORD_NUMBER(entry) ((uint32_t) (entry) - 1)
+#define ENTRY_TAG(entry) ((uint32_t) ((entry) >> 32))
+
+static uint64_t hash_name(const char *name)
+{
+    // FNV-1a
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for(const unsigned char *p = (const unsigned char *) name; *p != '\0'; p++)
+        h = (h ^ *p) * 0x100000001b3ULL;
+    return h;
+}
+
+static size_t records_offset(uint32_t slots)
+{
+    size_t end = sizeof(CardVaultHeader) + (size_t) slots * sizeof(uint64_t);
+    return (end + 4095) & ~(size_t) 4095;
+}
+
+static size_t vault_size(uint32_t slots)
+{
+    return records_offset(slots) + (size_t) (slots / 4 * 3) * sizeof(CardVaultRecord);
+}
+
+// Map the vault open on fd, checking that it is one. Returns 0; -1 with errno set
+static int vault_map(CardVault *v, int fd, int writable)
+{
+    struct stat st;
+    CardVaultHeader header;
+    if(fstat(fd, &st) < 0)
+        return -1;
+    if(pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != CARD_VAULT_MAGIC ||
+       header.slots == 0 || (header.slots & (header.slots - 1)) != 0 ||
+       header.records_offset != records_offset(header.slots) || header.max_records != header.slots / 4 * 3 ||
+       (size_t) st.st_size < vault_size(header.slots))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED)
+        return -1;
+    v->fd = fd;
+    v->writable = writable;
+    v->map_len = st.st_size;
+    v->header = (CardVaultHeader *) map;
+    v->index = (uint64_t *) ((char *) map + sizeof(CardVaultHeader));
+    v->records = (CardVaultRecord *) ((char *) map + header.records_offset);
+    return 0;
+}
+
+// Create an empty vault with slots index entries, locked for writing. Returns its descriptor; -1 on error
+static int vault_create(const char *path, uint32_t slots)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0)
+        return -1;
+
+    CardVaultHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = CARD_VAULT_MAGIC;
+    header.slots = slots;
+    header.max_records = slots / 4 * 3;
+    header.records_offset = records_offset(slots);
+    if(flock(fd, LOCK_EX | LOCK_NB) < 0 || ftruncate(fd, vault_size(slots)) < 0 ||
+       pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+    {
+        int saved = errno;
+        close(fd);
+        unlink(path);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+CardVault* card_vault_open(const char *path, int writable)
+{
+    if(strlen(path) >= sizeof(((CardVault *) 0)->path))
+    {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    CardVault *v = (CardVault *) calloc(1, sizeof(CardVault));
+    if(v == NULL)
+        return NULL;
+    strcpy(v->path, path);
+
+    int fd = open(path, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if(fd < 0 && writable && errno == ENOENT)
+        fd = vault_create(path, CARD_VAULT_DEFAULT_SLOTS);
+    else if(fd >= 0 && writable && flock(fd, LOCK_EX | LOCK_NB) < 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+    if(fd < 0 || vault_map(v, fd, writable) < 0)
+    {
+        int saved = errno;
+        if(fd >= 0)
+            close(fd);
+        free(v);
+        errno = saved;
+        return NULL;
+    }
+    return v;
+}
+
+static void vault_unmap(CardVault *v)
+{
+    munmap(v->header, v->map_len);
+    close(v->fd);
+}
+
+void card_vault_close(CardVault *v)
+{
+    if(v == NULL)
+        return;
+    vault_unmap(v);
+    free(v);
+}
+
+// The index entry for name: the one holding it, or the empty one it would go in
+static uint32_t find_slot(const CardVault *v, const char *name, uint64_t h, uint64_t *entry)
+{
+    uint32_t mask = v->header->slots - 1;
+    uint32_t tag = (uint32_t) (h >> 32);
+    for(uint32_t i = (uint32_t) h & mask; ; i = (i + 1) & mask)
+    {
+        uint64_t e = __atomic_load_n(&v->index[i], __ATOMIC_ACQUIRE);
+        if(e == 0)
+        {
+            *entry = 0;
+            return i;
+        }
+        if(ENTRY_TAG(e) == tag && RECORD_NUMBER(e) < v->header->max_records &&
+           strncmp(v->records[RECORD_NUMBER(e)].name, name, CARD_VAULT_NAME_SIZE) == 0)
+        {
+            *entry = e;
+            return i;
+        }
+    }
+}
+
+static void append(CardVault *v, uint32_t slot, uint64_t h, const char *name, const void *card, size_t len)
+{
+    uint32_t n = v->header->records;
+    CardVaultRecord *rec = &v->records[n];
+    memset(rec, 0, sizeof(*rec));
+    strcpy(rec->name, name);
+    rec->len = len;
+    memcpy(rec->card, card, len);
+
+    // The index entry goes in last, once the record is complete
+    __atomic_store_n(&v->header->records, n + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&v->index[slot], (h >> 32) << 32 | (uint64_t) (n + 1), __ATOMIC_RELEASE);
+}
+
+static int sync_directory(const char *path)
+{
+    char copy[sizeof(((CardVault *) 0)->path)];
+    strcpy(copy, path);
+    int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0)
+        return -1;
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+// Move the current cards into a vault with twice the room, which replaces this one
+static int grow(CardVault *v)
+{
+    char tmp[sizeof(v->path) + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", v->path);
+    int fd = vault_create(tmp, v->header->slots * 2);
+    if(fd < 0)
+        return -1;
+
+    CardVault bigger;
+    if(vault_map(&bigger, fd, 1) < 0)
+    {
+        int saved = errno;
+        close(fd);
+        unlink(tmp);
+        errno = saved;
+        return -1;
+    }
+    strcpy(bigger.path, v->path);
+    for(uint32_t i = 0; i < v->header->slots; i++)
+    {
+        uint64_t e = v->index[i];
+        if(e == 0)
+            continue;
+        CardVaultRecord *rec = &v->records[RECORD_NUMBER(e)];
+        uint64_t h = hash_name(rec->name), entry;
+        append(&bigger, find_slot(&bigger, rec->name, h, &entry), h, rec->name, rec->card, rec->len);
+    }
+
+    if(card_vault_sync(&bigger) < 0 || rename(tmp, v->path) < 0 || sync_directory(v->path) < 0)
+    {
+        int saved = errno;
+        vault_unmap(&bigger);
+        unlink(tmp);
+        errno = saved;
+        return -1;
+    }
+
+    // Readers still on the old file reopen the path when they see this
+    __atomic_store_n(&v->header->moved, 1, __ATOMIC_RELEASE);
+    vault_unmap(v);
+    *v = bigger;
+    return 0;
+}
+
+int card_vault_put(CardVault *v, const char *name, const void *card, size_t len)
+{
+    if(!v->writable || strlen(name) >= CARD_VAULT_NAME_SIZE || len > CARD_VAULT_CARD_SIZE)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if(v->header->records == v->header->max_records && grow(v) < 0)
+        return -1;
+
+    uint64_t h = hash_name(name), entry;
+    append(v, find_slot(v, name, h, &entry), h, name, card, len);
+    return 0;
+}
+
+int card_vault_get(CardVault *v, const char *name, void *card, size_t len)
+{
+    // A vault that has been replaced is reopened; failing that, the old one still answers
+    if(!v->writable && __atomic_load_n(&v->header->moved, __ATOMIC_ACQUIRE))
+    {
+        int fd = open(v->path, O_RDONLY | O_CLOEXEC);
+        CardVault fresh;
+        if(fd >= 0 && vault_map(&fresh, fd, 0) == 0)
+        {
+            strcpy(fresh.path, v->path);
+            vault_unmap(v);
+            *v = fresh;
+        }
+        else if(fd >= 0)
+            close(fd);
+    }
+
+    uint64_t entry;
+    find_slot(v, name, hash_name(name), &entry);
+    if(entry == 0)
+        return -1;
+    CardVaultRecord *rec = &v->records[RECORD_NUMBER(entry)];
+    size_t n = rec->len < len ? rec->len : len;
+    memcpy(card, rec->card, n);
+    return n;
+}
+
+int card_vault_sync(CardVault *v)
+{
+    return msync(v->header, v->map_len, MS_SYNC);
+}
@@ -0,0 +1,82 @@
+/*
+ * The card vault: every user's card in one memory-mapped file, in place
+ * of a <user-name>.card file each.
+ *
+ * With CARD_VAULT set to a path, the bank writes new cards to the vault
+ * there and the ATM reads them from it; without it both use card files.
+ * card-vault imports existing card files into a vault and times lookups
+ * in it against reading the files.
+ *
+ * The file is a header, an open-addressing hash index and the records,
+ * each a name and its card.  An index entry holds part of the name's
+ * hash beside the record number, so a lookup probes the index (one
+ * cache line, nearly always) and then reads the one record it points
+ * at, with no system call.  Records are only ever appended: writing a
+ * card again for the same name adds a record and switches the index
+ * entry to it.  The writer fills in a record before it stores the index
+ * entry that publishes it, so readers in other processes need no lock
+ * and never see a card half written.
+ *
+ * The file is sized for all the records its index can take (sparse until
+ * they are written).  Once that many are used the writer copies the live
+ * ones into a vault with twice the room, renames it over the old one and
+ * marks the old one moved; readers notice the mark and reopen the path.
+ * One process writes a vault at a time (it holds an flock on it).
+ */
+
+#ifndef __CARD_VAULT_H__
+#define __CARD_VAULT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CARD_VAULT_MAGIC 0x32544c5644524143ULL      // "CARDVLT2"
+#define CARD_VAULT_DEFAULT_SLOTS 4096
+#define CARD_VAULT_NAME_SIZE 256
+#define CARD_VAULT_CARD_SIZE 48
+
+typedef struct _CardVaultHeader
+{
+    uint64_t magic;
+    uint32_t slots;             // index entries, a power of two
+    uint32_t max_records;       // three quarters of slots
+    uint32_t records;           // records appended so far, current or replaced
+    uint32_t moved;             // set once a larger vault has replaced this one
+    uint64_t records_offset;
+    char pad[32];
+} CardVaultHeader;
+
+typedef struct _CardVaultRecord
+{
+    char name[CARD_VAULT_NAME_SIZE];
+    uint32_t len;
+    uint32_t reserved;
+    unsigned char card[CARD_VAULT_CARD_SIZE];
+} CardVaultRecord;
+
+typedef struct _CardVault
+{
+    char path[4096];
+    int fd;
+    int writable;
+    size_t map_len;
+    CardVaultHeader *header;
+    uint64_t *index;            // hash tag << 32 | record number + 1; 0 if empty
+    CardVaultRecord *records;
+} CardVault;
+
+// Open the vault at path; one opened writable is created if missing.
+// Returns NULL with errno set on failure (EWOULDBLOCK: another process is writing it)
+CardVault* card_vault_open(const char *path, int writable);
+void card_vault_close(CardVault *v);
+
+// Store len bytes (at most CARD_VAULT_CARD_SIZE) as name's card. Returns 0; -1 with errno set
+int card_vault_put(CardVault *v, const char *name, const void *card, size_t len);
+
+// Copy name's card into card. Returns its length; -1 if there is none
+int card_vault_get(CardVault *v, const char *name, void *card, size_t len);
+
+// Write what has been stored out to disk. Returns 0; -1 with errno set
+int card_vault_sync(CardVault *v);
+
+#endif
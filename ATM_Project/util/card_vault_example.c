@@ -0,0 +1,89 @@
+#include "card_vault.h"
+#include "check.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void card_for(int i, char *name, unsigned char *card)
+{
+    sprintf(name, "user%d", i);
+    for(int b = 0; b < CARD_VAULT_CARD_SIZE; b++)
+        card[b] = (unsigned char) (i * 31 + b);
+}
+
+// Whether v holds the card put for every i below n
+static int holds(CardVault *v, int n)
+{
+    char name[32];
+    unsigned char want[CARD_VAULT_CARD_SIZE], got[CARD_VAULT_CARD_SIZE];
+    for(int i = 0; i < n; i++)
+    {
+        card_for(i, name, want);
+        if(card_vault_get(v, name, got, sizeof(got)) != CARD_VAULT_CARD_SIZE || memcmp(got, want, sizeof(got)) != 0)
+            return 0;
+    }
+    return 1;
+}
+
+int main()
+{
+    char dir[] = "/tmp/card-vault-test.XXXXXX", path[64], tmp[sizeof(path) + 4];
+    if(mkdtemp(dir) == NULL)
+    {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    snprintf(path, sizeof(path), "%s/cards.vault", dir);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    CardVault *writer = card_vault_open(path, 1);
+    check(writer != NULL, "created");
+    if(writer == NULL)
+        return EXIT_FAILURE;
+    CardVault *second = card_vault_open(path, 1);
+    check(second == NULL && errno == EWOULDBLOCK, "one writer at a time");
+
+    char name[32];
+    unsigned char card[CARD_VAULT_CARD_SIZE];
+    card_for(0, name, card);
+    card_vault_put(writer, name, card, CARD_VAULT_CARD_SIZE - 12);
+    check(card_vault_get(writer, name, card, sizeof(card)) == CARD_VAULT_CARD_SIZE - 12, "length kept");
+    check(card_vault_get(writer, "nobody", card, sizeof(card)) == -1, "missing name");
+
+    // A reader opened now must follow the vault when it is replaced
+    CardVault *reader = card_vault_open(path, 0);
+    check(reader != NULL, "reader opened");
+
+    // user0 again replaces the card put above, filling the last record
+    int full = writer->header->max_records;
+    for(int i = 0; i < full - 1; i++)
+    {
+        card_for(i, name, card);
+        card_vault_put(writer, name, card, sizeof(card));
+    }
+    check(writer->header->slots == CARD_VAULT_DEFAULT_SLOTS && writer->header->records == (uint32_t) full,
+          "full before growing");
+
+    // The next card grows it; the replaced card for user0 is not copied
+    card_for(full - 1, name, card);
+    check(card_vault_put(writer, name, card, sizeof(card)) == 0, "put that grows");
+    check(writer->header->slots == 2 * CARD_VAULT_DEFAULT_SLOTS && writer->header->records == (uint32_t) full,
+          "grown");
+    check(access(tmp, F_OK) != 0, "renamed into place");
+    check(holds(writer, full), "writer holds every card");
+    check(reader != NULL && holds(reader, full) && reader->header->slots == 2 * CARD_VAULT_DEFAULT_SLOTS,
+          "reader reopened");
+
+    check(card_vault_sync(writer) == 0, "synced");
+    card_vault_close(writer);
+    card_vault_close(reader);
+    reader = card_vault_open(path, 0);
+    check(reader != NULL && holds(reader, full), "kept on disk");
+    card_vault_close(reader);
+
+    unlink(path);
+    rmdir(dir);
+    return check_status();
+}
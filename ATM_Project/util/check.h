@@ -0,0 +1,28 @@
+/*
+ * Checks for the example programs that make test runs.  check() prints
+ * what was checked and whether it held, and counts the failures;
+ * main() returns check_status() so a failed check fails the build.
+ */
+
+#ifndef __CHECK_H__
+#define __CHECK_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static int check_failures = 0;
+
+static inline void check(int ok, const char *what)
+{
+    printf("%s: %s\n", what, ok ? "ok" : "FAIL");
+    if(!ok)
+        check_failures++;
+}
+
+// EXIT_FAILURE if any check failed
+static inline int check_status(void)
+{
+    return check_failures > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+#endif
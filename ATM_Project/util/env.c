@@ -0,0 +1,22 @@
+#include <stdlib.h>
+#include <errno.h>
+#include "env.h"
+
+int env_int(const char *name, int def, int min, int max)
+{
+    char *value = getenv(name);
+    if(value == NULL || *value == '\0')
+        return def;
+
+    char *end;
+    errno = 0;
+    long n = strtol(value, &end, 10);
+    if(errno != 0 || *end != '\0')
+        return def;
+
+    if(n < min)
+        return min;
+    if(n > max)
+        return max;
+    return (int) n;
+}
@@ -0,0 +1,16 @@
+/*
+ * Helpers for reading runtime tunables from the environment.
+ *
+ * The atm and bank programs must take exactly one argument, so
+ * optional knobs (batch sizes, timeouts, ...) are passed in through
+ * environment variables instead of the command line.
+ */
+
+#ifndef __ENV_H__
+#define __ENV_H__
+
+// Returns the integer value of the environment variable `name`, or `def`
+// if it is unset or not a number. The result is clamped to [min, max].
+int env_int(const char *name, int def, int min, int max);
+
+#endif
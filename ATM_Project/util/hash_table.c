@@ -83,6 +83,53 @@ uint32_t hash(const char * data, int len)
     return hash;
 }
 
+// Rehash every entry into twice as many bins, moving the list elements
+// rather than allocating new ones. If the new bins cannot be allocated the
+// table keeps the ones it has
+static void hash_table_grow(HashTable *ht)
+{
+    uint32_t num_bins = ht->num_bins * 2, i;
+    List **bins = (List**) malloc(sizeof(List*) * num_bins);
+    if(bins == NULL)
+        return;
+
+    for(i=0; i < num_bins; i++)
+    {
+        bins[i] = list_create();
+        if(bins[i] == NULL)
+        {
+            while(i > 0)
+                list_free(bins[--i]);
+            free(bins);
+            return;
+        }
+    }
+
+    for(i=0; i < ht->num_bins; i++)
+    {
+        ListElem *elem = ht->bins[i]->head;
+        while(elem != NULL)
+        {
+            ListElem *next = elem->next;
+            List *bin = bins[hash(elem->key, strlen(elem->key)) % num_bins];
+
+            elem->next = NULL;
+            if(bin->tail == NULL)
+                bin->head = elem;
+            else
+                bin->tail->next = elem;
+            bin->tail = elem;
+            bin->size++;
+            elem = next;
+        }
+        free(ht->bins[i]);
+    }
+
+    free(ht->bins);
+    ht->bins = bins;
+    ht->num_bins = num_bins;
+}
+
 void hash_table_add(HashTable *ht, char *key, void *val)
 {
     uint32_t idx = hash(key, strlen(key)) % ht->num_bins;
@@ -93,6 +140,9 @@ void hash_table_add(HashTable *ht, char *key, void *val)
         ht->size -= list_size(ht->bins[idx]);
         list_add(ht->bins[idx], key, val);
         ht->size += list_size(ht->bins[idx]);
+
+        if(ht->size > ht->num_bins * HASH_TABLE_MAX_LOAD)
+            hash_table_grow(ht);
     }
 }
 
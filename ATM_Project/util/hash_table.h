@@ -2,6 +2,8 @@
  * This is a simple hash table that maps a char* key to a void* data.
  * It does not permit multiple entires with the same key.
  * See hash_table_example.c for an example of how to use it.
+ * Once it holds more than HASH_TABLE_MAX_LOAD entries per bin it doubles
+ * its bins, so lookups stay short however many entries are added.
  * Feel free to change this as you desire.
  */
 
@@ -11,6 +13,8 @@
 #include "list.h"
 #include <stdint.h>
 
+#define HASH_TABLE_MAX_LOAD 2
+
 typedef struct _HashTable
 {
     uint32_t num_bins;
@@ -1,23 +1,45 @@
 #include "hash_table.h"
+#include "check.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+// Whether key is found in ht with the value val
+static int found(HashTable *ht, const char *key, const char *val)
+{
+    const char *v = (const char*) hash_table_find(ht, key);
+    return v != NULL && strcmp(v, val) == 0;
+}
 
 int main()
 {
     HashTable *ht = hash_table_create(10);
-    printf("Size: %d\n", hash_table_size(ht));
+    check(hash_table_size(ht) == 0, "empty");
 
     hash_table_add(ht, "Alice", "123");
     hash_table_add(ht, "Bob", "345");
-
-    printf("Alice -> %s\n", hash_table_find(ht, "Alice"));
+    check(found(ht, "Alice", "123") && found(ht, "Bob", "345"), "found");
     hash_table_del(ht, "Alice");
+    check(hash_table_find(ht, "Alice") == NULL && hash_table_size(ht) == 1, "deleted");
     hash_table_add(ht, "Alice", "234");
-    printf("Alice -> %s\n", hash_table_find(ht, "Alice"));
-    printf("Bob -> %s\n", hash_table_find(ht, "Bob"));
-    printf("Charlie -> %s\n", (hash_table_find(ht, "Charlie") == NULL ? "Not Found" : "FAIL"));
+    check(found(ht, "Alice", "234") && found(ht, "Bob", "345") && hash_table_find(ht, "Charlie") == NULL,
+          "added again");
+
+    // Adding more entries than there are bins grows the table
+    char keys[100][8];
+    for(int i = 0; i < 100; i++)
+    {
+        snprintf(keys[i], sizeof(keys[i]), "k%d", i);
+        hash_table_add(ht, keys[i], keys[i]);
+    }
+    printf("Size: %d, bins: %d\n", hash_table_size(ht), ht->num_bins);
+    check(hash_table_size(ht) == 102 && ht->num_bins > 10, "grown");
 
-    printf("Size: %d\n", hash_table_size(ht));
+    int all = found(ht, "Alice", "234") && found(ht, "Bob", "345");
+    for(int i = 0; i < 100; i++)
+        all = all && hash_table_find(ht, keys[i]) == keys[i];
+    check(all, "every key found after growing");
+    hash_table_free(ht);
 
-    return EXIT_SUCCESS;
+    return check_status();
 }
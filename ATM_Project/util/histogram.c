@@ -0,0 +1,88 @@
+#include <string.h>
+#include "histogram.h"
+
+#define SUB_BUCKETS (1ULL << HISTOGRAM_SUB_BITS)
+
+static uint32_t bucket_of(uint64_t value)
+{
+    if(value < SUB_BUCKETS)
+        return (uint32_t) value;
+
+    // Keep the top HISTOGRAM_SUB_BITS + 1 bits of the value
+    uint32_t msb = 63 - __builtin_clzll(value);
+    uint32_t shift = msb - HISTOGRAM_SUB_BITS;
+    return ((shift + 1) << HISTOGRAM_SUB_BITS) + (uint32_t) ((value >> shift) - SUB_BUCKETS);
+}
+
+// The largest value that lands in bucket i
+static uint64_t bucket_high(uint32_t i)
+{
+    if(i < SUB_BUCKETS)
+        return i;
+
+    uint32_t shift = (i >> HISTOGRAM_SUB_BITS) - 1;
+    uint64_t low = ((i & (SUB_BUCKETS - 1)) + SUB_BUCKETS) << shift;
+    return low + ((1ULL << shift) - 1);
+}
+
+void histogram_reset(Histogram *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+void histogram_record(Histogram *h, uint64_t value)
+{
+    h->counts[bucket_of(value)]++;
+    h->count++;
+    h->sum += value;
+    if(value < h->min)
+        h->min = value;
+    if(value > h->max)
+        h->max = value;
+}
+
+void histogram_merge(Histogram *dst, const Histogram *src)
+{
+    for(uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+        dst->counts[i] += src->counts[i];
+
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if(src->min < dst->min)
+        dst->min = src->min;
+    if(src->max > dst->max)
+        dst->max = src->max;
+}
+
+// The value below which `percentile` percent of the recorded values fall,
+// reported as the top of its bucket (never above the largest value seen);
+// 0 if nothing has been recorded
+uint64_t histogram_percentile(const Histogram *h, double percentile)
+{
+    if(h->count == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t) (percentile / 100.0 * h->count + 0.5);
+    if(rank < 1)
+        rank = 1;
+    if(rank > h->count)
+        rank = h->count;
+
+    uint64_t seen = 0;
+    for(uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += h->counts[i];
+        if(seen >= rank)
+        {
+            uint64_t value = bucket_high(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+double histogram_mean(const Histogram *h)
+{
+    return h->count > 0 ? (double) h->sum / h->count : 0.0;
+}
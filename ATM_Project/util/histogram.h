@@ -0,0 +1,35 @@
+/*
+ * A log-linear latency histogram in the style of HdrHistogram.
+ *
+ * Values below 2^HISTOGRAM_SUB_BITS are counted exactly; above that each
+ * power of two is split into 2^HISTOGRAM_SUB_BITS equal buckets, so any
+ * recorded value is reproduced within 1 part in 128 over the full 64-bit
+ * range.  Recording is a couple of shifts and an increment, and a
+ * histogram is a fixed-size struct that can be embedded, copied or
+ * merged without allocating.
+ */
+
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include <stdint.h>
+
+#define HISTOGRAM_SUB_BITS 7
+#define HISTOGRAM_BUCKETS ((65 - HISTOGRAM_SUB_BITS) << HISTOGRAM_SUB_BITS)
+
+typedef struct _Histogram
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t counts[HISTOGRAM_BUCKETS];
+} Histogram;
+
+void histogram_reset(Histogram *h);
+void histogram_record(Histogram *h, uint64_t value);
+void histogram_merge(Histogram *dst, const Histogram *src);
+uint64_t histogram_percentile(const Histogram *h, double percentile);
+double histogram_mean(const Histogram *h);
+
+#endif
@@ -6,6 +6,8 @@
 List* list_create()
 {
     List *list = (List*) malloc(sizeof(List));
+    if(list == NULL)
+        return NULL;
     list->head = list->tail = NULL;
     list->size = 0;
     return list;
@@ -56,7 +58,10 @@ void list_add(List *list, char *key, void *val)
     if(list->tail == NULL)
         list->head = list->tail = elem;
     else
+    {
         list->tail->next = elem;
+        list->tail = elem;
+    }
 
     list->size++;
 }
@@ -1,24 +1,33 @@
 #include "list.h"
+#include "check.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+// Whether key is found in ls with the value val
+static int found(List *ls, const char *key, const char *val)
+{
+    const char *v = (const char*) list_find(ls, key);
+    return v != NULL && strcmp(v, val) == 0;
+}
 
 int main()
 {
     List *ls = list_create();
-    printf("Charlie -> %s\n", (list_find(ls, "Charlie") == NULL ? "Not Found" : "FAIL"));
+    check(list_find(ls, "Charlie") == NULL, "empty");
     list_add(ls, "Alice", "123");
     list_add(ls, "Bob", "345");
+    list_add(ls, "Charlie", "567");
+    check(ls->size == 3, "size after three adds");
 
-    printf("Alice -> '%s'\n", (char*) list_find(ls, "Alice"));
-    printf("Bob -> '%s'\n", (char*) list_find(ls, "Bob"));
+    // Every element is kept, not only the first and last
+    check(found(ls, "Alice", "123") && found(ls, "Bob", "345") && found(ls, "Charlie", "567"), "every key found");
+    check(list_find(ls, "Dave") == NULL, "missing key");
 
-    printf("Charlie -> %s\n", (list_find(ls, "Charlie") == NULL ? "Not Found" : "FAIL"));
-
-    printf("Size = %d\n", ls->size);
+    // Duplicates are permitted; the first one added is found
     list_add(ls, "Alice", "456");
-    printf("Size = %d\n", ls->size);
+    check(ls->size == 4 && found(ls, "Alice", "123"), "duplicate key");
     list_free(ls);
 
-	return EXIT_SUCCESS;
+    return check_status();
 }
-
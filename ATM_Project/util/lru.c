@@ -0,0 +1,49 @@
+#include "lru.h"
+
+static LruLink *link_of(const LruList *list, int32_t i)
+{
+    return (LruLink *) ((char *) list->links + (size_t) i * list->stride);
+}
+
+void lru_init(LruList *list, LruLink *links, size_t stride)
+{
+    list->head = list->tail = -1;
+    list->links = links;
+    list->stride = stride;
+}
+
+void lru_unlink(LruList *list, int32_t i)
+{
+    LruLink *l = link_of(list, i);
+
+    if(l->prev != -1)
+        link_of(list, l->prev)->next = l->next;
+    else
+        list->head = l->next;
+
+    if(l->next != -1)
+        link_of(list, l->next)->prev = l->prev;
+    else
+        list->tail = l->prev;
+}
+
+void lru_push_front(LruList *list, int32_t i)
+{
+    LruLink *l = link_of(list, i);
+
+    l->prev = -1;
+    l->next = list->head;
+    if(list->head != -1)
+        link_of(list, list->head)->prev = i;
+    else
+        list->tail = i;
+    list->head = i;
+}
+
+void lru_touch(LruList *list, int32_t i)
+{
+    if(list->head == i)
+        return;
+    lru_unlink(list, i);
+    lru_push_front(list, i);
+}
@@ -0,0 +1,39 @@
+/*
+ * A least-recently-used list threaded through a fixed array of entries
+ * by index, for tables that never move their entries (reply_cache.h,
+ * session_table.h).  Indexes rather than pointers keep the links small
+ * and let a table chain its free entries through the same fields.
+ *
+ * Embed an LruLink in the entry struct and give lru_init() the first
+ * entry's link and the size of an entry; entry i's link is then found
+ * i entries on.  -1 marks the end of the list.
+ */
+
+#ifndef __LRU_H__
+#define __LRU_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct _LruLink
+{
+    int32_t prev;               // towards the most recently used entry
+    int32_t next;               // towards the least recently used entry
+} LruLink;
+
+typedef struct _LruList
+{
+    int32_t head;               // most recently used
+    int32_t tail;               // least recently used
+    LruLink *links;
+    size_t stride;
+} LruList;
+
+void lru_init(LruList *list, LruLink *links, size_t stride);
+void lru_unlink(LruList *list, int32_t i);
+void lru_push_front(LruList *list, int32_t i);
+
+// Mark entry i, already on the list, most recently used
+void lru_touch(LruList *list, int32_t i);
+
+#endif
@@ -0,0 +1,165 @@
+#include <stdlib.h>
+#include "timer_wheel.h"
+
+TimerWheel* timer_wheel_create(uint64_t tick_us, uint32_t num_slots, uint64_t now_us)
+{
+    TimerWheel *wheel = (TimerWheel*) malloc(sizeof(TimerWheel));
+    if(wheel == NULL)
+        return NULL;
+
+    wheel->tick_us = tick_us;
+    wheel->current_tick = now_us / tick_us;
+    wheel->num_slots = num_slots;
+    wheel->heads = (TimerEntry**) calloc(num_slots, sizeof(TimerEntry*));
+    wheel->tails = (TimerEntry**) calloc(num_slots, sizeof(TimerEntry*));
+    wheel->size = 0;
+
+    if(wheel->heads == NULL || wheel->tails == NULL)
+    {
+        timer_wheel_free(wheel);
+        return NULL;
+    }
+    return wheel;
+}
+
+void timer_wheel_free(TimerWheel *wheel)
+{
+    if(wheel != NULL)
+    {
+        free(wheel->heads);
+        free(wheel->tails);
+        free(wheel);
+    }
+}
+
+// Timers already due land in the current tick; each slot is kept in
+// insertion order so equal deadlines fire first-in, first-out.
+void timer_wheel_add(TimerWheel *wheel, TimerEntry *entry, uint64_t expires_us)
+{
+    uint64_t tick = expires_us / wheel->tick_us;
+    if(tick < wheel->current_tick)
+        tick = wheel->current_tick;
+
+    uint32_t slot = tick % wheel->num_slots;
+    entry->expires_us = expires_us;
+    entry->next = NULL;
+
+    if(wheel->tails[slot] == NULL)
+        wheel->heads[slot] = entry;
+    else
+        wheel->tails[slot]->next = entry;
+    wheel->tails[slot] = entry;
+    wheel->size++;
+}
+
+// Unlink a pending timer. An entry whose deadline had already passed when it
+// was added went into the then-current tick, which expire has not moved past
+// while the entry is still pending, so the slot can be recomputed either way.
+// Returns 0 on success; -1 if the entry is not in the wheel
+int timer_wheel_cancel(TimerWheel *wheel, TimerEntry *entry)
+{
+    uint64_t tick = entry->expires_us / wheel->tick_us;
+    if(tick < wheel->current_tick)
+        tick = wheel->current_tick;
+
+    uint32_t slot = tick % wheel->num_slots;
+    TimerEntry *prev = NULL, *cur = wheel->heads[slot];
+
+    while(cur != NULL && cur != entry)
+    {
+        prev = cur;
+        cur = cur->next;
+    }
+    if(cur == NULL)
+        return -1;
+
+    if(prev == NULL)
+        wheel->heads[slot] = cur->next;
+    else
+        prev->next = cur->next;
+    if(wheel->tails[slot] == cur)
+        wheel->tails[slot] = prev;
+
+    cur->next = NULL;
+    wheel->size--;
+    return 0;
+}
+
+// Unlink every timer that is due at now_us and return them as a list
+// chained through `next`, oldest tick first.
+TimerEntry* timer_wheel_expire(TimerWheel *wheel, uint64_t now_us)
+{
+    TimerEntry *expired = NULL, *expired_tail = NULL;
+    uint64_t now_tick = now_us / wheel->tick_us;
+
+    // Never walk more than one revolution, however long we were away
+    if(now_tick > wheel->current_tick + wheel->num_slots)
+        wheel->current_tick = now_tick - wheel->num_slots;
+
+    for(; wheel->current_tick <= now_tick && wheel->size > 0; wheel->current_tick++)
+    {
+        uint32_t slot = wheel->current_tick % wheel->num_slots;
+        TimerEntry *entry = wheel->heads[slot];
+        TimerEntry *keep = NULL, *keep_tail = NULL;
+
+        while(entry != NULL)
+        {
+            TimerEntry *next = entry->next;
+            entry->next = NULL;
+
+            if(entry->expires_us / wheel->tick_us <= now_tick)
+            {
+                if(expired_tail == NULL)
+                    expired = entry;
+                else
+                    expired_tail->next = entry;
+                expired_tail = entry;
+                wheel->size--;
+            }
+            else
+            {
+                // Belongs to a later revolution
+                if(keep_tail == NULL)
+                    keep = entry;
+                else
+                    keep_tail->next = entry;
+                keep_tail = entry;
+            }
+            entry = next;
+        }
+
+        wheel->heads[slot] = keep;
+        wheel->tails[slot] = keep_tail;
+    }
+
+    if(wheel->current_tick <= now_tick)
+        wheel->current_tick = now_tick;
+
+    return expired;
+}
+
+// Milliseconds until the next tick that holds a timer, suitable for
+// epoll_wait/poll; -1 if the wheel is empty.
+int timer_wheel_timeout_ms(const TimerWheel *wheel, uint64_t now_us)
+{
+    if(wheel->size == 0)
+        return -1;
+
+    for(uint32_t i = 0; i < wheel->num_slots; i++)
+    {
+        uint64_t tick = wheel->current_tick + i;
+        if(wheel->heads[tick % wheel->num_slots] != NULL)
+        {
+            uint64_t due_us = tick * wheel->tick_us;
+            if(due_us <= now_us)
+                return 0;
+            return (int) ((due_us - now_us + 999) / 1000);
+        }
+    }
+    return (int) ((wheel->num_slots * wheel->tick_us + 999) / 1000);
+}
+
+uint32_t timer_wheel_size(const TimerWheel *wheel)
+{
+    return wheel->size;
+}
@@ -0,0 +1,40 @@
+/*
+ * A hashed timing wheel.  Timers are bucketed by the tick they expire
+ * in, so adding a timer and expiring a tick's worth of timers are both
+ * O(1) regardless of how many timers are pending.  Timers further out
+ * than one revolution stay in their bucket until their tick comes round.
+ *
+ * Embed a TimerEntry in whatever needs a deadline and recover the
+ * containing struct from the entries returned by timer_wheel_expire().
+ */
+
+#ifndef __TIMER_WHEEL_H__
+#define __TIMER_WHEEL_H__
+
+#include <stdint.h>
+
+typedef struct _TimerEntry
+{
+    uint64_t expires_us;
+    struct _TimerEntry *next;
+} TimerEntry;
+
+typedef struct _TimerWheel
+{
+    uint64_t tick_us;
+    uint64_t current_tick;
+    uint32_t num_slots;
+    TimerEntry **heads;
+    TimerEntry **tails;
+    uint32_t size;
+} TimerWheel;
+
+TimerWheel* timer_wheel_create(uint64_t tick_us, uint32_t num_slots, uint64_t now_us);
+void timer_wheel_free(TimerWheel *wheel);
+void timer_wheel_add(TimerWheel *wheel, TimerEntry *entry, uint64_t expires_us);
+int timer_wheel_cancel(TimerWheel *wheel, TimerEntry *entry);
+TimerEntry* timer_wheel_expire(TimerWheel *wheel, uint64_t now_us);
+int timer_wheel_timeout_ms(const TimerWheel *wheel, uint64_t now_us);
+uint32_t timer_wheel_size(const TimerWheel *wheel);
+
+#endif
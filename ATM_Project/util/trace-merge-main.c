@@ -0,0 +1,226 @@
+/*
+ * Merges the trace files written by the ATM, router and bank (see
+ * trace.h) into one view per request.
+ *
+ * Usage:  trace-merge [-c] [-r <request id>] [-n <requests>] <trace file>...
+ *
+ *   -c  write Chrome trace JSON (load it in chrome://tracing or
+ *       Perfetto) instead of a text timeline
+ *   -r  only show the request with this ID (hex, as printed)
+ *   -n  only show the first <requests> requests
+ *
+ * The text timeline lists each request's spans from every process in
+ * start order, with times relative to the request's first span.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "trace.h"
+
+static const char *point_names[TRACE_NUM_POINTS] = TRACE_POINT_NAMES;
+
+typedef struct _Span
+{
+    TraceRecord rec;
+    const char *process;
+    uint32_t pid;
+} Span;
+
+typedef struct _Request
+{
+    uint64_t trace_id;
+    uint64_t first_ns;
+    size_t begin;
+    size_t end;
+} Request;
+
+static Span *spans = NULL;
+static size_t num_spans = 0, max_spans = 0;
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage:  trace-merge [-c] [-r <request id>] [-n <requests>] <trace file>...\n");
+    exit(1);
+}
+
+// Copy every complete record out of one trace file
+static int load(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        perror(path);
+        return -1;
+    }
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if(fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(TraceHeader))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        fprintf(stderr, "%s: not a trace file\n", path);
+        return -1;
+    }
+
+    TraceHeader *header = (TraceHeader*) map;
+    if(header->magic != TRACE_MAGIC || header->version != TRACE_VERSION ||
+       sizeof(TraceHeader) + (size_t) header->num_slots * sizeof(TraceRecord) > (size_t) st.st_size)
+    {
+        fprintf(stderr, "%s: not a trace file\n", path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    TraceRecord *slots = (TraceRecord*) ((char*) map + sizeof(TraceHeader));
+    uint64_t end = __atomic_load_n(&header->next_seq, __ATOMIC_ACQUIRE);
+    uint64_t first = end > header->num_slots ? end - header->num_slots : 0;
+    char *process = strndup(header->process, sizeof(header->process));
+
+    for(uint64_t seq = first; seq < end; seq++)
+    {
+        TraceRecord *slot = &slots[seq % header->num_slots];
+        if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq + 1)
+            continue;
+
+        if(num_spans == max_spans)
+        {
+            max_spans = max_spans ? max_spans * 2 : 4096;
+            spans = (Span*) realloc(spans, max_spans * sizeof(Span));
+            if(spans == NULL)
+            {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        Span *span = &spans[num_spans];
+        span->rec = *slot;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq + 1 || span->rec.point >= TRACE_NUM_POINTS)
+            continue;   // overwritten while we copied it
+        span->process = process;
+        span->pid = header->pid;
+        num_spans++;
+    }
+
+    munmap(map, st.st_size);
+    return 0;
+}
+
+static int by_request_then_time(const void *a, const void *b)
+{
+    const TraceRecord *x = &((const Span*) a)->rec, *y = &((const Span*) b)->rec;
+    if(x->trace_id != y->trace_id)
+        return x->trace_id < y->trace_id ? -1 : 1;
+    if(x->start_ns != y->start_ns)
+        return x->start_ns < y->start_ns ? -1 : 1;
+    return 0;
+}
+
+static int by_first_span(const void *a, const void *b)
+{
+    const Request *x = (const Request*) a, *y = (const Request*) b;
+    if(x->first_ns != y->first_ns)
+        return x->first_ns < y->first_ns ? -1 : 1;
+    return 0;
+}
+
+static void print_timeline(const Request *req)
+{
+    printf("request %016llx\n", (unsigned long long) req->trace_id);
+    for(size_t i = req->begin; i < req->end; i++)
+    {
+        const Span *s = &spans[i];
+        printf("  +%10.1f us  %-8s %6u  %-16s %10.1f us\n",
+               (s->rec.start_ns - req->first_ns) / 1e3, s->process, s->pid,
+               point_names[s->rec.point], s->rec.duration_ns / 1e3);
+    }
+}
+
+static void print_chrome(const Request *req, uint64_t origin_ns, int *first)
+{
+    for(size_t i = req->begin; i < req->end; i++)
+    {
+        const Span *s = &spans[i];
+        printf("%s\n{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %u, \"tid\": %u, "
+               "\"args\": {\"process\": \"%s\", \"request\": \"%016llx\"}}",
+               *first ? "" : ",", point_names[s->rec.point], (s->rec.start_ns - origin_ns) / 1e3,
+               s->rec.duration_ns / 1e3, s->pid, s->rec.tid, s->process,
+               (unsigned long long) s->rec.trace_id);
+        *first = 0;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int chrome = 0;
+    int only_one = 0;
+    unsigned long long only_id = 0;
+    long limit = -1;
+    int opt;
+
+    while((opt = getopt(argc, argv, "cr:n:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'c': chrome = 1; break;
+            case 'r': only_one = 1; only_id = strtoull(optarg, NULL, 16); break;
+            case 'n': limit = atol(optarg); break;
+            default: usage();
+        }
+    }
+    if(optind >= argc)
+        usage();
+
+    for(int i = optind; i < argc; i++)
+        if(load(argv[i]) < 0)
+            return EXIT_FAILURE;
+
+    qsort(spans, num_spans, sizeof(Span), by_request_then_time);
+
+    // Group the spans by request (ID 0 means the frame had no header)
+    Request *requests = (Request*) malloc((num_spans + 1) * sizeof(Request));
+    size_t num_requests = 0;
+    for(size_t i = 0; i < num_spans; )
+    {
+        size_t j = i;
+        while(j < num_spans && spans[j].rec.trace_id == spans[i].rec.trace_id)
+            j++;
+        if(spans[i].rec.trace_id != 0 && (!only_one || spans[i].rec.trace_id == only_id))
+        {
+            Request *req = &requests[num_requests++];
+            req->trace_id = spans[i].rec.trace_id;
+            req->first_ns = spans[i].rec.start_ns;
+            req->begin = i;
+            req->end = j;
+        }
+        i = j;
+    }
+    qsort(requests, num_requests, sizeof(Request), by_first_span);
+    if(limit >= 0 && (size_t) limit < num_requests)
+        num_requests = limit;
+
+    if(chrome)
+    {
+        int first = 1;
+        printf("{\"traceEvents\": [");
+        for(size_t i = 0; i < num_requests; i++)
+            print_chrome(&requests[i], requests[0].first_ns, &first);
+        printf("\n]}\n");
+    }
+    else
+    {
+        for(size_t i = 0; i < num_requests; i++)
+            print_timeline(&requests[i]);
+    }
+
+    free(requests);
+    free(spans);
+    return EXIT_SUCCESS;
+}
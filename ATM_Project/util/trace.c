@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "trace.h"
+#include "encryption/frame.h"
+#include "util/env.h"
+
+static TraceHeader *trace_header = NULL;
+static TraceRecord *trace_slots = NULL;
+static size_t trace_map_len = 0;
+static __thread uint16_t trace_tid = 0;
+
+uint64_t trace_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Create this process's trace file. Returns 0 on success; -1 if it could not
+// be created, in which case spans are silently discarded
+int trace_open(const char *process)
+{
+    const char *dir = getenv("TRACE_DIR");
+    uint32_t num_slots = env_int("TRACE_SLOTS", TRACE_DEFAULT_SLOTS, 1, 1 << 26);
+    char path[4096];
+
+    snprintf(path, sizeof(path), "%s/%s.%d.trace", dir != NULL ? dir : ".", process, (int)getpid());
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+    {
+        perror("Error creating trace file");
+        return -1;
+    }
+
+    size_t map_len = sizeof(TraceHeader) + (size_t)num_slots * sizeof(TraceRecord);
+    void *map = MAP_FAILED;
+    if(ftruncate(fd, map_len) == 0)
+    {
+        map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        perror("Error mapping trace file");
+        return -1;
+    }
+
+    TraceHeader *header = (TraceHeader *)map;
+    header->magic = TRACE_MAGIC;
+    header->version = TRACE_VERSION;
+    header->num_slots = num_slots;
+    header->pid = getpid();
+    header->next_seq = 0;
+    strncpy(header->process, process, sizeof(header->process) - 1);
+
+    trace_slots = (TraceRecord *)((char *)map + sizeof(TraceHeader));
+    trace_map_len = map_len;
+    __atomic_store_n(&trace_header, header, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void trace_close()
+{
+    TraceHeader *header = trace_header;
+    if(header != NULL)
+    {
+        trace_header = NULL;
+        munmap(header, trace_map_len);
+    }
+}
+
+// Record one span. Safe to call from any thread, with or without an open trace file
+void trace_span(uint64_t trace_id, TracePoint point, uint64_t start_ns, uint64_t end_ns)
+{
+    TraceHeader *header = __atomic_load_n(&trace_header, __ATOMIC_ACQUIRE);
+    if(header == NULL)
+    {
+        return;
+    }
+    if(trace_tid == 0)
+    {
+        trace_tid = (uint16_t)syscall(SYS_gettid) | 1;
+    }
+
+    uint64_t seq = __atomic_fetch_add(&header->next_seq, 1, __ATOMIC_RELAXED);
+    TraceRecord *rec = &trace_slots[seq % header->num_slots];
+
+    // Unpublish the slot while it is rewritten so readers never see a mix
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    rec->trace_id = trace_id;
+    rec->start_ns = start_ns;
+    rec->duration_ns = end_ns > start_ns ? (uint32_t)(end_ns - start_ns) : 0;
+    rec->point = point;
+    rec->tid = trace_tid;
+    __atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+// The trace ID of a frame: the request ID from its cleartext header, or 0
+uint64_t trace_id_of(const void *frame, long len)
+{
+    FrameHeader header;
+    if(len < 0 || frame_peek((const unsigned char *)frame, len, &header) != 0)
+    {
+        return 0;
+    }
+    return header.request_id;
+}
@@ -0,0 +1,99 @@
+/*
+ * Request tracing across the ATM, router and bank.
+ *
+ * Each process records spans (a trace point, a start time and a
+ * duration) into its own trace file, a memory-mapped ring of fixed-size
+ * records written the same way as the router's capture: a writer claims
+ * a slot with one atomic add and publishes it by storing its sequence
+ * number last, so threads record without locks or syscalls, and the
+ * oldest spans are overwritten once the ring is full.
+ *
+ * Spans are keyed by the request ID from the frame header, which the
+ * router and bank can read without decrypting anything and the bank
+ * echoes in its reply, so trace-merge can line up every process's view
+ * of a request.  Timestamps come from CLOCK_MONOTONIC, which all
+ * processes on a host share.
+ *
+ * Tracing is compiled in with -DTRACE (make TRACE=1); otherwise the
+ * TRACE_* macros expand to nothing.  Trace files are written to
+ * TRACE_DIR (default .) as <process>.<pid>.trace with TRACE_SLOTS
+ * records (default 65536).
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+
+#define TRACE_MAGIC 0x43415254u
+#define TRACE_VERSION 2
+#define TRACE_DEFAULT_SLOTS 65536
+
+// Where a span was recorded. The bank's stages follow BankStage's order
+typedef enum
+{
+    TRACE_ATM_REQUEST,          // command issued until its reply is handled
+    TRACE_ATM_SEAL,
+    TRACE_ATM_SEND,             // one (re)transmission
+    TRACE_ATM_OPEN,
+    TRACE_ROUTER_REQUEST,       // atm->bank datagram received until forwarded
+    TRACE_ROUTER_REPLY,         // bank->atm datagram received until forwarded
+    TRACE_BANK_CACHE,
+    TRACE_BANK_ADMIT,
+    TRACE_BANK_DECRYPT,
+    TRACE_BANK_PARSE,
+    TRACE_BANK_EXECUTE,
+    TRACE_BANK_ENCRYPT,
+    TRACE_BANK_SEND,
+    TRACE_BANK_REQUEST,         // datagram dequeued until its reply is queued
+    TRACE_NUM_POINTS
+} TracePoint;
+
+#define TRACE_POINT_NAMES { \
+    "atm request", "atm seal", "atm send", "atm open", \
+    "router request", "router reply", \
+    "bank cache", "bank admit", "bank decrypt", "bank parse", "bank execute", "bank encrypt", "bank send", \
+    "bank request" }
+
+typedef struct _TraceHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_slots;
+    uint32_t pid;
+    uint64_t next_seq;
+    char process[16];
+    char pad[24];
+} TraceHeader;
+
+typedef struct _TraceRecord
+{
+    uint64_t seq;               // sequence number + 1; 0 while being written
+    uint64_t trace_id;
+    uint64_t start_ns;
+    uint32_t duration_ns;
+    uint16_t point;
+    uint16_t tid;               // low bits of the recording thread's ID
+} TraceRecord;
+
+uint64_t trace_now_ns();
+int trace_open(const char *process);
+void trace_close();
+void trace_span(uint64_t trace_id, TracePoint point, uint64_t start_ns, uint64_t end_ns);
+uint64_t trace_id_of(const void *frame, long len);
+
+#ifdef TRACE
+#define TRACE_OPEN(process) trace_open(process)
+#define TRACE_CLOSE() trace_close()
+#define TRACE_NOW() trace_now_ns()
+#define TRACE_SPAN(id, point, start_ns) trace_span((id), (point), (start_ns), trace_now_ns())
+#define TRACE_SPAN_AT(id, point, start_ns, end_ns) trace_span((id), (point), (start_ns), (end_ns))
+#else
+#define TRACE_OPEN(process) ((void)0)
+#define TRACE_CLOSE() ((void)0)
+#define TRACE_NOW() ((uint64_t)0)
+#define TRACE_SPAN(id, point, start_ns) ((void)(start_ns))
+#define TRACE_SPAN_AT(id, point, start_ns, end_ns) ((void)(start_ns), (void)(end_ns))
+#endif
+
+#endif
@@ -0,0 +1,205 @@
+/*
+ * Measures round-trip latency over each transport (see transport.h).
+ *
+ * Usage:  transport-bench [-n <round trips>] [-s <bytes>] [-p <port>] [<transport> ...]
+ *
+ *   -n  round trips timed per transport (default 100000), after 1000
+ *       untimed ones
+ *   -s  message size (default 512, about the size of a sealed request)
+ *   -p  port of the echoing endpoint; the pinging one uses the next port
+ *       (default 33000)
+ *
+ * The transports named (default: udp unix shm tcp) are measured in turn.
+ * The messages are laid out as frames (see frame.h), which tcp needs to
+ * find where each one ends.  For each transport, a child process echoes
+ * every message straight back while the parent has one outstanding at a
+ * time.  Both sides wait in transport_poll() the way the ATM and bank do,
+ * so the times include waking a sleeping receiver.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/wait.h>
+#include "transport.h"
+#include "histogram.h"
+#include "encryption/frame.h"
+
+#define WARMUP_ROUND_TRIPS 1000
+#define MAX_SIZE FRAME_MAX_SIZE
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage:  transport-bench [-n <round trips>] [-s <bytes>] [-p <port>] [<transport> ...]\n");
+    exit(1);
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void endpoint_addr(struct sockaddr_in *addr, unsigned port)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = inet_addr("127.0.0.1");
+    addr->sin_port = htons(port);
+}
+
+static int open_endpoint(unsigned port)
+{
+    struct sockaddr_in addr;
+    endpoint_addr(&addr, port);
+    int fd = transport_socket();
+    if(fd < 0 || transport_bind(fd, &addr) < 0)
+    {
+        perror("Could not open endpoint");
+        exit(1);
+    }
+    return fd;
+}
+
+// Wait up to timeout_ns for a message. Returns its length; -1 on timeout
+static ssize_t wait_recv(int fd, char *buf, size_t len, struct sockaddr_in *from, uint64_t timeout_ns)
+{
+    uint64_t deadline = now_ns() + timeout_ns;
+    while(1)
+    {
+        ssize_t n = transport_recvfrom(fd, buf, len, MSG_DONTWAIT, from);
+        if(n >= 0)
+            return n;
+
+        uint64_t now = now_ns();
+        if(now >= deadline)
+            return -1;
+        struct timespec ts = { (deadline - now) / 1000000000, (deadline - now) % 1000000000 };
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        transport_poll(&pfd, 1, &ts);
+    }
+}
+
+// The child: send everything back where it came from until a bare busy header arrives
+static void echo(unsigned port)
+{
+    static char buf[MAX_SIZE];
+    int fd = open_endpoint(port);
+    struct sockaddr_in from;
+
+    while(1)
+    {
+        ssize_t n = wait_recv(fd, buf, sizeof(buf), &from, 60000000000ULL);
+        if(n <= (ssize_t) sizeof(FrameHeader))
+            break;
+        transport_sendto(fd, buf, n, 0, &from);
+    }
+    transport_close(fd);
+}
+
+// Returns 0 on success; -1 if the echo endpoint stopped answering
+static int ping(unsigned port, long round_trips, size_t size, Histogram *rtt)
+{
+    static char buf[MAX_SIZE], reply[MAX_SIZE];
+    int fd = open_endpoint(port + 1);
+    struct sockaddr_in dest;
+    endpoint_addr(&dest, port);
+
+    // A request frame whose ciphertext fills out the rest of size
+    FrameHeader header = { FRAME_REQUEST, 0, 0, 0 };
+    int length_ciphertext = size - FRAME_OVERHEAD;
+    memset(buf, 'x', size);
+    memcpy(buf, &header, sizeof(header));
+    memcpy(buf + sizeof(header), &length_ciphertext, sizeof(length_ciphertext));
+
+    // The echo endpoint may not be up yet: knock until it answers
+    int up = 0;
+    for(int i = 0; i < 500 && !up; i++)
+    {
+        transport_sendto(fd, buf, size, 0, &dest);
+        up = wait_recv(fd, reply, sizeof(reply), NULL, 10000000) >= 0;
+    }
+    while(up && wait_recv(fd, reply, sizeof(reply), NULL, 10000000) >= 0);
+
+    histogram_reset(rtt);
+    for(long i = 0; up && i < WARMUP_ROUND_TRIPS + round_trips; i++)
+    {
+        uint64_t start = now_ns();
+        transport_sendto(fd, buf, size, 0, &dest);
+        if(wait_recv(fd, reply, sizeof(reply), NULL, 1000000000) < 0)
+            up = 0;
+        else if(i >= WARMUP_ROUND_TRIPS)
+            histogram_record(rtt, now_ns() - start);
+    }
+
+    header.type = FRAME_BUSY;
+    transport_sendto(fd, &header, sizeof(header), 0, &dest);
+    transport_close(fd);
+    return up ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+    static const char *all[] = { "udp", "unix", "shm", "tcp" };
+    long round_trips = 100000;
+    long size = 512;
+    long port = 33000;
+    int opt;
+
+    while((opt = getopt(argc, argv, "n:s:p:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'n': round_trips = atol(optarg); break;
+            case 's': size = atol(optarg); break;
+            case 'p': port = atol(optarg); break;
+            default: usage();
+        }
+    }
+    if(round_trips < 1 || size < (long) FRAME_OVERHEAD || size > MAX_SIZE || port < 1 || port > 65534)
+        usage();
+
+    const char **names = optind < argc ? (const char **) argv + optind : all;
+    int num_names = optind < argc ? argc - optind : 4;
+
+    printf("%-5s %12s %9s %9s %9s %9s %9s %9s\n", "", "round trips/s", "mean", "p50", "p90", "p99", "p99.9", "max");
+    for(int t = 0; t < num_names; t++)
+    {
+        if(transport_select(names[t]) < 0)
+            usage();
+        fflush(stdout);
+
+        pid_t child = fork();
+        if(child < 0)
+        {
+            perror("fork");
+            return EXIT_FAILURE;
+        }
+        if(child == 0)
+        {
+            echo(port);
+            _exit(0);
+        }
+
+        Histogram rtt;
+        int ok = ping(port, round_trips, size, &rtt);
+        waitpid(child, NULL, 0);
+        if(ok < 0)
+        {
+            printf("%-5s no answer from the echo endpoint\n", names[t]);
+            continue;
+        }
+
+        printf("%-5s %12.0f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f  us\n", names[t],
+               1e9 / histogram_mean(&rtt), histogram_mean(&rtt) / 1e3,
+               histogram_percentile(&rtt, 50) / 1e3, histogram_percentile(&rtt, 90) / 1e3,
+               histogram_percentile(&rtt, 99) / 1e3, histogram_percentile(&rtt, 99.9) / 1e3,
+               rtt.max / 1e3);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,1638 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/tcp.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include "transport.h"
+#include "env.h"
+#include "encryption/frame.h"
+
+// Ephemeral ports handed out to endpoints bound to port 0 (unix and shm)
+#define EPHEMERAL_FIRST 49152
+#define EPHEMERAL_COUNT 16384
+
+// Messages translated per unix sendmmsg/recvmmsg call
+#define UNIX_MAX_BATCH 64
+
+#define SHM_MAGIC 0x4d485341u
+#define SHM_PREFIX "/atm-shm"
+#define SHM_MAX_SOCKETS 64              // shm endpoints per process
+#define SHM_FD_BASE (1 << 24)           // shm endpoints are numbered from here
+#define SHM_MAX_SENDERS 256             // rings into one endpoint
+#define SHM_PEER_BITS 9                 // endpoints one endpoint can send to
+#define SHM_MAX_PEERS (1 << SHM_PEER_BITS)
+
+#define TCP_MAGIC 0x41544d54u           // "ATMT", the start of a connection
+#define TCP_MAX_ENDPOINTS 64            // tcp endpoints per process
+#define TCP_MAX_CONNS 256               // connections into or out of one endpoint
+#define TCP_IN_BUFFER (64 * 1024)       // bytes read ahead per connection
+#define TCP_EVENTS 64
+
+static const char *transport_names[NUM_TRANSPORTS] = { "udp", "unix", "shm", "tcp" };
+static int current_kind = -1;
+
+static uint64_t realtime_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int transport_select(const char *name)
+{
+    for(int i = 0; i < NUM_TRANSPORTS; i++)
+    {
+        if(strcmp(name, transport_names[i]) == 0)
+        {
+            current_kind = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+TransportKind transport_kind()
+{
+    if(current_kind < 0)
+    {
+        const char *name = getenv("TRANSPORT");
+        if(name == NULL || transport_select(name) < 0)
+            current_kind = TRANSPORT_UDP;
+    }
+    return (TransportKind) current_kind;
+}
+
+const char *transport_name(TransportKind kind)
+{
+    return kind < NUM_TRANSPORTS ? transport_names[kind] : "?";
+}
+
+static void loopback_addr(struct sockaddr_in *addr, unsigned port)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr->sin_port = htons(port);
+}
+
+// Fill in hdr's control buffer the way SO_TIMESTAMPNS would, with the time
+// the message arrived, or leave it empty if timestamps are off
+static void add_timestamp(struct msghdr *hdr, int timestamps, uint64_t ns)
+{
+    if(timestamps && hdr->msg_control != NULL && hdr->msg_controllen >= CMSG_SPACE(sizeof(struct timespec)))
+    {
+        struct cmsghdr *c = (struct cmsghdr *) hdr->msg_control;
+        struct timespec ts = { ns / 1000000000, ns % 1000000000 };
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_TIMESTAMPNS;
+        c->cmsg_len = CMSG_LEN(sizeof(ts));
+        memcpy(CMSG_DATA(c), &ts, sizeof(ts));
+        hdr->msg_controllen = CMSG_SPACE(sizeof(ts));
+    }
+    else
+        hdr->msg_controllen = 0;
+}
+
+/*
+ * unix: AF_UNIX datagram sockets, one socket file per port
+ */
+
+static const char *unix_dir()
+{
+    static const char *dir = NULL;
+    if(dir == NULL)
+    {
+        dir = getenv("TRANSPORT_DIR");
+        if(dir == NULL || *dir == '\0')
+            dir = "/tmp/atm-transport";
+    }
+    return dir;
+}
+
+static socklen_t unix_addr(struct sockaddr_un *un, unsigned port)
+{
+    un->sun_family = AF_UNIX;
+    int n = snprintf(un->sun_path, sizeof(un->sun_path), "%s/%u", unix_dir(), port);
+    return offsetof(struct sockaddr_un, sun_path) + n + 1;
+}
+
+// The port a unix address stands for; 0 for an unbound sender
+static void unix_to_inet(const struct sockaddr_un *un, socklen_t len, struct sockaddr_in *addr)
+{
+    unsigned port = 0;
+    if(len > offsetof(struct sockaddr_un, sun_path) && un->sun_path[0] != '\0')
+    {
+        const char *slash = strrchr(un->sun_path, '/');
+        port = atoi(slash != NULL ? slash + 1 : un->sun_path);
+    }
+    loopback_addr(addr, port);
+}
+
+static int unix_bind_port(int fd, unsigned port)
+{
+    struct sockaddr_un un;
+    socklen_t len = unix_addr(&un, port);
+    if(bind(fd, (struct sockaddr *)&un, len) == 0)
+        return 0;
+    if(errno != EADDRINUSE)
+        return -1;
+
+    // A file left behind by an endpoint that has gone away refuses
+    // connections; take it over as binding a UDP port would
+    int probe = socket(AF_UNIX, SOCK_DGRAM, 0);
+    int live = probe < 0 || connect(probe, (struct sockaddr *)&un, len) == 0 || errno != ECONNREFUSED;
+    if(probe >= 0)
+        close(probe);
+    if(live)
+    {
+        errno = EADDRINUSE;
+        return -1;
+    }
+    unlink(un.sun_path);
+    return bind(fd, (struct sockaddr *)&un, len);
+}
+
+static int unix_bind(int fd, unsigned port)
+{
+    if(port != 0)
+        return unix_bind_port(fd, port);
+
+    unsigned start = getpid() * 2654435761u;
+    for(unsigned i = 0; i < EPHEMERAL_COUNT; i++)
+    {
+        if(unix_bind_port(fd, EPHEMERAL_FIRST + (start + i) % EPHEMERAL_COUNT) == 0)
+            return 0;
+        if(errno != EADDRINUSE)
+            return -1;
+    }
+    return -1;
+}
+
+static int unix_close(int fd)
+{
+    struct sockaddr_un un;
+    socklen_t len = sizeof(un);
+    if(getsockname(fd, (struct sockaddr *)&un, &len) == 0 &&
+       len > offsetof(struct sockaddr_un, sun_path) && un.sun_path[0] != '\0')
+        unlink(un.sun_path);
+    return close(fd);
+}
+
+// Point each message's name at a unix address for the duration of one
+// sendmmsg/recvmmsg, then put the caller's sockaddr_in back
+typedef struct _UnixNames
+{
+    struct sockaddr_un un[UNIX_MAX_BATCH];
+    void *saved[UNIX_MAX_BATCH];
+    socklen_t saved_len[UNIX_MAX_BATCH];
+} UnixNames;
+
+static __thread UnixNames unix_names;
+
+static int unix_sendmmsg(int fd, struct mmsghdr *msgs, unsigned int count, int flags)
+{
+    if(count > UNIX_MAX_BATCH)
+        count = UNIX_MAX_BATCH;
+
+    for(unsigned int i = 0; i < count; i++)
+    {
+        struct msghdr *hdr = &msgs[i].msg_hdr;
+        unix_names.saved[i] = hdr->msg_name;
+        unix_names.saved_len[i] = hdr->msg_namelen;
+        if(hdr->msg_name != NULL)
+        {
+            unsigned port = ntohs(((struct sockaddr_in *)hdr->msg_name)->sin_port);
+            hdr->msg_namelen = unix_addr(&unix_names.un[i], port);
+            hdr->msg_name = &unix_names.un[i];
+        }
+    }
+
+    // A unix datagram for a full receive queue would block the sender where
+    // UDP drops it; keep the UDP behaviour so two busy endpoints cannot deadlock
+    int n = sendmmsg(fd, msgs, count, flags | MSG_DONTWAIT);
+
+    for(unsigned int i = 0; i < count; i++)
+    {
+        msgs[i].msg_hdr.msg_name = unix_names.saved[i];
+        msgs[i].msg_hdr.msg_namelen = unix_names.saved_len[i];
+    }
+    return n;
+}
+
+static int unix_recvmmsg(int fd, struct mmsghdr *msgs, unsigned int count, int flags)
+{
+    if(count > UNIX_MAX_BATCH)
+        count = UNIX_MAX_BATCH;
+
+    for(unsigned int i = 0; i < count; i++)
+    {
+        struct msghdr *hdr = &msgs[i].msg_hdr;
+        unix_names.saved[i] = hdr->msg_name;
+        if(hdr->msg_name != NULL)
+        {
+            hdr->msg_name = &unix_names.un[i];
+            hdr->msg_namelen = sizeof(unix_names.un[i]);
+        }
+    }
+
+    int n = recvmmsg(fd, msgs, count, flags, NULL);
+
+    for(unsigned int i = 0; i < count; i++)
+    {
+        struct msghdr *hdr = &msgs[i].msg_hdr;
+        if(unix_names.saved[i] == NULL)
+            continue;
+        if((int) i < n)
+            unix_to_inet(&unix_names.un[i], hdr->msg_namelen, (struct sockaddr_in *)unix_names.saved[i]);
+        hdr->msg_name = unix_names.saved[i];
+        hdr->msg_namelen = sizeof(struct sockaddr_in);
+    }
+    return n;
+}
+
+/*
+ * shm: a pair of single-producer, single-consumer rings between each two
+ * endpoints that talk, and a futex per process to sleep on
+ */
+
+// One direction of a link, written only by the sending endpoint and read
+// only by the receiving one. Slots follow the header
+typedef struct _ShmRing
+{
+    uint32_t magic;
+    uint32_t num_slots;         // a power of two
+    uint32_t slot_size;         // bytes per slot, ShmSlot header included
+    uint32_t producer_port;
+    uint32_t closed;            // set once the producer is gone
+    char pad1[44];
+    uint32_t head;              // next slot to fill; written by the producer
+    char pad2[60];
+    uint32_t tail;              // next slot to drain; written by the consumer
+    char pad3[60];
+} ShmRing;
+
+typedef struct _ShmSlot
+{
+    uint32_t len;
+    uint32_t pad;
+    uint64_t sent_ns;           // CLOCK_REALTIME, reported as the receive timestamp
+    char data[];
+} ShmSlot;
+
+enum { SENDER_FREE = 0, SENDER_CLAIMED, SENDER_READY };
+
+// A ring registered with an endpoint by one of its senders
+typedef struct _ShmSender
+{
+    uint32_t state;
+    uint32_t port;
+    uint32_t id;                // distinguishes rings from the same port across restarts
+} ShmSender;
+
+// The segment that makes an endpoint reachable. Senders register their
+// rings here and ring the doorbell of the endpoint's owner after sending
+typedef struct _ShmEndpoint
+{
+    uint32_t magic;
+    uint32_t pid;
+    uint32_t alive;
+    uint32_t incarnation;       // bumped whenever a new owner takes the port
+    uint32_t door_port;         // endpoint holding the doorbell the owner sleeps on
+    uint32_t num_senders;       // high-water mark of senders[]
+    char pad1[40];
+    uint32_t door;              // futex word, bumped by every batch sent to the owner
+    uint32_t sleepers;          // owner threads waiting on door
+    char pad2[56];
+    ShmSender senders[SHM_MAX_SENDERS];
+} ShmEndpoint;
+
+typedef struct _ShmInbox
+{
+    uint32_t id;
+    ShmRing *ring;
+    size_t map_len;
+} ShmInbox;
+
+typedef struct _ShmPeer
+{
+    uint32_t port;              // 0 if the entry is unused
+    uint32_t incarnation;
+    ShmEndpoint *ep;
+    ShmEndpoint *door;
+    ShmRing *ring;
+    size_t ring_len;
+} ShmPeer;
+
+typedef struct _ShmSocket
+{
+    int used;
+    uint32_t port;              // 0 until bound
+    int timestamps;
+    ShmEndpoint *ep;
+    ShmInbox inbox[SHM_MAX_SENDERS];
+    uint32_t next_inbox;        // where the next receive starts, so no sender starves the rest
+    ShmPeer *peers;             // hashed by port
+} ShmSocket;
+
+static ShmSocket shm_sockets[SHM_MAX_SOCKETS];
+
+// All of a process's endpoints share the doorbell of the first one it bound
+static ShmEndpoint *shm_door = NULL;
+static uint32_t shm_door_port = 0;
+
+static long futex(uint32_t *word, int op, uint32_t value, const struct timespec *timeout)
+{
+    return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+static int pid_alive(uint32_t pid)
+{
+    return pid != 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+static ShmSocket *shm_socket(int fd)
+{
+    if(fd < SHM_FD_BASE || fd >= SHM_FD_BASE + SHM_MAX_SOCKETS || !shm_sockets[fd - SHM_FD_BASE].used)
+    {
+        errno = EBADF;
+        return NULL;
+    }
+    return &shm_sockets[fd - SHM_FD_BASE];
+}
+
+static void shm_endpoint_name(char *name, size_t size, uint32_t port)
+{
+    snprintf(name, size, SHM_PREFIX ".%u", port);
+}
+
+static void shm_ring_name(char *name, size_t size, uint32_t from, uint32_t to, uint32_t id)
+{
+    snprintf(name, size, SHM_PREFIX ".%u.%u.%08x", from, to, id);
+}
+
+// Map a segment, creating it with *len bytes if create is set; otherwise map
+// all of an existing segment and return its size in *len. Returns NULL on error
+static void *shm_map(const char *name, int create, size_t *len)
+{
+    int fd = shm_open(name, O_RDWR | (create ? O_CREAT : 0), 0600);
+    if(fd < 0)
+        return NULL;
+
+    void *map = MAP_FAILED;
+    struct stat st;
+    if(create ? ftruncate(fd, *len) == 0 : fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        if(!create)
+            *len = st.st_size;
+        map = mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    return map == MAP_FAILED ? NULL : map;
+}
+
+static ShmEndpoint *shm_open_endpoint(uint32_t port)
+{
+    char name[64];
+    size_t len;
+    shm_endpoint_name(name, sizeof(name), port);
+    ShmEndpoint *ep = (ShmEndpoint *) shm_map(name, 0, &len);
+    if(ep != NULL && (len < sizeof(ShmEndpoint) || ep->magic != SHM_MAGIC))
+    {
+        munmap(ep, len);
+        return NULL;
+    }
+    return ep;
+}
+
+static void shm_ring_door(ShmEndpoint *door)
+{
+    __atomic_add_fetch(&door->door, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&door->sleepers, __ATOMIC_SEQ_CST) != 0)
+        futex(&door->door, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+// Take over port for s. Returns 0 on success; -1 if a live endpoint has it
+static int shm_claim(ShmSocket *s, uint32_t port)
+{
+    char name[64];
+    size_t len = sizeof(ShmEndpoint);
+    shm_endpoint_name(name, sizeof(name), port);
+    ShmEndpoint *ep = (ShmEndpoint *) shm_map(name, 1, &len);
+    if(ep == NULL)
+        return -1;
+
+    if(ep->magic == SHM_MAGIC && __atomic_load_n(&ep->alive, __ATOMIC_ACQUIRE) && pid_alive(ep->pid))
+    {
+        munmap(ep, len);
+        errno = EADDRINUSE;
+        return -1;
+    }
+
+    // Rings left by the previous owner's senders will never be read again
+    for(uint32_t i = 0; i < SHM_MAX_SENDERS; i++)
+    {
+        if(ep->magic == SHM_MAGIC && ep->senders[i].state == SENDER_READY)
+        {
+            char ring[64];
+            shm_ring_name(ring, sizeof(ring), ep->senders[i].port, port, ep->senders[i].id);
+            shm_unlink(ring);
+        }
+        ep->senders[i].state = SENDER_FREE;
+    }
+    ep->num_senders = 0;
+    ep->magic = SHM_MAGIC;
+    ep->pid = getpid();
+    ep->sleepers = 0;
+    ep->door_port = shm_door != NULL ? shm_door_port : port;
+    __atomic_add_fetch(&ep->incarnation, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&ep->alive, 1, __ATOMIC_RELEASE);
+
+    if(shm_door == NULL)
+    {
+        shm_door = ep;
+        shm_door_port = port;
+    }
+    s->ep = ep;
+    s->port = port;
+    return 0;
+}
+
+static int shm_bind(ShmSocket *s, uint32_t port)
+{
+    if(s->ep != NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if(s->peers == NULL && (s->peers = (ShmPeer *) calloc(SHM_MAX_PEERS, sizeof(ShmPeer))) == NULL)
+        return -1;
+
+    if(port != 0)
+        return shm_claim(s, port);
+
+    unsigned start = getpid() * 2654435761u;
+    for(unsigned i = 0; i < EPHEMERAL_COUNT; i++)
+    {
+        if(shm_claim(s, EPHEMERAL_FIRST + (start + i) % EPHEMERAL_COUNT) == 0)
+            return 0;
+        if(errno != EADDRINUSE)
+            return -1;
+    }
+    return -1;
+}
+
+static void shm_disconnect(ShmPeer *peer)
+{
+    if(peer->ring != NULL)
+    {
+        __atomic_store_n(&peer->ring->closed, 1, __ATOMIC_RELEASE);
+        munmap(peer->ring, peer->ring_len);
+    }
+    if(peer->door != NULL && peer->door != peer->ep)
+        munmap(peer->door, sizeof(ShmEndpoint));
+    if(peer->ep != NULL)
+        munmap(peer->ep, sizeof(ShmEndpoint));
+    peer->ring = NULL;
+    peer->door = NULL;
+    peer->ep = NULL;
+}
+
+// Create s's ring to port and register it with the endpoint there.
+// Returns 0 on success; -1 if there is no such endpoint or it has no room
+static int shm_connect(ShmSocket *s, ShmPeer *peer, uint32_t port)
+{
+    static uint32_t next_id = 0;
+
+    ShmEndpoint *ep = shm_open_endpoint(port);
+    if(ep == NULL)
+        return -1;
+    uint32_t incarnation = __atomic_load_n(&ep->incarnation, __ATOMIC_ACQUIRE);
+    ShmEndpoint *door = ep->door_port == port ? ep : shm_open_endpoint(ep->door_port);
+    if(!__atomic_load_n(&ep->alive, __ATOMIC_ACQUIRE) || door == NULL)
+    {
+        if(door != NULL && door != ep)
+            munmap(door, sizeof(ShmEndpoint));
+        munmap(ep, sizeof(ShmEndpoint));
+        return -1;
+    }
+
+    uint32_t num_slots = 1;
+    while(num_slots < (uint32_t) env_int("TRANSPORT_SHM_SLOTS", 256, 2, 1 << 16))
+        num_slots <<= 1;
+    uint32_t slot_size = (sizeof(ShmSlot) + env_int("TRANSPORT_SHM_SLOT_SIZE", 2048, 1, 1 << 20) + 63) & ~63u;
+    size_t len = sizeof(ShmRing) + (size_t) num_slots * slot_size;
+
+    char name[64];
+    uint32_t id = (getpid() << 12) ^ (uint32_t) monotonic_ns() ^ next_id++;
+    shm_ring_name(name, sizeof(name), s->port, port, id);
+    ShmRing *ring = (ShmRing *) shm_map(name, 1, &len);
+    if(ring == NULL)
+    {
+        munmap(ep, sizeof(ShmEndpoint));
+        return -1;
+    }
+    ring->magic = SHM_MAGIC;
+    ring->num_slots = num_slots;
+    ring->slot_size = slot_size;
+    ring->producer_port = s->port;
+    ring->closed = 0;
+    ring->head = 0;
+    ring->tail = 0;
+
+    // Claim a sender slot and publish the ring in it
+    for(uint32_t i = 0; i < SHM_MAX_SENDERS; i++)
+    {
+        uint32_t expected = SENDER_FREE;
+        if(!__atomic_compare_exchange_n(&ep->senders[i].state, &expected, SENDER_CLAIMED, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            continue;
+        ep->senders[i].port = s->port;
+        ep->senders[i].id = id;
+        __atomic_store_n(&ep->senders[i].state, SENDER_READY, __ATOMIC_RELEASE);
+
+        uint32_t count = __atomic_load_n(&ep->num_senders, __ATOMIC_ACQUIRE);
+        while(count < i + 1 && !__atomic_compare_exchange_n(&ep->num_senders, &count, i + 1, 0,
+                                                           __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+        peer->port = port;
+        peer->incarnation = incarnation;
+        peer->ep = ep;
+        peer->door = door;
+        peer->ring = ring;
+        peer->ring_len = len;
+        return 0;
+    }
+
+    shm_unlink(name);
+    munmap(ring, len);
+    if(door != ep)
+        munmap(door, sizeof(ShmEndpoint));
+    munmap(ep, sizeof(ShmEndpoint));
+    errno = ENOBUFS;
+    return -1;
+}
+
+// The link from s to port, (re)connecting it if the endpoint there has
+// changed hands. Returns NULL if nothing is listening on port
+static ShmPeer *shm_peer(ShmSocket *s, uint32_t port)
+{
+    uint32_t mask = SHM_MAX_PEERS - 1;
+    uint32_t i = (port * 2654435769u) >> (32 - SHM_PEER_BITS);
+    ShmPeer *peer = NULL;
+
+    for(uint32_t probe = 0; probe < SHM_MAX_PEERS; probe++, i = (i + 1) & mask)
+    {
+        if(s->peers[i].port == port || s->peers[i].port == 0)
+        {
+            peer = &s->peers[i];
+            break;
+        }
+    }
+    if(peer == NULL)
+        return NULL;
+
+    if(peer->ring != NULL &&
+       (!__atomic_load_n(&peer->ep->alive, __ATOMIC_ACQUIRE) ||
+        __atomic_load_n(&peer->ep->incarnation, __ATOMIC_ACQUIRE) != peer->incarnation))
+        shm_disconnect(peer);
+    if(peer->ring == NULL && shm_connect(s, peer, port) < 0)
+        return NULL;
+    return peer;
+}
+
+static size_t iov_total(const struct msghdr *hdr)
+{
+    size_t len = 0;
+    for(size_t i = 0; i < hdr->msg_iovlen; i++)
+        len += hdr->msg_iov[i].iov_len;
+    return len;
+}
+
+static int shm_sendmmsg(ShmSocket *s, struct mmsghdr *msgs, unsigned int count)
+{
+    if(s->ep == NULL && shm_bind(s, 0) < 0)
+        return -1;
+
+    uint64_t sent_ns = realtime_ns();
+    ShmEndpoint *pending = NULL;
+    unsigned int n;
+
+    for(n = 0; n < count; n++)
+    {
+        struct msghdr *hdr = &msgs[n].msg_hdr;
+        if(hdr->msg_name == NULL)
+        {
+            errno = EDESTADDRREQ;
+            break;
+        }
+
+        size_t len = iov_total(hdr);
+        msgs[n].msg_len = len;
+
+        // Like UDP, a datagram for an endpoint that is not there, or whose
+        // ring is full, is silently lost
+        ShmPeer *peer = shm_peer(s, ntohs(((struct sockaddr_in *)hdr->msg_name)->sin_port));
+        if(peer == NULL)
+            continue;
+
+        ShmRing *ring = peer->ring;
+        if(len > ring->slot_size - sizeof(ShmSlot))
+        {
+            errno = EMSGSIZE;
+            break;
+        }
+        uint32_t head = ring->head;
+        if(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= ring->num_slots)
+            continue;
+
+        ShmSlot *slot = (ShmSlot *) ((char *) ring + sizeof(ShmRing) +
+                                     (size_t) (head & (ring->num_slots - 1)) * ring->slot_size);
+        size_t off = 0;
+        for(size_t i = 0; i < hdr->msg_iovlen; i++)
+        {
+            memcpy(slot->data + off, hdr->msg_iov[i].iov_base, hdr->msg_iov[i].iov_len);
+            off += hdr->msg_iov[i].iov_len;
+        }
+        slot->len = len;
+        slot->sent_ns = sent_ns;
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+        // One wakeup per run of messages for the same process
+        if(pending != NULL && pending != peer->door)
+            shm_ring_door(pending);
+        pending = peer->door;
+    }
+
+    if(pending != NULL)
+        shm_ring_door(pending);
+    return n > 0 || count == 0 ? (int) n : -1;
+}
+
+static void shm_detach(ShmSocket *s, uint32_t i)
+{
+    ShmInbox *in = &s->inbox[i];
+    if(in->ring != NULL)
+    {
+        char name[64];
+        shm_ring_name(name, sizeof(name), in->ring->producer_port, s->port, in->id);
+        shm_unlink(name);
+        munmap(in->ring, in->map_len);
+    }
+    in->ring = NULL;
+    in->id = 0;
+}
+
+// Attach any rings registered since the last look, and let go of rings
+// whose producer has closed them once they are drained
+static uint32_t shm_refresh(ShmSocket *s)
+{
+    ShmEndpoint *ep = s->ep;
+    uint32_t count = __atomic_load_n(&ep->num_senders, __ATOMIC_ACQUIRE);
+
+    for(uint32_t i = 0; i < count; i++)
+    {
+        ShmSender *sender = &ep->senders[i];
+        ShmInbox *in = &s->inbox[i];
+        if(__atomic_load_n(&sender->state, __ATOMIC_ACQUIRE) != SENDER_READY)
+            continue;
+
+        if(in->ring != NULL && in->id == sender->id)
+        {
+            if(__atomic_load_n(&in->ring->closed, __ATOMIC_ACQUIRE) &&
+               in->ring->tail == __atomic_load_n(&in->ring->head, __ATOMIC_ACQUIRE))
+            {
+                shm_detach(s, i);
+                __atomic_store_n(&sender->state, SENDER_FREE, __ATOMIC_RELEASE);
+            }
+            continue;
+        }
+
+        shm_detach(s, i);
+        char name[64];
+        shm_ring_name(name, sizeof(name), sender->port, s->port, sender->id);
+        in->ring = (ShmRing *) shm_map(name, 0, &in->map_len);
+        if(in->ring == NULL || in->map_len < sizeof(ShmRing) || in->ring->magic != SHM_MAGIC)
+        {
+            // Its producer gave up on it before we got here
+            if(in->ring != NULL)
+                munmap(in->ring, in->map_len);
+            in->ring = NULL;
+            shm_unlink(name);
+            __atomic_store_n(&sender->state, SENDER_FREE, __ATOMIC_RELEASE);
+            continue;
+        }
+        in->id = sender->id;
+    }
+    return count;
+}
+
+static int shm_readable(ShmSocket *s)
+{
+    if(s->ep == NULL)
+        return 0;
+
+    uint32_t count = shm_refresh(s);
+    for(uint32_t i = 0; i < count; i++)
+    {
+        ShmRing *ring = s->inbox[i].ring;
+        if(ring != NULL && ring->tail != __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+            return 1;
+    }
+    return 0;
+}
+
+// Copy one slot into a message the way recvmsg would fill it in
+static void shm_deliver(ShmSocket *s, ShmRing *ring, ShmSlot *slot, struct mmsghdr *msg)
+{
+    struct msghdr *hdr = &msg->msg_hdr;
+    size_t off = 0;
+    for(size_t i = 0; i < hdr->msg_iovlen && off < slot->len; i++)
+    {
+        size_t n = slot->len - off < hdr->msg_iov[i].iov_len ? slot->len - off : hdr->msg_iov[i].iov_len;
+        memcpy(hdr->msg_iov[i].iov_base, slot->data + off, n);
+        off += n;
+    }
+    msg->msg_len = off;
+    hdr->msg_flags = off < slot->len ? MSG_TRUNC : 0;
+
+    if(hdr->msg_name != NULL)
+    {
+        loopback_addr((struct sockaddr_in *) hdr->msg_name, ring->producer_port);
+        hdr->msg_namelen = sizeof(struct sockaddr_in);
+    }
+    add_timestamp(hdr, s->timestamps, slot->sent_ns);
+}
+
+static int shm_recvmmsg(ShmSocket *s, struct mmsghdr *msgs, unsigned int count)
+{
+    if(s->ep == NULL)
+        return 0;
+
+    uint32_t num_inbox = shm_refresh(s);
+    unsigned int n = 0;
+
+    for(uint32_t k = 0; k < num_inbox && n < count; k++)
+    {
+        ShmRing *ring = s->inbox[(s->next_inbox + k) % num_inbox].ring;
+        if(ring == NULL)
+            continue;
+
+        uint32_t tail = ring->tail;
+        uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        while(tail != head && n < count)
+        {
+            ShmSlot *slot = (ShmSlot *) ((char *) ring + sizeof(ShmRing) +
+                                         (size_t) (tail & (ring->num_slots - 1)) * ring->slot_size);
+            shm_deliver(s, ring, slot, &msgs[n++]);
+            tail++;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+    if(num_inbox > 0)
+        s->next_inbox = (s->next_inbox + 1) % num_inbox;
+    return n;
+}
+
+static int shm_close(ShmSocket *s)
+{
+    if(s->peers != NULL)
+    {
+        for(uint32_t i = 0; i < SHM_MAX_PEERS; i++)
+            shm_disconnect(&s->peers[i]);
+        free(s->peers);
+    }
+
+    if(s->ep != NULL)
+    {
+        for(uint32_t i = 0; i < SHM_MAX_SENDERS; i++)
+            shm_detach(s, i);
+        __atomic_store_n(&s->ep->alive, 0, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&s->ep->incarnation, 1, __ATOMIC_RELEASE);
+
+        char name[64];
+        shm_endpoint_name(name, sizeof(name), s->port);
+
+        // While other endpoints still sleep on this one's doorbell, senders
+        // must be able to find it
+        int others = 0;
+        for(int i = 0; i < SHM_MAX_SOCKETS; i++)
+            others |= &shm_sockets[i] != s && shm_sockets[i].used && shm_sockets[i].ep != NULL;
+        if(s->ep != shm_door || !others)
+        {
+            shm_unlink(name);
+            if(s->ep == shm_door)
+                shm_door = NULL;
+            munmap(s->ep, sizeof(ShmEndpoint));
+        }
+    }
+
+    memset(s, 0, sizeof(*s));
+    return 0;
+}
+
+// Sleep until a sender rings this process's doorbell (if it has not already
+// moved on from seq) or timeout_ns passes; a negative timeout waits forever
+static void shm_sleep(uint32_t seq, int64_t timeout_ns)
+{
+    struct timespec ts = { timeout_ns / 1000000000, timeout_ns % 1000000000 };
+    __atomic_add_fetch(&shm_door->sleepers, 1, __ATOMIC_SEQ_CST);
+    futex(&shm_door->door, FUTEX_WAIT, seq, timeout_ns < 0 ? NULL : &ts);
+    __atomic_sub_fetch(&shm_door->sleepers, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * tcp: persistent connections between endpoints, carrying frames back to
+ * back and cut apart again by the length in each frame
+ */
+
+// The first bytes on a connection: the port its opener listens on, which is
+// the name replies are addressed to
+typedef struct _TcpHello
+{
+    uint32_t magic;
+    uint16_t port;
+    uint16_t reserved;
+} TcpHello;
+
+typedef struct _TcpConn
+{
+    int fd;
+    struct sockaddr_in peer;    // the far endpoint: its address and listening port
+    int identified;             // set once peer is known (at once for connections we open)
+    int want_out;               // EPOLLOUT is armed because out[] did not drain
+    int dirty;                  // has bytes queued by the current send call
+    uint64_t rx_ns;             // when in[] was last filled, CLOCK_REALTIME
+    char *in;
+    size_t in_start, in_end;
+    char *out;
+    size_t out_start, out_end, out_cap;
+} TcpConn;
+
+// An endpoint's descriptor is an epoll instance holding its listening
+// socket, its connections and an eventfd that stays readable while whole
+// frames wait in a connection's buffer, so it can be polled like a socket
+typedef struct _TcpEndpoint
+{
+    int epfd;
+    int listen_fd;
+    int pending_fd;
+    int pending;
+    int timestamps;
+    int reuseport;
+    size_t max_out;
+    TcpConn *conns[TCP_MAX_CONNS];
+    uint32_t num_conns;
+    uint32_t next_conn;         // where the next receive starts, so no connection starves the rest
+    TcpConn *dirty[TCP_MAX_CONNS];
+    uint32_t num_dirty;
+} TcpEndpoint;
+
+// Endpoints are opened, closed and looked up under tcp_lock; each one is
+// then only used by one thread at a time
+static TcpEndpoint *tcp_endpoints[TCP_MAX_ENDPOINTS];
+static pthread_mutex_t tcp_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static TcpEndpoint *tcp_endpoint(int fd)
+{
+    TcpEndpoint *ep = NULL;
+    pthread_mutex_lock(&tcp_lock);
+    for(int i = 0; i < TCP_MAX_ENDPOINTS && ep == NULL; i++)
+    {
+        if(tcp_endpoints[i] != NULL && tcp_endpoints[i]->epfd == fd)
+            ep = tcp_endpoints[i];
+    }
+    pthread_mutex_unlock(&tcp_lock);
+    if(ep == NULL)
+        errno = EBADF;
+    return ep;
+}
+
+static void tcp_watch(TcpEndpoint *ep, int op, int fd, uint32_t events, void *ptr)
+{
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = ptr;
+    epoll_ctl(ep->epfd, op, fd, &ev);
+}
+
+static int tcp_socket()
+{
+    TcpEndpoint *ep = (TcpEndpoint *) calloc(1, sizeof(TcpEndpoint));
+    if(ep == NULL)
+        return -1;
+    ep->listen_fd = -1;
+    ep->max_out = (size_t) env_int("TRANSPORT_TCP_MAX_BUFFER", 4 << 20, TCP_IN_BUFFER, 1 << 30);
+    ep->epfd = epoll_create1(0);
+    ep->pending_fd = eventfd(0, EFD_NONBLOCK);
+    if(ep->epfd < 0 || ep->pending_fd < 0)
+    {
+        if(ep->epfd >= 0)
+            close(ep->epfd);
+        if(ep->pending_fd >= 0)
+            close(ep->pending_fd);
+        free(ep);
+        return -1;
+    }
+    tcp_watch(ep, EPOLL_CTL_ADD, ep->pending_fd, EPOLLIN, ep);
+
+    pthread_mutex_lock(&tcp_lock);
+    int slot;
+    for(slot = 0; slot < TCP_MAX_ENDPOINTS && tcp_endpoints[slot] != NULL; slot++);
+    if(slot < TCP_MAX_ENDPOINTS)
+        tcp_endpoints[slot] = ep;
+    pthread_mutex_unlock(&tcp_lock);
+
+    if(slot == TCP_MAX_ENDPOINTS)
+    {
+        close(ep->epfd);
+        close(ep->pending_fd);
+        free(ep);
+        errno = EMFILE;
+        return -1;
+    }
+    return ep->epfd;
+}
+
+static int tcp_bind(TcpEndpoint *ep, const struct sockaddr_in *addr)
+{
+    if(ep->listen_fd >= 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(fd < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if(ep->reuseport)
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    if(bind(fd, (const struct sockaddr *) addr, sizeof(*addr)) < 0 || listen(fd, 128) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    ep->listen_fd = fd;
+    tcp_watch(ep, EPOLL_CTL_ADD, fd, EPOLLIN, NULL);
+    return 0;
+}
+
+static TcpConn *tcp_add_conn(TcpEndpoint *ep, int fd, const struct sockaddr_in *peer)
+{
+    TcpConn *conn = ep->num_conns < TCP_MAX_CONNS ? (TcpConn *) calloc(1, sizeof(TcpConn)) : NULL;
+    if(conn == NULL || (conn->in = (char *) malloc(TCP_IN_BUFFER)) == NULL)
+    {
+        free(conn);
+        close(fd);
+        return NULL;
+    }
+
+    // Small frames go out as soon as they are written; batching is done here
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    conn->fd = fd;
+    conn->peer = *peer;
+    ep->conns[ep->num_conns++] = conn;
+    tcp_watch(ep, EPOLL_CTL_ADD, fd, EPOLLIN, conn);
+    return conn;
+}
+
+static void tcp_close_conn(TcpEndpoint *ep, TcpConn *conn)
+{
+    for(uint32_t i = 0; i < ep->num_conns; i++)
+    {
+        if(ep->conns[i] == conn)
+        {
+            ep->conns[i] = ep->conns[--ep->num_conns];
+            break;
+        }
+    }
+    for(uint32_t i = 0; i < ep->num_dirty; i++)
+    {
+        if(ep->dirty[i] == conn)
+            ep->dirty[i] = ep->dirty[--ep->num_dirty];
+    }
+    epoll_ctl(ep->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    free(conn->in);
+    free(conn->out);
+    free(conn);
+}
+
+// Append len bytes to conn's output. Returns 0 on success; -1 if that would
+// take the backlog past the endpoint's limit
+static int tcp_queue(TcpEndpoint *ep, TcpConn *conn, const void *data, size_t len)
+{
+    if(conn->out_end + len > conn->out_cap && conn->out_start > 0)
+    {
+        memmove(conn->out, conn->out + conn->out_start, conn->out_end - conn->out_start);
+        conn->out_end -= conn->out_start;
+        conn->out_start = 0;
+    }
+    if(conn->out_end + len > conn->out_cap)
+    {
+        size_t cap = conn->out_cap > 0 ? conn->out_cap : TCP_IN_BUFFER;
+        while(cap < conn->out_end + len)
+            cap *= 2;
+        char *out = cap <= ep->max_out ? (char *) realloc(conn->out, cap) : NULL;
+        if(out == NULL)
+        {
+            errno = ENOBUFS;
+            return -1;
+        }
+        conn->out = out;
+        conn->out_cap = cap;
+    }
+    memcpy(conn->out + conn->out_end, data, len);
+    conn->out_end += len;
+    return 0;
+}
+
+// Write out as much of conn's backlog as the socket takes, arming EPOLLOUT
+// for the rest. Returns 0; -1 if the connection failed and was closed
+static int tcp_flush(TcpEndpoint *ep, TcpConn *conn)
+{
+    while(conn->out_start < conn->out_end)
+    {
+        ssize_t n = send(conn->fd, conn->out + conn->out_start, conn->out_end - conn->out_start, MSG_NOSIGNAL);
+        if(n > 0)
+            conn->out_start += n;
+        else if(n < 0 && errno == EINTR)
+            continue;
+        else if(n < 0 && (errno == EAGAIN || errno == ENOTCONN))
+        {
+            if(!conn->want_out)
+                tcp_watch(ep, EPOLL_CTL_MOD, conn->fd, EPOLLIN | EPOLLOUT, conn);
+            conn->want_out = 1;
+            return 0;
+        }
+        else
+        {
+            tcp_close_conn(ep, conn);
+            return -1;
+        }
+    }
+
+    conn->out_start = conn->out_end = 0;
+    if(conn->want_out)
+        tcp_watch(ep, EPOLL_CTL_MOD, conn->fd, EPOLLIN, conn);
+    conn->want_out = 0;
+    return 0;
+}
+
+// The connection to dest, opening one (and binding ep, so replies can find
+// it) if there is none. Returns NULL if no connection could be started
+static TcpConn *tcp_conn_to(TcpEndpoint *ep, const struct sockaddr_in *dest)
+{
+    for(uint32_t i = 0; i < ep->num_conns; i++)
+    {
+        TcpConn *conn = ep->conns[i];
+        if(conn->identified && conn->peer.sin_port == dest->sin_port &&
+           conn->peer.sin_addr.s_addr == dest->sin_addr.s_addr)
+            return conn;
+    }
+
+    if(ep->listen_fd < 0)
+    {
+        struct sockaddr_in any;
+        loopback_addr(&any, 0);
+        any.sin_addr.s_addr = htonl(INADDR_ANY);
+        if(tcp_bind(ep, &any) < 0)
+            return NULL;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(fd < 0)
+        return NULL;
+    if(connect(fd, (const struct sockaddr *) dest, sizeof(*dest)) < 0 && errno != EINPROGRESS)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    TcpConn *conn = tcp_add_conn(ep, fd, dest);
+    if(conn == NULL)
+        return NULL;
+    conn->identified = 1;
+
+    struct sockaddr_in self;
+    socklen_t len = sizeof(self);
+    getsockname(ep->listen_fd, (struct sockaddr *) &self, &len);
+    TcpHello hello = { htonl(TCP_MAGIC), self.sin_port, 0 };
+    tcp_queue(ep, conn, &hello, sizeof(hello));
+    return conn;
+}
+
+// Read what conn has for us. Returns 0; -1 if it closed
+static int tcp_fill(TcpEndpoint *ep, TcpConn *conn)
+{
+    if(conn->in_start > 0 && conn->in_start == conn->in_end)
+        conn->in_start = conn->in_end = 0;
+    else if(conn->in_start > TCP_IN_BUFFER / 2)
+    {
+        memmove(conn->in, conn->in + conn->in_start, conn->in_end - conn->in_start);
+        conn->in_end -= conn->in_start;
+        conn->in_start = 0;
+    }
+    if(conn->in_end == TCP_IN_BUFFER)
+        return 0;
+
+    ssize_t n = recv(conn->fd, conn->in + conn->in_end, TCP_IN_BUFFER - conn->in_end, 0);
+    if(n < 0 && (errno == EAGAIN || errno == EINTR))
+        return 0;
+    if(n <= 0)
+    {
+        tcp_close_conn(ep, conn);
+        return -1;
+    }
+    conn->in_end += n;
+    conn->rx_ns = realtime_ns();
+
+    if(!conn->identified && conn->in_end - conn->in_start >= sizeof(TcpHello))
+    {
+        TcpHello hello;
+        memcpy(&hello, conn->in + conn->in_start, sizeof(hello));
+        if(ntohl(hello.magic) != TCP_MAGIC)
+        {
+            tcp_close_conn(ep, conn);
+            return -1;
+        }
+        conn->peer.sin_port = hello.port;
+        conn->identified = 1;
+        conn->in_start += sizeof(hello);
+    }
+    return 0;
+}
+
+// Accept new connections, read what has arrived and push out backlogs
+static void tcp_poll_events(TcpEndpoint *ep)
+{
+    struct epoll_event events[TCP_EVENTS];
+    int n = epoll_wait(ep->epfd, events, TCP_EVENTS, 0);
+
+    for(int i = 0; i < n; i++)
+    {
+        void *ptr = events[i].data.ptr;
+        if(ptr == (void *) ep)
+            continue;
+
+        if(ptr == NULL)
+        {
+            struct sockaddr_in peer;
+            socklen_t len = sizeof(peer);
+            int fd;
+            while((fd = accept4(ep->listen_fd, (struct sockaddr *) &peer, &len, SOCK_NONBLOCK)) >= 0)
+            {
+                peer.sin_port = 0;
+                tcp_add_conn(ep, fd, &peer);
+                len = sizeof(peer);
+            }
+            continue;
+        }
+
+        TcpConn *conn = (TcpConn *) ptr;
+        if((events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) && conn->out_start < conn->out_end &&
+           tcp_flush(ep, conn) < 0)
+            continue;
+        if(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            tcp_fill(ep, conn);
+    }
+}
+
+// The length of the whole frame at the front of conn's input; 0 if there is
+// none yet, -1 if the stream is not carrying frames
+static int tcp_next_frame(TcpConn *conn)
+{
+    if(!conn->identified)
+        return 0;
+    return frame_length((const unsigned char *) conn->in + conn->in_start, conn->in_end - conn->in_start);
+}
+
+static void tcp_deliver(TcpEndpoint *ep, TcpConn *conn, size_t len, struct mmsghdr *msg)
+{
+    struct msghdr *hdr = &msg->msg_hdr;
+    const char *frame = conn->in + conn->in_start;
+    size_t off = 0;
+    for(size_t i = 0; i < hdr->msg_iovlen && off < len; i++)
+    {
+        size_t n = len - off < hdr->msg_iov[i].iov_len ? len - off : hdr->msg_iov[i].iov_len;
+        memcpy(hdr->msg_iov[i].iov_base, frame + off, n);
+        off += n;
+    }
+    msg->msg_len = off;
+    hdr->msg_flags = off < len ? MSG_TRUNC : 0;
+    conn->in_start += len;
+
+    if(hdr->msg_name != NULL)
+    {
+        memcpy(hdr->msg_name, &conn->peer, sizeof(conn->peer));
+        hdr->msg_namelen = sizeof(conn->peer);
+    }
+    add_timestamp(hdr, ep->timestamps, conn->rx_ns);
+}
+
+static int tcp_recvmmsg(TcpEndpoint *ep, struct mmsghdr *msgs, unsigned int count)
+{
+    tcp_poll_events(ep);
+
+    unsigned int n = 0;
+    int more = 0;
+    for(uint32_t k = 0; k < ep->num_conns; )
+    {
+        TcpConn *conn = ep->conns[(ep->next_conn + k) % ep->num_conns];
+        int len;
+        while((len = tcp_next_frame(conn)) > 0 && n < count)
+            tcp_deliver(ep, conn, len, &msgs[n++]);
+
+        // Whatever is on the other end is not speaking frames
+        if(len < 0)
+            tcp_close_conn(ep, conn);
+        else
+        {
+            more |= len > 0;
+            k++;
+        }
+    }
+    if(ep->num_conns > 0)
+        ep->next_conn = (ep->next_conn + 1) % ep->num_conns;
+
+    // Keep the endpoint readable while frames are left in the buffers
+    uint64_t value = 1;
+    if(more && !ep->pending)
+        ep->pending = write(ep->pending_fd, &value, sizeof(value)) == sizeof(value);
+    else if(!more && ep->pending)
+        ep->pending = read(ep->pending_fd, &value, sizeof(value)) != sizeof(value);
+    return n;
+}
+
+static int tcp_sendmmsg(TcpEndpoint *ep, struct mmsghdr *msgs, unsigned int count)
+{
+    unsigned int n;
+    for(n = 0; n < count; n++)
+    {
+        struct msghdr *hdr = &msgs[n].msg_hdr;
+        if(hdr->msg_name == NULL)
+        {
+            errno = EDESTADDRREQ;
+            break;
+        }
+
+        size_t len = iov_total(hdr);
+        msgs[n].msg_len = len;
+        if(len > TCP_IN_BUFFER)
+        {
+            errno = EMSGSIZE;
+            break;
+        }
+
+        // As with a datagram to a port nobody has bound, a frame for an
+        // endpoint that cannot be reached is lost
+        TcpConn *conn = tcp_conn_to(ep, (const struct sockaddr_in *) hdr->msg_name);
+        if(conn == NULL)
+            continue;
+
+        size_t start = conn->out_end;
+        int ok = 1;
+        for(size_t i = 0; i < hdr->msg_iovlen && ok; i++)
+            ok = tcp_queue(ep, conn, hdr->msg_iov[i].iov_base, hdr->msg_iov[i].iov_len) == 0;
+        if(!ok)
+            break;
+
+        // A message that is not a whole frame would desynchronise the stream
+        if(frame_length((const unsigned char *) conn->out + start, len) != (int) len)
+        {
+            conn->out_end = start;
+            errno = EINVAL;
+            break;
+        }
+
+        if(!conn->dirty)
+        {
+            conn->dirty = 1;
+            ep->dirty[ep->num_dirty++] = conn;
+        }
+    }
+
+    // One write per connection for everything queued above
+    while(ep->num_dirty > 0)
+    {
+        TcpConn *conn = ep->dirty[--ep->num_dirty];
+        conn->dirty = 0;
+        tcp_flush(ep, conn);
+    }
+    return n > 0 || count == 0 ? (int) n : -1;
+}
+
+static int tcp_close(TcpEndpoint *ep)
+{
+    pthread_mutex_lock(&tcp_lock);
+    for(int i = 0; i < TCP_MAX_ENDPOINTS; i++)
+    {
+        if(tcp_endpoints[i] == ep)
+            tcp_endpoints[i] = NULL;
+    }
+    pthread_mutex_unlock(&tcp_lock);
+
+    // Give queued frames one last chance to go out
+    while(ep->num_conns > 0)
+    {
+        TcpConn *conn = ep->conns[0];
+        if(tcp_flush(ep, conn) == 0)
+            tcp_close_conn(ep, conn);
+    }
+    if(ep->listen_fd >= 0)
+        close(ep->listen_fd);
+    close(ep->pending_fd);
+    int ret = close(ep->epfd);
+    free(ep);
+    return ret;
+}
+
+/*
+ * The socket-style interface
+ */
+
+int transport_socket()
+{
+    switch(transport_kind())
+    {
+        case TRANSPORT_UNIX:
+            mkdir(unix_dir(), 0777);
+            return socket(AF_UNIX, SOCK_DGRAM, 0);
+        case TRANSPORT_SHM:
+            for(int i = 0; i < SHM_MAX_SOCKETS; i++)
+            {
+                if(!shm_sockets[i].used)
+                {
+                    shm_sockets[i].used = 1;
+                    return SHM_FD_BASE + i;
+                }
+            }
+            errno = EMFILE;
+            return -1;
+        case TRANSPORT_TCP:
+            return tcp_socket();
+        default:
+            return socket(AF_INET, SOCK_DGRAM, 0);
+    }
+}
+
+// Bind to addr's port; port 0 picks a free one. An unbound unix endpoint
+// can send but cannot be answered, so bind before sending if replies matter
+int transport_bind(int fd, const struct sockaddr_in *addr)
+{
+    ShmSocket *s;
+    TcpEndpoint *ep;
+    switch(transport_kind())
+    {
+        case TRANSPORT_UNIX:
+            return unix_bind(fd, ntohs(addr->sin_port));
+        case TRANSPORT_SHM:
+            return (s = shm_socket(fd)) != NULL ? shm_bind(s, ntohs(addr->sin_port)) : -1;
+        case TRANSPORT_TCP:
+            return (ep = tcp_endpoint(fd)) != NULL ? tcp_bind(ep, addr) : -1;
+        default:
+            return bind(fd, (const struct sockaddr *) addr, sizeof(*addr));
+    }
+}
+
+// Only SO_TIMESTAMPNS means anything to an shm endpoint, and only it and
+// SO_REUSEPORT (which must come before bind) to a tcp one; other options are
+// accepted and ignored, as SO_REUSEPORT is by unix sockets
+int transport_setsockopt(int fd, int level, int name, const void *value, socklen_t len)
+{
+    ShmSocket *s;
+    TcpEndpoint *ep;
+    switch(transport_kind())
+    {
+        case TRANSPORT_UNIX:
+            if(level == SOL_SOCKET && name == SO_REUSEPORT)
+                return 0;
+            return setsockopt(fd, level, name, value, len);
+        case TRANSPORT_SHM:
+            if((s = shm_socket(fd)) == NULL)
+                return -1;
+            if(level == SOL_SOCKET && name == SO_TIMESTAMPNS && len >= sizeof(int))
+                s->timestamps = *(const int *) value != 0;
+            return 0;
+        case TRANSPORT_TCP:
+            if((ep = tcp_endpoint(fd)) == NULL)
+                return -1;
+            if(level == SOL_SOCKET && name == SO_TIMESTAMPNS && len >= sizeof(int))
+                ep->timestamps = *(const int *) value != 0;
+            if(level == SOL_SOCKET && name == SO_REUSEPORT && len >= sizeof(int))
+                ep->reuseport = *(const int *) value != 0;
+            return 0;
+        default:
+            return setsockopt(fd, level, name, value, len);
+    }
+}
+
+int transport_close(int fd)
+{
+    ShmSocket *s;
+    TcpEndpoint *ep;
+    switch(transport_kind())
+    {
+        case TRANSPORT_UNIX:
+            return unix_close(fd);
+        case TRANSPORT_SHM:
+            return (s = shm_socket(fd)) != NULL ? shm_close(s) : -1;
+        case TRANSPORT_TCP:
+            return (ep = tcp_endpoint(fd)) != NULL ? tcp_close(ep) : -1;
+        default:
+            return close(fd);
+    }
+}
+
+int transport_sendmmsg(int fd, struct mmsghdr *msgs, unsigned int count, int flags)
+{
+    ShmSocket *s;
+    TcpEndpoint *ep;
+    switch(transport_kind())
+    {
+        case TRANSPORT_UNIX:
+            return unix_sendmmsg(fd, msgs, count, flags);
+        case TRANSPORT_SHM:
+            return (s = shm_socket(fd)) != NULL ? shm_sendmmsg(s, msgs, count) : -1;
+        case TRANSPORT_TCP:
+            return (ep = tcp_endpoint(fd)) != NULL ? tcp_sendmmsg(ep, msgs, count) : -1;
+        default:
+            return sendmmsg(fd, msgs, count, flags);
+    }
+}
+
+// Without MSG_DONTWAIT shm and tcp endpoints block like a socket until
+// something arrives
+int transport_recvmmsg(int fd, struct mmsghdr *msgs, unsigned int count, int flags)
+{
+    ShmSocket *s;
+    TcpEndpoint *ep;
+    switch(transport_kind())
+    {
+        case TRANSPORT_UNIX:
+            return unix_recvmmsg(fd, msgs, count, flags);
+        case TRANSPORT_SHM:
+            if((s = shm_socket(fd)) == NULL)
+                return -1;
+            while(1)
+            {
+                int n = shm_recvmmsg(s, msgs, count);
+                if(n > 0 || (flags & MSG_DONTWAIT))
+                {
+                    if(n == 0)
+                        errno = EAGAIN;
+                    return n > 0 ? n : -1;
+                }
+                struct pollfd pfd = { fd, POLLIN, 0 };
+                if(transport_poll(&pfd, 1, NULL) < 0 && errno != EINTR)
+                    return -1;
+            }
+        case TRANSPORT_TCP:
+            if((ep = tcp_endpoint(fd)) == NULL)
+                return -1;
+            while(1)
+            {
+                int n = tcp_recvmmsg(ep, msgs, count);
+                if(n > 0 || (flags & MSG_DONTWAIT))
+                {
+                    if(n == 0)
+                        errno = EAGAIN;
+                    return n > 0 ? n : -1;
+                }
+                struct pollfd pfd = { fd, POLLIN, 0 };
+                if(ppoll(&pfd, 1, NULL, NULL) < 0 && errno != EINTR)
+                    return -1;
+            }
+        default:
+            return recvmmsg(fd, msgs, count, flags, NULL);
+    }
+}
+
+ssize_t transport_sendto(int fd, const void *data, size_t len, int flags, const struct sockaddr_in *dest)
+{
+    if(transport_kind() == TRANSPORT_UDP)
+        return sendto(fd, data, len, flags, (const struct sockaddr *) dest, sizeof(*dest));
+
+    struct iovec iov = { (void *) data, len };
+    struct mmsghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_hdr.msg_name = (void *) dest;
+    msg.msg_hdr.msg_namelen = sizeof(*dest);
+    msg.msg_hdr.msg_iov = &iov;
+    msg.msg_hdr.msg_iovlen = 1;
+    if(transport_sendmmsg(fd, &msg, 1, flags) < 1)
+        return -1;
+    return len;
+}
+
+ssize_t transport_recvfrom(int fd, void *data, size_t len, int flags, struct sockaddr_in *from)
+{
+    if(transport_kind() == TRANSPORT_UDP)
+    {
+        socklen_t addr_len = sizeof(*from);
+        return recvfrom(fd, data, len, flags, (struct sockaddr *) from, from != NULL ? &addr_len : NULL);
+    }
+
+    struct iovec iov = { data, len };
+    struct mmsghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_hdr.msg_name = from;
+    msg.msg_hdr.msg_namelen = from != NULL ? sizeof(*from) : 0;
+    msg.msg_hdr.msg_iov = &iov;
+    msg.msg_hdr.msg_iovlen = 1;
+    if(transport_recvmmsg(fd, &msg, 1, flags) < 1)
+        return -1;
+    return msg.msg_len;
+}
+
+int transport_poll(struct pollfd *fds, nfds_t nfds, const struct timespec *timeout)
+{
+    int has_shm = 0, has_other = 0;
+    if(transport_kind() == TRANSPORT_SHM)
+    {
+        for(nfds_t i = 0; i < nfds; i++)
+        {
+            if(shm_socket(fds[i].fd) != NULL)
+                has_shm = 1;
+            else if(fds[i].fd >= 0)
+                has_other = 1;
+        }
+    }
+    if(!has_shm || shm_door == NULL)
+        return ppoll(fds, nfds, timeout, NULL);
+
+    uint64_t deadline_ns = timeout != NULL ? monotonic_ns() + timeout->tv_sec * 1000000000ULL + timeout->tv_nsec : 0;
+    struct timespec zero = { 0, 0 };
+
+    while(1)
+    {
+        // Anything sent after this load changes the doorbell, so the sleep
+        // below cannot miss it
+        uint32_t seq = __atomic_load_n(&shm_door->door, __ATOMIC_SEQ_CST);
+        int ready = 0;
+
+        if(has_other)
+        {
+            int saved[nfds];
+            for(nfds_t i = 0; i < nfds; i++)
+            {
+                saved[i] = fds[i].fd;
+                if(shm_socket(fds[i].fd) != NULL)
+                    fds[i].fd = -1;
+            }
+            ready = ppoll(fds, nfds, &zero, NULL);
+            for(nfds_t i = 0; i < nfds; i++)
+                fds[i].fd = saved[i];
+            if(ready < 0)
+                return -1;
+        }
+
+        for(nfds_t i = 0; i < nfds; i++)
+        {
+            ShmSocket *s = shm_socket(fds[i].fd);
+            if(s == NULL)
+                continue;
+            fds[i].revents = (fds[i].events & POLLIN) && shm_readable(s) ? POLLIN : 0;
+            ready += fds[i].revents != 0;
+        }
+        if(ready > 0)
+            return ready;
+
+        int64_t wait_ns = -1;
+        if(timeout != NULL)
+        {
+            uint64_t now = monotonic_ns();
+            if(now >= deadline_ns)
+                return 0;
+            wait_ns = deadline_ns - now;
+        }
+        if(has_other && (wait_ns < 0 || wait_ns > TRANSPORT_POLL_SLICE_MS * 1000000LL))
+            wait_ns = TRANSPORT_POLL_SLICE_MS * 1000000LL;
+        shm_sleep(seq, wait_ns);
+    }
+}
@@ -0,0 +1,93 @@
+/*
+ * The message transport between the ATM, router and bank.
+ *
+ * Every endpoint keeps its UDP identity, a struct sockaddr_in whose
+ * port names it, but when all three programs run on one host the
+ * datagrams need not cross the UDP loopback stack.  TRANSPORT selects
+ * how they move, and must be the same for every process:
+ *
+ *   udp   (default) AF_INET datagram sockets
+ *   unix  AF_UNIX datagram sockets bound to TRANSPORT_DIR/<port>
+ *         (default /tmp/atm-transport); sending to a receiver whose
+ *         queue is full fails with EAGAIN instead of blocking
+ *   shm   shared-memory rings: each pair of endpoints that talk gets a
+ *         single-producer, single-consumer ring in each direction
+ *         (/atm-shm.<from>.<to>.<id>), and a receiver is woken through a
+ *         futex in its endpoint segment (/atm-shm.<port>)
+ *   tcp   a persistent TCP connection between each two endpoints that
+ *         talk, opened by the first one to send.  Messages must be whole
+ *         frames (see frame.h): they are written back to back and the
+ *         receiver cuts them apart with the length each frame carries, so
+ *         a message may be up to FRAME_MAX_SIZE bytes and none are lost to
+ *         a full socket buffer
+ *
+ * The transport_* calls mirror the socket calls they replace and
+ * translate addresses at the boundary, so callers, the router's route
+ * table and the bank's reply addressing all keep using sockaddr_in.
+ * udp and unix endpoints are real descriptors that can go into epoll
+ * or select.  shm endpoints are not; wait on them with transport_poll(),
+ * which sleeps on the futex and looks at any ordinary descriptors in
+ * the set every TRANSPORT_POLL_SLICE_MS.  An shm ring has one producer
+ * and one consumer, so an shm endpoint must only be used from one
+ * thread.
+ *
+ * Messages larger than TRANSPORT_SHM_SLOT_SIZE (default 2048) bytes
+ * cannot be sent over shm; each ring holds TRANSPORT_SHM_SLOTS
+ * (default 256) messages, and like a full socket buffer a full ring
+ * drops what is sent to it.
+ *
+ * A tcp endpoint is an epoll descriptor over its listening socket and
+ * connections, so it can go into epoll or poll like a socket.  The
+ * connection's opener first sends the port it listens on, and replies
+ * addressed to that port reuse the connection.  Frames sent in one
+ * transport_sendmmsg are coalesced into one write per connection, and
+ * each read takes in as much as has arrived.  Frames the socket will not
+ * take yet wait in the endpoint, up to TRANSPORT_TCP_MAX_BUFFER (default
+ * 4 MB) per connection, and go out on a later send or receive; past that
+ * sends fail with ENOBUFS.  Like an shm endpoint, a tcp endpoint must
+ * only be used from one thread at a time.
+ */
+
+#ifndef __TRANSPORT_H__
+#define __TRANSPORT_H__
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <time.h>
+
+#define TRANSPORT_POLL_SLICE_MS 10
+
+typedef enum
+{
+    TRANSPORT_UDP = 0,
+    TRANSPORT_UNIX,
+    TRANSPORT_SHM,
+    TRANSPORT_TCP,
+    NUM_TRANSPORTS
+} TransportKind;
+
+// The transport this process uses, from TRANSPORT (udp if unset or unknown)
+TransportKind transport_kind();
+const char *transport_name(TransportKind kind);
+
+// Switch this process to the named transport before any endpoint is opened.
+// Returns 0 on success; -1 if the name is unknown
+int transport_select(const char *name);
+
+int transport_socket();
+int transport_bind(int fd, const struct sockaddr_in *addr);
+int transport_setsockopt(int fd, int level, int name, const void *value, socklen_t len);
+int transport_close(int fd);
+
+ssize_t transport_sendto(int fd, const void *data, size_t len, int flags, const struct sockaddr_in *dest);
+ssize_t transport_recvfrom(int fd, void *data, size_t len, int flags, struct sockaddr_in *from);
+int transport_sendmmsg(int fd, struct mmsghdr *msgs, unsigned int count, int flags);
+int transport_recvmmsg(int fd, struct mmsghdr *msgs, unsigned int count, int flags);
+
+// poll(2) over a set that may mix endpoints and ordinary descriptors,
+// with a ppoll-style timeout (NULL waits forever)
+int transport_poll(struct pollfd *fds, nfds_t nfds, const struct timespec *timeout);
+
+#endif
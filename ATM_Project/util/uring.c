@@ -0,0 +1,203 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(Uring *u, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    u->enters++;
+    return (int) syscall(__NR_io_uring_enter, u->fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(Uring *u, unsigned opcode, const void *arg, unsigned nr_args)
+{
+    return (int) syscall(__NR_io_uring_register, u->fd, opcode, arg, nr_args);
+}
+
+Uring* uring_create(unsigned sq_entries, unsigned cq_entries)
+{
+    Uring *u = (Uring *) calloc(1, sizeof(Uring));
+    if(u == NULL)
+        return NULL;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    if(cq_entries > 0)
+    {
+        p.flags |= IORING_SETUP_CQSIZE;
+        p.cq_entries = cq_entries;
+    }
+    u->fd = uring_setup(sq_entries, &p);
+    if(u->fd < 0)
+    {
+        free(u);
+        return NULL;
+    }
+    u->features = p.features;
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    u->sqes = (struct io_uring_sqe *) mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                            u->fd, IORING_OFF_SQES);
+    if(u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED)
+    {
+        int saved = errno;
+        uring_free(u);
+        errno = saved;
+        return NULL;
+    }
+
+    char *sq = (char *) u->sq_ring;
+    u->sq_entries = p.sq_entries;
+    u->sq_head = (unsigned *) (sq + p.sq_off.head);
+    u->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *) (sq + p.sq_off.array);
+    u->sq_flags = (unsigned *) (sq + p.sq_off.flags);
+    u->sqe_tail = *u->sq_tail;
+
+    char *cq = (char *) u->cq_ring;
+    u->cq_head = (unsigned *) (cq + p.cq_off.head);
+    u->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    return u;
+}
+
+void uring_free(Uring *u)
+{
+    if(u == NULL)
+        return;
+    if(u->sq_ring != NULL && u->sq_ring != MAP_FAILED)
+        munmap(u->sq_ring, u->sq_ring_size);
+    if(u->cq_ring != NULL && u->cq_ring != MAP_FAILED)
+        munmap(u->cq_ring, u->cq_ring_size);
+    if(u->sqes != NULL && u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->sqes_size);
+    close(u->fd);
+    free(u);
+}
+
+struct io_uring_sqe* uring_get_sqe(Uring *u)
+{
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if(u->sqe_tail - head >= u->sq_entries)
+        return NULL;
+
+    unsigned index = u->sqe_tail++ & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[index] = index;
+    return sqe;
+}
+
+unsigned uring_unsubmitted(const Uring *u)
+{
+    return u->sqe_tail - *u->sq_tail;
+}
+
+int uring_submit(Uring *u, unsigned wait_nr)
+{
+    unsigned count = uring_unsubmitted(u);
+    __atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+
+    // Completions the CQ ring had no room for are only moved into it by an enter
+    unsigned flags = wait_nr > 0 || (__atomic_load_n(u->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW) ?
+                     IORING_ENTER_GETEVENTS : 0;
+    if(count == 0 && flags == 0)
+        return 0;
+
+    int n;
+    do
+        n = uring_enter(u, count, wait_nr, flags);
+    while(n < 0 && errno == EINTR);
+    return n;
+}
+
+struct io_uring_cqe* uring_peek_cqe(Uring *u)
+{
+    unsigned head = *u->cq_head;
+    if(head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        if(!(__atomic_load_n(u->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW))
+            return NULL;
+        uring_submit(u, 0);
+        if(head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+            return NULL;
+    }
+    return &u->cqes[head & *u->cq_mask];
+}
+
+void uring_cqe_seen(Uring *u)
+{
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_register_buffers(Uring *u, const struct iovec *iov, unsigned iov_count)
+{
+    return uring_register(u, IORING_REGISTER_BUFFERS, iov, iov_count);
+}
+
+int uring_buf_ring_init(Uring *u, UringBufRing *br, uint16_t group, unsigned entries)
+{
+    memset(br, 0, sizeof(*br));
+    br->size = entries * sizeof(struct io_uring_buf);
+    br->ring = (struct io_uring_buf_ring *) mmap(NULL, br->size, PROT_READ | PROT_WRITE,
+                                                 MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if(br->ring == MAP_FAILED)
+    {
+        br->ring = NULL;
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) br->ring;
+    reg.ring_entries = entries;
+    reg.bgid = group;
+    if(uring_register(u, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        int saved = errno;
+        munmap(br->ring, br->size);
+        br->ring = NULL;
+        errno = saved;
+        return -1;
+    }
+    br->group = group;
+    br->entries = entries;
+    return 0;
+}
+
+void uring_buf_ring_free(Uring *u, UringBufRing *br)
+{
+    if(br->ring == NULL)
+        return;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = br->group;
+    uring_register(u, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(br->ring, br->size);
+    br->ring = NULL;
+}
+
+void uring_buf_ring_add(UringBufRing *br, void *addr, unsigned len, uint16_t id)
+{
+    struct io_uring_buf *buf = &br->ring->bufs[br->tail & (br->entries - 1)];
+    buf->addr = (uint64_t) (uintptr_t) addr;
+    buf->len = len;
+    buf->bid = id;
+    br->tail++;
+    __atomic_store_n(&br->ring->tail, br->tail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,96 @@
+/*
+ * A small io_uring wrapper over the raw system calls, covering what the
+ * bank's io_uring backend needs (see bank-side/bank_uring.h).
+ *
+ * uring_get_sqe() hands out submission entries to fill in, and
+ * uring_submit() passes every entry filled so far to the kernel in one
+ * io_uring_enter.  Completions are read with uring_peek_cqe() and
+ * released with uring_cqe_seen().  The ring's descriptor polls readable
+ * while completions are waiting, so it can go into epoll with other
+ * descriptors.  A ring must only be used from one thread.
+ *
+ * A provided-buffer ring (uring_buf_ring_*) gives the kernel a pool of
+ * buffers to receive into, so one multishot receive keeps completing
+ * without being resubmitted.  The kernel picks a buffer for each message
+ * and names it in the completion; hand it back with uring_buf_ring_add()
+ * once its contents have been used.
+ */
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+typedef struct _Uring
+{
+    int fd;
+    unsigned features;
+    unsigned long enters;           // io_uring_enter calls made
+
+    // Submission queue: entries up to sqe_tail have been handed out, those
+    // up to *sq_tail passed to the kernel
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *sq_flags;
+    unsigned sqe_tail;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} Uring;
+
+typedef struct _UringBufRing
+{
+    struct io_uring_buf_ring *ring;
+    uint16_t group;
+    unsigned entries;               // a power of two
+    uint16_t tail;
+    size_t size;
+} UringBufRing;
+
+// A ring with sq_entries submission and cq_entries completion entries
+// (0 for the kernel's default of twice sq_entries). Returns NULL with errno
+// set if the kernel has no io_uring or will not give us one
+Uring* uring_create(unsigned sq_entries, unsigned cq_entries);
+void uring_free(Uring *u);
+
+// The next submission entry, cleared; NULL if every entry is taken until the next submit
+struct io_uring_sqe* uring_get_sqe(Uring *u);
+
+// Submit every entry filled since the last submit and wait for at least
+// wait_nr completions. Returns the number submitted; -1 on error
+int uring_submit(Uring *u, unsigned wait_nr);
+
+// Entries filled but not yet submitted
+unsigned uring_unsubmitted(const Uring *u);
+
+// The oldest completion, or NULL if there is none yet
+struct io_uring_cqe* uring_peek_cqe(Uring *u);
+void uring_cqe_seen(Uring *u);
+
+// Register iov_count buffers for IORING_OP_READ_FIXED/WRITE_FIXED
+int uring_register_buffers(Uring *u, const struct iovec *iov, unsigned iov_count);
+
+// Register a ring of entries (a power of two) provided buffers as buffer group
+// group. Returns 0 on success; -1 with errno set
+int uring_buf_ring_init(Uring *u, UringBufRing *br, uint16_t group, unsigned entries);
+void uring_buf_ring_free(Uring *u, UringBufRing *br);
+
+// Give the kernel buffer id back to receive into
+void uring_buf_ring_add(UringBufRing *br, void *addr, unsigned len, uint16_t id);
+
+#endif